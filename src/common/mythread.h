@@ -150,14 +150,21 @@ mythread_sigmask(int how, const sigset_t *restrict set,
 }
 
 
-// Creates a new thread with all signals blocked. Returns zero on success
-// and non-zero on error.
+// Creates a new thread with all signals blocked except the ones that
+// the thread itself may raise by faulting. What happens if those are
+// generated while blocked is undefined; Linux kills the process even
+// if the application has a handler (fxz catches SIGBUS from reading
+// a mapped file). Returns zero on success and non-zero on error.
 static inline int
 mythread_create(mythread *thread, void *(*func)(void *arg), void *arg)
 {
 	sigset_t old;
 	sigset_t all;
 	sigfillset(&all);
+	sigdelset(&all, SIGBUS);
+	sigdelset(&all, SIGFPE);
+	sigdelset(&all, SIGILL);
+	sigdelset(&all, SIGSEGV);
 
 	mythread_sigmask(SIG_SETMASK, &all, &old);
 	const int ret = pthread_create(thread, NULL, func, arg);
@@ -518,4 +525,287 @@ mythread_condtime_set(mythread_condtime *condtime, const mythread_cond *cond,
 
 #endif
 
+
+#ifdef MYTHREAD_ENABLED
+
+/////////////////////////////////////
+// State word for handing off work //
+/////////////////////////////////////
+
+// A mythread_state holds a small number that one thread changes to hand
+// work to another thread, which waits for the number to change. Changing
+// the value is a single atomic operation, and a sleeping thread is woken
+// only if there is one, so handing off work normally takes no lock. On
+// Linux the value itself is a futex. Elsewhere a mutex and a condition
+// variable are used for sleeping, and if the compiler has no atomic
+// operations, for everything else too.
+//
+// The code using a mythread_state must ensure that at most one thread
+// is waiting on it at a time.
+
+#if defined(MYTHREAD_WIN95) || defined(MYTHREAD_VISTA)
+#	define MYTHREAD_ATOMIC32 1
+typedef LONG mythread_atomic32;
+#	define mythread_atomic32_load(ptr) \
+		((uint32_t)InterlockedCompareExchange(ptr, 0, 0))
+#	define mythread_atomic32_store(ptr, value) \
+		InterlockedExchange(ptr, (LONG)(value))
+#	define mythread_atomic32_cas(ptr, expected, desired) \
+		(InterlockedCompareExchange(ptr, (LONG)(desired), \
+			(LONG)(expected)) == (LONG)(expected))
+#	define mythread_atomic32_add(ptr, value) \
+		InterlockedExchangeAdd(ptr, (LONG)(value))
+
+#elif defined(__GNUC__) && defined(__ATOMIC_SEQ_CST)
+#	define MYTHREAD_ATOMIC32 1
+typedef uint32_t mythread_atomic32;
+#	define mythread_atomic32_load(ptr) \
+		__atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#	define mythread_atomic32_store(ptr, value) \
+		__atomic_store_n(ptr, value, __ATOMIC_SEQ_CST)
+#	define mythread_atomic32_cas(ptr, expected, desired) \
+		__sync_bool_compare_and_swap(ptr, expected, desired)
+#	define mythread_atomic32_add(ptr, value) \
+		__atomic_fetch_add(ptr, value, __ATOMIC_SEQ_CST)
+
+#else
+typedef uint32_t mythread_atomic32;
+#endif
+
+#if defined(MYTHREAD_ATOMIC32) && defined(MYTHREAD_POSIX) \
+		&& defined(HAVE_LINUX_FUTEX_H)
+#	define MYTHREAD_FUTEX 1
+#	include <linux/futex.h>
+#	include <sys/syscall.h>
+#	include <unistd.h>
+#	include <limits.h>
+#endif
+
+
+typedef struct {
+	/// The current value
+	volatile mythread_atomic32 value;
+
+#ifdef MYTHREAD_ATOMIC32
+	/// Nonzero when a thread is sleeping or about to sleep. The thread
+	/// changing the value checks this after storing the value.
+	volatile mythread_atomic32 waiters;
+#endif
+
+#ifndef MYTHREAD_FUTEX
+	mythread_mutex mutex;
+	mythread_cond cond;
+#endif
+} mythread_state;
+
+
+#ifdef MYTHREAD_FUTEX
+static inline void
+mythread_futex_wake(mythread_state *state)
+{
+	syscall(SYS_futex, &state->value, FUTEX_WAKE_PRIVATE, INT_MAX,
+			NULL, NULL, 0);
+}
+
+static inline void
+mythread_futex_wait(mythread_state *state, uint32_t value,
+		const struct timespec *timeout)
+{
+	// The kernel returns immediately if the value has changed
+	// already. EINTR and EAGAIN are handled by the callers
+	// by checking the value again.
+	mythread_atomic32_add(&state->waiters, 1);
+	syscall(SYS_futex, &state->value, FUTEX_WAIT_PRIVATE, value,
+			timeout, NULL, 0);
+	mythread_atomic32_add(&state->waiters, (uint32_t)(-1));
+}
+#endif
+
+
+// Initializes a state word. Returns zero on success and non-zero on error.
+static inline int
+mythread_state_init(mythread_state *state, uint32_t value)
+{
+	state->value = value;
+
+#ifdef MYTHREAD_ATOMIC32
+	state->waiters = 0;
+#endif
+
+#ifndef MYTHREAD_FUTEX
+	if (mythread_mutex_init(&state->mutex))
+		return -1;
+
+	if (mythread_cond_init(&state->cond)) {
+		mythread_mutex_destroy(&state->mutex);
+		return -1;
+	}
+#endif
+
+	return 0;
+}
+
+static inline void
+mythread_state_destroy(mythread_state *state)
+{
+#ifdef MYTHREAD_FUTEX
+	(void)state;
+#else
+	mythread_cond_destroy(&state->cond);
+	mythread_mutex_destroy(&state->mutex);
+#endif
+}
+
+static inline uint32_t
+mythread_state_get(mythread_state *state)
+{
+#ifdef MYTHREAD_ATOMIC32
+	return mythread_atomic32_load(&state->value);
+#else
+	uint32_t value;
+	mythread_sync(state->mutex) {
+		value = state->value;
+	}
+
+	return value;
+#endif
+}
+
+// Wakes up the waiting thread, if any, after the value has been changed.
+static inline void
+mythread_state_wake(mythread_state *state)
+{
+#if defined(MYTHREAD_FUTEX)
+	if (mythread_atomic32_load(&state->waiters) != 0)
+		mythread_futex_wake(state);
+#elif defined(MYTHREAD_ATOMIC32)
+	// Taking the mutex ensures that the waiting thread is either
+	// still before its check of the value or already sleeping.
+	if (mythread_atomic32_load(&state->waiters) != 0) {
+		mythread_sync(state->mutex) {
+			mythread_cond_signal(&state->cond);
+		}
+	}
+#else
+	mythread_cond_signal(&state->cond);
+#endif
+}
+
+// Sets the value and wakes up the thread waiting for it to change.
+static inline void
+mythread_state_set(mythread_state *state, uint32_t value)
+{
+#ifdef MYTHREAD_ATOMIC32
+	mythread_atomic32_store(&state->value, value);
+	mythread_state_wake(state);
+#else
+	mythread_sync(state->mutex) {
+		state->value = value;
+		mythread_state_wake(state);
+	}
+#endif
+}
+
+// Sets the value to desired if it is equal to expected. Returns true
+// if the value was changed.
+static inline bool
+mythread_state_cas(mythread_state *state, uint32_t expected,
+		uint32_t desired)
+{
+#ifdef MYTHREAD_ATOMIC32
+	if (!mythread_atomic32_cas(&state->value, expected, desired))
+		return false;
+
+	mythread_state_wake(state);
+	return true;
+#else
+	bool changed = false;
+	mythread_sync(state->mutex) {
+		if (state->value == expected) {
+			state->value = desired;
+			mythread_state_wake(state);
+			changed = true;
+		}
+	}
+
+	return changed;
+#endif
+}
+
+// Waits until the value differs from the given value. Returns the new value.
+static inline uint32_t
+mythread_state_wait(mythread_state *state, uint32_t value)
+{
+	uint32_t current;
+
+#if defined(MYTHREAD_FUTEX)
+	while ((current = mythread_atomic32_load(&state->value)) == value)
+		mythread_futex_wait(state, value, NULL);
+#else
+	mythread_sync(state->mutex) {
+#	ifdef MYTHREAD_ATOMIC32
+		mythread_atomic32_add(&state->waiters, 1);
+		while ((current = mythread_atomic32_load(&state->value))
+				== value)
+			mythread_cond_wait(&state->cond, &state->mutex);
+
+		mythread_atomic32_add(&state->waiters, (uint32_t)(-1));
+#	else
+		while ((current = state->value) == value)
+			mythread_cond_wait(&state->cond, &state->mutex);
+#	endif
+	}
+#endif
+
+	return current;
+}
+
+// Waits until the value differs from the given value or until timeout_ms
+// milliseconds have passed. Returns the current value, which is equal to
+// the given value if the wait timed out. A wakeup by a signal may end
+// the wait early too.
+static inline uint32_t
+mythread_state_timedwait(mythread_state *state, uint32_t value,
+		uint32_t timeout_ms)
+{
+	uint32_t current;
+
+#if defined(MYTHREAD_FUTEX)
+	current = mythread_atomic32_load(&state->value);
+	if (current == value) {
+		// FUTEX_WAIT takes a relative timeout.
+		const struct timespec timeout = {
+			.tv_sec = timeout_ms / 1000,
+			.tv_nsec = (long)(timeout_ms % 1000) * 1000000L,
+		};
+		mythread_futex_wait(state, value, &timeout);
+		current = mythread_atomic32_load(&state->value);
+	}
+#else
+	mythread_condtime condtime;
+	mythread_condtime_set(&condtime, &state->cond, timeout_ms);
+	bool timed_out = false;
+
+	mythread_sync(state->mutex) {
+#	ifdef MYTHREAD_ATOMIC32
+		mythread_atomic32_add(&state->waiters, 1);
+		while ((current = mythread_atomic32_load(&state->value))
+					== value && !timed_out)
+			timed_out = mythread_cond_timedwait(&state->cond,
+					&state->mutex, &condtime) != 0;
+
+		mythread_atomic32_add(&state->waiters, (uint32_t)(-1));
+#	else
+		while ((current = state->value) == value && !timed_out)
+			timed_out = mythread_cond_timedwait(&state->cond,
+					&state->mutex, &condtime) != 0;
+#	endif
+	}
+#endif
+
+	return current;
+}
+
+#endif
+
 #endif
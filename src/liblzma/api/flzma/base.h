@@ -241,12 +241,14 @@ typedef enum {
 		 *
 		 * Some coders can do random access in the input file. The
 		 * initialization functions of these coders take the file size
-		 * as an argument. No other coders can return LZMA_SEEK_NEEDED.
+		 * or an lzma_index as an argument. No other coders can return
+		 * LZMA_SEEK_NEEDED.
 		 *
 		 * When this value is returned, the application must seek to
 		 * the file position given in lzma_stream.seek_pos. This value
 		 * is guaranteed to never exceed the file size that was
-		 * specified at the coder initialization.
+		 * specified at the coder initialization (or stored in the
+		 * lzma_index).
 		 *
 		 * After seeking the application should read new input and
 		 * pass it normally via lzma_stream.next_in and .avail_in.
@@ -699,3 +701,53 @@ extern LZMA_API(uint64_t) lzma_memlimit_get(const lzma_stream *strm)
  */
 extern LZMA_API(lzma_ret) lzma_memlimit_set(
 		lzma_stream *strm, uint64_t memlimit) lzma_nothrow;
+
+
+/**
+ * \brief       Pool of threads shared by several streams
+ *
+ * A thread pool lets the multithreaded encoders reuse threads instead of
+ * creating new ones for every stream. The pool also caps the number of
+ * threads that all the streams using it have at the same time. A stream
+ * keeps the threads it gets until lzma_end() is called.
+ *
+ * The pool is attached with the thread_pool member of lzma_mt or
+ * lzma_options_lzma together with the LZMA_USE_THREAD_POOL flag or
+ * LZMA_MODE_THREAD_POOL, respectively. If the pool has no free thread and may not create
+ * more, the radix match finder of LZMA2 does the work of the missing
+ * threads in the calling thread, and the threaded .xz encoder encodes
+ * fewer Blocks concurrently. If the .xz encoder cannot get even one
+ * thread, it creates one thread outside the pool.
+ *
+ * The contents of this structure is not visible outside the library.
+ */
+typedef struct lzma_thread_pool_s lzma_thread_pool;
+
+
+/**
+ * \brief       Create a thread pool
+ *
+ * \param       threads     Maximum number of threads in the pool
+ * \param       allocator   lzma_allocator for the memory of the pool,
+ *                          or NULL to use malloc() and free(). Some of
+ *                          the memory of the streams is kept with the
+ *                          threads of the pool for the next stream if
+ *                          the streams use the same allocator.
+ *
+ * \return      Pointer to a new thread pool or NULL if memory allocation
+ *              failed, threads is zero, or liblzma was built without
+ *              threading support.
+ */
+extern LZMA_API(lzma_thread_pool *) lzma_thread_pool_create(
+		uint32_t threads, const lzma_allocator *allocator)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
+
+/**
+ * \brief       Free a thread pool
+ *
+ * All the streams using the pool must have been ended with lzma_end()
+ * before calling this. If pool is NULL, this does nothing.
+ */
+extern LZMA_API(void) lzma_thread_pool_end(lzma_thread_pool *pool)
+		lzma_nothrow;
@@ -49,6 +49,13 @@
 	 * Filter for SPARC binaries.
 	 */
 
+#define LZMA_FILTER_ARM64       LZMA_VLI_C(0x0A)
+	/**<
+	 * Filter for ARM64 binaries.
+	 *
+	 * The start offset must be a multiple of four.
+	 */
+
 
 /**
  * \brief       Options for BCJ filters
@@ -67,6 +67,117 @@
 #define LZMA_PRESET_ORIG          (UINT32_C(1) << 30)
 
 
+/**
+ * \brief       Input stays valid until the threaded encoder has finished
+ *
+ * With this flag in lzma_mt.flags, lzma_stream_encoder_mt() doesn't copy
+ * the input into buffers of its own. The worker threads read the Blocks
+ * directly from the memory pointed by strm->next_in instead, which saves
+ * a copy of the input and threads * block_size bytes of memory.
+ *
+ * The application must keep all input that it has passed to lzma_code()
+ * valid and unchanged until lzma_code() has returned LZMA_STREAM_END
+ * with LZMA_FINISH or LZMA_FULL_FLUSH, or until lzma_end() has been
+ * called. This is easiest to guarantee when the whole input is in one
+ * buffer, for example a memory-mapped file. If consecutive calls to
+ * lzma_code() give input that isn't contiguous in memory, a new Block
+ * is started at the boundary.
+ */
+#define LZMA_STABLE_INPUT         UINT32_C(0x80)
+
+
+/**
+ * \brief       Make Blocks readable while they are being compressed
+ *
+ * Normally lzma_stream_encoder_mt() writes out a Block only after it has
+ * been compressed completely, so with a big block_size it may take a long
+ * time until the first byte of a Block becomes available. With this flag
+ * in lzma_mt.flags, the compressed data of the oldest Block in progress
+ * is copied to strm->next_out as soon as the worker thread has produced
+ * it. This is useful when the output is streamed, for example, over
+ * a network.
+ *
+ * The Block Headers are then written before the sizes of the Blocks are
+ * known, so they don't contain the Compressed Size and Uncompressed Size
+ * fields. The sizes are still stored in the Index. Decoders that need
+ * the sizes in the Block Headers to decode Blocks in parallel will
+ * decode such files in a single thread.
+ */
+#define LZMA_EARLY_OUTPUT         UINT32_C(0x100)
+
+
+/**
+ * \brief       Use lzma_mt.thread_pool
+ *
+ * lzma_mt.thread_pool is read only if this flag is in lzma_mt.flags.
+ * The member used to be reserved, so older applications may leave it
+ * uninitialized.
+ */
+#define LZMA_USE_THREAD_POOL      UINT32_C(0x200)
+
+
+/**
+ * \brief       Use lzma_mt.block_filters
+ *
+ * lzma_mt.block_filters is read only if this flag is in lzma_mt.flags.
+ * The member used to be reserved, so older applications may leave it
+ * uninitialized.
+ */
+#define LZMA_USE_BLOCK_FILTERS    UINT32_C(0x400)
+
+
+/**
+ * \brief       Kinds of data that the threaded encoder recognizes in Blocks
+ *
+ * With LZMA_USE_BLOCK_FILTERS, lzma_stream_encoder_mt() looks at samples
+ * spread over the input of each Block and puts the Block in one of these
+ * classes. The filter chain of the class is then used for the Block.
+ */
+typedef enum {
+	LZMA_BLOCK_CLASS_GENERIC        = 0,
+		/**<
+		 * \brief       Data that fits none of the other classes
+		 */
+
+	LZMA_BLOCK_CLASS_X86            = 1,
+		/**<
+		 * \brief       x86 or x86-64 machine code
+		 *
+		 * Recognized from CALL instructions with near targets.
+		 */
+
+	LZMA_BLOCK_CLASS_ARM64          = 2,
+		/**<
+		 * \brief       ARM64 machine code
+		 *
+		 * Recognized from BL instructions with near targets.
+		 */
+
+	LZMA_BLOCK_CLASS_STRUCTURED     = 3,
+		/**<
+		 * \brief       Binary records or samples of a fixed size
+		 *
+		 * Tables, uncompressed audio and images, and arrays of
+		 * numbers where a byte tends to repeat the byte one record
+		 * earlier. Records of 2-32 bytes are recognized.
+		 */
+
+	LZMA_BLOCK_CLASS_INCOMPRESSIBLE = 4,
+		/**<
+		 * \brief       Data whose bytes are close to uniformly distributed
+		 *
+		 * This is usually data that is compressed or encrypted
+		 * already.
+		 */
+} lzma_block_class;
+
+
+/**
+ * \brief       Number of values in lzma_block_class
+ */
+#define LZMA_BLOCK_CLASS_COUNT 5
+
+
 /**
  * \brief       Multithreading options
  */
@@ -76,12 +187,20 @@ typedef struct {
 	 *
 	 * Set this to zero if no flags are wanted.
 	 *
-	 * No flags are currently supported.
+	 * The supported flags are LZMA_STABLE_INPUT, LZMA_EARLY_OUTPUT,
+	 * LZMA_USE_THREAD_POOL, and LZMA_USE_BLOCK_FILTERS.
 	 */
 	uint32_t flags;
 
 	/**
 	 * \brief       Number of worker threads to use
+	 *
+	 * If the last filter is LZMA2 using LZMA_MF_RAD, the radix match
+	 * finder can use several threads within one Block. The threads
+	 * are then split automatically between Blocks encoded concurrently
+	 * and the match finder of each Block, and the threads member of
+	 * lzma_options_lzma is ignored. The split can be guided with
+	 * memlimit and uncompressed_size below.
 	 */
 	uint32_t threads;
 
@@ -104,9 +223,13 @@ typedef struct {
 	 * on the compression options. For LZMA2 it will be 3*dict_size
 	 * or 1 MiB, whichever is more.
 	 *
-	 * For each thread, about 3 * block_size bytes of memory will be
-	 * allocated. This may change in later liblzma versions. If so,
-	 * the memory usage will probably be reduced, not increased.
+	 * For each thread, up to about 2 * block_size bytes of memory will
+	 * be allocated, or block_size with LZMA_STABLE_INPUT, and the
+	 * output of Blocks that finish out of order may take one more
+	 * block_size in total. The output buffers grow as needed, so with
+	 * compressible data much less is actually used. This may change
+	 * in later liblzma versions. If so, the memory usage will probably
+	 * be reduced, not increased.
 	 */
 	uint64_t block_size;
 
@@ -180,12 +303,75 @@ typedef struct {
 	uint32_t reserved_int2;
 	uint32_t reserved_int3;
 	uint32_t reserved_int4;
-	uint64_t reserved_int5;
-	uint64_t reserved_int6;
+
+	/**
+	 * \brief       Memory usage limit for splitting the threads
+	 *
+	 * With the radix match finder, fewer Blocks are encoded
+	 * concurrently if that is needed to keep the memory usage
+	 * of the encoder below this limit. The limit is not enforced
+	 * otherwise: if even one Block at a time needs more memory,
+	 * the encoder is initialized anyway. Use
+	 * lzma_stream_encoder_mt_memusage() to check the final usage.
+	 *
+	 * Set this to 0 if there is no limit.
+	 */
+	uint64_t memlimit;
+
+	/**
+	 * \brief       Expected uncompressed size of the Stream
+	 *
+	 * With the radix match finder, no more Blocks are encoded
+	 * concurrently than there will be Blocks in the Stream, so
+	 * small inputs get all the threads in the match finder. This
+	 * is only a hint; any amount of data may be encoded.
+	 *
+	 * Set this to 0 if the size isn't known.
+	 */
+	uint64_t uncompressed_size;
+
 	uint64_t reserved_int7;
 	uint64_t reserved_int8;
-	void *reserved_ptr1;
-	void *reserved_ptr2;
+
+	/**
+	 * \brief       Thread pool to take the threads from
+	 *
+	 * If LZMA_USE_THREAD_POOL is in flags and this is non-NULL, the
+	 * worker threads and the threads of the radix match finder are
+	 * taken from this pool and given back by lzma_end(). See
+	 * lzma_thread_pool_create(). Otherwise the threads are created
+	 * for this stream only.
+	 */
+	lzma_thread_pool *thread_pool;
+
+	/**
+	 * \brief       Filter chains to choose from for each Block
+	 *
+	 * If LZMA_USE_BLOCK_FILTERS isn't in flags or this is NULL, every
+	 * Block is encoded with the chain from filters or preset above.
+	 * Otherwise this must point to an array
+	 * of LZMA_BLOCK_CLASS_COUNT chains indexed by lzma_block_class.
+	 * A worker thread then waits until it has the whole input of its
+	 * Block, finds the class of the data, and encodes the Block with
+	 * the chain of that class. The chains are copied when the encoder
+	 * is initialized.
+	 *
+	 * A NULL element means the chain from filters or preset, except
+	 * for LZMA_BLOCK_CLASS_INCOMPRESSIBLE: with NULL there, Blocks of
+	 * that class are stored with uncompressed LZMA2 chunks without
+	 * trying to compress them.
+	 *
+	 * If the chain of LZMA_BLOCK_CLASS_STRUCTURED has a Delta filter,
+	 * its distance is replaced with the record size found in each
+	 * Block. If one of the chains uses LZMA_MF_RAD, its thread count
+	 * is replaced with the share of threads that each Block gets.
+	 *
+	 * The Block size and the split of the threads are determined from
+	 * the chain from filters or preset. The memory usage is calculated
+	 * for the chain that needs the most memory.
+	 */
+	const lzma_filter *const *block_filters;
+
 	void *reserved_ptr3;
 	void *reserved_ptr4;
 
@@ -451,6 +637,52 @@ extern LZMA_API(lzma_ret) lzma_stream_buffer_encode(
 		lzma_nothrow lzma_attr_warn_unused_result;
 
 
+/**
+ * \brief       Single-call multithreaded .xz Stream encoder
+ *
+ * The input is split into Blocks the same way as lzma_stream_encoder_mt()
+ * does, and up to the given number of threads encode the Blocks at the
+ * same time. The Blocks are encoded directly into the output buffer when
+ * there is room for their worst-case size. The rest are encoded into
+ * temporary buffers and copied to their places at the end.
+ *
+ * Since every Block has its own headers, incompressible input may need
+ * a little more than lzma_stream_buffer_bound() bytes of output space.
+ * Having at least the sum of lzma_block_buffer_bound() of every Block in
+ * addition to the Stream Header, Index, and Stream Footer avoids the
+ * temporary buffers completely.
+ *
+ * \param       filters     Array of filters like in lzma_stream_buffer_encode()
+ * \param       check       Type of the integrity check to calculate from
+ *                          uncompressed data.
+ * \param       threads     Number of threads to use. With the radix match
+ *                          finder, the threads are split between Blocks and
+ *                          the match finder like in lzma_stream_encoder_mt().
+ * \param       allocator   lzma_allocator for custom allocator functions.
+ *                          Set to NULL to use malloc() and free().
+ * \param       in          Beginning of the input buffer
+ * \param       in_size     Size of the input buffer
+ * \param       out         Beginning of the output buffer
+ * \param       out_pos     The next byte will be written to out[*out_pos].
+ *                          *out_pos is updated only if encoding succeeds.
+ * \param       out_size    Size of the out buffer; the first byte into
+ *                          which no data is written to is out[out_size].
+ *
+ * \return      - LZMA_OK: Encoding was successful.
+ *              - LZMA_BUF_ERROR: Not enough output buffer space.
+ *              - LZMA_UNSUPPORTED_CHECK
+ *              - LZMA_OPTIONS_ERROR
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_PROG_ERROR
+ */
+extern LZMA_API(lzma_ret) lzma_stream_buffer_encode_mt(
+		lzma_filter *filters, lzma_check check, uint32_t threads,
+		const lzma_allocator *allocator,
+		const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
+
 /************
  * Decoding *
  ************/
@@ -522,6 +754,22 @@ extern LZMA_API(lzma_ret) lzma_stream_buffer_encode(
 #define LZMA_CONCATENATED               UINT32_C(0x08)
 
 
+/**
+ * This flag makes the .xz decoder calculate the integrity check of the
+ * decompressed data in a separate thread. The decoder copies its output
+ * to a few internal buffers (256 KiB in total) from which the thread
+ * updates the check, so decompression and check calculation run in
+ * parallel. This helps most with LZMA_CHECK_SHA256.
+ *
+ * A wrong check value is still reported with LZMA_DATA_ERROR at the end
+ * of the Block, before any output of the next Block is produced.
+ *
+ * This flag is ignored if liblzma was built without threading support
+ * or if LZMA_IGNORE_CHECK is used. It has no effect on .lzma files.
+ */
+#define LZMA_THREADED_CHECK             UINT32_C(0x40)
+
+
 /**
  * \brief       Initialize .xz Stream decoder
  *
@@ -533,7 +781,8 @@ extern LZMA_API(lzma_ret) lzma_stream_buffer_encode(
  *                          had been specified.
  * \param       flags       Bitwise-or of zero or more of the decoder flags:
  *                          LZMA_TELL_NO_CHECK, LZMA_TELL_UNSUPPORTED_CHECK,
- *                          LZMA_TELL_ANY_CHECK, LZMA_CONCATENATED
+ *                          LZMA_TELL_ANY_CHECK, LZMA_CONCATENATED,
+ *                          LZMA_THREADED_CHECK
  *
  * \return      - LZMA_OK: Initialization was successful.
  *              - LZMA_MEM_ERROR: Cannot allocate memory.
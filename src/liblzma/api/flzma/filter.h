@@ -159,6 +159,30 @@ extern LZMA_API(uint64_t) lzma_raw_decoder_memusage(const lzma_filter *filters)
 		lzma_nothrow lzma_attr_pure;
 
 
+/**
+ * \brief       Calculate memory requirements of a decoder of known size
+ *
+ * The Block and Stream decoders don't allocate a bigger LZMA1 or LZMA2
+ * dictionary than is needed for the Uncompressed Size of the Block (and
+ * a possible preset dictionary). This function returns the memory usage
+ * of the raw decoder with the dictionary limited the same way.
+ *
+ * \param       filters     Array of filters terminated with
+ *                          .id == LZMA_VLI_UNKNOWN.
+ * \param       uncompressed_size
+ *                          Amount of data that will be decoded or
+ *                          LZMA_VLI_UNKNOWN if it isn't known. In the
+ *                          latter case this is the same as
+ *                          lzma_raw_decoder_memusage().
+ *
+ * \return      Number of bytes of memory required for decoding,
+ *              or UINT64_MAX on error.
+ */
+extern LZMA_API(uint64_t) lzma_raw_decoder_memusage_sized(
+		const lzma_filter *filters, lzma_vli uncompressed_size)
+		lzma_nothrow lzma_attr_pure;
+
+
 /**
  * \brief       Initialize raw encoder
  *
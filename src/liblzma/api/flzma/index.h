@@ -346,6 +346,37 @@ extern LZMA_API(lzma_ret) lzma_index_append(
 		lzma_nothrow lzma_attr_warn_unused_result;
 
 
+/**
+ * \brief       Add many Blocks to lzma_index at once
+ *
+ * \param       i                   Pointer to a lzma_index structure
+ * \param       allocator           Pointer to lzma_allocator, or NULL to
+ *                                  use malloc()
+ * \param       unpadded_sizes      Unpadded Sizes of the Blocks
+ * \param       uncompressed_sizes  Uncompressed Sizes of the Blocks
+ * \param       count               Number of Blocks
+ *
+ * This is the same as calling lzma_index_append() count times, but all
+ * the Records that don't fit in the already allocated memory are put
+ * into one allocation, and the limits are checked only once. This is
+ * much faster when an application that writes its own Blocks has
+ * millions of them.
+ *
+ * If an error is returned, none of the Blocks were added.
+ *
+ * \return      - LZMA_OK
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_DATA_ERROR: Compressed or uncompressed size of the
+ *                Stream or size of the Index field would grow too big.
+ *              - LZMA_PROG_ERROR
+ */
+extern LZMA_API(lzma_ret) lzma_index_append_multi(
+		lzma_index *i, const lzma_allocator *allocator,
+		const lzma_vli *unpadded_sizes,
+		const lzma_vli *uncompressed_sizes, size_t count)
+		lzma_nothrow lzma_attr_warn_unused_result;
+
+
 /**
  * \brief       Set the Stream Flags
  *
@@ -543,6 +574,98 @@ extern LZMA_API(lzma_bool) lzma_index_iter_locate(
 		lzma_index_iter *iter, lzma_vli target) lzma_nothrow;
 
 
+/**
+ * \brief       Lookup structure for locating Blocks quickly
+ *
+ * lzma_index_iter_locate() walks the trees of the lzma_index on every call.
+ * When the same lzma_index is searched very many times, it is faster to
+ * build an lzma_index_lookup once with lzma_index_lookup_init(). It keeps
+ * the uncompressed offsets of the Blocks in a flat array in the order of
+ * a binary search so that a search touches few cache lines.
+ *
+ * The lookup uses about 16 bytes of memory per Block. It refers to the
+ * lzma_index it was built from, so it becomes invalid when that
+ * lzma_index is modified or freed.
+ *
+ * The contents of this structure is not visible outside the library.
+ */
+typedef struct lzma_index_lookup_s lzma_index_lookup;
+
+
+/**
+ * \brief       Build a lookup structure for an lzma_index
+ *
+ * \return      Pointer to a new lzma_index_lookup, or NULL if i is NULL
+ *              or memory allocation fails
+ */
+extern LZMA_API(lzma_index_lookup *) lzma_index_lookup_init(
+		const lzma_index *i, const lzma_allocator *allocator)
+		lzma_nothrow;
+
+
+/**
+ * \brief       Free a lookup structure
+ *
+ * If lookup is NULL, this does nothing.
+ */
+extern LZMA_API(void) lzma_index_lookup_end(
+		lzma_index_lookup *lookup, const lzma_allocator *allocator)
+		lzma_nothrow;
+
+
+/**
+ * \brief       Locate many Blocks at once
+ *
+ * \param       lookup      Lookup structure from lzma_index_lookup_init()
+ * \param       targets     Uncompressed offsets to locate
+ * \param       numbers     The number in the file of the Block containing
+ *                          each target is stored here. The first Block is
+ *                          number 1. A target at or past the end of the
+ *                          file gives 0.
+ * \param       count       Number of elements in targets[] and numbers[]
+ *
+ * The Blocks are found the same way as with lzma_index_iter_locate(),
+ * so empty Blocks are never returned. Several targets are searched at
+ * the same time, which hides much of the latency of the memory accesses.
+ * Use lzma_index_lookup_block() to get the details of a Block.
+ */
+extern LZMA_API(void) lzma_index_lookup_batch(
+		const lzma_index_lookup *lookup, const lzma_vli *targets,
+		lzma_vli *numbers, size_t count) lzma_nothrow;
+
+
+/**
+ * \brief       Get the information about a Block with its number
+ *
+ * \param       lookup      Lookup structure from lzma_index_lookup_init()
+ * \param       iter        Iterator to store the information to. It doesn't
+ *                          need to be initialized.
+ * \param       number      Number of the Block in the file, starting from 1
+ *
+ * On success, *iter is set up as if lzma_index_iter_locate() had found
+ * the Block, so lzma_index_iter_next() can be used to read the Blocks
+ * after it.
+ *
+ * \return      False on success. If number is zero or greater than the
+ *              number of Blocks, *iter is not modified and true is
+ *              returned.
+ */
+extern LZMA_API(lzma_bool) lzma_index_lookup_block(
+		const lzma_index_lookup *lookup, lzma_index_iter *iter,
+		lzma_vli number) lzma_nothrow;
+
+
+/**
+ * \brief       Locate a Block with a lookup structure
+ *
+ * This is the same as lzma_index_iter_locate() but uses the lookup
+ * structure. iter doesn't need to be initialized.
+ */
+extern LZMA_API(lzma_bool) lzma_index_lookup_locate(
+		const lzma_index_lookup *lookup, lzma_index_iter *iter,
+		lzma_vli target) lzma_nothrow;
+
+
 /**
  * \brief       Concatenate lzma_indexes
  *
@@ -750,3 +873,148 @@ extern LZMA_API(lzma_ret) lzma_file_info_decoder(
 		lzma_stream *strm, lzma_index **dest_index,
 		uint64_t memlimit, uint64_t file_size)
 		lzma_nothrow;
+
+
+/**
+ * \brief       Single-call .xz file info decoder using positional reads
+ *
+ * \param       dest_index  On success, *dest_index is set to point to
+ *                          a new lzma_index for the whole file.
+ * \param       memlimit    Pointer to how much memory the resulting
+ *                          lzma_index is allowed to require. If the limit
+ *                          is too small, LZMA_MEMLIMIT_ERROR is returned
+ *                          and *memlimit is set to the amount of memory
+ *                          that would have been needed.
+ * \param       allocator   lzma_allocator for custom allocator functions.
+ *                          Set to NULL to use malloc() and free().
+ * \param       file_size   Size of the input .xz file
+ * \param       read_func   Function that reads exactly size bytes starting
+ *                          from the absolute file position pos into buf.
+ *                          It must return LZMA_OK on success. Any other
+ *                          value is returned from this function as is,
+ *                          so it should be an error code.
+ * \param       opaque      Passed to read_func as is
+ *
+ * This decodes the same information as lzma_file_info_decoder() but asks
+ * for the input with as few reads as possible instead of one seek at
+ * a time. The reads are up to 1 MiB each, reaching backwards from the
+ * position that the decoder needs. This way the Stream Header of a Stream
+ * and the Stream Footer and Index of the previous Stream usually come in
+ * the same read, and a file of many small Streams needs only a few reads.
+ * A file up to 1 MiB is read at once. Every read is within
+ * the file_size bytes.
+ *
+ * \return      - LZMA_OK
+ *              - LZMA_FORMAT_ERROR
+ *              - LZMA_OPTIONS_ERROR
+ *              - LZMA_DATA_ERROR
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_MEMLIMIT_ERROR
+ *              - LZMA_PROG_ERROR
+ *              - Anything that read_func returned
+ */
+extern LZMA_API(lzma_ret) lzma_file_info_pread(lzma_index **dest_index,
+		uint64_t *memlimit, const lzma_allocator *allocator,
+		uint64_t file_size,
+		lzma_ret (*read_func)(void *opaque, uint8_t *buf,
+			size_t size, uint64_t pos),
+		void *opaque) lzma_nothrow;
+
+
+/**
+ * \brief       Initialize a random access .xz decoder
+ *
+ * \param       strm        Pointer to a properly prepared lzma_stream
+ * \param       index       Combined Index of the whole .xz file, for
+ *                          example from lzma_file_info_decoder(). The
+ *                          Index must stay valid and unmodified until
+ *                          lzma_end() or until the decoder has been
+ *                          reinitialized.
+ * \param       memlimit    Memory usage limit for decoding a single Block.
+ *                          The cache isn't counted against this limit.
+ * \param       cache_size  Maximum total uncompressed size of the Blocks
+ *                          that are kept in memory after they have been
+ *                          decoded. Seeking into a cached Block doesn't
+ *                          need any input. Blocks that are bigger than
+ *                          this aren't cached. Use 0 to disable caching.
+ * \param       flags       Bitwise-or of zero or more of the decoder flags:
+ *                          LZMA_IGNORE_CHECK
+ *
+ * This decoder uses the Index to decode the .xz file starting from any
+ * uncompressed offset. Only the Block containing the offset is decoded
+ * from its beginning; the data before the offset in that Block is
+ * thrown away. Decoding continues from Block to Block (also over Stream
+ * boundaries) until the end of the file or until the next call to
+ * lzma_seekable_decoder_seek().
+ *
+ * Initially the decoder is positioned at the uncompressed offset 0 and
+ * the first input given to lzma_code() must start from the beginning of
+ * the file. When input is needed from elsewhere in the file, lzma_code()
+ * returns LZMA_SEEK_NEEDED and the application must continue by giving
+ * input starting from the absolute file position strm->seek_pos. Like
+ * with lzma_file_info_decoder(), no external seeking is needed if the
+ * whole file is given at once.
+ *
+ * Blocks are validated against the Index but the Index fields in the
+ * file aren't read, so the Index should come from the same file (or
+ * have been verified by some other means). The Stream Flags of every
+ * Stream must have been set in the Index, because they tell the Check
+ * of the Blocks. An Index from lzma_file_info_decoder() has them, but
+ * with lzma_index_decoder() or lzma_index_buffer_decode() they have to
+ * be set with lzma_index_stream_flags().
+ *
+ * Valid `action' arguments to lzma_code() are LZMA_RUN and LZMA_FINISH.
+ *
+ * Possible return values from lzma_code():
+ *   - LZMA_OK: All OK so far, more input or output space needed
+ *   - LZMA_SEEK_NEEDED: Provide more input starting from the absolute
+ *     file position strm->seek_pos
+ *   - LZMA_STREAM_END: All data up to the end of the file has been
+ *     decoded. Decoding can be continued after
+ *     lzma_seekable_decoder_seek().
+ *   - LZMA_OPTIONS_ERROR
+ *   - LZMA_DATA_ERROR
+ *   - LZMA_BUF_ERROR
+ *   - LZMA_MEM_ERROR
+ *   - LZMA_MEMLIMIT_ERROR
+ *   - LZMA_PROG_ERROR
+ *
+ * \return      - LZMA_OK
+ *              - LZMA_OPTIONS_ERROR: Unsupported flags
+ *              - LZMA_MEM_ERROR
+ *              - LZMA_PROG_ERROR: Stream Flags are missing from the Index
+ *                or the arguments are otherwise invalid.
+ */
+extern LZMA_API(lzma_ret) lzma_seekable_decoder(
+		lzma_stream *strm, const lzma_index *index,
+		uint64_t memlimit, uint64_t cache_size, uint32_t flags)
+		lzma_nothrow;
+
+
+/**
+ * \brief       Set the uncompressed offset of a random access decoder
+ *
+ * \param       strm        Pointer to lzma_stream that has been initialized
+ *                          with lzma_seekable_decoder()
+ * \param       uncompressed_offset
+ *                          Uncompressed offset in the file from which
+ *                          the next lzma_code() call continues. An offset
+ *                          at or past the end of the file makes
+ *                          lzma_code() return LZMA_STREAM_END.
+ *
+ * The input that the application has in strm->next_in may still be used,
+ * so the application doesn't need to do anything about it. If the new
+ * offset is ahead in the Block currently being decoded, decoding simply
+ * continues in that Block.
+ *
+ * This may be called after lzma_code() has returned LZMA_OK,
+ * LZMA_SEEK_NEEDED, LZMA_STREAM_END, or LZMA_MEMLIMIT_ERROR. The next
+ * call to lzma_code() may use either LZMA_RUN or LZMA_FINISH.
+ *
+ * \return      - LZMA_OK
+ *              - LZMA_PROG_ERROR: strm wasn't initialized with
+ *                lzma_seekable_decoder() or a fatal error has occurred.
+ */
+extern LZMA_API(lzma_ret) lzma_seekable_decoder_seek(
+		lzma_stream *strm, uint64_t uncompressed_offset)
+		lzma_nothrow;
@@ -177,6 +177,17 @@ typedef enum {
 } lzma_mode;
 
 
+/**
+ * \brief       Flag in lzma_options_lzma.mode to use the thread pool
+ *
+ * lzma_options_lzma.thread_pool is read only if this is bitwise-ORed
+ * with the mode, for example
+ * (lzma_mode)(LZMA_MODE_NORMAL | LZMA_MODE_THREAD_POOL). The member used
+ * to be reserved, so older applications may leave it uninitialized.
+ */
+#define LZMA_MODE_THREAD_POOL 0x100
+
+
 /**
  * \brief       Test if given compression mode is supported
  *
@@ -462,7 +473,18 @@ typedef struct {
 	lzma_reserved_enum reserved_enum2;
 	lzma_reserved_enum reserved_enum3;
 	lzma_reserved_enum reserved_enum4;
-	void *reserved_ptr1;
+
+	/**
+	 * \brief       Thread pool to take the threads from
+	 *
+	 * If LZMA_MODE_THREAD_POOL is set in mode and this is non-NULL,
+	 * the threads of the radix match finder are taken from this pool.
+	 * Threads that the pool cannot give are replaced by the calling
+	 * thread. Otherwise the threads are created for this stream only.
+	 * lzma_lzma_preset() sets this to NULL.
+	 */
+	lzma_thread_pool *thread_pool;
+
 	void *reserved_ptr2;
 
 } lzma_options_lzma;
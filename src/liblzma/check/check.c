@@ -172,3 +172,82 @@ lzma_check_finish(lzma_check_state *check, lzma_check type)
 
 	return;
 }
+
+
+// The combining works like in zlib: the CRC register of the first buffer
+// is moved forward over size2 zero bytes by multiplying it by x^(8 * size2)
+// modulo the polynomial, and the CRC of the second buffer is added. The
+// initial and final inversions of the two CRCs cancel out. The values
+// are in the reflected bit order so the top bit is the x^0 term.
+
+#ifdef HAVE_CHECK_CRC32
+/// a * b mod P
+static uint32_t
+crc32_mul(uint32_t a, uint32_t b)
+{
+	uint32_t product = 0;
+
+	for (uint32_t m = UINT32_C(1) << 31; m != 0; m >>= 1) {
+		if (a & m)
+			product ^= b;
+
+		b = (b >> 1) ^ (UINT32_C(0xEDB88320) & (0U - (b & 1)));
+	}
+
+	return product;
+}
+
+
+extern uint32_t
+lzma_crc32_combine(uint32_t crc1, uint32_t crc2, uint64_t size2)
+{
+	// x^(8 * size2) by squaring x^8
+	uint32_t shift = UINT32_C(1) << 31;
+	uint32_t square = UINT32_C(1) << (31 - 8);
+
+	for (; size2 != 0; size2 >>= 1) {
+		if (size2 & 1)
+			shift = crc32_mul(shift, square);
+
+		square = crc32_mul(square, square);
+	}
+
+	return crc32_mul(shift, crc1) ^ crc2;
+}
+#endif
+
+
+#ifdef HAVE_CHECK_CRC64
+static uint64_t
+crc64_mul(uint64_t a, uint64_t b)
+{
+	uint64_t product = 0;
+
+	for (uint64_t m = UINT64_C(1) << 63; m != 0; m >>= 1) {
+		if (a & m)
+			product ^= b;
+
+		b = (b >> 1) ^ (UINT64_C(0xC96C5795D7870F42)
+				& (0U - (b & 1)));
+	}
+
+	return product;
+}
+
+
+extern uint64_t
+lzma_crc64_combine(uint64_t crc1, uint64_t crc2, uint64_t size2)
+{
+	uint64_t shift = UINT64_C(1) << 63;
+	uint64_t square = UINT64_C(1) << (63 - 8);
+
+	for (; size2 != 0; size2 >>= 1) {
+		if (size2 & 1)
+			shift = crc64_mul(shift, square);
+
+		square = crc64_mul(square, square);
+	}
+
+	return crc64_mul(shift, crc1) ^ crc2;
+}
+#endif
@@ -122,6 +122,24 @@ extern void lzma_check_update(lzma_check_state *check, lzma_check type,
 extern void lzma_check_finish(lzma_check_state *check, lzma_check type);
 
 
+/// \brief      Combine the CRC32 values of two consecutive buffers
+///
+/// \param      crc1        lzma_crc32() of the first buffer
+/// \param      crc2        lzma_crc32() of the second buffer calculated
+///                         with zero as the initial value
+/// \param      size2       Size of the second buffer
+///
+/// \return     lzma_crc32() of the two buffers one after the other
+extern uint32_t lzma_crc32_combine(uint32_t crc1, uint32_t crc2,
+		uint64_t size2);
+
+/// \brief      Combine the CRC64 values of two consecutive buffers
+///
+/// This is like lzma_crc32_combine().
+extern uint64_t lzma_crc64_combine(uint64_t crc1, uint64_t crc2,
+		uint64_t size2);
+
+
 #ifndef LZMA_SHA256FUNC
 
 /// Prepare SHA-256 state for new input.
@@ -8,6 +8,9 @@
 /// http://www.intel.com/technology/comms/perfnet/download/CRC_generators.pdf
 /// The code in this file is not the same as in Intel's paper, but
 /// the basic principle is identical.
+///
+/// On x86 CPUs that have PCLMULQDQ, long inputs are folded with
+/// carry-less multiplication instead (see crc_clmul.h).
 //
 //  Author:     Lasse Collin
 //
@@ -18,13 +21,14 @@
 
 #include "check.h"
 #include "crc_macros.h"
+#include "crc_clmul.h"
 
 
 // If you make any changes, do some benchmarking! Seemingly unrelated
 // changes can very easily ruin the performance (and very probably is
 // very compiler dependent).
-extern LZMA_API(uint32_t)
-lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc)
+static uint32_t
+crc32_generic(const uint8_t *buf, size_t size, uint32_t crc)
 {
 	crc = ~crc;
 
@@ -80,3 +84,56 @@ lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc)
 
 	return ~crc;
 }
+
+
+#ifdef CRC_USE_CLMUL
+static crc_attr_clmul uint32_t
+crc32_clmul(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	if (size < CRC_CLMUL_MIN)
+		return crc32_generic(buf, size, crc);
+
+	// x^575, x^511, x^191, and x^127 mod P in the bit order of
+	// crc_clmul.h.
+	const __m128i k512 = _mm_set_epi64x(
+			(long long)UINT64_C(0xCAD38E8F00000000),
+			(long long)UINT64_C(0x653D982200000000));
+	const __m128i k128 = _mm_set_epi64x(
+			(long long)UINT64_C(0x9BA54C6F00000000),
+			(long long)UINT64_C(0x65673B4600000000));
+
+	uint8_t folded[16];
+	const size_t done = crc_clmul_fold_buf(buf, size,
+			_mm_cvtsi32_si128((int)(~crc)), k512, k128, folded);
+
+	crc = crc32_generic(folded, sizeof(folded), UINT32_MAX);
+	return crc32_generic(buf + done, size - done, crc);
+}
+
+
+static uint32_t crc32_resolve(const uint8_t *buf, size_t size, uint32_t crc);
+
+/// The implementation to use. It is set on the first call. Threads may
+/// race to set it but they all store the same value.
+static uint32_t (*crc32_func)(const uint8_t *buf, size_t size, uint32_t crc)
+		= &crc32_resolve;
+
+
+static uint32_t
+crc32_resolve(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	crc32_func = lzma_cpu_has_clmul() ? &crc32_clmul : &crc32_generic;
+	return crc32_func(buf, size, crc);
+}
+#endif
+
+
+extern LZMA_API(uint32_t)
+lzma_crc32(const uint8_t *buf, size_t size, uint32_t crc)
+{
+#ifdef CRC_USE_CLMUL
+	return crc32_func(buf, size, crc);
+#else
+	return crc32_generic(buf, size, crc);
+#endif
+}
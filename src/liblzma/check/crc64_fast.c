@@ -5,7 +5,8 @@
 ///
 /// Calculate the CRC64 using the slice-by-four algorithm. This is the same
 /// idea that is used in crc32_fast.c, but for CRC64 we use only four tables
-/// instead of eight to avoid increasing CPU cache usage.
+/// instead of eight to avoid increasing CPU cache usage. PCLMULQDQ is
+/// used on x86 CPUs that have it like in crc32_fast.c.
 //
 //  Author:     Lasse Collin
 //
@@ -16,6 +17,7 @@
 
 #include "check.h"
 #include "crc_macros.h"
+#include "crc_clmul.h"
 
 
 #ifdef WORDS_BIGENDIAN
@@ -26,8 +28,8 @@
 
 
 // See the comments in crc32_fast.c. They aren't duplicated here.
-extern LZMA_API(uint64_t)
-lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+static uint64_t
+crc64_generic(const uint8_t *buf, size_t size, uint64_t crc)
 {
 	crc = ~crc;
 
@@ -70,3 +72,57 @@ lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc)
 
 	return ~crc;
 }
+
+
+#ifdef CRC_USE_CLMUL
+static crc_attr_clmul uint64_t
+crc64_clmul(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	if (size < CRC_CLMUL_MIN)
+		return crc64_generic(buf, size, crc);
+
+	// x^575, x^511, x^191, and x^127 mod P in the bit order of
+	// crc_clmul.h.
+	const __m128i k512 = _mm_set_epi64x(
+			(long long)UINT64_C(0x081F6054A7842DF4),
+			(long long)UINT64_C(0x6AE3EFBB9DD441F3));
+	const __m128i k128 = _mm_set_epi64x(
+			(long long)UINT64_C(0xDABE95AFC7875F40),
+			(long long)UINT64_C(0xE05DD497CA393AE4));
+
+	uint8_t folded[16];
+	const size_t done = crc_clmul_fold_buf(buf, size,
+			_mm_set_epi64x(0, (long long)(~crc)),
+			k512, k128, folded);
+
+	crc = crc64_generic(folded, sizeof(folded), UINT64_MAX);
+	return crc64_generic(buf + done, size - done, crc);
+}
+
+
+static uint64_t crc64_resolve(const uint8_t *buf, size_t size, uint64_t crc);
+
+/// The implementation to use. It is set on the first call. Threads may
+/// race to set it but they all store the same value.
+static uint64_t (*crc64_func)(const uint8_t *buf, size_t size, uint64_t crc)
+		= &crc64_resolve;
+
+
+static uint64_t
+crc64_resolve(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	crc64_func = lzma_cpu_has_clmul() ? &crc64_clmul : &crc64_generic;
+	return crc64_func(buf, size, crc);
+}
+#endif
+
+
+extern LZMA_API(uint64_t)
+lzma_crc64(const uint8_t *buf, size_t size, uint64_t crc)
+{
+#ifdef CRC_USE_CLMUL
+	return crc64_func(buf, size, crc);
+#else
+	return crc64_generic(buf, size, crc);
+#endif
+}
@@ -0,0 +1,103 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       crc_clmul.h
+/// \brief      CRC folding with carry-less multiplication (PCLMULQDQ)
+///
+/// This is the method from Intel's paper "Fast CRC Computation for Generic
+/// Polynomials Using PCLMULQDQ Instruction". The input is folded into
+/// 128-bit blocks until 16 bytes are left. The CRC of these 16 bytes,
+/// calculated with zero as the initial value, equals the CRC of all the
+/// folded input. The paper uses Barrett reduction for the last step but
+/// here the table code of crc32_fast.c or crc64_fast.c does it instead,
+/// which keeps this file the same for both polynomials.
+///
+/// The bits of a reflected CRC are in the reversed order: the lowest bit
+/// of the first byte is the highest degree term. A product from PCLMULQDQ
+/// is then one bit too low, so the constant for folding a 64-bit half
+/// forward by n bits is x^(n-1) mod P. The constants are in the same
+/// reflected order: the term x^d is bit 63 - d of the 64-bit value.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_CRC_CLMUL_H
+#define LZMA_CRC_CLMUL_H
+
+#include "cpu_features.h"
+
+#if defined(HAVE_USABLE_CLMUL) && defined(LZMA_HAVE_CPUID) \
+		&& !defined(WORDS_BIGENDIAN)
+#	include <immintrin.h>
+#	define CRC_USE_CLMUL 1
+#	define crc_attr_clmul __attribute__((__target__("sse2,pclmul")))
+
+/// Inputs smaller than this are left to the table code
+#	define CRC_CLMUL_MIN 64
+
+
+/// Multiply the low half of a by the low half of k and the high half of a
+/// by the high half of k. The sum of the products is congruent to a moved
+/// forward by the distance k is made for.
+static inline crc_attr_clmul __m128i
+crc_clmul_fold(__m128i a, __m128i k)
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00),
+			_mm_clmulepi64_si128(a, k, 0x11));
+}
+
+
+/// \brief      Fold a buffer to 16 bytes
+///
+/// \param      buf         Input buffer of at least CRC_CLMUL_MIN bytes
+/// \param      size        Size of buf
+/// \param      init        The CRC register (the complement of the CRC
+///                         value of the API) in the low bits
+/// \param      k512        x^575 and x^511 mod P in the low and high half
+/// \param      k128        x^191 and x^127 mod P in the low and high half
+/// \param      out         The folded bytes are stored here
+///
+/// \return     The number of bytes that were folded. It is a multiple
+///             of 16. The rest of buf must be handled by the caller
+///             after the CRC of out[] has been calculated.
+static inline crc_attr_clmul size_t
+crc_clmul_fold_buf(const uint8_t *buf, size_t size, __m128i init,
+		__m128i k512, __m128i k128, uint8_t out[16])
+{
+	// Four independent blocks keep the multiplier busy. Each of them
+	// is folded 512 bits forward at a time.
+	__m128i a0 = _mm_loadu_si128((const __m128i *)(buf));
+	__m128i a1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+	__m128i a2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+	__m128i a3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+	a0 = _mm_xor_si128(a0, init);
+
+	size_t pos = 64;
+
+	for (; size - pos >= 64; pos += 64) {
+		const uint8_t *p = buf + pos;
+		a0 = _mm_xor_si128(crc_clmul_fold(a0, k512),
+				_mm_loadu_si128((const __m128i *)(p)));
+		a1 = _mm_xor_si128(crc_clmul_fold(a1, k512),
+				_mm_loadu_si128((const __m128i *)(p + 16)));
+		a2 = _mm_xor_si128(crc_clmul_fold(a2, k512),
+				_mm_loadu_si128((const __m128i *)(p + 32)));
+		a3 = _mm_xor_si128(crc_clmul_fold(a3, k512),
+				_mm_loadu_si128((const __m128i *)(p + 48)));
+	}
+
+	a0 = _mm_xor_si128(crc_clmul_fold(a0, k128), a1);
+	a0 = _mm_xor_si128(crc_clmul_fold(a0, k128), a2);
+	a0 = _mm_xor_si128(crc_clmul_fold(a0, k128), a3);
+
+	for (; size - pos >= 16; pos += 16)
+		a0 = _mm_xor_si128(crc_clmul_fold(a0, k128),
+				_mm_loadu_si128((const __m128i *)(buf + pos)));
+
+	_mm_storeu_si128((__m128i *)(out), a0);
+	return pos;
+}
+
+#endif
+#endif
@@ -3,9 +3,9 @@
 /// \file       sha256.c
 /// \brief      SHA-256
 ///
-/// \todo       Crypto++ has x86 ASM optimizations. They use SSE so if they
-///             are imported to liblzma, SSE instructions need to be used
-///             conditionally to keep the code working on older boxes.
+/// On x86 CPUs that have the SHA extensions, the blocks are hashed with
+/// SHA256RNDS2 and friends. The CPU is checked when the first block is
+/// hashed.
 //
 //  This code is based on the code found from 7-Zip, which has a modified
 //  version of the SHA-256 found from Crypto++ <http://www.cryptopp.com/>.
@@ -22,6 +22,12 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "check.h"
+#include "cpu_features.h"
+
+#if defined(HAVE_USABLE_SHA_NI) && defined(LZMA_HAVE_CPUID)
+#	include <immintrin.h>
+#	define SHA256_USE_SHA_NI 1
+#endif
 
 // Rotate a uint32_t. GCC can optimize this to a rotate instruction
 // at least on x86.
@@ -115,10 +121,126 @@ transform(uint32_t state[8], const uint32_t data[16])
 }
 
 
+/// Hash blocks that may be unaligned
+static void
+transform_blocks(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	uint32_t block[16];
+
+	for (; blocks > 0; --blocks, data += 64) {
+		memcpy(block, data, sizeof(block));
+		transform(state, block);
+	}
+
+	return;
+}
+
+
+#ifdef SHA256_USE_SHA_NI
+#define sha_attr __attribute__((__target__("sha,sse4.1,ssse3")))
+
+// Four rounds with the message words in msg. The two halves of the
+// state are in the order used by SHA256RNDS2: ABEF and CDGH.
+#define NI_ROUNDS(i, msg) \
+do { \
+	__m128i wk = _mm_add_epi32(msg, _mm_loadu_si128( \
+			(const __m128i *)(SHA256_K + 4 * (i)))); \
+	cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk); \
+	wk = _mm_shuffle_epi32(wk, 0x0E); \
+	abef = _mm_sha256rnds2_epu32(abef, cdgh, wk); \
+} while (0)
+
+// Calculate the next four message words into m0. m0 has the oldest
+// four words and m3 the newest.
+#define NI_SCHEDULE(m0, m1, m2, m3) \
+	m0 = _mm_sha256msg2_epu32(_mm_add_epi32( \
+			_mm_sha256msg1_epu32(m0, m1), \
+			_mm_alignr_epi8(m3, m2, 4)), m3)
+
+#define NI_LOAD(i, m) \
+do { \
+	m = _mm_shuffle_epi8(_mm_loadu_si128( \
+			(const __m128i *)(data + 16 * (i))), bswap); \
+	NI_ROUNDS(i, m); \
+} while (0)
+
+#define NI_NEXT(i, m0, m1, m2, m3) \
+do { \
+	NI_SCHEDULE(m0, m1, m2, m3); \
+	NI_ROUNDS(i, m0); \
+} while (0)
+
+
+static sha_attr void
+transform_blocks_ni(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	const __m128i bswap = _mm_set_epi64x(
+			0x0C0D0E0F08090A0BLL, 0x0405060700010203LL);
+
+	// DCBA and HGFE to ABEF and CDGH
+	const __m128i dcba = _mm_loadu_si128((const __m128i *)(state));
+	const __m128i hgfe = _mm_loadu_si128((const __m128i *)(state + 4));
+	const __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+	const __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+	__m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+	__m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+	for (; blocks > 0; --blocks, data += 64) {
+		const __m128i abef_save = abef;
+		const __m128i cdgh_save = cdgh;
+		__m128i m0, m1, m2, m3;
+
+		NI_LOAD(0, m0);
+		NI_LOAD(1, m1);
+		NI_LOAD(2, m2);
+		NI_LOAD(3, m3);
+
+		for (unsigned i = 4; i < 16; i += 4) {
+			NI_NEXT(i,     m0, m1, m2, m3);
+			NI_NEXT(i + 1, m1, m2, m3, m0);
+			NI_NEXT(i + 2, m2, m3, m0, m1);
+			NI_NEXT(i + 3, m3, m0, m1, m2);
+		}
+
+		abef = _mm_add_epi32(abef, abef_save);
+		cdgh = _mm_add_epi32(cdgh, cdgh_save);
+	}
+
+	// Back to DCBA and HGFE
+	const __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+	const __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+	_mm_storeu_si128((__m128i *)(state), _mm_blend_epi16(feba, dchg, 0xF0));
+	_mm_storeu_si128((__m128i *)(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+	return;
+}
+
+
+static void transform_resolve(
+		uint32_t state[8], const uint8_t *data, size_t blocks);
+
+/// The implementation to use. It is set when the first block is hashed.
+/// Threads may race to set it but they all store the same value.
+static void (*transform_func)(uint32_t state[8], const uint8_t *data,
+		size_t blocks) = &transform_resolve;
+
+
+static void
+transform_resolve(uint32_t state[8], const uint8_t *data, size_t blocks)
+{
+	transform_func = lzma_cpu_has_sha_ni()
+			? &transform_blocks_ni : &transform_blocks;
+	transform_func(state, data, blocks);
+	return;
+}
+#else
+#	define transform_func transform_blocks
+#endif
+
+
 static void
 process(lzma_check_state *check)
 {
-	transform(check->state.sha256.state, check->buffer.u32);
+	transform_func(check->state.sha256.state, check->buffer.u8, 1);
 	return;
 }
 
@@ -145,8 +267,21 @@ lzma_sha256_update(const uint8_t *buf, size_t size, lzma_check_state *check)
 	// This way we can be called with arbitrarily sized buffers
 	// (no need to be multiple of 64 bytes), and the code works also
 	// on architectures that don't allow unaligned memory access.
+	// Whole blocks are hashed straight from buf[] when the temporary
+	// buffer is empty.
 	while (size > 0) {
 		const size_t copy_start = check->state.sha256.size & 0x3F;
+
+		if (copy_start == 0 && size >= 64) {
+			const size_t whole = size & ~(size_t)(0x3F);
+			transform_func(check->state.sha256.state,
+					buf, whole / 64);
+			buf += whole;
+			size -= whole;
+			check->state.sha256.size += whole;
+			continue;
+		}
+
 		size_t copy_size = 64 - copy_start;
 		if (copy_size > size)
 			copy_size = size;
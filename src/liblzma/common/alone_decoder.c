@@ -116,6 +116,12 @@ alone_decode(void *coder_ptr, const lzma_allocator *allocator,
 					>= (LZMA_VLI_C(1) << 38))
 			return LZMA_FORMAT_ERROR;
 
+		// If the uncompressed size is known, the dictionary
+		// doesn't need to be bigger than that.
+		if (coder->uncompressed_size < coder->options.dict_size)
+			coder->options.dict_size
+					= (uint32_t)(coder->uncompressed_size);
+
 		// Calculate the memory usage so that it is ready
 		// for SEQ_CODER_INIT.
 		coder->memusage = lzma_lzma_decoder_memusage(&coder->options)
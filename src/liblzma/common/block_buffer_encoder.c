@@ -14,7 +14,7 @@
 #include "block_encoder.h"
 #include "filter_encoder.h"
 #include "lzma2_encoder.h"
-#include "check.h"
+#include "check_mt.h"
 
 
 /// Estimate the maximum size of the Block Header and Check fields for
@@ -57,6 +57,16 @@ lzma2_bound(uint64_t uncompressed_size)
 }
 
 
+/// Exact size of the LZMA2 data when it is stored in uncompressed chunks.
+/// This is smaller than lzma2_bound() which also covers compressed chunks.
+static uint64_t
+lzma2_uncompressed_size(uint64_t uncompressed_size)
+{
+	return uncompressed_size + (uncompressed_size + LZMA2_CHUNK_MAX - 1)
+			/ LZMA2_CHUNK_MAX * LZMA2_HEADER_UNCOMPRESSED + 1;
+}
+
+
 extern uint64_t
 lzma_block_buffer_bound64(uint64_t uncompressed_size)
 {
@@ -90,9 +100,9 @@ lzma_block_buffer_bound(size_t uncompressed_size)
 }
 
 
-static lzma_ret
-block_encode_uncompressed(lzma_block *block, const uint8_t *in, size_t in_size,
-		uint8_t *out, size_t *out_pos, size_t out_size)
+extern lzma_ret
+lzma_block_uncomp_header_encode(lzma_block *block, size_t in_size,
+		uint8_t *out)
 {
 	// Use LZMA2 uncompressed chunks. We wouldn't need a dictionary at
 	// all, but LZMA2 always requires a dictionary, so use the minimum
@@ -106,34 +116,46 @@ block_encode_uncompressed(lzma_block *block, const uint8_t *in, size_t in_size,
 	filters[0].options = &lzma2;
 	filters[1].id = LZMA_VLI_UNKNOWN;
 
+	// The uncompressed chunks are never bigger than what lzma2_bound()
+	// returns but often smaller, so store the exact size into the
+	// Block Header.
+	block->uncompressed_size = in_size;
+	block->compressed_size = lzma2_uncompressed_size(in_size);
+
 	// Set the above filter options to *block temporarily so that we can
 	// encode the Block Header.
 	lzma_filter *filters_orig = block->filters;
 	block->filters = filters;
 
-	if (lzma_block_header_size(block) != LZMA_OK) {
-		block->filters = filters_orig;
-		return LZMA_PROG_ERROR;
-	}
+	lzma_ret ret = lzma_block_header_size(block);
+	if (ret == LZMA_OK)
+		ret = lzma_block_header_encode(block, out);
 
-	// Check that there's enough output space. The caller has already
-	// set block->compressed_size to what lzma2_bound() has returned,
-	// so we can reuse that value. We know that compressed_size is a
-	// known valid VLI and header_size is a small value so their sum
-	// will never overflow.
+	block->filters = filters_orig;
+	return ret == LZMA_OK ? LZMA_OK : LZMA_PROG_ERROR;
+}
+
+
+static lzma_ret
+block_encode_uncompressed(lzma_block *block, const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	// The caller has set block->compressed_size to what lzma2_bound()
+	// has returned.
 	assert(block->compressed_size == lzma2_bound(in_size));
+
+	uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+	return_if_error(lzma_block_uncomp_header_encode(
+			block, in_size, header));
+
+	// Check that there's enough output space. We know that
+	// compressed_size is a known valid VLI and header_size is a small
+	// value so their sum will never overflow.
 	if (out_size - *out_pos
-			< block->header_size + block->compressed_size) {
-		block->filters = filters_orig;
+			< block->header_size + block->compressed_size)
 		return LZMA_BUF_ERROR;
-	}
 
-	if (lzma_block_header_encode(block, out + *out_pos) != LZMA_OK) {
-		block->filters = filters_orig;
-		return LZMA_PROG_ERROR;
-	}
-
-	block->filters = filters_orig;
+	memcpy(out + *out_pos, header, block->header_size);
 	*out_pos += block->header_size;
 
 	// Encode the data using LZMA2 uncompressed chunks.
@@ -195,10 +217,23 @@ block_encode_normal(lzma_block *block, const lzma_allocator *allocator,
 			&raw_encoder, allocator, block->filters);
 
 	if (ret == LZMA_OK) {
+		// Fast LZMA2 encodes one dictionary-sized window per call,
+		// so keep calling until the encoder finishes, the output
+		// is full, or no progress is made. LZMA_TIMED_OUT means
+		// that its match finder threads are still busy, so there
+		// is no progress yet but there will be.
 		size_t in_pos = 0;
-		ret = raw_encoder.code(raw_encoder.coder, allocator,
-				in, &in_pos, in_size, out, out_pos, out_size,
-				LZMA_FINISH);
+		size_t in_prev;
+		size_t out_prev;
+		do {
+			in_prev = in_pos;
+			out_prev = *out_pos;
+			ret = raw_encoder.code(raw_encoder.coder, allocator,
+					in, &in_pos, in_size,
+					out, out_pos, out_size, LZMA_FINISH);
+		} while (*out_pos < out_size && (ret == LZMA_TIMED_OUT
+				|| (ret == LZMA_OK && (in_pos != in_prev
+					|| *out_pos != out_prev))));
 	}
 
 	// NOTE: This needs to be run even if lzma_raw_encoder_init() failed.
@@ -212,7 +247,7 @@ block_encode_normal(lzma_block *block, const lzma_allocator *allocator,
 		if (ret != LZMA_OK)
 			ret = LZMA_PROG_ERROR;
 
-	} else if (ret == LZMA_OK) {
+	} else if (ret == LZMA_OK || ret == LZMA_TIMED_OUT) {
 		// Output buffer became full.
 		ret = LZMA_BUF_ERROR;
 	}
@@ -270,27 +305,48 @@ block_buffer_encode(lzma_block *block, const lzma_allocator *allocator,
 	if (block->compressed_size == 0)
 		return LZMA_DATA_ERROR;
 
+	// With a multithreaded LZMA2 encoder, the check is calculated
+	// by other threads while the data is being compressed.
+	lzma_check_state check;
+	lzma_check_init(&check, block->check);
+#ifdef MYTHREAD_ENABLED
+	lzma_check_mt check_mt;
+	if (check_size > 0) {
+		lzma_thread_pool *pool = NULL;
+		const uint32_t threads = try_to_compress
+				? lzma_check_mt_threads(block->filters, &pool)
+				: 0;
+		lzma_check_mt_start(&check_mt, &check, block->check,
+				in, in_size, threads, pool, true);
+	}
+#endif
+
 	// Do the actual compression.
 	lzma_ret ret = LZMA_BUF_ERROR;
 	if (try_to_compress)
 		ret = block_encode_normal(block, allocator,
 				in, in_size, out, out_pos, out_size);
 
-	if (ret != LZMA_OK) {
-		// If the error was something else than output buffer
-		// becoming full, return the error now.
-		if (ret != LZMA_BUF_ERROR)
-			return ret;
-
+	if (ret == LZMA_BUF_ERROR) {
 		// The data was uncompressible (at least with the options
 		// given to us) or the output buffer was too small. Use the
 		// uncompressed chunks of LZMA2 to wrap the data into a valid
 		// Block. If we haven't been given enough output space, even
 		// this may fail.
-		return_if_error(block_encode_uncompressed(block, in, in_size,
-				out, out_pos, out_size));
+		ret = block_encode_uncompressed(block, in, in_size,
+				out, out_pos, out_size);
 	}
 
+#ifdef MYTHREAD_ENABLED
+	// The threads must be waited for even if encoding failed.
+	if (check_size > 0)
+		lzma_check_mt_finish(&check_mt, &check);
+#endif
+
+	// If the error was something else than output buffer
+	// becoming full, return the error now.
+	return_if_error(ret);
+
 	assert(*out_pos <= out_size);
 
 	// Block Padding. No buffer overflow here, because we already adjusted
@@ -306,9 +362,9 @@ block_buffer_encode(lzma_block *block, const lzma_allocator *allocator,
 		// Calculate the integrity check. We reserved space for
 		// the Check field earlier so we don't need to check for
 		// available output space here.
-		lzma_check_state check;
-		lzma_check_init(&check, block->check);
+#ifndef MYTHREAD_ENABLED
 		lzma_check_update(&check, block->check, in, in_size);
+#endif
 		lzma_check_finish(&check, block->check);
 
 		memcpy(block->raw_check, check.buffer.u8, check_size);
@@ -21,4 +21,12 @@
 /// should have been 64-bit, but fixing it would break the ABI.
 extern uint64_t lzma_block_buffer_bound64(uint64_t uncompressed_size);
 
+
+/// Set the sizes in *block for storing in_size bytes using uncompressed
+/// LZMA2 chunks and encode the Block Header for that into out, which
+/// must have room for LZMA_BLOCK_HEADER_SIZE_MAX bytes. The Block Header
+/// has the LZMA2 filter; block->filters is left as is.
+extern lzma_ret lzma_block_uncomp_header_encode(lzma_block *block,
+		size_t in_size, uint8_t *out);
+
 #endif
@@ -48,6 +48,10 @@ typedef struct {
 
 	/// True if the integrity check won't be calculated and verified.
 	bool ignore_check;
+
+	/// Thread that calculates the check, or NULL if the check is
+	/// calculated in coder->check directly.
+	lzma_check_thread *check_thread;
 } lzma_block_coder;
 
 
@@ -102,6 +106,12 @@ block_decode(void *coder_ptr, const lzma_allocator *allocator,
 					coder->block->uncompressed_size))
 			return LZMA_DATA_ERROR;
 
+#ifdef MYTHREAD_ENABLED
+		if (coder->check_thread != NULL)
+			lzma_check_thread_update(coder->check_thread,
+					out + out_start, out_used);
+		else
+#endif
 		if (!coder->ignore_check)
 			lzma_check_update(&coder->check, coder->block->check,
 					out + out_start, out_used);
@@ -146,6 +156,15 @@ block_decode(void *coder_ptr, const lzma_allocator *allocator,
 		if (coder->block->check == LZMA_CHECK_NONE)
 			return LZMA_STREAM_END;
 
+#ifdef MYTHREAD_ENABLED
+		// This waits until the thread has caught up. Thus a wrong
+		// Check is reported at the end of the Block like without
+		// the thread.
+		if (coder->check_thread != NULL)
+			lzma_check_thread_finish(coder->check_thread,
+					&coder->check);
+		else
+#endif
 		if (!coder->ignore_check)
 			lzma_check_finish(&coder->check, coder->block->check);
 
@@ -189,8 +208,9 @@ block_decoder_end(void *coder_ptr, const lzma_allocator *allocator)
 
 
 extern lzma_ret
-lzma_block_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
-		lzma_block *block)
+lzma_block_decoder_init_threaded(lzma_next_coder *next,
+		const lzma_allocator *allocator, lzma_block *block,
+		lzma_check_thread *check_thread)
 {
 	lzma_next_coder_init(&lzma_block_decoder_init, next, allocator);
 
@@ -239,9 +259,32 @@ lzma_block_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	coder->ignore_check = block->version >= 1
 			? block->ignore_check : false;
 
-	// Initialize the filter chain.
-	return lzma_raw_decoder_init(&coder->next, allocator,
-			block->filters);
+	// The thread is worth using only if there is something to calculate.
+	coder->check_thread = NULL;
+#ifdef MYTHREAD_ENABLED
+	if (check_thread != NULL && !coder->ignore_check
+			&& block->check != LZMA_CHECK_NONE
+			&& lzma_check_is_supported(block->check)) {
+		coder->check_thread = check_thread;
+		lzma_check_thread_init(check_thread, block->check);
+	}
+#else
+	(void)check_thread;
+#endif
+
+	// Initialize the filter chain. If Uncompressed Size is known,
+	// the dictionary doesn't need to be bigger than that.
+	return lzma_raw_decoder_init_sized(&coder->next, allocator,
+			block->filters, block->uncompressed_size);
+}
+
+
+extern lzma_ret
+lzma_block_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
+		lzma_block *block)
+{
+	return lzma_block_decoder_init_threaded(
+			next, allocator, block, NULL);
 }
 
 
@@ -14,9 +14,17 @@
 #define LZMA_BLOCK_DECODER_H
 
 #include "common.h"
+#include "check_thread.h"
 
 
 extern lzma_ret lzma_block_decoder_init(lzma_next_coder *next,
 		const lzma_allocator *allocator, lzma_block *block);
 
+/// Like lzma_block_decoder_init() but the integrity check is calculated
+/// by check_thread, which may be NULL. check_thread must stay valid until
+/// the Block has been decoded or the decoder has been freed.
+extern lzma_ret lzma_block_decoder_init_threaded(lzma_next_coder *next,
+		const lzma_allocator *allocator, lzma_block *block,
+		lzma_check_thread *check_thread);
+
 #endif
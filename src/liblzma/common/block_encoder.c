@@ -12,7 +12,7 @@
 
 #include "block_encoder.h"
 #include "filter_encoder.h"
-#include "check.h"
+#include "check_mt.h"
 
 
 typedef struct {
@@ -41,6 +41,13 @@ typedef struct {
 
 	/// Check of the uncompressed data
 	lzma_check_state check;
+
+#ifdef MYTHREAD_ENABLED
+	/// Threads of the LZMA2 encoder, which big input chunks
+	/// are checked with too
+	uint32_t check_threads;
+	lzma_thread_pool *check_pool;
+#endif
 } lzma_block_coder;
 
 
@@ -77,8 +84,14 @@ block_encode(void *coder_ptr, const lzma_allocator *allocator,
 		// checked it at the beginning of this function.
 		coder->uncompressed_size += in_used;
 
+#ifdef MYTHREAD_ENABLED
+		lzma_check_update_mt(&coder->check, coder->block->check,
+				in + in_start, in_used, coder->check_threads,
+				coder->check_pool);
+#else
 		lzma_check_update(&coder->check, coder->block->check,
 				in + in_start, in_used);
+#endif
 
 		if (ret != LZMA_STREAM_END || action == LZMA_SYNC_FLUSH)
 			return ret;
@@ -215,6 +228,11 @@ lzma_block_encoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 
 	// Initialize the check
 	lzma_check_init(&coder->check, block->check);
+#ifdef MYTHREAD_ENABLED
+	coder->check_threads = block->filters == NULL ? 0
+			: lzma_check_mt_threads(block->filters,
+				&coder->check_pool);
+#endif
 
 	// Initialize the requested filters.
 	return lzma_raw_encoder_init(&coder->next, allocator, block->filters);
@@ -0,0 +1,144 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       check_mt.c
+/// \brief      Calculates the integrity check of a buffer in slices
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "check_mt.h"
+
+
+/// Returns true if the checks of slices can be combined
+static bool
+is_combinable(lzma_check type)
+{
+	switch (type) {
+#ifdef HAVE_CHECK_CRC32
+	case LZMA_CHECK_CRC32:
+		return true;
+#endif
+
+#ifdef HAVE_CHECK_CRC64
+	case LZMA_CHECK_CRC64:
+		return true;
+#endif
+
+	default:
+		return false;
+	}
+}
+
+
+static void
+slice_run(void *slice_ptr)
+{
+	lzma_check_slice *slice = slice_ptr;
+	lzma_check_update(&slice->state, slice->type, slice->buf, slice->size);
+	return;
+}
+
+
+extern uint32_t
+lzma_check_mt_threads(const lzma_filter *filters, lzma_thread_pool **pool)
+{
+	*pool = NULL;
+
+	for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i) {
+		if (filters[i].id == LZMA_FILTER_LZMA2
+				&& filters[i].options != NULL) {
+			const lzma_options_lzma *opt = filters[i].options;
+			*pool = lzma_options_thread_pool(opt);
+			return opt->threads;
+		}
+	}
+
+	return 0;
+}
+
+
+extern void
+lzma_check_mt_start(lzma_check_mt *cm, const lzma_check_state *check,
+		lzma_check type, const uint8_t *buf, size_t size,
+		uint32_t threads, lzma_thread_pool *pool, bool all)
+{
+	size_t count = 1;
+	if (is_combinable(type)) {
+		count = my_min(size / LZMA_CHECK_MT_SLICE_MIN,
+				LZMA_CHECK_MT_SLICES);
+		count = my_min(count, threads);
+		count += count == 0;
+	}
+
+	const bool use_threads = threads > 1
+			&& size >= LZMA_CHECK_MT_SLICE_MIN;
+
+	cm->count = count;
+
+	for (size_t i = 0; i < count; ++i) {
+		lzma_check_slice *slice = &cm->slices[i];
+		const size_t start = size / count * i;
+		const size_t end = i + 1 == count ? size : start + size / count;
+
+		slice->type = type;
+		slice->buf = buf + start;
+		slice->size = end - start;
+
+		if (i == 0)
+			slice->state = *check;
+		else
+			lzma_check_init(&slice->state, type);
+
+		slice->threaded = use_threads && (i > 0 || all)
+				&& lzma_thread_create(&slice->thread, pool,
+					false, &slice_run, slice) == 0;
+	}
+
+	return;
+}
+
+
+extern void
+lzma_check_mt_finish(lzma_check_mt *cm, lzma_check_state *check)
+{
+	// Do the slices that have no thread before waiting for the others.
+	for (size_t i = 0; i < cm->count; ++i)
+		if (!cm->slices[i].threaded)
+			slice_run(&cm->slices[i]);
+
+	for (size_t i = 0; i < cm->count; ++i)
+		if (cm->slices[i].threaded)
+			lzma_thread_join(&cm->slices[i].thread);
+
+	*check = cm->slices[0].state;
+
+	for (size_t i = 1; i < cm->count; ++i) {
+		const lzma_check_slice *slice = &cm->slices[i];
+
+		switch (slice->type) {
+#ifdef HAVE_CHECK_CRC32
+		case LZMA_CHECK_CRC32:
+			check->state.crc32 = lzma_crc32_combine(
+					check->state.crc32,
+					slice->state.state.crc32, slice->size);
+			break;
+#endif
+
+#ifdef HAVE_CHECK_CRC64
+		case LZMA_CHECK_CRC64:
+			check->state.crc64 = lzma_crc64_combine(
+					check->state.crc64,
+					slice->state.state.crc64, slice->size);
+			break;
+#endif
+
+		default:
+			assert(0);
+			break;
+		}
+	}
+
+	return;
+}
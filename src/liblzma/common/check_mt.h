@@ -0,0 +1,126 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       check_mt.h
+/// \brief      Calculates the integrity check of a buffer in slices
+///
+/// CRC32 and CRC64 of a big buffer are calculated in slices by several
+/// threads and the results are combined. Other checks are calculated in
+/// one piece, possibly in another thread while the caller compresses.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_CHECK_MT_H
+#define LZMA_CHECK_MT_H
+
+#include "common.h"
+#include "check.h"
+#include "thread_pool.h"
+
+#ifdef MYTHREAD_ENABLED
+
+/// Maximum number of slices
+#define LZMA_CHECK_MT_SLICES 16
+
+/// Smaller slices aren't worth a thread of their own
+#define LZMA_CHECK_MT_SLICE_MIN ((size_t)(1) << 20)
+
+
+typedef struct {
+	/// Type of the check
+	lzma_check type;
+
+	/// The data of the slice
+	const uint8_t *buf;
+	size_t size;
+
+	/// The check of the slice. The first slice continues from the
+	/// state given to lzma_check_mt_start() and the others begin
+	/// from the initial state.
+	lzma_check_state state;
+
+	/// True if another thread calculates this slice
+	bool threaded;
+
+	lzma_thread thread;
+
+} lzma_check_slice;
+
+
+typedef struct {
+	/// Number of slices in use
+	size_t count;
+
+	lzma_check_slice slices[LZMA_CHECK_MT_SLICES];
+
+} lzma_check_mt;
+
+
+/// \brief      Find the threads that the filter chain uses
+///
+/// The threads member of the LZMA2 options tells how many threads the
+/// check may use too. If threads are taken from a pool, the same pool
+/// is used.
+///
+/// \return     Number of threads or zero if there are no LZMA2 options
+extern uint32_t lzma_check_mt_threads(const lzma_filter *filters,
+		lzma_thread_pool **pool);
+
+
+/// \brief      Start calculating the check of a buffer
+///
+/// \param      cm          Structure that must stay at the same address
+///                         until lzma_check_mt_finish()
+/// \param      check       The state to continue from. It isn't modified.
+/// \param      type        Type of the check
+/// \param      buf         Data to add to the check. It must stay
+///                         available until lzma_check_mt_finish().
+/// \param      size        Size of buf
+/// \param      threads     Number of threads that may be used. Nothing is
+///                         done in other threads if this is 1 or less.
+/// \param      pool        Pool to take the threads from or NULL to create
+///                         threads. Slices that the pool has no threads
+///                         for are calculated by lzma_check_mt_finish().
+/// \param      all         If true, all slices are started in other
+///                         threads so that the caller can do other work
+///                         meanwhile. Otherwise the first slice is left to
+///                         lzma_check_mt_finish().
+extern void lzma_check_mt_start(lzma_check_mt *cm,
+		const lzma_check_state *check, lzma_check type,
+		const uint8_t *buf, size_t size, uint32_t threads,
+		lzma_thread_pool *pool, bool all);
+
+
+/// \brief      Calculate the rest of the slices and combine them
+///
+/// The result is stored to *check, which must be the same state that was
+/// given to lzma_check_mt_start(). lzma_check_finish() hasn't been called.
+extern void lzma_check_mt_finish(lzma_check_mt *cm,
+		lzma_check_state *check);
+
+
+/// \brief      Update the check using up to the given number of threads
+///
+/// This is lzma_check_update() for a buffer that may be big.
+static inline void
+lzma_check_update_mt(lzma_check_state *check, lzma_check type,
+		const uint8_t *buf, size_t size, uint32_t threads,
+		lzma_thread_pool *pool)
+{
+	if (threads <= 1 || size < 2 * LZMA_CHECK_MT_SLICE_MIN) {
+		lzma_check_update(check, type, buf, size);
+		return;
+	}
+
+	lzma_check_mt cm;
+	lzma_check_mt_start(&cm, check, type, buf, size, threads, pool,
+			false);
+	lzma_check_mt_finish(&cm, check);
+	return;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,252 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       check_thread.c
+/// \brief      Calculates the integrity check of decoded data in a thread
+///
+/// The decoder copies its output into a small ring of buffers and the
+/// thread updates the check from them. The decoder only waits when the
+/// ring is full or when it needs the final check value at the end of
+/// a Block.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "check_thread.h"
+
+
+struct lzma_check_thread_s {
+	/// Memory for LZMA_CHECK_THREAD_BUFS buffers
+	uint8_t *bufs;
+
+	/// Amount of data in each buffer that has been handed to the thread
+	size_t sizes[LZMA_CHECK_THREAD_BUFS];
+
+	/// The buffer that the thread processes next. Modified only by
+	/// the thread while holding the mutex.
+	size_t head;
+
+	/// Number of buffers handed to the thread and not yet processed.
+	/// The buffer being processed is included in this count.
+	size_t count;
+
+	/// The buffer that the decoder is filling and the amount of data
+	/// in it. These are used only by the decoder thread.
+	size_t fill;
+	size_t fill_pos;
+
+	/// Type of the check and its state. The thread modifies the state
+	/// only when count > 0.
+	lzma_check type;
+	lzma_check_state state;
+
+	/// True when the thread has been told to exit
+	bool exit;
+
+	mythread_mutex mutex;
+
+	/// The thread waits for this when there is no work.
+	mythread_cond cond_work;
+
+	/// The decoder waits for this when all buffers are in use or
+	/// when waiting for the check to finish.
+	mythread_cond cond_done;
+
+	mythread thread_id;
+};
+
+
+static MYTHREAD_RET_TYPE
+worker_start(void *ct_ptr)
+{
+	lzma_check_thread *ct = ct_ptr;
+
+	while (true) {
+		size_t head = 0;
+		bool has_work = false;
+
+		mythread_sync(ct->mutex) {
+			while (ct->count == 0 && !ct->exit)
+				mythread_cond_wait(&ct->cond_work, &ct->mutex);
+
+			has_work = ct->count > 0;
+			head = ct->head;
+		}
+
+		if (!has_work)
+			break;
+
+		lzma_check_update(&ct->state, ct->type,
+				ct->bufs + head * LZMA_CHECK_THREAD_BUF_SIZE,
+				ct->sizes[head]);
+
+		mythread_sync(ct->mutex) {
+			ct->head = (head + 1) % LZMA_CHECK_THREAD_BUFS;
+			--ct->count;
+			mythread_cond_signal(&ct->cond_done);
+		}
+	}
+
+	return MYTHREAD_RET_VALUE;
+}
+
+
+/// Hands the buffer being filled to the thread and waits until the next
+/// buffer is free.
+static void
+submit(lzma_check_thread *ct)
+{
+	mythread_sync(ct->mutex) {
+		ct->sizes[ct->fill] = ct->fill_pos;
+		++ct->count;
+		mythread_cond_signal(&ct->cond_work);
+
+		while (ct->count == LZMA_CHECK_THREAD_BUFS)
+			mythread_cond_wait(&ct->cond_done, &ct->mutex);
+	}
+
+	ct->fill = (ct->fill + 1) % LZMA_CHECK_THREAD_BUFS;
+	ct->fill_pos = 0;
+	return;
+}
+
+
+/// Waits until the thread has processed everything handed to it.
+static void
+wait_idle(lzma_check_thread *ct)
+{
+	mythread_sync(ct->mutex) {
+		while (ct->count > 0)
+			mythread_cond_wait(&ct->cond_done, &ct->mutex);
+	}
+
+	return;
+}
+
+
+extern lzma_check_thread *
+lzma_check_thread_create(const lzma_allocator *allocator)
+{
+	lzma_check_thread *ct = lzma_alloc(sizeof(lzma_check_thread),
+			allocator);
+	if (ct == NULL)
+		return NULL;
+
+	ct->bufs = lzma_alloc(LZMA_CHECK_THREAD_MEMUSAGE, allocator);
+	if (ct->bufs == NULL)
+		goto error_bufs;
+
+	if (mythread_mutex_init(&ct->mutex))
+		goto error_mutex;
+
+	if (mythread_cond_init(&ct->cond_work))
+		goto error_cond_work;
+
+	if (mythread_cond_init(&ct->cond_done))
+		goto error_cond_done;
+
+	ct->head = 0;
+	ct->count = 0;
+	ct->fill = 0;
+	ct->fill_pos = 0;
+	ct->type = LZMA_CHECK_NONE;
+	ct->exit = false;
+
+	if (mythread_create(&ct->thread_id, &worker_start, ct))
+		goto error_thread;
+
+	return ct;
+
+error_thread:
+	mythread_cond_destroy(&ct->cond_done);
+
+error_cond_done:
+	mythread_cond_destroy(&ct->cond_work);
+
+error_cond_work:
+	mythread_mutex_destroy(&ct->mutex);
+
+error_mutex:
+	lzma_free(ct->bufs, allocator);
+
+error_bufs:
+	lzma_free(ct, allocator);
+	return NULL;
+}
+
+
+extern void
+lzma_check_thread_end(lzma_check_thread *ct, const lzma_allocator *allocator)
+{
+	if (ct == NULL)
+		return;
+
+	mythread_sync(ct->mutex) {
+		ct->exit = true;
+		mythread_cond_signal(&ct->cond_work);
+	}
+
+	// The thread finishes the buffers it has been given before exiting.
+	int ret = mythread_join(ct->thread_id);
+	assert(ret == 0);
+	(void)ret;
+
+	mythread_cond_destroy(&ct->cond_done);
+	mythread_cond_destroy(&ct->cond_work);
+	mythread_mutex_destroy(&ct->mutex);
+
+	lzma_free(ct->bufs, allocator);
+	lzma_free(ct, allocator);
+	return;
+}
+
+
+extern void
+lzma_check_thread_init(lzma_check_thread *ct, lzma_check type)
+{
+	// The thread may still be working on data of an earlier Block
+	// if decoding it failed.
+	wait_idle(ct);
+
+	ct->fill_pos = 0;
+	ct->type = type;
+	lzma_check_init(&ct->state, type);
+	return;
+}
+
+
+extern void
+lzma_check_thread_update(lzma_check_thread *ct,
+		const uint8_t *buf, size_t size)
+{
+	while (size > 0) {
+		const size_t copy_size = my_min(size,
+				LZMA_CHECK_THREAD_BUF_SIZE - ct->fill_pos);
+		memcpy(ct->bufs + ct->fill * LZMA_CHECK_THREAD_BUF_SIZE
+				+ ct->fill_pos, buf, copy_size);
+
+		ct->fill_pos += copy_size;
+		buf += copy_size;
+		size -= copy_size;
+
+		if (ct->fill_pos == LZMA_CHECK_THREAD_BUF_SIZE)
+			submit(ct);
+	}
+
+	return;
+}
+
+
+extern void
+lzma_check_thread_finish(lzma_check_thread *ct, lzma_check_state *check)
+{
+	if (ct->fill_pos > 0)
+		submit(ct);
+
+	wait_idle(ct);
+
+	lzma_check_finish(&ct->state, ct->type);
+	*check = ct->state;
+	return;
+}
@@ -0,0 +1,62 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       check_thread.h
+/// \brief      Calculates the integrity check of decoded data in a thread
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_CHECK_THREAD_H
+#define LZMA_CHECK_THREAD_H
+
+#include "common.h"
+#include "check.h"
+
+
+/// Number of buffers that can be waiting for the check thread
+#define LZMA_CHECK_THREAD_BUFS 4
+
+/// Size of one buffer. Data is handed to the thread when a buffer
+/// becomes full or at the end of a Block.
+#define LZMA_CHECK_THREAD_BUF_SIZE (64 << 10)
+
+/// Memory usage of the check thread
+#define LZMA_CHECK_THREAD_MEMUSAGE \
+	(LZMA_CHECK_THREAD_BUFS * LZMA_CHECK_THREAD_BUF_SIZE)
+
+
+typedef struct lzma_check_thread_s lzma_check_thread;
+
+
+/// \brief      Create the check thread
+///
+/// \return     Pointer to the new structure or NULL if memory allocation
+///             or thread creation failed
+extern lzma_check_thread *lzma_check_thread_create(
+		const lzma_allocator *allocator);
+
+/// \brief      Stop the thread and free the memory
+extern void lzma_check_thread_end(lzma_check_thread *ct,
+		const lzma_allocator *allocator);
+
+/// \brief      Start calculating a new check of the given type
+///
+/// Data from an earlier unfinished check is thrown away.
+extern void lzma_check_thread_init(lzma_check_thread *ct, lzma_check type);
+
+/// \brief      Copy data to be added to the check
+///
+/// This waits only if all the buffers are in use.
+extern void lzma_check_thread_update(lzma_check_thread *ct,
+		const uint8_t *buf, size_t size);
+
+/// \brief      Wait until all data has been processed and finish the check
+///
+/// The result is copied to *check like lzma_check_finish() would have
+/// left it.
+extern void lzma_check_thread_finish(lzma_check_thread *ct,
+		lzma_check_state *check);
+
+#endif
@@ -126,7 +126,8 @@
 	| LZMA_TELL_UNSUPPORTED_CHECK \
 	| LZMA_TELL_ANY_CHECK \
 	| LZMA_IGNORE_CHECK \
-	| LZMA_CONCATENATED )
+	| LZMA_CONCATENATED \
+	| LZMA_THREADED_CHECK )
 
 
 /// Largest valid lzma_action value as unsigned integer.
@@ -0,0 +1,107 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       cpu_features.h
+/// \brief      Detection of CPU instruction set extensions
+//
+//  Author:     Conor McCarthy
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_CPU_FEATURES_H
+#define LZMA_CPU_FEATURES_H
+
+#include "common.h"
+
+#if defined(HAVE_CPUID_H) && (defined(__x86_64__) || defined(__i386__))
+#	include <cpuid.h>
+#	define LZMA_HAVE_CPUID 1
+#endif
+
+#ifdef HAVE_IMMINTRIN_H
+#	include <immintrin.h>
+#endif
+
+// SSE2 intrinsics are used on x86 when the compiler may use SSE2
+// everywhere, so that no run-time check is needed.
+#if defined(HAVE__MM_MOVEMASK_EPI8) \
+		&& (defined(__SSE2__) \
+			|| (defined(_MSC_VER) && (defined(_M_X64) \
+				|| (defined(_M_IX86_FP) && _M_IX86_FP >= 2))))
+#	define LZMA_HAVE_SSE2 1
+#endif
+
+
+/// Get the EBX register of CPUID leaf 7, subleaf 0 (structured extended
+/// feature flags). Zero is returned if the leaf isn't supported.
+static inline uint32_t
+lzma_cpuid_7_ebx(void)
+{
+#ifdef LZMA_HAVE_CPUID
+	unsigned int eax, ebx, ecx, edx;
+	if (__get_cpuid_max(0, NULL) < 7)
+		return 0;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+	(void)eax;
+	(void)ecx;
+	(void)edx;
+	return ebx;
+#else
+	return 0;
+#endif
+}
+
+
+/// Returns true if the CPU supports SSE2 and the PCLMULQDQ instruction
+/// (carry-less multiplication).
+static inline bool
+lzma_cpu_has_clmul(void)
+{
+#ifdef LZMA_HAVE_CPUID
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	(void)eax;
+	(void)ebx;
+	return (ecx & (UINT32_C(1) << 1)) != 0
+			&& (edx & (UINT32_C(1) << 26)) != 0;
+#else
+	return false;
+#endif
+}
+
+
+/// Returns true if the CPU supports the SHA extensions (SHA256RNDS2 etc.)
+/// and SSSE3 and SSE4.1 which are needed together with them.
+static inline bool
+lzma_cpu_has_sha_ni(void)
+{
+#ifdef LZMA_HAVE_CPUID
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return false;
+
+	(void)eax;
+	(void)ebx;
+	(void)edx;
+	const uint32_t ssse3_sse41 = (UINT32_C(1) << 9) | (UINT32_C(1) << 19);
+	return (ecx & ssse3_sse41) == ssse3_sse41
+			&& (lzma_cpuid_7_ebx() & (UINT32_C(1) << 29)) != 0;
+#else
+	return false;
+#endif
+}
+
+
+/// Returns true if the CPU supports the BMI2 instructions (SHLX, SHRX etc.).
+static inline bool
+lzma_cpu_has_bmi2(void)
+{
+	return (lzma_cpuid_7_ebx() & (UINT32_C(1) << 8)) != 0;
+}
+
+#endif
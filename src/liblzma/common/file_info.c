@@ -853,3 +853,112 @@ lzma_file_info_decoder(lzma_stream *strm, lzma_index **dest_index,
 
 	return LZMA_OK;
 }
+
+
+/// Size of the window that lzma_file_info_pread() reads at once. Every
+/// Stream needs its Stream Header and the Stream Footer and Index of the
+/// previous Stream, which are next to each other in the file. Reading
+/// a big window backwards from the Stream Header usually gets the
+/// latter too, and with small Streams many whole Streams.
+#define PREAD_WINDOW (UINT32_C(1) << 20)
+
+/// How much the window extends past the requested position. This
+/// covers the 8 KiB that the decoder reads when scanning backwards and
+/// small Index fields. Larger Index fields are read forward with
+/// further windows.
+#define PREAD_AHEAD (UINT32_C(64) << 10)
+
+
+extern LZMA_API(lzma_ret)
+lzma_file_info_pread(lzma_index **dest_index, uint64_t *memlimit,
+		const lzma_allocator *allocator, uint64_t file_size,
+		lzma_ret (*read_func)(void *opaque, uint8_t *buf,
+			size_t size, uint64_t pos),
+		void *opaque)
+{
+	if (dest_index == NULL || memlimit == NULL || read_func == NULL)
+		return LZMA_PROG_ERROR;
+
+	uint8_t *window = lzma_alloc(PREAD_WINDOW, allocator);
+	if (window == NULL)
+		return LZMA_MEM_ERROR;
+
+	lzma_next_coder next = LZMA_NEXT_CODER_INIT;
+	lzma_index *index = NULL;
+	uint64_t seek_pos = 0;
+
+	lzma_ret ret = lzma_file_info_decoder_init(&next, allocator,
+			&seek_pos, &index, *memlimit, file_size);
+
+	// The window holds the file range [window_start, window_end).
+	// The decoder is at the file position window_start + in_pos.
+	uint64_t window_start = 0;
+	uint64_t window_end = 0;
+	size_t in_pos = 0;
+
+	while (ret == LZMA_OK) {
+		ret = next.code(next.coder, allocator, window, &in_pos,
+				(size_t)(window_end - window_start),
+				NULL, NULL, 0, LZMA_RUN);
+
+		if (ret == LZMA_OK) {
+			// All of the window was used and the decoder needs
+			// the data right after it. This happens with the
+			// Stream Header at the beginning of the file and
+			// with big Index fields.
+			assert(window_start + in_pos == window_end);
+			if (window_end == file_size) {
+				ret = LZMA_DATA_ERROR;
+				break;
+			}
+
+			window_start = window_end;
+			window_end = my_min(file_size,
+					window_start + PREAD_WINDOW);
+			in_pos = 0;
+
+		} else if (ret == LZMA_SEEK_NEEDED) {
+			ret = LZMA_OK;
+
+			if (seek_pos >= window_start
+					&& seek_pos < window_end) {
+				// The decoder went backwards but the data
+				// is still in the window.
+				in_pos = (size_t)(seek_pos - window_start);
+				continue;
+			}
+
+			window_end = my_min(file_size, my_max(
+					seek_pos + PREAD_AHEAD,
+					(uint64_t)(PREAD_WINDOW)));
+			window_start = window_end - my_min(window_end,
+					PREAD_WINDOW);
+			in_pos = (size_t)(seek_pos - window_start);
+
+		} else {
+			break;
+		}
+
+		ret = read_func(opaque, window,
+				(size_t)(window_end - window_start),
+				window_start);
+	}
+
+	if (ret == LZMA_STREAM_END && index != NULL) {
+		*dest_index = index;
+		ret = LZMA_OK;
+	} else if (ret == LZMA_STREAM_END) {
+		// read_func returned LZMA_STREAM_END.
+		ret = LZMA_PROG_ERROR;
+	} else if (ret == LZMA_MEMLIMIT_ERROR) {
+		// Tell how much memory would have been needed.
+		uint64_t old_memlimit;
+		if (next.memconfig(next.coder, memlimit, &old_memlimit, 0)
+				!= LZMA_OK)
+			ret = LZMA_PROG_ERROR;
+	}
+
+	lzma_next_end(&next, allocator);
+	lzma_free(window, allocator);
+	return ret;
+}
@@ -107,6 +107,14 @@ static const lzma_filter_decoder decoders[] = {
 		.props_decode = &lzma_simple_props_decode,
 	},
 #endif
+#ifdef HAVE_DECODER_ARM64
+	{
+		.id = LZMA_FILTER_ARM64,
+		.init = &lzma_simple_arm64_decoder_init,
+		.memusage = NULL,
+		.props_decode = &lzma_simple_props_decode,
+	},
+#endif
 #ifdef HAVE_DECODER_DELTA
 	{
 		.id = LZMA_FILTER_DELTA,
@@ -145,6 +153,85 @@ lzma_raw_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 }
 
 
+/// Copy the filter chain to chain[] if the uncompressed size is known and
+/// smaller than the dictionary size of LZMA1 or LZMA2. The copied chain
+/// uses *lzma_opt with the dictionary size reduced. When the dictionary
+/// doesn't need to be changed or the chain is invalid, the original chain
+/// is returned as is.
+static const lzma_filter *
+sized_chain(const lzma_filter *filters, lzma_vli uncompressed_size,
+		lzma_filter *chain, lzma_options_lzma *lzma_opt)
+{
+	if (filters == NULL || uncompressed_size == LZMA_VLI_UNKNOWN)
+		return filters;
+
+	bool changed = false;
+	size_t i = 0;
+
+	while (filters[i].id != LZMA_VLI_UNKNOWN) {
+		if (i == LZMA_FILTERS_MAX)
+			return filters;
+
+		chain[i] = filters[i];
+
+		if ((filters[i].id == LZMA_FILTER_LZMA1
+				|| filters[i].id == LZMA_FILTER_LZMA2)
+				&& filters[i].options != NULL) {
+			*lzma_opt = *(const lzma_options_lzma *)(
+					filters[i].options);
+
+			// A preset dictionary is copied to the beginning
+			// of the dictionary buffer so it needs space too.
+			const lzma_vli needed = uncompressed_size
+					+ (lzma_opt->preset_dict != NULL
+						? lzma_opt->preset_dict_size
+						: 0);
+
+			if (needed < lzma_opt->dict_size) {
+				lzma_opt->dict_size = (uint32_t)(needed);
+				chain[i].options = lzma_opt;
+				changed = true;
+			}
+		}
+
+		++i;
+	}
+
+	if (!changed)
+		return filters;
+
+	chain[i] = filters[i];
+	return chain;
+}
+
+
+extern lzma_ret
+lzma_raw_decoder_init_sized(lzma_next_coder *next,
+		const lzma_allocator *allocator,
+		const lzma_filter *options, lzma_vli uncompressed_size)
+{
+	// The decoders read their options only during initialization
+	// so the copies may be on the stack.
+	lzma_filter chain[LZMA_FILTERS_MAX + 1];
+	lzma_options_lzma lzma_opt;
+
+	return lzma_raw_decoder_init(next, allocator, sized_chain(
+			options, uncompressed_size, chain, &lzma_opt));
+}
+
+
+extern LZMA_API(uint64_t)
+lzma_raw_decoder_memusage_sized(const lzma_filter *filters,
+		lzma_vli uncompressed_size)
+{
+	lzma_filter chain[LZMA_FILTERS_MAX + 1];
+	lzma_options_lzma lzma_opt;
+
+	return lzma_raw_decoder_memusage(sized_chain(
+			filters, uncompressed_size, chain, &lzma_opt));
+}
+
+
 extern LZMA_API(lzma_ret)
 lzma_raw_decoder(lzma_stream *strm, const lzma_filter *options)
 {
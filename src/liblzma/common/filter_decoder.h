@@ -20,4 +20,12 @@ extern lzma_ret lzma_raw_decoder_init(
 		lzma_next_coder *next, const lzma_allocator *allocator,
 		const lzma_filter *options);
 
+/// Like lzma_raw_decoder_init() but the dictionary of LZMA1 and LZMA2 is
+/// made no bigger than needed for uncompressed_size bytes of output.
+/// uncompressed_size may be LZMA_VLI_UNKNOWN. The caller must verify
+/// that no more than uncompressed_size bytes are decoded.
+extern lzma_ret lzma_raw_decoder_init_sized(
+		lzma_next_coder *next, const lzma_allocator *allocator,
+		const lzma_filter *options, lzma_vli uncompressed_size);
+
 #endif
@@ -716,6 +716,147 @@ lzma_index_append(lzma_index *i, const lzma_allocator *allocator,
 }
 
 
+/// Store Records to g->records[first] and onwards. The bases are the
+/// cumulative sums of the Record before the first one and are updated
+/// to those of the last stored Record.
+static void
+index_group_fill(index_group *g, size_t first,
+		const lzma_vli *unpadded_sizes,
+		const lzma_vli *uncompressed_sizes, size_t count,
+		lzma_vli *compressed_base, lzma_vli *uncompressed_base)
+{
+	lzma_vli cbase = *compressed_base;
+	lzma_vli ubase = *uncompressed_base;
+
+	for (size_t n = 0; n < count; ++n) {
+		index_record *r = &g->records[first + n];
+		r->unpadded_sum = cbase + unpadded_sizes[n];
+		r->uncompressed_sum = ubase + uncompressed_sizes[n];
+		cbase = vli_ceil4(r->unpadded_sum);
+		ubase = r->uncompressed_sum;
+	}
+
+	g->last = first + count - 1;
+
+	*compressed_base = cbase;
+	*uncompressed_base = ubase;
+	return;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_index_append_multi(lzma_index *i, const lzma_allocator *allocator,
+		const lzma_vli *unpadded_sizes,
+		const lzma_vli *uncompressed_sizes, size_t count)
+{
+	if (i == NULL || (count > 0 && (unpadded_sizes == NULL
+			|| uncompressed_sizes == NULL)))
+		return LZMA_PROG_ERROR;
+
+	if (count == 0)
+		return LZMA_OK;
+
+	index_stream *s = (index_stream *)(i->streams.rightmost);
+	index_group *g = (index_group *)(s->groups.rightmost);
+
+	lzma_vli compressed_base = g == NULL ? 0
+			: vli_ceil4(g->records[g->last].unpadded_sum);
+	lzma_vli uncompressed_base = g == NULL ? 0
+			: g->records[g->last].uncompressed_sum;
+
+	// Validate all the Records first so that nothing is appended
+	// if one of them is bad. Every sum stays at or below
+	// LZMA_VLI_MAX, so adding one more size cannot overflow.
+	lzma_vli unpadded_sum = compressed_base;
+	lzma_vli uncompressed_sum = uncompressed_base;
+	lzma_vli index_list_size_add = 0;
+
+	for (size_t n = 0; n < count; ++n) {
+		if (unpadded_sizes[n] < UNPADDED_SIZE_MIN
+				|| unpadded_sizes[n] > UNPADDED_SIZE_MAX
+				|| uncompressed_sizes[n] > LZMA_VLI_MAX)
+			return LZMA_PROG_ERROR;
+
+		unpadded_sum = vli_ceil4(unpadded_sum) + unpadded_sizes[n];
+		uncompressed_sum += uncompressed_sizes[n];
+		if (unpadded_sum > LZMA_VLI_MAX
+				|| uncompressed_sum > LZMA_VLI_MAX)
+			return LZMA_DATA_ERROR;
+
+		index_list_size_add += lzma_vli_size(unpadded_sizes[n])
+				+ lzma_vli_size(uncompressed_sizes[n]);
+	}
+
+	// The same limits as in lzma_index_append(). The sizes only grow,
+	// so checking them after the last Record is enough.
+	if (index_file_size(s->node.compressed_base, unpadded_sum,
+			s->record_count + count,
+			s->index_list_size + index_list_size_add,
+			s->stream_padding) == LZMA_VLI_UNKNOWN)
+		return LZMA_DATA_ERROR;
+
+	if (index_size(i->record_count + count,
+			i->index_list_size + index_list_size_add)
+			> LZMA_BACKWARD_SIZE_MAX)
+		return LZMA_DATA_ERROR;
+
+	// Records that don't fit in the last group go to one new group.
+	// It is allocated before anything is stored so that running out
+	// of memory leaves the lzma_index unchanged.
+	const size_t free_records = g == NULL ? 0 : g->allocated - g->last - 1;
+	const size_t rest = count > free_records ? count - free_records : 0;
+	index_group *new_group = NULL;
+
+	if (rest > 0) {
+		if (rest > PREALLOC_MAX)
+			return LZMA_MEM_ERROR;
+
+		const size_t allocated = my_max(rest, i->prealloc);
+		new_group = lzma_alloc(sizeof(index_group)
+				+ allocated * sizeof(index_record),
+				allocator);
+		if (new_group == NULL)
+			return LZMA_MEM_ERROR;
+
+		new_group->allocated = allocated;
+		i->prealloc = INDEX_GROUP_SIZE;
+	}
+
+	const lzma_vli compressed_start = compressed_base;
+	const lzma_vli uncompressed_start = uncompressed_base;
+	const size_t fill = count - rest;
+
+	if (fill > 0)
+		index_group_fill(g, g->last + 1, unpadded_sizes,
+				uncompressed_sizes, fill,
+				&compressed_base, &uncompressed_base);
+
+	if (new_group != NULL) {
+		new_group->node.uncompressed_base = uncompressed_base;
+		new_group->node.compressed_base = compressed_base;
+		new_group->number_base = s->record_count + fill + 1;
+
+		index_group_fill(new_group, 0, unpadded_sizes + fill,
+				uncompressed_sizes + fill, rest,
+				&compressed_base, &uncompressed_base);
+
+		index_tree_append(&s->groups, &new_group->node);
+	}
+
+	// Update the totals. compressed_base is now the rounded-up sum
+	// of all the Blocks in the Stream.
+	s->record_count += count;
+	s->index_list_size += index_list_size_add;
+
+	i->total_size += compressed_base - compressed_start;
+	i->uncompressed_size += uncompressed_sum - uncompressed_start;
+	i->record_count += count;
+	i->index_list_size += index_list_size_add;
+
+	return LZMA_OK;
+}
+
+
 /// Structure to pass info to index_cat_helper()
 typedef struct {
 	/// Uncompressed size of the destination
@@ -1079,6 +1220,28 @@ iter_set_info(lzma_index_iter *iter)
 }
 
 
+/// Get the pointer to the current group. See iter_set_info() for
+/// explanation.
+static const index_group *
+iter_group(const lzma_index_iter *iter)
+{
+	const index_stream *stream = iter->internal[ITER_STREAM].p;
+
+	switch (iter->internal[ITER_METHOD].s) {
+	case ITER_METHOD_NORMAL:
+		return iter->internal[ITER_GROUP].p;
+
+	case ITER_METHOD_NEXT:
+		return index_tree_next(iter->internal[ITER_GROUP].p);
+
+	case ITER_METHOD_LEFTMOST:
+		return (const index_group *)(stream->groups.leftmost);
+	}
+
+	return NULL;
+}
+
+
 extern LZMA_API(void)
 lzma_index_iter_init(lzma_index_iter *iter, const lzma_index *i)
 {
@@ -1114,24 +1277,8 @@ lzma_index_iter_next(lzma_index_iter *iter, lzma_index_iter_mode mode)
 	// If we are being asked for the next Stream, leave group to NULL
 	// so that the rest of the this function thinks that this Stream
 	// has no groups and will thus go to the next Stream.
-	if (mode != LZMA_INDEX_ITER_STREAM) {
-		// Get the pointer to the current group. See iter_set_inf()
-		// for explanation.
-		switch (iter->internal[ITER_METHOD].s) {
-		case ITER_METHOD_NORMAL:
-			group = iter->internal[ITER_GROUP].p;
-			break;
-
-		case ITER_METHOD_NEXT:
-			group = index_tree_next(iter->internal[ITER_GROUP].p);
-			break;
-
-		case ITER_METHOD_LEFTMOST:
-			group = (const index_group *)(
-					stream->groups.leftmost);
-			break;
-		}
-	}
+	if (mode != LZMA_INDEX_ITER_STREAM)
+		group = iter_group(iter);
 
 again:
 	if (stream == NULL) {
@@ -1206,6 +1353,77 @@ again:
 }
 
 
+/// Encode a variable-length integer when out is known to have room
+/// for it. Returns the number of bytes written.
+static inline size_t
+vli_put(lzma_vli vli, uint8_t *out)
+{
+	size_t n = 0;
+
+	while (vli >= 0x80) {
+		out[n++] = (uint8_t)(vli) | 0x80;
+		vli >>= 7;
+	}
+
+	out[n++] = (uint8_t)(vli);
+	return n;
+}
+
+
+extern bool
+lzma_index_encode_records(lzma_index_iter *iter,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	while (out_size - *out_pos >= 2 * LZMA_VLI_BYTES_MAX) {
+		if (lzma_index_iter_next(iter, LZMA_INDEX_ITER_BLOCK))
+			return true;
+
+		// The iterator is moved only once per group. The Records
+		// of the group are read straight from the cumulative sums.
+		const index_group *group = iter_group(iter);
+		size_t record = iter->internal[ITER_RECORD].s;
+		const size_t first = record;
+
+		lzma_vli compressed_base = record == 0
+				? group->node.compressed_base
+				: vli_ceil4(group->records[record - 1]
+					.unpadded_sum);
+		lzma_vli uncompressed_base = record == 0
+				? group->node.uncompressed_base
+				: group->records[record - 1].uncompressed_sum;
+
+		size_t pos = *out_pos;
+
+		while (true) {
+			const index_record *r = &group->records[record];
+			pos += vli_put(r->unpadded_sum - compressed_base,
+					out + pos);
+			pos += vli_put(r->uncompressed_sum
+					- uncompressed_base, out + pos);
+
+			compressed_base = vli_ceil4(r->unpadded_sum);
+			uncompressed_base = r->uncompressed_sum;
+
+			if (record == group->last || out_size - pos
+					< 2 * LZMA_VLI_BYTES_MAX)
+				break;
+
+			++record;
+		}
+
+		*out_pos = pos;
+
+		if (record != first) {
+			iter->internal[ITER_GROUP].p = group;
+			iter->internal[ITER_RECORD].s = record;
+			iter_set_info(iter);
+		}
+	}
+
+	return false;
+}
+
+
 extern LZMA_API(lzma_bool)
 lzma_index_iter_locate(lzma_index_iter *iter, lzma_vli target)
 {
@@ -1248,3 +1466,237 @@ lzma_index_iter_locate(lzma_index_iter *iter, lzma_vli target)
 
 	return false;
 }
+
+
+/// Group of Records referenced by lzma_index_lookup
+typedef struct {
+	const index_stream *stream;
+	const index_group *group;
+
+	/// Number of the first Record of the group in the file minus one
+	lzma_vli block_base;
+} lookup_group;
+
+
+struct lzma_index_lookup_s {
+	/// The lzma_index the lookup was built from
+	const lzma_index *index;
+
+	/// Number of Blocks
+	size_t count;
+
+	/// Number of levels in the implicit search tree
+	uint32_t height;
+
+	/// Uncompressed end offsets of the Blocks in Eytzinger order:
+	/// the children of keys[k] are keys[2 * k] and keys[2 * k + 1].
+	/// keys[0] isn't part of the tree.
+	lzma_vli *keys;
+
+	/// Index of the Block of each element of keys[], starting from 0
+	size_t *blocks;
+
+	/// The groups of the lzma_index in order
+	lookup_group *groups;
+	size_t group_count;
+};
+
+
+/// Fill keys[] and blocks[] with the in-order traversal of the tree.
+/// The depth of the recursion is only the height of the tree.
+static size_t
+lookup_build(lzma_index_lookup *lookup, const lzma_vli *sorted,
+		size_t pos, size_t k)
+{
+	if (k <= lookup->count) {
+		pos = lookup_build(lookup, sorted, pos, 2 * k);
+		lookup->keys[k] = sorted[pos];
+		lookup->blocks[k] = pos++;
+		pos = lookup_build(lookup, sorted, pos, 2 * k + 1);
+	}
+
+	return pos;
+}
+
+
+extern LZMA_API(lzma_index_lookup *)
+lzma_index_lookup_init(const lzma_index *i, const lzma_allocator *allocator)
+{
+	if (i == NULL || i->record_count > SIZE_MAX / sizeof(lzma_vli) - 1)
+		return NULL;
+
+	lzma_index_lookup *lookup = lzma_alloc(sizeof(lzma_index_lookup),
+			allocator);
+	if (lookup == NULL)
+		return NULL;
+
+	const size_t count = (size_t)(i->record_count);
+	lookup->index = i;
+	lookup->count = count;
+	lookup->height = 0;
+	while ((count >> lookup->height) != 0)
+		++lookup->height;
+
+	size_t group_count = 0;
+	for (const index_stream *s = (const index_stream *)(
+				i->streams.leftmost);
+			s != NULL; s = index_tree_next(&s->node))
+		group_count += s->groups.count;
+
+	lookup->group_count = group_count;
+	lookup->keys = lzma_alloc((count + 1) * sizeof(lzma_vli), allocator);
+	lookup->blocks = lzma_alloc((count + 1) * sizeof(size_t), allocator);
+	lookup->groups = lzma_alloc(my_max(group_count, 1)
+			* sizeof(lookup_group), allocator);
+
+	// The end offsets in Block order
+	lzma_vli *sorted = lzma_alloc(my_max(count, 1) * sizeof(lzma_vli),
+			allocator);
+
+	if (lookup->keys == NULL || lookup->blocks == NULL
+			|| lookup->groups == NULL || sorted == NULL) {
+		lzma_free(sorted, allocator);
+		lzma_index_lookup_end(lookup, allocator);
+		return NULL;
+	}
+
+	size_t pos = 0;
+	size_t g = 0;
+	for (const index_stream *s = (const index_stream *)(
+				i->streams.leftmost);
+			s != NULL; s = index_tree_next(&s->node)) {
+		for (const index_group *group = (const index_group *)(
+					s->groups.leftmost);
+				group != NULL;
+				group = index_tree_next(&group->node)) {
+			lookup->groups[g].stream = s;
+			lookup->groups[g].group = group;
+			lookup->groups[g].block_base = pos;
+			++g;
+
+			for (size_t r = 0; r <= group->last; ++r)
+				sorted[pos++] = s->node.uncompressed_base
+					+ group->records[r].uncompressed_sum;
+		}
+	}
+
+	assert(pos == count);
+	assert(g == group_count);
+
+	lookup->keys[0] = 0;
+	lookup->blocks[0] = 0;
+	lookup_build(lookup, sorted, 0, 1);
+	lzma_free(sorted, allocator);
+
+	return lookup;
+}
+
+
+extern LZMA_API(void)
+lzma_index_lookup_end(lzma_index_lookup *lookup,
+		const lzma_allocator *allocator)
+{
+	if (lookup != NULL) {
+		lzma_free(lookup->keys, allocator);
+		lzma_free(lookup->blocks, allocator);
+		lzma_free(lookup->groups, allocator);
+		lzma_free(lookup, allocator);
+	}
+
+	return;
+}
+
+
+/// Number of targets that lzma_index_lookup_batch() searches for
+/// at the same time
+#define LOOKUP_BATCH 8
+
+
+extern LZMA_API(void)
+lzma_index_lookup_batch(const lzma_index_lookup *lookup,
+		const lzma_vli *targets, lzma_vli *numbers, size_t count)
+{
+	const lzma_vli *keys = lookup->keys;
+	const size_t n = lookup->count;
+
+	for (size_t done = 0; done < count; done += LOOKUP_BATCH) {
+		const size_t m = my_min(count - done, LOOKUP_BATCH);
+		const lzma_vli *t = targets + done;
+		size_t k[LOOKUP_BATCH];
+
+		for (size_t j = 0; j < LOOKUP_BATCH; ++j)
+			k[j] = 1;
+
+		// Walk down all the trees in lockstep without branches so
+		// that the loads of the different targets overlap and the
+		// compiler may vectorize the comparisons. A node past
+		// the end of the tree stays where it is and reads keys[0].
+		// Go right when the key is not greater than the target.
+		for (uint32_t level = 0; level < lookup->height; ++level) {
+			for (size_t j = 0; j < m; ++j) {
+				const bool inside = k[j] <= n;
+				const size_t node = inside ? k[j] : 0;
+				const size_t next = 2 * k[j]
+						+ (keys[node] <= t[j]);
+				k[j] = inside ? next : k[j];
+			}
+		}
+
+		// The wanted Block is the last one where the search went
+		// left: drop the trailing right turns and that left turn.
+		// If the search never went left, the target is past
+		// the end and this gives 0.
+		for (size_t j = 0; j < m; ++j) {
+			size_t node = k[j];
+			while (node & 1)
+				node >>= 1;
+
+			node >>= 1;
+			numbers[done + j] = node == 0 ? 0
+					: (lzma_vli)(lookup->blocks[node]) + 1;
+		}
+	}
+
+	return;
+}
+
+
+extern LZMA_API(lzma_bool)
+lzma_index_lookup_block(const lzma_index_lookup *lookup,
+		lzma_index_iter *iter, lzma_vli number)
+{
+	if (number == 0 || number > lookup->count)
+		return true;
+
+	// Find the last group that starts at or before the Block.
+	size_t left = 0;
+	size_t right = lookup->group_count - 1;
+	while (left < right) {
+		const size_t pos = left + (right - left + 1) / 2;
+		if (lookup->groups[pos].block_base < number)
+			left = pos;
+		else
+			right = pos - 1;
+	}
+
+	const lookup_group *g = &lookup->groups[left];
+
+	iter->internal[ITER_INDEX].p = lookup->index;
+	iter->internal[ITER_STREAM].p = g->stream;
+	iter->internal[ITER_GROUP].p = g->group;
+	iter->internal[ITER_RECORD].s = (size_t)(number - 1 - g->block_base);
+
+	iter_set_info(iter);
+
+	return false;
+}
+
+
+extern LZMA_API(lzma_bool)
+lzma_index_lookup_locate(const lzma_index_lookup *lookup,
+		lzma_index_iter *iter, lzma_vli target)
+{
+	lzma_vli number;
+	lzma_index_lookup_batch(lookup, &target, &number, 1);
+	return lzma_index_lookup_block(lookup, iter, number);
+}
@@ -34,6 +34,16 @@ extern uint32_t lzma_index_padding_size(const lzma_index *i);
 extern void lzma_index_prealloc(lzma_index *i, lzma_vli records);
 
 
+/// Encode the Records of the List of Records that follow the Record the
+/// iterator points to. Only whole Records are written, and only while out
+/// has room for the largest possible Record. The iterator is left at the
+/// last encoded Record. This is used only by the Index encoder.
+///
+/// \return    True if there are no more Records, false otherwise
+extern bool lzma_index_encode_records(lzma_index_iter *iter,
+		uint8_t *out, size_t *out_pos, size_t out_size);
+
+
 /// Round the variable-length integer to the next multiple of four.
 static inline lzma_vli
 vli_ceil4(lzma_vli vli)
@@ -83,8 +83,16 @@ index_encode(void *coder_ptr,
 		break;
 	}
 
-	case SEQ_NEXT:
-		if (lzma_index_iter_next(
+	case SEQ_NEXT: {
+		// Encode whole Records directly while there is room for
+		// them. The last few bytes of out are filled one integer
+		// at a time below.
+		const bool end = lzma_index_encode_records(&coder->iter,
+				out, out_pos, out_size);
+		if (!end && *out_pos == out_size)
+			break;
+
+		if (end || lzma_index_iter_next(
 				&coder->iter, LZMA_INDEX_ITER_BLOCK)) {
 			// Get the size of the Index Padding field.
 			coder->pos = lzma_index_padding_size(coder->index);
@@ -94,6 +102,7 @@ index_encode(void *coder_ptr,
 		}
 
 		coder->sequence = SEQ_UNPADDED;
+	}
 
 	// Fall through
 
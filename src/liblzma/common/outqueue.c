@@ -13,26 +13,34 @@
 #include "outqueue.h"
 
 
-/// This is to ease integer overflow checking: We may allocate up to
-/// 2 * LZMA_THREADS_MAX buffers and we need some extra memory for other
-/// data structures (that's the second /2).
-#define BUF_SIZE_MAX (UINT64_MAX / LZMA_THREADS_MAX / 2 / 2)
+/// This is to ease integer overflow checking: We may reserve up to
+/// LZMA_THREADS_MAX + 1 buffers and we need some extra memory for other
+/// data structures (that's the /2).
+#define BUF_SIZE_MAX (UINT64_MAX / (LZMA_THREADS_MAX + 1) / 2)
+
+/// Memory used by one chunk
+#define CHUNK_ALLOC_SIZE (sizeof(lzma_outchunk) + LZMA_OUTQ_CHUNK_SIZE)
 
 
 static lzma_ret
-get_options(uint64_t *bufs_alloc_size, uint32_t *bufs_count,
+get_options(uint64_t *chunks_max, uint32_t *bufs_count,
 		uint64_t buf_size_max, uint32_t threads)
 {
 	if (threads > LZMA_THREADS_MAX || buf_size_max > BUF_SIZE_MAX)
 		return LZMA_OPTIONS_ERROR;
 
-	// The number of buffers is twice the number of threads.
-	// This wastes RAM but keeps the threads busy when buffers
+	// The number of buffers is twice the number of threads. The buffer
+	// structures are small. This keeps the threads busy when buffers
 	// finish out of order.
+	*bufs_count = threads * 2;
+
+	// Memory is reserved for the worst case of every thread plus one
+	// buffer. Finished buffers keep only the chunks they used, so with
+	// compressible data many of them fit into the extra space.
 	//
 	// NOTE: If this is changed, update BUF_SIZE_MAX too.
-	*bufs_count = threads * 2;
-	*bufs_alloc_size = *bufs_count * buf_size_max;
+	*chunks_max = (buf_size_max + LZMA_OUTQ_CHUNK_SIZE - 1)
+			/ LZMA_OUTQ_CHUNK_SIZE;
 
 	return LZMA_OK;
 }
@@ -41,15 +49,52 @@ get_options(uint64_t *bufs_alloc_size, uint32_t *bufs_count,
 extern uint64_t
 lzma_outq_memusage(uint64_t buf_size_max, uint32_t threads)
 {
-	uint64_t bufs_alloc_size;
+	uint64_t chunks_max;
 	uint32_t bufs_count;
 
-	if (get_options(&bufs_alloc_size, &bufs_count, buf_size_max, threads)
+	if (get_options(&chunks_max, &bufs_count, buf_size_max, threads)
 			!= LZMA_OK)
 		return UINT64_MAX;
 
 	return sizeof(lzma_outq) + bufs_count * sizeof(lzma_outbuf)
-			+ bufs_alloc_size;
+			+ (threads + 1) * chunks_max * CHUNK_ALLOC_SIZE;
+}
+
+
+/// Move the chunks of a buffer to the list of free chunks.
+static void
+free_chunks(lzma_outq *outq, lzma_outbuf *buf)
+{
+	if (buf->head != NULL) {
+		buf->tail->next = outq->chunks_free;
+		outq->chunks_free = buf->head;
+	}
+
+	buf->head = NULL;
+	buf->tail = NULL;
+	buf->chunks = 0;
+	return;
+}
+
+
+/// Take all buffers out of use. The threads must have been stopped.
+static void
+clear_bufs(lzma_outq *outq)
+{
+	uint32_t i = outq->bufs_pos - outq->bufs_used;
+	if (outq->bufs_pos < outq->bufs_used)
+		i += outq->bufs_allocated;
+
+	while (outq->bufs_used > 0) {
+		free_chunks(outq, &outq->bufs[i]);
+
+		if (++i == outq->bufs_allocated)
+			i = 0;
+
+		--outq->bufs_used;
+	}
+
+	return;
 }
 
 
@@ -57,30 +102,30 @@ extern lzma_ret
 lzma_outq_init(lzma_outq *outq, const lzma_allocator *allocator,
 		uint64_t buf_size_max, uint32_t threads)
 {
-	uint64_t bufs_alloc_size;
+	uint64_t chunks_max;
 	uint32_t bufs_count;
 
-	// Set bufs_count and bufs_alloc_size.
-	return_if_error(get_options(&bufs_alloc_size, &bufs_count,
+	// Set bufs_count and chunks_max.
+	return_if_error(get_options(&chunks_max, &bufs_count,
 			buf_size_max, threads));
 
-	// Allocate memory if needed.
-	if (outq->buf_size_max != buf_size_max
-			|| outq->bufs_allocated != bufs_count) {
-		lzma_outq_end(outq, allocator);
-
 #if SIZE_MAX < UINT64_MAX
-		if (bufs_alloc_size > SIZE_MAX)
-			return LZMA_MEM_ERROR;
+	if ((threads + 1) * chunks_max * CHUNK_ALLOC_SIZE > SIZE_MAX)
+		return LZMA_MEM_ERROR;
 #endif
 
+	// Keep the chunks of the buffers that were in use. They can be
+	// used again whatever the new options are.
+	if (outq->bufs != NULL)
+		clear_bufs(outq);
+
+	// Allocate memory if needed.
+	if (outq->bufs_allocated != bufs_count) {
+		lzma_free(outq->bufs, allocator);
 		outq->bufs = lzma_alloc(bufs_count * sizeof(lzma_outbuf),
 				allocator);
-		outq->bufs_mem = lzma_alloc((size_t)(bufs_alloc_size),
-				allocator);
-
-		if (outq->bufs == NULL || outq->bufs_mem == NULL) {
-			lzma_outq_end(outq, allocator);
+		if (outq->bufs == NULL) {
+			outq->bufs_allocated = 0;
 			return LZMA_MEM_ERROR;
 		}
 	}
@@ -88,10 +133,14 @@ lzma_outq_init(lzma_outq *outq, const lzma_allocator *allocator,
 	// Initialize the rest of the main structure. Initialization of
 	// outq->bufs[] is done when they are actually needed.
 	outq->buf_size_max = (size_t)(buf_size_max);
+	outq->buf_chunks_max = (size_t)(chunks_max);
+	outq->chunks_reserved = 0;
+	outq->chunks_limit = (size_t)((threads + 1) * chunks_max);
 	outq->bufs_allocated = bufs_count;
 	outq->bufs_pos = 0;
 	outq->bufs_used = 0;
 	outq->read_pos = 0;
+	outq->chunk_pos = 0;
 
 	return LZMA_OK;
 }
@@ -100,11 +149,18 @@ lzma_outq_init(lzma_outq *outq, const lzma_allocator *allocator,
 extern void
 lzma_outq_end(lzma_outq *outq, const lzma_allocator *allocator)
 {
+	if (outq->bufs != NULL)
+		clear_bufs(outq);
+
 	lzma_free(outq->bufs, allocator);
 	outq->bufs = NULL;
+	outq->bufs_allocated = 0;
 
-	lzma_free(outq->bufs_mem, allocator);
-	outq->bufs_mem = NULL;
+	while (outq->chunks_free != NULL) {
+		lzma_outchunk *chunk = outq->chunks_free;
+		outq->chunks_free = chunk->next;
+		lzma_free(chunk, allocator);
+	}
 
 	return;
 }
@@ -114,12 +170,15 @@ extern lzma_outbuf *
 lzma_outq_get_buf(lzma_outq *outq)
 {
 	// Caller must have checked it with lzma_outq_has_buf().
-	assert(outq->bufs_used < outq->bufs_allocated);
+	assert(lzma_outq_has_buf(outq));
 
 	// Initialize the new buffer.
 	lzma_outbuf *buf = &outq->bufs[outq->bufs_pos];
-	buf->buf = outq->bufs_mem + outq->bufs_pos * outq->buf_size_max;
+	buf->head = NULL;
+	buf->tail = NULL;
+	buf->chunks = 0;
 	buf->size = 0;
+	buf->readable = 0;
 	buf->finished = false;
 
 	// Update the queue state.
@@ -127,19 +186,63 @@ lzma_outq_get_buf(lzma_outq *outq)
 		outq->bufs_pos = 0;
 
 	++outq->bufs_used;
+	outq->chunks_reserved += outq->buf_chunks_max;
 
 	return buf;
 }
 
 
+extern lzma_outchunk *
+lzma_outq_add_chunk(lzma_outq *outq, lzma_outbuf *buf,
+		const lzma_allocator *allocator)
+{
+	lzma_outchunk *chunk = outq->chunks_free;
+	if (chunk != NULL) {
+		outq->chunks_free = chunk->next;
+	} else {
+		chunk = lzma_alloc(CHUNK_ALLOC_SIZE, allocator);
+		if (chunk == NULL)
+			return NULL;
+	}
+
+	chunk->next = NULL;
+
+	if (buf->head == NULL)
+		buf->head = chunk;
+	else
+		buf->tail->next = chunk;
+
+	buf->tail = chunk;
+	++buf->chunks;
+
+	return chunk;
+}
+
+
+extern void
+lzma_outq_finish_buf(lzma_outq *outq, lzma_outbuf *buf)
+{
+	assert(!buf->finished);
+	assert(buf->chunks <= outq->buf_chunks_max);
+
+	buf->finished = true;
+	outq->chunks_reserved -= outq->buf_chunks_max - buf->chunks;
+	return;
+}
+
+
 extern bool
 lzma_outq_is_readable(const lzma_outq *outq)
 {
+	if (outq->bufs_used == 0)
+		return false;
+
 	uint32_t i = outq->bufs_pos - outq->bufs_used;
 	if (outq->bufs_pos < outq->bufs_used)
 		i += outq->bufs_allocated;
 
-	return outq->bufs[i].finished;
+	return outq->bufs[i].finished
+			|| outq->bufs[i].readable > outq->read_pos;
 }
 
 
@@ -160,25 +263,49 @@ lzma_outq_read(lzma_outq *restrict outq, uint8_t *restrict out,
 
 	lzma_outbuf *buf = &outq->bufs[i];
 
-	// If it isn't finished yet, we cannot read from it.
-	if (!buf->finished)
-		return LZMA_OK;
+	// If it isn't finished yet, only the part that the worker thread
+	// has marked readable can be copied.
+	const size_t avail = buf->finished ? buf->size : buf->readable;
+
+	while (outq->read_pos < avail && *out_pos < out_size) {
+		// Move to the next chunk once the head chunk has been read.
+		// The worker has already added the next chunk because
+		// there is more to read.
+		if (outq->chunk_pos == LZMA_OUTQ_CHUNK_SIZE) {
+			lzma_outchunk *chunk = buf->head;
+			assert(chunk->next != NULL);
+			buf->head = chunk->next;
+			--buf->chunks;
+			if (buf->finished)
+				--outq->chunks_reserved;
+
+			chunk->next = outq->chunks_free;
+			outq->chunks_free = chunk;
+			outq->chunk_pos = 0;
+		}
 
-	// Copy from the buffer to output.
-	lzma_bufcpy(buf->buf, &outq->read_pos, buf->size,
-			out, out_pos, out_size);
+		const size_t chunk_size = my_min(LZMA_OUTQ_CHUNK_SIZE,
+				outq->chunk_pos + (avail - outq->read_pos));
+		const size_t copy_start = outq->chunk_pos;
+		lzma_bufcpy(buf->head->buf, &outq->chunk_pos, chunk_size,
+				out, out_pos, out_size);
+		outq->read_pos += outq->chunk_pos - copy_start;
+	}
 
 	// Return if we didn't get all the data from the buffer.
-	if (outq->read_pos < buf->size)
+	if (!buf->finished || outq->read_pos < buf->size)
 		return LZMA_OK;
 
 	// The buffer was finished. Tell the caller its size information.
 	*unpadded_size = buf->unpadded_size;
 	*uncompressed_size = buf->uncompressed_size;
 
-	// Free this buffer for further use.
+	// Free this buffer and its chunks for further use.
+	outq->chunks_reserved -= buf->chunks;
+	free_chunks(outq, buf);
 	--outq->bufs_used;
 	outq->read_pos = 0;
+	outq->chunk_pos = 0;
 
 	return LZMA_STREAM_END;
 }
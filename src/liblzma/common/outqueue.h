@@ -13,18 +13,56 @@
 #include "common.h"
 
 
+/// Size of the chunks from which the output buffers are built
+#define LZMA_OUTQ_CHUNK_SIZE (UINT32_C(1) << 16)
+
+
+/// A piece of an output buffer
+typedef struct lzma_outchunk_s lzma_outchunk;
+struct lzma_outchunk_s {
+	/// The next chunk of the same buffer or in the list of free chunks
+	lzma_outchunk *next;
+
+	/// LZMA_OUTQ_CHUNK_SIZE bytes of data
+	uint8_t buf[];
+};
+
+
 /// Output buffer for a single thread
+///
+/// The data is stored in a list of chunks that grows as the worker
+/// thread writes more. All but the last chunk are full.
 typedef struct {
-	/// Pointer to the output buffer of lzma_outq.buf_size_max bytes
-	uint8_t *buf;
+	/// The oldest chunk that hasn't been read yet. Chunks are removed
+	/// from the head of the list once they have been read.
+	///
+	/// \note       This is accessed by two threads and thus access
+	///             to this variable needs a mutex.
+	lzma_outchunk *head;
+
+	/// The chunk being written. This is set only when a chunk is
+	/// added with lzma_outq_add_chunk().
+	lzma_outchunk *tail;
 
-	/// Amount of data written to buf
+	/// Number of chunks in the list
+	size_t chunks;
+
+	/// Amount of data written to the buffer
 	size_t size;
 
 	/// Additional size information
 	lzma_vli unpadded_size;
 	lzma_vli uncompressed_size;
 
+	/// Amount of data at the beginning of the buffer that may be read
+	/// before the buffer has been finished. The worker thread keeps
+	/// writing after this position. This stays zero unless the encoder
+	/// streams Blocks that are still being compressed.
+	///
+	/// \note       This is modified by another thread and thus access
+	///             to this variable needs a mutex.
+	size_t readable;
+
 	/// True when no more data will be written into this buffer.
 	///
 	/// \note       This is read by another thread and thus access
@@ -38,12 +76,26 @@ typedef struct {
 	/// Array of buffers that are used cyclically.
 	lzma_outbuf *bufs;
 
-	/// Memory allocated for all the buffers
-	uint8_t *bufs_mem;
+	/// Chunks that aren't used by any buffer. They are reused
+	/// before new chunks are allocated.
+	lzma_outchunk *chunks_free;
 
-	/// Amount of buffer space available in each buffer
+	/// Maximum amount of data that a single buffer may need to hold
 	size_t buf_size_max;
 
+	/// Number of chunks needed for buf_size_max bytes
+	size_t buf_chunks_max;
+
+	/// Number of chunks that the buffers in use may hold. A buffer
+	/// that hasn't been finished may grow to buf_chunks_max chunks
+	/// so that much is reserved for it. Finished buffers count only
+	/// the chunks they actually hold.
+	size_t chunks_reserved;
+
+	/// Maximum value of chunks_reserved. No new buffer is taken into
+	/// use if its worst case wouldn't fit.
+	size_t chunks_limit;
+
 	/// Number of buffers allocated
 	uint32_t bufs_allocated;
 
@@ -57,6 +109,9 @@ typedef struct {
 	/// Position in the buffer in lzma_outq_read()
 	size_t read_pos;
 
+	/// Position in the head chunk of the buffer being read
+	size_t chunk_pos;
+
 } lzma_outq;
 
 
@@ -79,10 +134,11 @@ extern uint64_t lzma_outq_memusage(uint64_t buf_size_max, uint32_t threads);
 /// \param      buf_size_max    Maximum amount of data that a single buffer
 ///                             in the queue may need to store.
 /// \param      threads         Number of buffers that may be in use
-///                             concurrently. Note that more than this number
-///                             of buffers will actually get allocated to
-///                             improve performance when buffers finish
-///                             out of order.
+///                             concurrently. Memory for one more buffer
+///                             is allowed for buffers that have finished
+///                             out of order. Since finished buffers hold
+///                             only the chunks they need, several of them
+///                             usually fit into that space.
 ///
 /// \return     - LZMA_OK
 ///             - LZMA_MEM_ERROR
@@ -99,15 +155,42 @@ extern void lzma_outq_end(lzma_outq *outq, const lzma_allocator *allocator);
 /// \brief      Get a new buffer
 ///
 /// lzma_outq_has_buf() must be used to check that there is a buffer
-/// available before calling lzma_outq_get_buf().
+/// available before calling lzma_outq_get_buf(). The buffer has no
+/// chunks yet.
 ///
 extern lzma_outbuf *lzma_outq_get_buf(lzma_outq *outq);
 
 
+/// \brief      Add a chunk to the end of a buffer
+///
+/// The new chunk becomes buf->tail. The caller must not make the buffer
+/// hold more than lzma_outq.buf_size_max bytes.
+///
+/// \note       This modifies the list of chunks that is read by another
+///             thread and thus call to this function needs to be
+///             protected with a mutex.
+///
+/// \return     The new chunk or NULL if memory allocation failed
+///
+extern lzma_outchunk *lzma_outq_add_chunk(lzma_outq *outq,
+		lzma_outbuf *buf, const lzma_allocator *allocator);
+
+
+/// \brief      Mark a buffer as finished
+///
+/// Only the chunks that the buffer actually holds stay reserved after
+/// this. Call to this function needs to be protected with a mutex like
+/// access to lzma_outbuf.finished.
+///
+extern void lzma_outq_finish_buf(lzma_outq *outq, lzma_outbuf *buf);
+
+
 /// \brief      Test if there is data ready to be read
 ///
+/// The oldest buffer is readable when it has been finished or when its
+/// worker has made more of it readable than has been read so far.
 /// Call to this function must be protected with the same mutex that
-/// is used to protect lzma_outbuf.finished.
+/// is used to protect lzma_outbuf.finished and lzma_outbuf.readable.
 ///
 extern bool lzma_outq_is_readable(const lzma_outq *outq);
 
@@ -123,13 +206,16 @@ extern bool lzma_outq_is_readable(const lzma_outq *outq);
 /// \param      unpadded_size   Unpadded Size from the Block encoder
 /// \param      uncompressed_size Uncompressed Size from the Block encoder
 ///
-/// \return     - LZMA: All OK. Either no data was available or the buffer
-///               being read didn't become empty yet.
+/// \return     - LZMA_OK: All OK. Either no data was available or the
+///               buffer being read didn't become empty yet. If the buffer
+///               hasn't been finished, its readable part may have been
+///               copied.
 ///             - LZMA_STREAM_END: The buffer being read was finished.
 ///               *unpadded_size and *uncompressed_size were set.
 ///
-/// \note       This reads lzma_outbuf.finished variables and thus call
-///             to this function needs to be protected with a mutex.
+/// \note       This reads lzma_outbuf.finished and lzma_outbuf.readable
+///             variables and thus call to this function needs to be
+///             protected with a mutex.
 ///
 extern lzma_ret lzma_outq_read(lzma_outq *restrict outq,
 		uint8_t *restrict out, size_t *restrict out_pos,
@@ -139,12 +225,17 @@ extern lzma_ret lzma_outq_read(lzma_outq *restrict outq,
 
 /// \brief      Test if there is at least one buffer free
 ///
-/// This must be used before getting a new buffer with lzma_outq_get_buf().
+/// A buffer is free if one is unused and the chunks it may need fit
+/// within the memory limit of the queue. This must be used before
+/// getting a new buffer with lzma_outq_get_buf(). Call to this function
+/// must be protected with the same mutex as lzma_outq_finish_buf().
 ///
 static inline bool
 lzma_outq_has_buf(const lzma_outq *outq)
 {
-	return outq->bufs_used < outq->bufs_allocated;
+	return outq->bufs_used < outq->bufs_allocated
+			&& outq->chunks_limit - outq->chunks_reserved
+				>= outq->buf_chunks_max;
 }
 
 
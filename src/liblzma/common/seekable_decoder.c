@@ -0,0 +1,617 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       seekable_decoder.c
+/// \brief      Decodes .xz files starting from any uncompressed offset
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "block_decoder.h"
+#include "filter_decoder.h"
+
+
+/// Maximum number of Blocks kept in the cache
+#define CACHE_ENTRIES 8
+
+
+typedef struct {
+	/// Uncompressed data of the Block. NULL if the entry is unused.
+	uint8_t *buf;
+
+	/// Block number in the file (lzma_index_iter.block.number_in_file)
+	lzma_vli number;
+
+	/// Uncompressed size of the Block
+	size_t size;
+
+	/// Number of bytes decoded into buf so far. The entry can be
+	/// used for seeking only when this equals size.
+	size_t decoded;
+
+	/// Value of coder->use_counter when the entry was last used.
+	/// The entry with the smallest value is evicted first.
+	uint64_t last_use;
+
+} cache_entry;
+
+
+typedef struct {
+	enum {
+		SEQ_LOCATE,
+		SEQ_BLOCK_HEADER,
+		SEQ_BLOCK_DECODE,
+		SEQ_CACHED,
+		SEQ_END,
+	} sequence;
+
+	/// Block decoder
+	lzma_next_coder block_decoder;
+
+	/// Block options decoded by the Block Header decoder and used by
+	/// the Block decoder.
+	lzma_block block_options;
+
+	/// Index of the file. This is owned by the application.
+	const lzma_index *index;
+
+	/// Location of the Block that is currently being decoded
+	lzma_index_iter iter;
+
+	/// Uncompressed offset of the next byte to give to the application
+	lzma_vli target;
+
+	/// Number of bytes decoded from the current Block when not
+	/// decoding into the cache
+	lzma_vli block_pos;
+
+	/// Absolute position of in[*in_pos] in the file
+	uint64_t file_cur_pos;
+
+	/// Pointer to lzma_stream.seek_pos to be used when returning
+	/// LZMA_SEEK_NEEDED
+	uint64_t *external_seek_pos;
+
+	/// Memory usage limit and the memory usage of the Block decoder
+	uint64_t memlimit;
+	uint64_t memusage;
+
+	/// If true, LZMA_IGNORE_CHECK was used.
+	bool ignore_check;
+
+	/// The entry that the current Block is decoded into or copied
+	/// from, or NULL if the current Block isn't cached.
+	cache_entry *entry;
+
+	/// Maximum total size of the cached Blocks and the current size
+	uint64_t cache_limit;
+	uint64_t cache_used;
+
+	/// Incremented every time a cache entry is used
+	uint64_t use_counter;
+
+	cache_entry cache[CACHE_ENTRIES];
+
+	/// Position in buffer[]
+	size_t pos;
+
+	/// Buffer to hold Block Header. Bytes of the Blocks that are
+	/// skipped before the seek target are decoded into this too
+	/// when the Block isn't cached.
+	uint8_t buffer[4096];
+
+} lzma_seekable_coder;
+
+
+static void
+cache_free(lzma_seekable_coder *coder, cache_entry *entry,
+		const lzma_allocator *allocator)
+{
+	coder->cache_used -= entry->size;
+	lzma_free(entry->buf, allocator);
+	entry->buf = NULL;
+	entry->size = 0;
+	return;
+}
+
+
+/// Finds the cache entry of a fully decoded Block.
+static cache_entry *
+cache_find(lzma_seekable_coder *coder, lzma_vli number)
+{
+	for (size_t i = 0; i < CACHE_ENTRIES; ++i) {
+		cache_entry *entry = &coder->cache[i];
+		if (entry->buf != NULL && entry->number == number
+				&& entry->decoded == entry->size) {
+			entry->last_use = ++coder->use_counter;
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+
+/// Allocates a cache entry for the current Block, evicting the least
+/// recently used Blocks as needed. Returns NULL if the Block won't be
+/// cached; it is decoded directly to the output then.
+static cache_entry *
+cache_alloc(lzma_seekable_coder *coder, const lzma_allocator *allocator)
+{
+	const lzma_vli size = coder->iter.block.uncompressed_size;
+	if (size > coder->cache_limit || size > SIZE_MAX)
+		return NULL;
+
+	while (true) {
+		cache_entry *lru = NULL;
+		for (size_t i = 0; i < CACHE_ENTRIES; ++i) {
+			cache_entry *entry = &coder->cache[i];
+			if (entry->buf == NULL) {
+				if (coder->cache_used + size
+						<= coder->cache_limit) {
+					lru = entry;
+					break;
+				}
+			} else if (lru == NULL
+					|| entry->last_use < lru->last_use) {
+				lru = entry;
+			}
+		}
+
+		assert(lru != NULL);
+
+		if (lru->buf == NULL) {
+			lru->buf = lzma_alloc((size_t)(size), allocator);
+			if (lru->buf == NULL)
+				return NULL;
+
+			lru->number = coder->iter.block.number_in_file;
+			lru->size = (size_t)(size);
+			lru->decoded = 0;
+			lru->last_use = ++coder->use_counter;
+			coder->cache_used += size;
+			return lru;
+		}
+
+		cache_free(coder, lru, allocator);
+	}
+}
+
+
+/// Seeks to the absolute file position target_pos. If the position is
+/// in the current input buffer, this only adjusts *in_pos. Returns true
+/// if the caller must return LZMA_SEEK_NEEDED.
+static bool
+seek_to_pos(lzma_seekable_coder *coder, uint64_t target_pos,
+		size_t in_start, size_t *in_pos, size_t in_size)
+{
+	const uint64_t pos_min = coder->file_cur_pos - (*in_pos - in_start);
+	const uint64_t pos_max = coder->file_cur_pos + (in_size - *in_pos);
+
+	bool external_seek_needed;
+
+	if (target_pos >= pos_min && target_pos <= pos_max) {
+		*in_pos += (size_t)(target_pos - coder->file_cur_pos);
+		external_seek_needed = false;
+	} else {
+		*coder->external_seek_pos = target_pos;
+		external_seek_needed = true;
+		*in_pos = in_size;
+	}
+
+	coder->file_cur_pos = target_pos;
+
+	return external_seek_needed;
+}
+
+
+/// Copies the decoded data of the current cache entry to out[].
+static void
+copy_cached(lzma_seekable_coder *coder,
+		uint8_t *restrict out, size_t *restrict out_pos,
+		size_t out_size)
+{
+	const cache_entry *entry = coder->entry;
+	const lzma_vli skip = coder->target
+			- coder->iter.block.uncompressed_file_offset;
+	if (skip >= entry->decoded)
+		return;
+
+	size_t pos = (size_t)(skip);
+	coder->target += lzma_bufcpy(entry->buf, &pos, entry->decoded,
+			out, out_pos, out_size);
+	return;
+}
+
+
+static lzma_ret
+seekable_decode(void *coder_ptr, const lzma_allocator *allocator,
+		const uint8_t *restrict in, size_t *restrict in_pos,
+		size_t in_size, uint8_t *restrict out,
+		size_t *restrict out_pos, size_t out_size,
+		lzma_action action)
+{
+	lzma_seekable_coder *coder = coder_ptr;
+	const size_t in_start = *in_pos;
+	lzma_ret ret = LZMA_OK;
+
+	while (*out_pos < out_size)
+	switch (coder->sequence) {
+	case SEQ_LOCATE:
+		// Find the Block that contains the target offset.
+		lzma_index_iter_init(&coder->iter, coder->index);
+		if (lzma_index_iter_locate(&coder->iter, coder->target)) {
+			coder->sequence = SEQ_END;
+			break;
+		}
+
+		coder->entry = cache_find(coder,
+				coder->iter.block.number_in_file);
+		if (coder->entry != NULL) {
+			coder->sequence = SEQ_CACHED;
+			break;
+		}
+
+		coder->block_pos = 0;
+		coder->pos = 0;
+		coder->sequence = SEQ_BLOCK_HEADER;
+
+		if (seek_to_pos(coder,
+				coder->iter.block.compressed_file_offset,
+				in_start, in_pos, in_size))
+			return LZMA_SEEK_NEEDED;
+
+		break;
+
+	case SEQ_BLOCK_HEADER: {
+		if (*in_pos >= in_size)
+			goto out;
+
+		if (coder->pos == 0) {
+			// The Index says there is a Block here.
+			if (in[*in_pos] == 0x00)
+				return LZMA_DATA_ERROR;
+
+			coder->block_options.header_size
+					= lzma_block_header_size_decode(
+						in[*in_pos]);
+		}
+
+		coder->file_cur_pos += lzma_bufcpy(in, in_pos, in_size,
+				coder->buffer, &coder->pos,
+				coder->block_options.header_size);
+
+		if (coder->pos < coder->block_options.header_size)
+			goto out;
+
+		coder->pos = 0;
+
+		coder->block_options.version = 1;
+		coder->block_options.check
+				= coder->iter.stream.flags->check;
+
+		lzma_filter filters[LZMA_FILTERS_MAX + 1];
+		coder->block_options.filters = filters;
+
+		return_if_error(lzma_block_header_decode(&coder->block_options,
+				allocator, coder->buffer));
+
+		coder->block_options.ignore_check = coder->ignore_check;
+
+		// Validate the sizes against the Index and set them so
+		// that the Block decoder can verify them.
+		ret = lzma_block_compressed_size(&coder->block_options,
+				coder->iter.block.unpadded_size);
+
+		if (ret == LZMA_OK) {
+			if (coder->block_options.uncompressed_size
+					== LZMA_VLI_UNKNOWN)
+				coder->block_options.uncompressed_size
+					= coder->iter.block.uncompressed_size;
+			else if (coder->block_options.uncompressed_size
+					!= coder->iter.block.uncompressed_size)
+				ret = LZMA_DATA_ERROR;
+		}
+
+		if (ret == LZMA_OK) {
+			const uint64_t memusage
+					= lzma_raw_decoder_memusage_sized(
+					filters, coder->block_options
+						.uncompressed_size);
+
+			if (memusage == UINT64_MAX) {
+				ret = LZMA_OPTIONS_ERROR;
+			} else {
+				coder->memusage = memusage;
+
+				if (memusage > coder->memlimit)
+					ret = LZMA_MEMLIMIT_ERROR;
+				else
+					ret = lzma_block_decoder_init(
+						&coder->block_decoder,
+						allocator,
+						&coder->block_options);
+			}
+		}
+
+		for (size_t i = 0; i < LZMA_FILTERS_MAX; ++i)
+			lzma_free(filters[i].options, allocator);
+
+		coder->block_options.filters = NULL;
+
+		// If the application raises the limit, the Block Header
+		// is read again.
+		if (ret == LZMA_MEMLIMIT_ERROR)
+			coder->sequence = SEQ_LOCATE;
+
+		if (ret != LZMA_OK)
+			return ret;
+
+		// Decode into the cache if the Block fits there. A failed
+		// allocation isn't an error; the Block just isn't cached.
+		coder->entry = cache_alloc(coder, allocator);
+		coder->sequence = SEQ_BLOCK_DECODE;
+		break;
+	}
+
+	case SEQ_BLOCK_DECODE: {
+		const lzma_vli skip = coder->target
+				- coder->iter.block.uncompressed_file_offset;
+		uint8_t *dest;
+		size_t dest_pos;
+		size_t dest_size;
+
+		if (coder->entry != NULL) {
+			// Decode to the cache at least as far as the target.
+			dest = coder->entry->buf;
+			dest_pos = coder->entry->decoded;
+			dest_size = coder->entry->size;
+		} else if (coder->block_pos < skip) {
+			// Throw away the data before the target.
+			dest = coder->buffer;
+			dest_pos = 0;
+			dest_size = (size_t)(my_min(skip - coder->block_pos,
+					sizeof(coder->buffer)));
+		} else {
+			dest = out;
+			dest_pos = *out_pos;
+			dest_size = out_size;
+		}
+
+		const size_t in_used_start = *in_pos;
+		const size_t dest_start = dest_pos;
+
+		ret = coder->block_decoder.code(
+				coder->block_decoder.coder, allocator,
+				in, in_pos, in_size, dest, &dest_pos, dest_size,
+				action);
+
+		coder->file_cur_pos += *in_pos - in_used_start;
+
+		const size_t decoded = dest_pos - dest_start;
+
+		if (coder->entry != NULL) {
+			coder->entry->decoded = dest_pos;
+			copy_cached(coder, out, out_pos, out_size);
+		} else {
+			coder->block_pos += decoded;
+			if (dest == out) {
+				*out_pos = dest_pos;
+				coder->target += decoded;
+			}
+		}
+
+		if (ret == LZMA_STREAM_END) {
+			// The Block decoder has verified the sizes
+			// and the Check field.
+			ret = LZMA_OK;
+			coder->sequence = coder->entry != NULL
+					? SEQ_CACHED : SEQ_LOCATE;
+			break;
+		}
+
+		if (ret != LZMA_OK)
+			return ret;
+
+		// Return if the Block decoder couldn't make progress.
+		if (decoded == 0 && *in_pos == in_used_start)
+			goto out;
+
+		break;
+	}
+
+	case SEQ_CACHED:
+		copy_cached(coder, out, out_pos, out_size);
+
+		if (coder->target == coder->iter.block.uncompressed_file_offset
+				+ coder->iter.block.uncompressed_size)
+			coder->sequence = SEQ_LOCATE;
+
+		break;
+
+	case SEQ_END:
+		return LZMA_STREAM_END;
+
+	default:
+		assert(0);
+		return LZMA_PROG_ERROR;
+	}
+
+out:
+	return coder->sequence == SEQ_END ? LZMA_STREAM_END : ret;
+}
+
+
+static void
+seekable_decoder_end(void *coder_ptr, const lzma_allocator *allocator)
+{
+	lzma_seekable_coder *coder = coder_ptr;
+	lzma_next_end(&coder->block_decoder, allocator);
+
+	for (size_t i = 0; i < CACHE_ENTRIES; ++i)
+		lzma_free(coder->cache[i].buf, allocator);
+
+	lzma_free(coder, allocator);
+	return;
+}
+
+
+static lzma_ret
+seekable_decoder_memconfig(void *coder_ptr, uint64_t *memusage,
+		uint64_t *old_memlimit, uint64_t new_memlimit)
+{
+	lzma_seekable_coder *coder = coder_ptr;
+
+	// The cache has a limit of its own so it isn't counted
+	// against the memory usage limit.
+	*memusage = coder->memusage + coder->cache_used;
+	*old_memlimit = coder->memlimit;
+
+	if (new_memlimit != 0) {
+		if (new_memlimit < coder->memusage)
+			return LZMA_MEMLIMIT_ERROR;
+
+		coder->memlimit = new_memlimit;
+	}
+
+	return LZMA_OK;
+}
+
+
+/// The Check IDs of the Blocks come from the Stream Flags in the Index.
+/// An Index from lzma_index_decoder() or lzma_index_buffer_decode() has
+/// none until lzma_index_stream_flags() has been called.
+static bool
+index_has_stream_flags(const lzma_index *index)
+{
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, index);
+
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM))
+		if (iter.stream.flags == NULL)
+			return false;
+
+	return true;
+}
+
+
+static lzma_ret
+seekable_decoder_init(lzma_next_coder *next, const lzma_allocator *allocator,
+		const lzma_index *index, uint64_t *seek_pos,
+		uint64_t memlimit, uint64_t cache_size, uint32_t flags)
+{
+	lzma_next_coder_init(&seekable_decoder_init, next, allocator);
+
+	if (index == NULL || seek_pos == NULL
+			|| !index_has_stream_flags(index))
+		return LZMA_PROG_ERROR;
+
+	if (flags & ~LZMA_IGNORE_CHECK)
+		return LZMA_OPTIONS_ERROR;
+
+	lzma_seekable_coder *coder = next->coder;
+	if (coder == NULL) {
+		coder = lzma_alloc(sizeof(lzma_seekable_coder), allocator);
+		if (coder == NULL)
+			return LZMA_MEM_ERROR;
+
+		next->coder = coder;
+		next->code = &seekable_decode;
+		next->end = &seekable_decoder_end;
+		next->memconfig = &seekable_decoder_memconfig;
+
+		coder->block_decoder = LZMA_NEXT_CODER_INIT;
+
+		for (size_t i = 0; i < CACHE_ENTRIES; ++i)
+			coder->cache[i].buf = NULL;
+	}
+
+	for (size_t i = 0; i < CACHE_ENTRIES; ++i) {
+		lzma_free(coder->cache[i].buf, allocator);
+		coder->cache[i].buf = NULL;
+		coder->cache[i].size = 0;
+	}
+
+	coder->sequence = SEQ_LOCATE;
+	coder->index = index;
+	coder->target = 0;
+	coder->block_pos = 0;
+	coder->file_cur_pos = 0;
+	coder->external_seek_pos = seek_pos;
+	coder->memlimit = my_max(1, memlimit);
+	coder->memusage = LZMA_MEMUSAGE_BASE;
+	coder->ignore_check = (flags & LZMA_IGNORE_CHECK) != 0;
+	coder->entry = NULL;
+	coder->cache_limit = cache_size;
+	coder->cache_used = 0;
+	coder->use_counter = 0;
+	coder->pos = 0;
+
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_seekable_decoder(lzma_stream *strm, const lzma_index *index,
+		uint64_t memlimit, uint64_t cache_size, uint32_t flags)
+{
+	lzma_next_strm_init(seekable_decoder_init, strm, index,
+			&strm->seek_pos, memlimit, cache_size, flags);
+
+	strm->internal->supported_actions[LZMA_RUN] = true;
+	strm->internal->supported_actions[LZMA_FINISH] = true;
+
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_seekable_decoder_seek(lzma_stream *strm, uint64_t uncompressed_offset)
+{
+	// Errors other than LZMA_MEMLIMIT_ERROR are fatal also here.
+	if (strm == NULL || strm->internal == NULL
+			|| strm->internal->next.code != &seekable_decode
+			|| strm->internal->sequence == ISEQ_ERROR)
+		return LZMA_PROG_ERROR;
+
+	lzma_seekable_coder *coder = strm->internal->next.coder;
+
+	// Continue in the current Block if the offset is in it and
+	// doesn't require decoding the Block again from its beginning.
+	bool same_block = false;
+	if (coder->sequence == SEQ_BLOCK_DECODE
+			|| coder->sequence == SEQ_CACHED) {
+		const lzma_vli start
+				= coder->iter.block.uncompressed_file_offset;
+		const lzma_vli end
+				= start + coder->iter.block.uncompressed_size;
+
+		if (uncompressed_offset < end) {
+			if (coder->entry != NULL)
+				same_block = uncompressed_offset >= start;
+			else
+				same_block = uncompressed_offset
+						>= start + coder->block_pos;
+		}
+	}
+
+	if (!same_block) {
+		// A partially decoded Block cannot be used later.
+		if (coder->sequence == SEQ_BLOCK_DECODE
+				&& coder->entry != NULL)
+			cache_free(coder, coder->entry, strm->allocator);
+
+		coder->entry = NULL;
+		coder->sequence = SEQ_LOCATE;
+	}
+
+	coder->target = uncompressed_offset;
+
+	// Allow lzma_code() to be called again after LZMA_STREAM_END
+	// or with a different action.
+	strm->internal->sequence = ISEQ_RUN;
+	strm->internal->allow_buf_error = false;
+
+	return LZMA_OK;
+}
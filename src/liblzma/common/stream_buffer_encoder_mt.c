@@ -0,0 +1,333 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       stream_buffer_encoder_mt.c
+/// \brief      Single-call multithreaded .xz Stream encoder
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "stream_encoder_mt.h"
+#include "index.h"
+
+
+/// A Block to be encoded by one of the threads
+typedef struct {
+	/// Block options. The sizes are filled in by the Block encoder.
+	lzma_block block;
+
+	/// Uncompressed data of the Block
+	const uint8_t *in;
+	size_t in_size;
+
+	/// Space reserved for the encoded Block. This points either into
+	/// the output buffer of the application or to scratch.
+	uint8_t *buf;
+	size_t buf_size;
+
+	/// Encoded size of the Block
+	size_t size;
+
+	/// Memory allocated if the Block didn't fit into the output buffer
+	uint8_t *scratch;
+
+} buffer_block;
+
+
+typedef struct {
+	buffer_block *blocks;
+	size_t block_count;
+
+	const lzma_allocator *allocator;
+
+	/// Index of the next Block to encode
+	size_t next;
+
+	/// The first error from any of the threads
+	lzma_ret ret;
+
+	mythread_mutex mutex;
+
+} buffer_coder;
+
+
+/// Encode Blocks until all of them have been taken or an error occurs.
+/// This is run by the worker threads and the calling thread alike.
+static void
+encode_blocks(buffer_coder *coder)
+{
+	while (true) {
+		size_t i;
+		mythread_sync(coder->mutex) {
+			i = coder->ret == LZMA_OK ? coder->next++ : SIZE_MAX;
+		}
+
+		if (i >= coder->block_count)
+			return;
+
+		buffer_block *b = &coder->blocks[i];
+		lzma_ret ret = LZMA_OK;
+
+		if (b->buf == NULL) {
+			b->scratch = lzma_alloc(b->buf_size, coder->allocator);
+			if (b->scratch == NULL)
+				ret = LZMA_MEM_ERROR;
+
+			b->buf = b->scratch;
+		}
+
+		// The reserved space is always big enough so
+		// LZMA_BUF_ERROR isn't possible.
+		if (ret == LZMA_OK)
+			ret = lzma_block_buffer_encode(&b->block,
+					coder->allocator, b->in, b->in_size,
+					b->buf, &b->size, b->buf_size);
+
+		if (ret != LZMA_OK) {
+			mythread_sync(coder->mutex) {
+				if (coder->ret == LZMA_OK)
+					coder->ret = ret;
+			}
+
+			return;
+		}
+	}
+}
+
+
+static MYTHREAD_RET_TYPE
+worker_start(void *coder_ptr)
+{
+	encode_blocks(coder_ptr);
+	return MYTHREAD_RET_VALUE;
+}
+
+
+/// Encode the Blocks in parallel. The calling thread encodes Blocks too,
+/// so at most workers - 1 threads are created. If creating a thread fails,
+/// the remaining threads simply get more Blocks to encode.
+static lzma_ret
+encode_parallel(buffer_coder *coder, uint32_t workers)
+{
+	mythread *threads = NULL;
+	if (workers > 1) {
+		threads = lzma_alloc((workers - 1) * sizeof(mythread),
+				coder->allocator);
+		if (threads == NULL)
+			return LZMA_MEM_ERROR;
+	}
+
+	if (mythread_mutex_init(&coder->mutex)) {
+		lzma_free(threads, coder->allocator);
+		return LZMA_MEM_ERROR;
+	}
+
+	uint32_t thread_count = 0;
+
+	while (thread_count + 1 < workers && mythread_create(
+			&threads[thread_count], &worker_start, coder) == 0)
+		++thread_count;
+
+	encode_blocks(coder);
+
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		const int ret = mythread_join(threads[i]);
+		assert(ret == 0);
+		(void)ret;
+	}
+
+	mythread_mutex_destroy(&coder->mutex);
+	lzma_free(threads, coder->allocator);
+	return coder->ret;
+}
+
+
+/// Move the encoded Blocks next to each other after the Stream Header
+/// and add them to the Index.
+static lzma_ret
+compact_blocks(buffer_coder *coder, lzma_index *index,
+		uint8_t *out, size_t *out_pos, size_t out_size)
+{
+	// All the Records fit in one group of the Index.
+	lzma_index_prealloc(index, coder->block_count);
+
+	for (size_t i = 0; i < coder->block_count; ++i) {
+		buffer_block *b = &coder->blocks[i];
+
+		if (out_size - *out_pos < b->size)
+			return LZMA_BUF_ERROR;
+
+		// A Block that was encoded into the output buffer never
+		// starts before its final position. Its final position
+		// may overlap the space reserved for itself but not the
+		// space of the later Blocks.
+		if (b->buf != out + *out_pos)
+			memmove(out + *out_pos, b->buf, b->size);
+
+		*out_pos += b->size;
+
+		return_if_error(lzma_index_append(index, coder->allocator,
+				lzma_block_unpadded_size(&b->block),
+				b->block.uncompressed_size));
+	}
+
+	return LZMA_OK;
+}
+
+
+extern LZMA_API(lzma_ret)
+lzma_stream_buffer_encode_mt(lzma_filter *filters, lzma_check check,
+		uint32_t threads, const lzma_allocator *allocator,
+		const uint8_t *in, size_t in_size,
+		uint8_t *out, size_t *out_pos_ptr, size_t out_size)
+{
+	// Sanity checks
+	if (filters == NULL || (unsigned int)(check) > LZMA_CHECK_ID_MAX
+			|| (in == NULL && in_size != 0) || out == NULL
+			|| out_pos_ptr == NULL || *out_pos_ptr > out_size)
+		return LZMA_PROG_ERROR;
+
+	if (!lzma_check_is_supported(check))
+		return LZMA_UNSUPPORTED_CHECK;
+
+	// Get the Block size and the number of Blocks to encode in
+	// parallel the same way as the threaded stream encoder does.
+	// The input is already all in memory so the thread split
+	// can use its size.
+	const lzma_mt mt = {
+		.flags = LZMA_STABLE_INPUT,
+		.threads = threads,
+		.filters = filters,
+		.check = check,
+		.uncompressed_size = in_size,
+	};
+
+	lzma_options_easy easy;
+	const lzma_filter *chain;
+	uint64_t block_size;
+	uint32_t workers;
+	return_if_error(lzma_mt_options_get(&mt, &easy, &chain,
+			&block_size, &workers));
+
+	// Use a local copy. We update *out_pos_ptr only if everything
+	// succeeds.
+	size_t out_pos = *out_pos_ptr;
+
+	// Check that there's enough space for both Stream Header and
+	// Stream Footer, and reserve space for the Stream Footer.
+	if (out_size - out_pos <= 2 * LZMA_STREAM_HEADER_SIZE)
+		return LZMA_BUF_ERROR;
+
+	out_size -= LZMA_STREAM_HEADER_SIZE;
+
+	// Encode the Stream Header.
+	lzma_stream_flags stream_flags = {
+		.version = 0,
+		.check = check,
+	};
+
+	if (lzma_stream_header_encode(&stream_flags, out + out_pos)
+			!= LZMA_OK)
+		return LZMA_PROG_ERROR;
+
+	out_pos += LZMA_STREAM_HEADER_SIZE;
+
+	// Split the input into Blocks.
+	buffer_coder coder = {
+		.blocks = NULL,
+		.block_count = in_size == 0
+				? 0 : (in_size - 1) / block_size + 1,
+		.allocator = allocator,
+		.next = 0,
+		.ret = LZMA_OK,
+	};
+
+	if (coder.block_count > 0) {
+		coder.blocks = lzma_alloc(coder.block_count
+				* sizeof(buffer_block), allocator);
+		if (coder.blocks == NULL)
+			return LZMA_MEM_ERROR;
+	}
+
+	// Reserve the worst-case space for each Block. The Blocks are
+	// encoded directly into the output buffer as long as they fit
+	// there; the rest get scratch memory. Because the reserved
+	// spaces follow each other in order, compacting them later
+	// never overwrites a Block that hasn't been moved yet.
+	size_t reserve_pos = out_pos;
+	for (size_t i = 0; i < coder.block_count; ++i) {
+		buffer_block *b = &coder.blocks[i];
+		const size_t offset = (size_t)(i * block_size);
+
+		b->block = (lzma_block){
+			.version = 0,
+			.check = check,
+			.filters = (lzma_filter *)(chain),
+		};
+		b->in = in + offset;
+		b->in_size = my_min(in_size - offset, (size_t)(block_size));
+		b->buf_size = lzma_block_buffer_bound(b->in_size);
+		b->size = 0;
+		b->scratch = NULL;
+		b->buf = NULL;
+
+		if (b->buf_size == 0) {
+			lzma_free(coder.blocks, allocator);
+			return LZMA_BUF_ERROR;
+		}
+
+		if (reserve_pos != SIZE_MAX
+				&& out_size - reserve_pos >= b->buf_size) {
+			b->buf = out + reserve_pos;
+			reserve_pos += b->buf_size;
+		} else {
+			reserve_pos = SIZE_MAX;
+		}
+	}
+
+	lzma_ret ret = LZMA_OK;
+	if (coder.block_count > 0)
+		ret = encode_parallel(&coder,
+				(uint32_t)(my_min(workers, coder.block_count)));
+
+	// Create the Index while putting the Blocks to their places.
+	lzma_index *i = NULL;
+	if (ret == LZMA_OK) {
+		i = lzma_index_init(allocator);
+		if (i == NULL)
+			ret = LZMA_MEM_ERROR;
+	}
+
+	if (ret == LZMA_OK)
+		ret = compact_blocks(&coder, i, out, &out_pos, out_size);
+
+	for (size_t j = 0; j < coder.block_count; ++j)
+		lzma_free(coder.blocks[j].scratch, allocator);
+
+	lzma_free(coder.blocks, allocator);
+
+	// Encode the Index and get its size which will be stored into
+	// the Stream Footer.
+	if (ret == LZMA_OK) {
+		ret = lzma_index_buffer_encode(i, out, &out_pos, out_size);
+		stream_flags.backward_size = lzma_index_size(i);
+	}
+
+	lzma_index_end(i, allocator);
+
+	if (ret != LZMA_OK)
+		return ret;
+
+	// Stream Footer. We have already reserved space for this.
+	if (lzma_stream_footer_encode(&stream_flags, out + out_pos)
+			!= LZMA_OK)
+		return LZMA_PROG_ERROR;
+
+	out_pos += LZMA_STREAM_HEADER_SIZE;
+
+	// Everything went fine, make the new output position available
+	// to the application.
+	*out_pos_ptr = out_pos;
+	return LZMA_OK;
+}
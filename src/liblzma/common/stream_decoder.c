@@ -12,6 +12,7 @@
 
 #include "stream_decoder.h"
 #include "block_decoder.h"
+#include "filter_decoder.h"
 
 
 typedef struct {
@@ -40,6 +41,10 @@ typedef struct {
 	/// with O(1) memory usage.
 	lzma_index_hash *index_hash;
 
+	/// Thread calculating the integrity checks if LZMA_THREADED_CHECK
+	/// was used, otherwise NULL.
+	lzma_check_thread *check_thread;
+
 	/// Memory usage limit
 	uint64_t memlimit;
 
@@ -206,8 +211,11 @@ stream_decode(void *coder_ptr, const lzma_allocator *allocator,
 		// it always resets this to false.
 		coder->block_options.ignore_check = coder->ignore_check;
 
-		// Check the memory usage limit.
-		const uint64_t memusage = lzma_raw_decoder_memusage(filters);
+		// Check the memory usage limit. The Block decoder allocates
+		// a smaller dictionary if the Block Header has Uncompressed
+		// Size that is smaller than the dictionary size.
+		const uint64_t memusage = lzma_raw_decoder_memusage_sized(
+				filters, coder->block_options.uncompressed_size);
 		lzma_ret ret;
 
 		if (memusage == UINT64_MAX) {
@@ -220,16 +228,20 @@ stream_decode(void *coder_ptr, const lzma_allocator *allocator,
 			// invalid filter chain.
 			coder->memusage = memusage;
 
-			if (memusage > coder->memlimit) {
+			if (coder->check_thread != NULL)
+				coder->memusage += LZMA_CHECK_THREAD_MEMUSAGE;
+
+			if (coder->memusage > coder->memlimit) {
 				// The chain would need too much memory.
 				ret = LZMA_MEMLIMIT_ERROR;
 			} else {
 				// Memory usage is OK.
 				// Initialize the Block decoder.
-				ret = lzma_block_decoder_init(
+				ret = lzma_block_decoder_init_threaded(
 						&coder->block_decoder,
 						allocator,
-						&coder->block_options);
+						&coder->block_options,
+						coder->check_thread);
 			}
 		}
 
@@ -382,6 +394,9 @@ stream_decoder_end(void *coder_ptr, const lzma_allocator *allocator)
 	lzma_stream_coder *coder = coder_ptr;
 	lzma_next_end(&coder->block_decoder, allocator);
 	lzma_index_hash_end(coder->index_hash, allocator);
+#ifdef MYTHREAD_ENABLED
+	lzma_check_thread_end(coder->check_thread, allocator);
+#endif
 	lzma_free(coder, allocator);
 	return;
 }
@@ -439,10 +454,29 @@ lzma_stream_decoder_init(
 
 		coder->block_decoder = LZMA_NEXT_CODER_INIT;
 		coder->index_hash = NULL;
+		coder->check_thread = NULL;
+	}
+
+#ifdef MYTHREAD_ENABLED
+	// The thread is kept if the decoder is reinitialized with
+	// the same flag.
+	if ((flags & LZMA_THREADED_CHECK) && !(flags & LZMA_IGNORE_CHECK)) {
+		if (coder->check_thread == NULL) {
+			coder->check_thread = lzma_check_thread_create(
+					allocator);
+			if (coder->check_thread == NULL)
+				return LZMA_MEM_ERROR;
+		}
+	} else {
+		lzma_check_thread_end(coder->check_thread, allocator);
+		coder->check_thread = NULL;
 	}
+#endif
 
 	coder->memlimit = my_max(1, memlimit);
 	coder->memusage = LZMA_MEMUSAGE_BASE;
+	if (coder->check_thread != NULL)
+		coder->memusage += LZMA_CHECK_THREAD_MEMUSAGE;
 	coder->tell_no_check = (flags & LZMA_TELL_NO_CHECK) != 0;
 	coder->tell_unsupported_check
 			= (flags & LZMA_TELL_UNSUPPORTED_CHECK) != 0;
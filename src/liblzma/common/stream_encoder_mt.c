@@ -10,18 +10,36 @@
 //
 ///////////////////////////////////////////////////////////////////////////////
 
+#include "stream_encoder_mt.h"
 #include "filter_encoder.h"
-#include "easy_preset.h"
 #include "block_encoder.h"
 #include "block_buffer_encoder.h"
+#include "lzma2_encoder.h"
+#include "check.h"
 #include "index_encoder.h"
 #include "outqueue.h"
+#include "thread_pool.h"
 
 
 /// Maximum supported block size. This makes it simpler to prevent integer
 /// overflows if we are given unusually large block size.
 #define BLOCK_SIZE_MAX (UINT64_MAX / LZMA_THREADS_MAX)
 
+/// With the radix match finder, this many threads are given to each Block
+/// before another Block is encoded concurrently. The match finder stops
+/// scaling well somewhere above this while independent Blocks cost memory
+/// and some compression ratio.
+#define RADIX_BLOCK_THREADS 8
+
+/// With lzma_mt.block_filters, the input of a Block is classified from
+/// up to this many samples of CLASSIFY_SAMPLE_SIZE bytes spread evenly
+/// over the Block. Blocks smaller than one sample aren't classified.
+#define CLASSIFY_SAMPLES 16
+#define CLASSIFY_SAMPLE_SIZE 4096
+
+/// Longest record of structured data that is looked for
+#define CLASSIFY_RECORD_MAX 32
+
 
 typedef enum {
 	/// Waiting for work.
@@ -44,19 +62,37 @@ typedef enum {
 
 } worker_state;
 
+/// The worker_state is kept in the low bits of worker_thread.state.
+/// The main thread adds THR_INPUT_STEP to the value every time it gives
+/// more input to the thread, so that the value changes and wakes up the
+/// thread even when the state stays the same.
+#define THR_STATE_MASK 7
+#define THR_INPUT_STEP 8
+
 typedef struct lzma_stream_coder_s lzma_stream_coder;
 
 typedef struct worker_thread_s worker_thread;
 struct worker_thread_s {
-	worker_state state;
+	/// State of the thread and the count of input updates. The main
+	/// thread hands work to the thread by changing this, and the
+	/// thread marks itself idle here.
+	mythread_state state;
 
-	/// Input buffer of coder->block_size bytes. The main thread will
-	/// put new input into this and update in_size accordingly. Once
-	/// no more input is coming, state will be set to THR_FINISH.
-	uint8_t *in;
+	/// Input of the Block. This points to in_buf or, with
+	/// LZMA_STABLE_INPUT, to the memory of the application. The main
+	/// thread will put new input here and update in_size accordingly.
+	/// Once no more input is coming, state will be set to THR_FINISH.
+	const uint8_t *in;
+
+	/// Input buffer of coder->block_size bytes. This is NULL with
+	/// LZMA_STABLE_INPUT.
+	uint8_t *in_buf;
 
 	/// Amount of data available in the input buffer. This is modified
-	/// only by the main thread.
+	/// only by the main thread, before it changes the state.
+	///
+	/// \note      This is accessed by two threads and thus access
+	///             to this variable needs a mutex.
 	size_t in_size;
 
 	/// Output buffer for this thread. This is set by the main
@@ -85,15 +121,23 @@ struct worker_thread_s {
 	/// Compression options for this Block
 	lzma_block block_options;
 
+	/// Filter chain chosen for this Block from coder->block_filters.
+	/// The options are shared with the coder except that the Delta
+	/// filter uses the record size found in the Block and the radix
+	/// match finder may get one more thread.
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_options_delta delta;
+	lzma_options_lzma lzma;
+
 	/// Next structure in the stack of free worker threads.
 	worker_thread *next;
 
+	/// Protects in_size, progress_in, and progress_out. This is never
+	/// held while waiting; the waiting is done on the state.
 	mythread_mutex mutex;
-	mythread_cond cond;
 
-	/// The ID of this thread is used to join the thread
-	/// when it's not needed anymore.
-	mythread thread_id;
+	/// The thread is joined when it's not needed anymore.
+	lzma_thread thread;
 };
 
 
@@ -109,9 +153,33 @@ struct lzma_stream_coder_s {
 	/// LZMA_FULL_FLUSH or LZMA_FULL_BARRIER is used earlier.
 	size_t block_size;
 
+	/// True if LZMA_STABLE_INPUT was used. The input isn't copied
+	/// to the buffers of the threads then.
+	bool stable_input;
+
+	/// True if LZMA_EARLY_OUTPUT was used. The Block Headers are
+	/// written without sizes and the workers make their output
+	/// readable while they are compressing.
+	bool early_output;
+
 	/// The filter chain currently in use
 	lzma_filter filters[LZMA_FILTERS_MAX + 1];
 
+	/// Filter chains from lzma_mt.block_filters indexed by
+	/// lzma_block_class. An empty chain means coder->filters, or
+	/// storing the Block for LZMA_BLOCK_CLASS_INCOMPRESSIBLE.
+	lzma_filter block_filters[LZMA_BLOCK_CLASS_COUNT]
+			[LZMA_FILTERS_MAX + 1];
+
+	/// True if lzma_mt.block_filters was used
+	bool classify;
+
+	/// The radix match finder of this many first structures in
+	/// "threads" below gets one thread more than the chains above
+	/// have, so that the threads that don't divide evenly between
+	/// the Blocks are used too.
+	uint32_t rad_threads_extra;
+
 
 	/// Index to hold sizes of the Blocks
 	lzma_index *index;
@@ -153,6 +221,9 @@ struct lzma_stream_coder_s {
 	/// thus the number of worker threads actually created so far.
 	uint32_t threads_initialized;
 
+	/// Pool from which the threads are taken or NULL
+	lzma_thread_pool *thread_pool;
+
 	/// Stack of free threads. When a thread finishes, it puts itself
 	/// back into this stack. This starts as empty because threads
 	/// are created only when actually needed.
@@ -177,6 +248,47 @@ struct lzma_stream_coder_s {
 };
 
 
+static inline worker_state
+thread_state(uint32_t value)
+{
+	return (worker_state)(value & THR_STATE_MASK);
+}
+
+
+/// Set a new state and wake up the thread unless the thread has already
+/// become idle. The value changes even if the state stays the same, so
+/// this tells the thread to look at in_size again. Returns false if the
+/// thread was idle, which means that the Block encoder has failed.
+static bool
+thread_update(worker_thread *thr, worker_state state)
+{
+	while (true) {
+		const uint32_t value = mythread_state_get(&thr->state);
+		if (thread_state(value) == THR_IDLE)
+			return false;
+
+		if (mythread_state_cas(&thr->state, value,
+				((value & ~(uint32_t)(THR_STATE_MASK))
+					+ THR_INPUT_STEP) | state))
+			return true;
+	}
+}
+
+
+/// Mark the thread as idle unless the main thread has told it to exit.
+static void
+thread_set_idle(worker_thread *thr)
+{
+	while (true) {
+		const uint32_t value = mythread_state_get(&thr->state);
+		if (thread_state(value) == THR_EXIT
+				|| mythread_state_cas(&thr->state, value,
+					value & ~(uint32_t)(THR_STATE_MASK)))
+			return;
+	}
+}
+
+
 /// Tell the main thread that something has gone wrong.
 static void
 worker_error(worker_thread *thr, lzma_ret ret)
@@ -195,34 +307,414 @@ worker_error(worker_thread *thr, lzma_ret ret)
 }
 
 
+/// Add a chunk to the end of the output buffer of the thread.
+static lzma_ret
+worker_add_chunk(worker_thread *thr)
+{
+	lzma_outchunk *chunk;
+	mythread_sync(thr->coder->mutex) {
+		chunk = lzma_outq_add_chunk(&thr->coder->outq, thr->outbuf,
+				thr->allocator);
+	}
+
+	return chunk == NULL ? LZMA_MEM_ERROR : LZMA_OK;
+}
+
+
+/// Classify CLASSIFY_SAMPLE_SIZE bytes of data other than by randomness.
+/// The byte frequencies are added to totals[]. The record size of
+/// structured data is stored in *record.
+static lzma_block_class
+classify_sample(const uint8_t *buf, uint32_t *totals, uint32_t *record)
+{
+	const size_t size = CLASSIFY_SAMPLE_SIZE;
+
+	uint32_t counts[256] = { 0 };
+	for (size_t i = 0; i < size; ++i)
+		++counts[buf[i]];
+
+	for (size_t i = 0; i < 256; ++i)
+		totals[i] += counts[i];
+
+	// x86 code: CALLs whose rel32 has 0x00 or 0xFF as the high byte,
+	// which are the ones that the x86 filter converts. In random data
+	// there is one of these in every 32 KiB on average.
+	size_t calls = 0;
+	for (size_t i = 0; i + 5 <= size; ++i)
+		calls += buf[i] == 0xE8 && (uint8_t)(buf[i + 4] + 1) <= 1;
+
+	if (calls >= size / 512)
+		return LZMA_BLOCK_CLASS_X86;
+
+	// ARM64 code: BLs to within +/-4 MiB, that is, the top six bits of
+	// the 26-bit immediate are equal. In random data one in 2048 words
+	// is like this.
+	calls = 0;
+	for (size_t i = 0; i + 4 <= size; i += 4) {
+		const uint32_t instr = read32le(buf + i);
+		calls += (instr >> 26) == 0x25
+				&& (((instr >> 20) + 1) & 0x3F) <= 1;
+	}
+
+	if (calls >= size / 256)
+		return LZMA_BLOCK_CLASS_ARM64;
+
+	// Structured data: a byte equals the byte one record earlier much
+	// more often than the previous byte. The shortest such distance
+	// is taken so that multiples of the record size don't win. Text
+	// is left out because similar lines would look like records.
+	size_t control = counts[0x7F];
+	for (size_t i = 0; i < 0x20; ++i)
+		if (i != '\t' && i != '\n' && i != '\r')
+			control += counts[i];
+
+	if (control < size / 32)
+		return LZMA_BLOCK_CLASS_GENERIC;
+
+	size_t equal[CLASSIFY_RECORD_MAX + 1];
+	for (size_t dist = 1; dist <= CLASSIFY_RECORD_MAX; ++dist) {
+		equal[dist] = 0;
+		for (size_t i = dist; i < size; ++i)
+			equal[dist] += buf[i] == buf[i - dist];
+	}
+
+	size_t best = 2;
+	for (size_t dist = 3; dist <= CLASSIFY_RECORD_MAX; ++dist)
+		if (equal[dist] > equal[best] + equal[best] / 8)
+			best = dist;
+
+	if (equal[best] < size / 8 || equal[best] < 4 * equal[1])
+		return LZMA_BLOCK_CLASS_GENERIC;
+
+	*record = (uint32_t)(best);
+	return LZMA_BLOCK_CLASS_STRUCTURED;
+}
+
+
+/// Classify the input of a Block from samples spread over it. For
+/// LZMA_BLOCK_CLASS_STRUCTURED, the record size is stored in *record.
+static lzma_block_class
+classify_block(const uint8_t *in, size_t in_size, uint32_t *record)
+{
+	if (in_size < CLASSIFY_SAMPLE_SIZE)
+		return LZMA_BLOCK_CLASS_GENERIC;
+
+	const size_t samples = my_min(CLASSIFY_SAMPLES,
+			in_size / CLASSIFY_SAMPLE_SIZE);
+	const size_t step = samples > 1
+			? (in_size - CLASSIFY_SAMPLE_SIZE) / (samples - 1) : 0;
+
+	uint32_t totals[256] = { 0 };
+	size_t votes[LZMA_BLOCK_CLASS_COUNT] = { 0 };
+	size_t record_votes[CLASSIFY_RECORD_MAX + 1] = { 0 };
+
+	for (size_t i = 0; i < samples; ++i) {
+		// Keep the samples aligned for the ARM64 instructions.
+		uint32_t sample_record = 0;
+		const lzma_block_class c = classify_sample(
+				in + ((i * step) & ~(size_t)(3)),
+				totals, &sample_record);
+		++votes[c];
+		++record_votes[sample_record];
+	}
+
+	// Random data: the number of pairs of equal bytes in all the
+	// samples together is what it would be with at least 7.9 bits
+	// of entropy per byte. This is Renyi entropy of order two, which
+	// needs no logarithms. A single sample would be too small to
+	// tell random data from data that LZMA2 can compress a little.
+	const uint64_t size = (uint64_t)(samples) * CLASSIFY_SAMPLE_SIZE;
+	uint64_t pairs = 0;
+	for (size_t i = 0; i < 256; ++i)
+		pairs += (uint64_t)(totals[i]) * (totals[i] - (totals[i] > 0));
+
+	// 2^7.9 is about 239.
+	if (pairs * 239 <= size * (size - 1))
+		return LZMA_BLOCK_CLASS_INCOMPRESSIBLE;
+
+	// A BCJ filter does little harm to data that isn't code, so
+	// a quarter of the Block is enough.
+	const lzma_block_class code = votes[LZMA_BLOCK_CLASS_ARM64]
+			> votes[LZMA_BLOCK_CLASS_X86]
+			? LZMA_BLOCK_CLASS_ARM64 : LZMA_BLOCK_CLASS_X86;
+	if (votes[code] >= (samples + 3) / 4)
+		return code;
+
+	// Delta with a wrong distance makes the data worse, so half of
+	// the samples have to find the same record size.
+	size_t best = 2;
+	for (size_t i = 3; i <= CLASSIFY_RECORD_MAX; ++i)
+		if (record_votes[i] > record_votes[best])
+			best = i;
+
+	if (record_votes[best] >= (samples + 1) / 2) {
+		*record = (uint32_t)(best);
+		return LZMA_BLOCK_CLASS_STRUCTURED;
+	}
+
+	return LZMA_BLOCK_CLASS_GENERIC;
+}
+
+
+/// Wait until the main thread has given all the input of the Block.
+/// The amount of input is stored in *in_size unless the thread was
+/// asked to stop or exit.
+static worker_state
+worker_wait_input(worker_thread *thr, size_t *in_size)
+{
+	uint32_t value = mythread_state_get(&thr->state);
+	while (thread_state(value) == THR_RUN)
+		value = mythread_state_wait(&thr->state, value);
+
+	mythread_sync(thr->mutex) {
+		*in_size = thr->in_size;
+	}
+
+	return thread_state(value);
+}
+
+
+/// Choose the filter chain for the Block from coder->block_filters.
+/// Returns NULL if the Block should be stored uncompressed.
+static lzma_filter *
+worker_filters(worker_thread *thr, size_t in_size)
+{
+	uint32_t record = 0;
+	const lzma_block_class c = classify_block(thr->in, in_size, &record);
+	const lzma_filter *chain = thr->coder->block_filters[c];
+
+	if (chain[0].id == LZMA_VLI_UNKNOWN)
+		return c == LZMA_BLOCK_CLASS_INCOMPRESSIBLE
+				? NULL : thr->coder->filters;
+
+	size_t i = 0;
+	do {
+		thr->filters[i] = chain[i];
+
+		if (chain[i].id == LZMA_FILTER_DELTA && record != 0) {
+			thr->delta = *(const lzma_options_delta *)(
+					chain[i].options);
+			thr->delta.dist = record;
+			thr->filters[i].options = &thr->delta;
+		}
+	} while (chain[i++].id != LZMA_VLI_UNKNOWN);
+
+	return thr->filters;
+}
+
+
+/// Give the radix match finder of the Block one more thread if this is
+/// one of the first coder->rad_threads_extra workers. The chain is
+/// copied to thr->filters if it isn't there already.
+static lzma_filter *
+worker_rad_threads(worker_thread *thr, lzma_filter *filters)
+{
+	if ((uint32_t)(thr - thr->coder->threads)
+			>= thr->coder->rad_threads_extra)
+		return filters;
+
+	for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i) {
+		if (filters[i].id != LZMA_FILTER_LZMA2)
+			continue;
+
+		const lzma_options_lzma *opt = filters[i].options;
+		if (opt->mf != LZMA_MF_RAD)
+			break;
+
+		if (filters != thr->filters) {
+			size_t j = 0;
+			do {
+				thr->filters[j] = filters[j];
+			} while (filters[j++].id != LZMA_VLI_UNKNOWN);
+		}
+
+		thr->lzma = *opt;
+		++thr->lzma.threads;
+		thr->filters[i].options = &thr->lzma;
+		return thr->filters;
+	}
+
+	return filters;
+}
+
+
+/// Append size bytes to the output of the Block. *chunk and *chunk_pos
+/// tell where the next byte goes. The chunks that the output buffer
+/// already has are overwritten before new ones are added.
+static lzma_ret
+worker_write(worker_thread *thr, lzma_outchunk **chunk, size_t *chunk_pos,
+		const uint8_t *buf, size_t size)
+{
+	while (size > 0) {
+		if (*chunk_pos == LZMA_OUTQ_CHUNK_SIZE) {
+			*chunk = (*chunk)->next;
+			*chunk_pos = 0;
+		}
+
+		if (*chunk == NULL) {
+			return_if_error(worker_add_chunk(thr));
+			*chunk = thr->outbuf->tail;
+		}
+
+		const size_t copy_size = my_min(size,
+				LZMA_OUTQ_CHUNK_SIZE - *chunk_pos);
+		memcpy((*chunk)->buf + *chunk_pos, buf, copy_size);
+
+		*chunk_pos += copy_size;
+		thr->outbuf->size += copy_size;
+		buf += copy_size;
+		size -= copy_size;
+	}
+
+	return LZMA_OK;
+}
+
+
+/// Store the input of the Block using uncompressed LZMA2 chunks. This
+/// takes care of the Block Header too. The Block is written directly
+/// over the chunks of the output buffer, adding chunks when needed.
+static lzma_ret
+worker_store(worker_thread *thr, size_t in_size)
+{
+	lzma_block *block = &thr->block_options;
+
+	uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
+	return_if_error(lzma_block_uncomp_header_encode(
+			block, in_size, header));
+
+	lzma_outchunk *chunk = thr->outbuf->head;
+	size_t chunk_pos = 0;
+	thr->outbuf->size = 0;
+
+	return_if_error(worker_write(thr, &chunk, &chunk_pos,
+			header, block->header_size));
+
+	// LZMA2 uncompressed chunks, of which the first resets
+	// the dictionary, and the end marker
+	uint8_t control = 0x01;
+	for (size_t in_pos = 0; in_pos < in_size; ) {
+		const size_t copy_size = my_min(in_size - in_pos,
+				LZMA2_CHUNK_MAX);
+		const uint8_t chunk_header[LZMA2_HEADER_UNCOMPRESSED] = {
+			control,
+			(uint8_t)((copy_size - 1) >> 8),
+			(uint8_t)((copy_size - 1) & 0xFF),
+		};
+		control = 0x02;
+
+		return_if_error(worker_write(thr, &chunk, &chunk_pos,
+				chunk_header, sizeof(chunk_header)));
+		return_if_error(worker_write(thr, &chunk, &chunk_pos,
+				thr->in + in_pos, copy_size));
+		in_pos += copy_size;
+	}
+
+	// The end marker and Block Padding are zeros.
+	static const uint8_t zeros[4] = { 0, 0, 0, 0 };
+	return_if_error(worker_write(thr, &chunk, &chunk_pos, zeros,
+			1 + ((4 - ((block->compressed_size) & 3)) & 3)));
+
+	// Check
+	const size_t check_size = lzma_check_size(block->check);
+	if (check_size > 0) {
+		lzma_check_state check;
+		lzma_check_init(&check, block->check);
+		lzma_check_update(&check, block->check, thr->in, in_size);
+		lzma_check_finish(&check, block->check);
+
+		memcpy(block->raw_check, check.buffer.u8, check_size);
+		return_if_error(worker_write(thr, &chunk, &chunk_pos,
+				check.buffer.u8, check_size));
+	}
+
+	return LZMA_OK;
+}
+
+
+/// Set the size information that will be read by the main thread
+/// to write the Index field.
+static worker_state
+worker_finish(worker_thread *thr)
+{
+	thr->outbuf->unpadded_size
+			= lzma_block_unpadded_size(&thr->block_options);
+	assert(thr->outbuf->unpadded_size != 0);
+	thr->outbuf->uncompressed_size = thr->block_options.uncompressed_size;
+
+	return THR_FINISH;
+}
+
+
 static worker_state
 worker_encode(worker_thread *thr, worker_state state)
 {
 	assert(thr->progress_in == 0);
 	assert(thr->progress_out == 0);
 
+	const bool early_output = thr->coder->early_output;
+
+	// With lzma_mt.block_filters the filter chain depends on the data,
+	// so nothing is encoded before the whole Block has been read.
+	lzma_filter *filters = thr->coder->filters;
+	size_t in_size = 0;
+
+	if (thr->coder->classify) {
+		state = worker_wait_input(thr, &in_size);
+		if (state >= THR_STOP)
+			return state;
+
+		filters = worker_filters(thr, in_size);
+	}
+
+	if (filters != NULL)
+		filters = worker_rad_threads(thr, filters);
+
 	// Set the Block options.
 	thr->block_options = (lzma_block){
 		.version = 0,
 		.check = thr->coder->stream_flags.check,
-		.compressed_size = thr->coder->outq.buf_size_max,
-		.uncompressed_size = thr->coder->block_size,
-
-		// TODO: To allow changing the filter chain, the filters
-		// array must be copied to each worker_thread.
-		.filters = thr->coder->filters,
+		.compressed_size = early_output ? LZMA_VLI_UNKNOWN
+				: thr->coder->outq.buf_size_max,
+		.uncompressed_size = early_output ? LZMA_VLI_UNKNOWN
+				: thr->coder->block_size,
+		.filters = filters,
 	};
 
+	// Incompressible data is stored without trying to compress it.
+	if (filters == NULL) {
+		const lzma_ret ret = worker_store(thr, in_size);
+		if (ret != LZMA_OK) {
+			worker_error(thr, ret);
+			return THR_STOP;
+		}
+
+		return worker_finish(thr);
+	}
+
 	// Calculate maximum size of the Block Header. This amount is
 	// reserved in the beginning of the buffer so that Block Header
 	// along with Compressed Size and Uncompressed Size can be
 	// written there.
 	lzma_ret ret = lzma_block_header_size(&thr->block_options);
+	if (ret == LZMA_OK)
+		ret = worker_add_chunk(thr);
+
 	if (ret != LZMA_OK) {
 		worker_error(thr, ret);
 		return THR_STOP;
 	}
 
+	// Without the size fields the Block Header can be encoded now
+	// so that it can be read before the Block has been finished.
+	if (early_output) {
+		ret = lzma_block_header_encode(&thr->block_options,
+				thr->outbuf->head->buf);
+		if (ret != LZMA_OK) {
+			worker_error(thr, ret);
+			return THR_STOP;
+		}
+	}
+
 	// Initialize the Block encoder.
 	ret = lzma_block_encoder_init(&thr->block_encoder,
 			thr->allocator, &thr->block_options);
@@ -232,29 +724,46 @@ worker_encode(worker_thread *thr, worker_state state)
 	}
 
 	size_t in_pos = 0;
-	size_t in_size = 0;
+	size_t readable = 0;
 
-	thr->outbuf->size = thr->block_options.header_size;
+	// The output goes to the chunk at thr->outbuf->tail. A new chunk
+	// is added when it becomes full.
+	size_t chunk_pos = thr->block_options.header_size;
+	thr->outbuf->size = chunk_pos;
 	const size_t out_size = thr->coder->outq.buf_size_max;
 
 	do {
-		mythread_sync(thr->mutex) {
-			// Store in_pos and out_pos into *thr so that
-			// an application may read them via
-			// lzma_get_progress() to get progress information.
-			//
-			// NOTE: These aren't updated when the encoding
-			// finishes. Instead, the final values are taken
-			// later from thr->outbuf.
-			thr->progress_in = in_pos;
-			thr->progress_out = thr->outbuf->size;
-
-			while (in_size == thr->in_size
-					&& thr->state == THR_RUN)
-				mythread_cond_wait(&thr->cond, &thr->mutex);
-
-			state = thr->state;
-			in_size = thr->in_size;
+		while (true) {
+			// Read the state before in_size. The main thread
+			// updates in_size before the state so the new
+			// input cannot be missed.
+			const uint32_t value = mythread_state_get(&thr->state);
+			state = thread_state(value);
+
+			mythread_sync(thr->mutex) {
+				// Store in_pos and out_pos into *thr so that
+				// an application may read them via
+				// lzma_get_progress() to get progress
+				// information.
+				//
+				// NOTE: These aren't updated when the encoding
+				// finishes. Instead, the final values are
+				// taken later from thr->outbuf.
+				thr->progress_in = in_pos;
+				thr->progress_out = thr->outbuf->size;
+
+				in_size = thr->in_size;
+			}
+
+			// Wait only if all the input given so far has
+			// been encoded. If the filter timed out waiting
+			// for its own threads, call it again without
+			// waiting for more input.
+			if (in_pos != in_size || state != THR_RUN
+					|| ret == LZMA_TIMED_OUT)
+				break;
+
+			mythread_state_wait(&thr->state, value);
 		}
 
 		// Return if we were asked to stop or exit.
@@ -274,21 +783,51 @@ worker_encode(worker_thread *thr, worker_state state)
 			action = LZMA_RUN;
 		}
 
+		if (chunk_pos == LZMA_OUTQ_CHUNK_SIZE) {
+			ret = worker_add_chunk(thr);
+			if (ret != LZMA_OK) {
+				worker_error(thr, ret);
+				return THR_STOP;
+			}
+
+			chunk_pos = 0;
+		}
+
+		// Don't let the buffer grow past out_size.
+		const size_t chunk_start = chunk_pos;
+		const size_t chunk_limit = my_min(LZMA_OUTQ_CHUNK_SIZE,
+				chunk_pos + (out_size - thr->outbuf->size));
+
 		ret = thr->block_encoder.code(
 				thr->block_encoder.coder, thr->allocator,
-				thr->in, &in_pos, in_limit, thr->outbuf->buf,
-				&thr->outbuf->size, out_size, action);
-	} while (ret == LZMA_OK && thr->outbuf->size < out_size);
+				thr->in, &in_pos, in_limit,
+				thr->outbuf->tail->buf, &chunk_pos,
+				chunk_limit, action);
+		thr->outbuf->size += chunk_pos - chunk_start;
+
+		// Let the main thread copy the new output already.
+		if (early_output && thr->outbuf->size > readable) {
+			readable = thr->outbuf->size;
+			mythread_sync(thr->coder->mutex) {
+				thr->outbuf->readable = readable;
+				mythread_cond_signal(&thr->coder->cond);
+			}
+		}
+	} while ((ret == LZMA_OK || ret == LZMA_TIMED_OUT)
+			&& thr->outbuf->size < out_size);
 
 	switch (ret) {
 	case LZMA_STREAM_END:
 		assert(state == THR_FINISH);
 
+		if (early_output)
+			break;
+
 		// Encode the Block Header. By doing it after
 		// the compression, we can store the Compressed Size
 		// and Uncompressed Size fields.
 		ret = lzma_block_header_encode(&thr->block_options,
-				thr->outbuf->buf);
+				thr->outbuf->head->buf);
 		if (ret != LZMA_OK) {
 			worker_error(thr, ret);
 			return THR_STOP;
@@ -297,30 +836,26 @@ worker_encode(worker_thread *thr, worker_state state)
 		break;
 
 	case LZMA_OK:
+	case LZMA_TIMED_OUT:
 		// The data was incompressible. Encode it using uncompressed
 		// LZMA2 chunks.
 		//
 		// First wait that we have gotten all the input.
-		mythread_sync(thr->mutex) {
-			while (thr->state == THR_RUN)
-				mythread_cond_wait(&thr->cond, &thr->mutex);
-
-			state = thr->state;
-			in_size = thr->in_size;
-		}
-
+		state = worker_wait_input(thr, &in_size);
 		if (state >= THR_STOP)
 			return state;
 
-		// Do the encoding. This takes care of the Block Header too.
-		thr->outbuf->size = 0;
-		ret = lzma_block_uncomp_encode(&thr->block_options,
-				thr->in, in_size, thr->outbuf->buf,
-				&thr->outbuf->size, out_size);
+		// Output that may have been read already cannot be
+		// replaced anymore. LZMA2 never needs more space than
+		// the buffer has so this shouldn't happen.
+		if (readable > 0) {
+			worker_error(thr, LZMA_PROG_ERROR);
+			return THR_STOP;
+		}
 
-		// It shouldn't fail.
+		ret = worker_store(thr, in_size);
 		if (ret != LZMA_OK) {
-			worker_error(thr, LZMA_PROG_ERROR);
+			worker_error(thr, ret);
 			return THR_STOP;
 		}
 
@@ -331,18 +866,11 @@ worker_encode(worker_thread *thr, worker_state state)
 		return THR_STOP;
 	}
 
-	// Set the size information that will be read by the main thread
-	// to write the Index field.
-	thr->outbuf->unpadded_size
-			= lzma_block_unpadded_size(&thr->block_options);
-	assert(thr->outbuf->unpadded_size != 0);
-	thr->outbuf->uncompressed_size = thr->block_options.uncompressed_size;
-
-	return THR_FINISH;
+	return worker_finish(thr);
 }
 
 
-static MYTHREAD_RET_TYPE
+static void
 worker_start(void *thr_ptr)
 {
 	worker_thread *thr = thr_ptr;
@@ -350,21 +878,18 @@ worker_start(void *thr_ptr)
 
 	while (true) {
 		// Wait for work.
-		mythread_sync(thr->mutex) {
-			while (true) {
-				// The thread is already idle so if we are
-				// requested to stop, just set the state.
-				if (thr->state == THR_STOP) {
-					thr->state = THR_IDLE;
-					mythread_cond_signal(&thr->cond);
-				}
-
-				state = thr->state;
-				if (state != THR_IDLE)
-					break;
-
-				mythread_cond_wait(&thr->cond, &thr->mutex);
-			}
+		while (true) {
+			const uint32_t value = mythread_state_get(&thr->state);
+			state = thread_state(value);
+
+			// The thread is already idle so if we are
+			// requested to stop, just set the state.
+			if (state == THR_STOP)
+				thread_set_idle(thr);
+			else if (state == THR_IDLE)
+				mythread_state_wait(&thr->state, value);
+			else
+				break;
 		}
 
 		assert(state != THR_IDLE);
@@ -377,19 +902,16 @@ worker_start(void *thr_ptr)
 			break;
 
 		// Mark the thread as idle unless the main thread has
-		// told us to exit. Signal is needed for the case
-		// where the main thread is waiting for the threads to stop.
-		mythread_sync(thr->mutex) {
-			if (thr->state != THR_EXIT) {
-				thr->state = THR_IDLE;
-				mythread_cond_signal(&thr->cond);
-			}
-		}
+		// told us to exit. This wakes up the main thread if it
+		// is waiting for the threads to stop.
+		thread_set_idle(thr);
 
 		mythread_sync(thr->coder->mutex) {
 			// Mark the output buffer as finished if
 			// no errors occurred.
-			thr->outbuf->finished = state == THR_FINISH;
+			if (state == THR_FINISH)
+				lzma_outq_finish_buf(&thr->coder->outq,
+						thr->outbuf);
 
 			// Update the main progress info.
 			thr->coder->progress_in
@@ -408,11 +930,11 @@ worker_start(void *thr_ptr)
 
 	// Exiting, free the resources.
 	mythread_mutex_destroy(&thr->mutex);
-	mythread_cond_destroy(&thr->cond);
+	mythread_state_destroy(&thr->state);
 
 	lzma_next_end(&thr->block_encoder, thr->allocator);
-	lzma_free(thr->in, thr->allocator);
-	return MYTHREAD_RET_VALUE;
+	lzma_free(thr->in_buf, thr->allocator);
+	return;
 }
 
 
@@ -421,23 +943,18 @@ static void
 threads_stop(lzma_stream_coder *coder, bool wait_for_threads)
 {
 	// Tell the threads to stop.
-	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
-		mythread_sync(coder->threads[i].mutex) {
-			coder->threads[i].state = THR_STOP;
-			mythread_cond_signal(&coder->threads[i].cond);
-		}
-	}
+	for (uint32_t i = 0; i < coder->threads_initialized; ++i)
+		mythread_state_set(&coder->threads[i].state, THR_STOP);
 
 	if (!wait_for_threads)
 		return;
 
 	// Wait for the threads to settle in the idle state.
 	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
-		mythread_sync(coder->threads[i].mutex) {
-			while (coder->threads[i].state != THR_IDLE)
-				mythread_cond_wait(&coder->threads[i].cond,
-						&coder->threads[i].mutex);
-		}
+		uint32_t value = mythread_state_get(&coder->threads[i].state);
+		while (thread_state(value) != THR_IDLE)
+			value = mythread_state_wait(
+					&coder->threads[i].state, value);
 	}
 
 	return;
@@ -449,18 +966,11 @@ threads_stop(lzma_stream_coder *coder, bool wait_for_threads)
 static void
 threads_end(lzma_stream_coder *coder, const lzma_allocator *allocator)
 {
-	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
-		mythread_sync(coder->threads[i].mutex) {
-			coder->threads[i].state = THR_EXIT;
-			mythread_cond_signal(&coder->threads[i].cond);
-		}
-	}
+	for (uint32_t i = 0; i < coder->threads_initialized; ++i)
+		mythread_state_set(&coder->threads[i].state, THR_EXIT);
 
-	for (uint32_t i = 0; i < coder->threads_initialized; ++i) {
-		int ret = mythread_join(coder->threads[i].thread_id);
-		assert(ret == 0);
-		(void)ret;
-	}
+	for (uint32_t i = 0; i < coder->threads_initialized; ++i)
+		lzma_thread_join(&coder->threads[i].thread);
 
 	lzma_free(coder->threads, allocator);
 	return;
@@ -468,65 +978,89 @@ threads_end(lzma_stream_coder *coder, const lzma_allocator *allocator)
 
 
 /// Initialize a new worker_thread structure and create a new thread.
+/// If the thread pool has no thread to give and this coder already has
+/// a thread, coder->thr is left NULL and LZMA_OK is returned. The Block
+/// then waits for one of the threads of this coder to become free.
 static lzma_ret
 initialize_new_thread(lzma_stream_coder *coder,
 		const lzma_allocator *allocator)
 {
 	worker_thread *thr = &coder->threads[coder->threads_initialized];
 
-	thr->in = lzma_alloc(coder->block_size, allocator);
-	if (thr->in == NULL)
-		return LZMA_MEM_ERROR;
+	thr->in = NULL;
+	thr->in_buf = NULL;
 
 	if (mythread_mutex_init(&thr->mutex))
-		goto error_mutex;
+		return LZMA_MEM_ERROR;
 
-	if (mythread_cond_init(&thr->cond))
-		goto error_cond;
+	if (mythread_state_init(&thr->state, THR_IDLE))
+		goto error_state;
 
-	thr->state = THR_IDLE;
 	thr->allocator = allocator;
 	thr->coder = coder;
 	thr->progress_in = 0;
 	thr->progress_out = 0;
 	thr->block_encoder = LZMA_NEXT_CODER_INIT;
 
-	if (mythread_create(&thr->thread_id, &worker_start, thr))
+	// Without any threads nothing could be encoded so then take
+	// a thread outside the pool. Waiting for the pool could
+	// deadlock if the application doesn't end the other streams
+	// while waiting for this one.
+	if (lzma_thread_create(&thr->thread, coder->thread_pool,
+			coder->threads_initialized == 0, &worker_start, thr))
 		goto error_thread;
 
+	// With LZMA_STABLE_INPUT the Blocks are read directly from
+	// the input of the application. The buffer is allocated only
+	// after the thread has been got so that it isn't allocated
+	// again and again while the pool has no free threads.
+	if (!coder->stable_input) {
+		thr->in_buf = lzma_alloc(coder->block_size, allocator);
+		if (thr->in_buf == NULL) {
+			// The thread frees its resources when it exits.
+			mythread_state_set(&thr->state, THR_EXIT);
+			lzma_thread_join(&thr->thread);
+			return LZMA_MEM_ERROR;
+		}
+
+		thr->in = thr->in_buf;
+	}
+
 	++coder->threads_initialized;
 	coder->thr = thr;
 
 	return LZMA_OK;
 
 error_thread:
-	mythread_cond_destroy(&thr->cond);
+	mythread_state_destroy(&thr->state);
 
-error_cond:
+error_state:
 	mythread_mutex_destroy(&thr->mutex);
-
-error_mutex:
-	lzma_free(thr->in, allocator);
-	return LZMA_MEM_ERROR;
+	return coder->thread_pool != NULL && coder->threads_initialized > 0
+			? LZMA_OK : LZMA_MEM_ERROR;
 }
 
 
 static lzma_ret
 get_thread(lzma_stream_coder *coder, const lzma_allocator *allocator)
 {
-	// If there are no free output subqueues, there is no
-	// point to try getting a thread.
-	if (!lzma_outq_has_buf(&coder->outq))
-		return LZMA_OK;
+	bool has_buf;
 
-	// If there is a free structure on the stack, use it.
 	mythread_sync(coder->mutex) {
-		if (coder->threads_free != NULL) {
+		// If there are no free output subqueues, there is no
+		// point to try getting a thread.
+		has_buf = lzma_outq_has_buf(&coder->outq);
+
+		// If there is a free structure on the stack, use it.
+		if (has_buf && coder->threads_free != NULL) {
 			coder->thr = coder->threads_free;
 			coder->threads_free = coder->threads_free->next;
 		}
 	}
 
+	if (!has_buf)
+		return LZMA_OK;
+
 	if (coder->thr == NULL) {
 		// If there are no uninitialized structures left, return.
 		if (coder->threads_initialized == coder->threads_max)
@@ -534,17 +1068,26 @@ get_thread(lzma_stream_coder *coder, const lzma_allocator *allocator)
 
 		// Initialize a new thread.
 		return_if_error(initialize_new_thread(coder, allocator));
+		if (coder->thr == NULL)
+			return LZMA_OK;
+	}
+
+	// Only the main thread takes buffers into use so there still
+	// is one free.
+	lzma_outbuf *outbuf;
+	mythread_sync(coder->mutex) {
+		outbuf = lzma_outq_get_buf(&coder->outq);
 	}
 
 	// Reset the parts of the thread state that have to be done
 	// in the main thread.
 	mythread_sync(coder->thr->mutex) {
-		coder->thr->state = THR_RUN;
 		coder->thr->in_size = 0;
-		coder->thr->outbuf = lzma_outq_get_buf(&coder->outq);
-		mythread_cond_signal(&coder->thr->cond);
+		coder->thr->outbuf = outbuf;
 	}
 
+	mythread_state_set(&coder->thr->state, THR_RUN);
+
 	return LZMA_OK;
 }
 
@@ -563,41 +1106,56 @@ stream_encode_in(lzma_stream_coder *coder, const lzma_allocator *allocator,
 				return ret;
 		}
 
-		// Copy the input data to thread's buffer.
 		size_t thr_in_size = coder->thr->in_size;
-		lzma_bufcpy(in, in_pos, in_size, coder->thr->in,
-				&thr_in_size, coder->block_size);
+		bool discontiguous = false;
+
+		if (!coder->stable_input) {
+			// Copy the input data to thread's buffer.
+			lzma_bufcpy(in, in_pos, in_size, coder->thr->in_buf,
+					&thr_in_size, coder->block_size);
+
+		} else if (*in_pos < in_size) {
+			// Let the thread read the input in place. Nothing
+			// is read before in_size is updated below.
+			if (thr_in_size == 0)
+				coder->thr->in = in + *in_pos;
+
+			if (coder->thr->in + thr_in_size == in + *in_pos) {
+				const size_t copy_size = my_min(
+						in_size - *in_pos,
+						coder->block_size
+							- thr_in_size);
+				*in_pos += copy_size;
+				thr_in_size += copy_size;
+			} else {
+				// A Block has to be contiguous in memory.
+				discontiguous = true;
+			}
+		}
 
 		// Tell the Block encoder to finish if
 		//  - it has got block_size bytes of input; or
 		//  - all input was used and LZMA_FINISH, LZMA_FULL_FLUSH,
-		//    or LZMA_FULL_BARRIER was used.
+		//    or LZMA_FULL_BARRIER was used; or
+		//  - the new input doesn't continue the input of the Block
+		//    in memory with LZMA_STABLE_INPUT.
 		//
 		// TODO: LZMA_SYNC_FLUSH and LZMA_SYNC_BARRIER.
 		const bool finish = thr_in_size == coder->block_size
-				|| (*in_pos == in_size && action != LZMA_RUN);
-
-		bool block_error = false;
-
+				|| (*in_pos == in_size && action != LZMA_RUN)
+				|| discontiguous;
+
+		// Tell the Block encoder its new amount of input and
+		// update the state if needed. If the thread has become
+		// idle, something has gone wrong with the Block encoder.
+		// It has set coder->thread_error which we will read
+		// a few lines later.
 		mythread_sync(coder->thr->mutex) {
-			if (coder->thr->state == THR_IDLE) {
-				// Something has gone wrong with the Block
-				// encoder. It has set coder->thread_error
-				// which we will read a few lines later.
-				block_error = true;
-			} else {
-				// Tell the Block encoder its new amount
-				// of input and update the state if needed.
-				coder->thr->in_size = thr_in_size;
-
-				if (finish)
-					coder->thr->state = THR_FINISH;
-
-				mythread_cond_signal(&coder->thr->cond);
-			}
+			coder->thr->in_size = thr_in_size;
 		}
 
-		if (block_error) {
+		if (!thread_update(coder->thr,
+				finish ? THR_FINISH : THR_RUN)) {
 			lzma_ret ret;
 
 			mythread_sync(coder->mutex) {
@@ -837,6 +1395,27 @@ stream_encode_mt(void *coder_ptr, const lzma_allocator *allocator,
 }
 
 
+/// Free the options of coder->filters and coder->block_filters.
+static void
+filters_free(lzma_stream_coder *coder, const lzma_allocator *allocator)
+{
+	for (size_t i = 0; coder->filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+		lzma_free(coder->filters[i].options, allocator);
+
+	coder->filters[0].id = LZMA_VLI_UNKNOWN;
+
+	for (size_t c = 0; c < LZMA_BLOCK_CLASS_COUNT; ++c) {
+		lzma_filter *chain = coder->block_filters[c];
+		for (size_t i = 0; chain[i].id != LZMA_VLI_UNKNOWN; ++i)
+			lzma_free(chain[i].options, allocator);
+
+		chain[0].id = LZMA_VLI_UNKNOWN;
+	}
+
+	return;
+}
+
+
 static void
 stream_encoder_mt_end(void *coder_ptr, const lzma_allocator *allocator)
 {
@@ -846,8 +1425,7 @@ stream_encoder_mt_end(void *coder_ptr, const lzma_allocator *allocator)
 	threads_end(coder, allocator);
 	lzma_outq_end(&coder->outq, allocator);
 
-	for (size_t i = 0; coder->filters[i].id != LZMA_VLI_UNKNOWN; ++i)
-		lzma_free(coder->filters[i].options, allocator);
+	filters_free(coder, allocator);
 
 	lzma_next_end(&coder->index_encoder, allocator);
 	lzma_index_end(coder->index, allocator);
@@ -860,18 +1438,249 @@ stream_encoder_mt_end(void *coder_ptr, const lzma_allocator *allocator)
 }
 
 
+/// Memory usage of a filter chain when its radix match finder gets
+/// rad_threads threads
+static uint64_t
+chain_memusage(const lzma_filter *chain, uint32_t rad_threads)
+{
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_options_lzma opt;
+
+	size_t i = 0;
+	do {
+		if (i == LZMA_FILTERS_MAX + 1)
+			return UINT64_MAX;
+
+		filters[i] = chain[i];
+
+		if (chain[i].id == LZMA_FILTER_LZMA2
+				&& chain[i].options != NULL) {
+			opt = *(const lzma_options_lzma *)(chain[i].options);
+			if (opt.mf == LZMA_MF_RAD) {
+				opt.threads = rad_threads;
+				filters[i].options = &opt;
+			}
+		}
+	} while (chain[i++].id != LZMA_VLI_UNKNOWN);
+
+	return lzma_raw_encoder_memusage(filters);
+}
+
+
+/// Get the filter chains for the Block classes of the options. They are
+/// NULL unless LZMA_USE_BLOCK_FILTERS has been set in the flags.
+static const lzma_filter *const *
+mt_block_filters(const lzma_mt *options)
+{
+	return (options->flags & LZMA_USE_BLOCK_FILTERS) != 0
+			? options->block_filters : NULL;
+}
+
+
+/// Memory usage of the filter encoders of one Block whose radix match
+/// finder gets rad_threads threads. The Block is assumed to use the chain
+/// of filters and mt_block_filters() that needs the most memory.
+static uint64_t
+mt_filters_memusage(const lzma_mt *options, const lzma_filter *filters,
+		uint32_t rad_threads)
+{
+	uint64_t filters_memusage = chain_memusage(filters, rad_threads);
+	if (filters_memusage == UINT64_MAX)
+		return UINT64_MAX;
+
+	const lzma_filter *const *block_filters = mt_block_filters(options);
+	if (block_filters != NULL) {
+		for (size_t c = 0; c < LZMA_BLOCK_CLASS_COUNT; ++c) {
+			if (block_filters[c] == NULL)
+				continue;
+
+			const uint64_t memusage = chain_memusage(
+					block_filters[c], rad_threads);
+			if (memusage == UINT64_MAX)
+				return UINT64_MAX;
+
+			filters_memusage = my_max(filters_memusage,
+					memusage);
+		}
+	}
+
+	return filters_memusage;
+}
+
+
+/// Memory usage of the encoder when workers Blocks are encoded concurrently.
+/// inbuf_size is zero with LZMA_STABLE_INPUT.
+static uint64_t
+mt_memusage(const lzma_mt *options, const lzma_filter *filters,
+		uint32_t workers, uint64_t inbuf_size,
+		uint64_t outbuf_size_max)
+{
+	// Memory usage of the input buffers
+	const uint64_t inbuf_memusage = workers * inbuf_size;
+
+	// Memory usage of the filter encoders. The threads are split
+	// like worker_rad_threads() does: the first threads % workers
+	// Blocks get one thread more than the rest.
+	const uint32_t rad_threads = options->threads / workers;
+	const uint32_t rad_threads_extra = options->threads % workers;
+
+	uint64_t filters_memusage = mt_filters_memusage(
+			options, filters, rad_threads);
+	if (filters_memusage == UINT64_MAX)
+		return UINT64_MAX;
+
+	filters_memusage *= workers - rad_threads_extra;
+
+	if (rad_threads_extra > 0) {
+		const uint64_t memusage = mt_filters_memusage(
+				options, filters, rad_threads + 1);
+		if (memusage == UINT64_MAX)
+			return UINT64_MAX;
+
+		filters_memusage += memusage * rad_threads_extra;
+	}
+
+	// Memory usage of the output queue
+	const uint64_t outq_memusage = lzma_outq_memusage(
+			outbuf_size_max, workers);
+	if (outq_memusage == UINT64_MAX)
+		return UINT64_MAX;
+
+	// Sum them with overflow checking.
+	uint64_t total_memusage = LZMA_MEMUSAGE_BASE
+			+ sizeof(lzma_stream_coder)
+			+ workers * sizeof(worker_thread);
+
+	if (UINT64_MAX - total_memusage < inbuf_memusage)
+		return UINT64_MAX;
+
+	total_memusage += inbuf_memusage;
+
+	if (UINT64_MAX - total_memusage < filters_memusage)
+		return UINT64_MAX;
+
+	total_memusage += filters_memusage;
+
+	if (UINT64_MAX - total_memusage < outq_memusage)
+		return UINT64_MAX;
+
+	return total_memusage + outq_memusage;
+}
+
+
+/// Get the thread pool of the options. It is NULL unless
+/// LZMA_USE_THREAD_POOL has been set in the flags.
+static lzma_thread_pool *
+mt_thread_pool(const lzma_mt *options)
+{
+	return (options->flags & LZMA_USE_THREAD_POOL) != 0
+			? options->thread_pool : NULL;
+}
+
+
+/// Split options->threads between Blocks encoded concurrently and the
+/// radix match finder of each Block. The thread count of the match finder
+/// is set to options->threads / *workers; the threads that remain go to
+/// the first Blocks in worker_rad_threads(). If the chain doesn't use
+/// the radix match finder, every thread encodes a Block of its own. Otherwise the
+/// chain is copied to opt_easy (unless it already is there) so that
+/// the thread count of the match finder can be set without touching the
+/// options of the application, and *filters is made to point to the copy.
+static lzma_ret
+split_threads(const lzma_mt *options, lzma_options_easy *opt_easy,
+		const lzma_filter **filters, uint64_t block_size,
+		uint64_t outbuf_size_max, uint32_t *workers)
+{
+	*workers = options->threads;
+
+	size_t count = 0;
+	size_t rad = SIZE_MAX;
+	for ( ; (*filters)[count].id != LZMA_VLI_UNKNOWN; ++count) {
+		if (count == LZMA_FILTERS_MAX)
+			return LZMA_OPTIONS_ERROR;
+
+		if ((*filters)[count].id == LZMA_FILTER_LZMA2
+				&& (*filters)[count].options != NULL) {
+			const lzma_options_lzma *opt
+					= (*filters)[count].options;
+			if (opt->mf == LZMA_MF_RAD)
+				rad = count;
+		}
+	}
+
+	if (rad == SIZE_MAX)
+		return LZMA_OK;
+
+	if (*filters != opt_easy->filters) {
+		for (size_t i = 0; i <= count; ++i)
+			opt_easy->filters[i] = (*filters)[i];
+
+		opt_easy->opt_lzma = *(const lzma_options_lzma *)(
+				(*filters)[rad].options);
+		opt_easy->filters[rad].options = &opt_easy->opt_lzma;
+		*filters = opt_easy->filters;
+	}
+
+	lzma_options_lzma *opt = opt_easy->filters[rad].options;
+
+	if (mt_thread_pool(options) != NULL)
+		lzma_options_thread_pool_set(opt, mt_thread_pool(options));
+
+	uint32_t blocks = (options->threads + RADIX_BLOCK_THREADS - 1)
+			/ RADIX_BLOCK_THREADS;
+
+	// There is no point in having more Blocks in progress than
+	// the input will have.
+	if (options->uncompressed_size != 0) {
+		const uint64_t block_count
+				= (options->uncompressed_size - 1)
+					/ block_size + 1;
+		if (block_count < blocks)
+			blocks = (uint32_t)(block_count);
+	}
+
+	// Give up concurrent Blocks until the memory usage limit is met.
+	// Fewer Blocks leave more threads to the match finder which costs
+	// far less memory than a Block.
+	while (true) {
+		opt->threads = options->threads / blocks;
+
+		if (blocks == 1 || options->memlimit == 0)
+			break;
+
+		const uint64_t memusage = mt_memusage(options, *filters,
+				blocks, (options->flags & LZMA_STABLE_INPUT)
+					? 0 : block_size,
+				outbuf_size_max);
+		if (memusage == UINT64_MAX)
+			return LZMA_OPTIONS_ERROR;
+
+		if (memusage <= options->memlimit)
+			break;
+
+		--blocks;
+	}
+
+	*workers = blocks;
+	return LZMA_OK;
+}
+
+
 /// Options handling for lzma_stream_encoder_mt_init() and
 /// lzma_stream_encoder_mt_memusage()
 static lzma_ret
 get_options(const lzma_mt *options, lzma_options_easy *opt_easy,
 		const lzma_filter **filters, uint64_t *block_size,
-		uint64_t *outbuf_size_max)
+		uint64_t *outbuf_size_max, uint32_t *workers)
 {
 	// Validate some of the options.
 	if (options == NULL)
 		return LZMA_PROG_ERROR;
 
-	if (options->flags != 0 || options->threads == 0
+	if ((options->flags & ~(LZMA_STABLE_INPUT | LZMA_EARLY_OUTPUT
+				| LZMA_USE_THREAD_POOL
+				| LZMA_USE_BLOCK_FILTERS)) != 0
+			|| options->threads == 0
 			|| options->threads > LZMA_THREADS_MAX)
 		return LZMA_OPTIONS_ERROR;
 
@@ -908,7 +1717,19 @@ get_options(const lzma_mt *options, lzma_options_easy *opt_easy,
 	if (*outbuf_size_max == 0)
 		return LZMA_MEM_ERROR;
 
-	return LZMA_OK;
+	return split_threads(options, opt_easy, filters, *block_size,
+			*outbuf_size_max, workers);
+}
+
+
+extern lzma_ret
+lzma_mt_options_get(const lzma_mt *options, lzma_options_easy *easy,
+		const lzma_filter **filters, uint64_t *block_size,
+		uint32_t *workers)
+{
+	uint64_t outbuf_size_max;
+	return get_options(options, easy, filters, block_size,
+			&outbuf_size_max, workers);
 }
 
 
@@ -947,19 +1768,21 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	const lzma_filter *filters;
 	uint64_t block_size;
 	uint64_t outbuf_size_max;
+	uint32_t workers;
 	return_if_error(get_options(options, &easy, &filters,
-			&block_size, &outbuf_size_max));
+			&block_size, &outbuf_size_max, &workers));
 
 #if SIZE_MAX < UINT64_MAX
 	if (block_size > SIZE_MAX)
 		return LZMA_MEM_ERROR;
 #endif
 
-	// Validate the filter chain so that we can give an error in this
+	// Validate the filter chains so that we can give an error in this
 	// function instead of delaying it to the first call to lzma_code().
 	// The memory usage calculation verifies the filter chain as
 	// a side effect so we take advantage of that.
-	if (lzma_raw_encoder_memusage(filters) == UINT64_MAX)
+	if (mt_memusage(options, filters, workers, 0, outbuf_size_max)
+			== UINT64_MAX)
 		return LZMA_OPTIONS_ERROR;
 
 	// Validate the Check ID.
@@ -1001,23 +1824,39 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 // 		next->update = &stream_encoder_mt_update;
 
 		coder->filters[0].id = LZMA_VLI_UNKNOWN;
+		for (size_t c = 0; c < LZMA_BLOCK_CLASS_COUNT; ++c)
+			coder->block_filters[c][0].id = LZMA_VLI_UNKNOWN;
+
 		coder->index_encoder = LZMA_NEXT_CODER_INIT;
 		coder->index = NULL;
 		memzero(&coder->outq, sizeof(coder->outq));
 		coder->threads = NULL;
 		coder->threads_max = 0;
 		coder->threads_initialized = 0;
+		coder->block_size = 0;
+		coder->stable_input = false;
+		coder->early_output = false;
 	}
 
+	// The input buffers of the threads can be reused only if
+	// they are still needed and have the same size.
+	const bool stable_input = (options->flags & LZMA_STABLE_INPUT) != 0;
+	const bool inbufs_differ = coder->stable_input != stable_input
+			|| (!stable_input && coder->block_size != block_size);
+
 	// Basic initializations
 	coder->sequence = SEQ_STREAM_HEADER;
 	coder->block_size = (size_t)(block_size);
+	coder->stable_input = stable_input;
+	coder->early_output = (options->flags & LZMA_EARLY_OUTPUT) != 0;
 	coder->thread_error = LZMA_OK;
 	coder->thr = NULL;
+	coder->thread_pool = mt_thread_pool(options);
+	coder->rad_threads_extra = options->threads % workers;
 
 	// Allocate the thread-specific base structures.
-	assert(options->threads > 0);
-	if (coder->threads_max != options->threads) {
+	assert(workers > 0);
+	if (coder->threads_max != workers || inbufs_differ) {
 		threads_end(coder, allocator);
 
 		coder->threads = NULL;
@@ -1027,12 +1866,12 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 		coder->threads_free = NULL;
 
 		coder->threads = lzma_alloc(
-				options->threads * sizeof(worker_thread),
+				workers * sizeof(worker_thread),
 				allocator);
 		if (coder->threads == NULL)
 			return LZMA_MEM_ERROR;
 
-		coder->threads_max = options->threads;
+		coder->threads_max = workers;
 	} else {
 		// Reuse the old structures and threads. Tell the running
 		// threads to stop and wait until they have stopped.
@@ -1041,18 +1880,49 @@ stream_encoder_mt_init(lzma_next_coder *next, const lzma_allocator *allocator,
 
 	// Output queue
 	return_if_error(lzma_outq_init(&coder->outq, allocator,
-			outbuf_size_max, options->threads));
+			outbuf_size_max, workers));
 
 	// Timeout
 	coder->timeout = options->timeout;
 
-	// Free the old filter chain and copy the new one.
-	for (size_t i = 0; coder->filters[i].id != LZMA_VLI_UNKNOWN; ++i)
-		lzma_free(coder->filters[i].options, allocator);
+	// Free the old filter chains and copy the new ones.
+	filters_free(coder, allocator);
 
 	return_if_error(lzma_filters_copy(
 			filters, coder->filters, allocator));
 
+	const lzma_filter *const *block_filters = mt_block_filters(options);
+	coder->classify = block_filters != NULL;
+	if (coder->classify) {
+		for (size_t c = 0; c < LZMA_BLOCK_CLASS_COUNT; ++c) {
+			if (block_filters[c] == NULL)
+				continue;
+
+			lzma_filter *chain = coder->block_filters[c];
+			return_if_error(lzma_filters_copy(
+					block_filters[c],
+					chain, allocator));
+
+			// Give the radix match finder the same share of
+			// the threads as with the main chain. The remaining
+			// threads are added in worker_rad_threads().
+			for (size_t i = 0; chain[i].id != LZMA_VLI_UNKNOWN;
+					++i) {
+				if (chain[i].id != LZMA_FILTER_LZMA2)
+					continue;
+
+				lzma_options_lzma *opt = chain[i].options;
+				if (opt->mf != LZMA_MF_RAD)
+					continue;
+
+				opt->threads = options->threads / workers;
+				if (coder->thread_pool != NULL)
+					lzma_options_thread_pool_set(opt,
+							coder->thread_pool);
+			}
+		}
+	}
+
 	// Index
 	lzma_index_end(coder->index, allocator);
 	coder->index = lzma_index_init(allocator);
@@ -1100,44 +1970,13 @@ lzma_stream_encoder_mt_memusage(const lzma_mt *options)
 	const lzma_filter *filters;
 	uint64_t block_size;
 	uint64_t outbuf_size_max;
+	uint32_t workers;
 
 	if (get_options(options, &easy, &filters, &block_size,
-			&outbuf_size_max) != LZMA_OK)
-		return UINT64_MAX;
-
-	// Memory usage of the input buffers
-	const uint64_t inbuf_memusage = options->threads * block_size;
-
-	// Memory usage of the filter encoders
-	uint64_t filters_memusage = lzma_raw_encoder_memusage(filters);
-	if (filters_memusage == UINT64_MAX)
+			&outbuf_size_max, &workers) != LZMA_OK)
 		return UINT64_MAX;
 
-	filters_memusage *= options->threads;
-
-	// Memory usage of the output queue
-	const uint64_t outq_memusage = lzma_outq_memusage(
-			outbuf_size_max, options->threads);
-	if (outq_memusage == UINT64_MAX)
-		return UINT64_MAX;
-
-	// Sum them with overflow checking.
-	uint64_t total_memusage = LZMA_MEMUSAGE_BASE
-			+ sizeof(lzma_stream_coder)
-			+ options->threads * sizeof(worker_thread);
-
-	if (UINT64_MAX - total_memusage < inbuf_memusage)
-		return UINT64_MAX;
-
-	total_memusage += inbuf_memusage;
-
-	if (UINT64_MAX - total_memusage < filters_memusage)
-		return UINT64_MAX;
-
-	total_memusage += filters_memusage;
-
-	if (UINT64_MAX - total_memusage < outq_memusage)
-		return UINT64_MAX;
-
-	return total_memusage + outq_memusage;
+	return mt_memusage(options, filters, workers,
+			(options->flags & LZMA_STABLE_INPUT) ? 0 : block_size,
+			outbuf_size_max);
 }
@@ -0,0 +1,37 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       stream_encoder_mt.h
+/// \brief      Options handling shared by the multithreaded .xz encoders
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_STREAM_ENCODER_MT_H
+#define LZMA_STREAM_ENCODER_MT_H
+
+#include "common.h"
+#include "easy_preset.h"
+
+
+/// \brief      Validate multithreading options and resolve the encoder setup
+///
+/// Gets the filter chain from options->filters or options->preset, the
+/// Block size, and the number of Blocks to encode concurrently. With the
+/// radix match finder, the chain is copied into *easy and the thread
+/// count of the match finder is set in the copy.
+///
+/// \param      options     Options as given to lzma_stream_encoder_mt()
+/// \param      easy        Storage for the filter chain. *filters may
+///                         point into this, so it must be kept as long
+///                         as *filters is used.
+/// \param      filters     Set to point to the filter chain to use
+/// \param      block_size  Set to the uncompressed size of the Blocks
+/// \param      workers     Set to the number of Blocks to encode
+///                         concurrently
+extern lzma_ret lzma_mt_options_get(const lzma_mt *options,
+		lzma_options_easy *easy, const lzma_filter **filters,
+		uint64_t *block_size, uint32_t *workers);
+
+#endif
@@ -0,0 +1,310 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       thread_pool.c
+/// \brief      Threads shared between encoders
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "thread_pool.h"
+
+
+#ifdef MYTHREAD_ENABLED
+
+typedef enum {
+	/// Waiting in the pool to be taken into use.
+	POOL_IDLE,
+
+	/// Running the function of an lzma_thread.
+	POOL_RUN,
+
+	/// The pool is being freed.
+	POOL_EXIT,
+
+} pool_state;
+
+
+struct lzma_pool_thread_s {
+	/// State of the thread. Only the thread itself moves from
+	/// POOL_RUN to POOL_IDLE.
+	mythread_state state;
+
+	/// The function to run. This is set before the state is set
+	/// to POOL_RUN.
+	lzma_thread *job;
+
+	/// Memory kept for the next user of the thread. See
+	/// lzma_thread_scratch_get().
+	void *scratch;
+
+	/// Next structure in the stack of idle threads
+	lzma_pool_thread *next_free;
+
+	/// Next structure in the list of all threads of the pool
+	lzma_pool_thread *next;
+
+	lzma_thread_pool *pool;
+
+	mythread thread_id;
+};
+
+
+struct lzma_thread_pool_s {
+	/// The allocator used for the structures of the pool and
+	/// the scratch memory kept by the threads
+	const lzma_allocator *allocator;
+
+	/// Maximum number of threads the pool may create
+	uint32_t threads_max;
+
+	/// Number of threads created so far
+	uint32_t threads_created;
+
+	/// Stack of threads that aren't in use
+	lzma_pool_thread *threads_free;
+
+	/// All threads of the pool
+	lzma_pool_thread *threads;
+
+	/// Protects the members above
+	mythread_mutex mutex;
+};
+
+
+static MYTHREAD_RET_TYPE
+pool_thread_start(void *pthr_ptr)
+{
+	lzma_pool_thread *pthr = pthr_ptr;
+	uint32_t state = POOL_IDLE;
+
+	while (true) {
+		state = mythread_state_wait(&pthr->state, state);
+		if (state == POOL_EXIT)
+			break;
+
+		assert(state == POOL_RUN);
+		pthr->job->func(pthr->job->arg);
+
+		// The job must not be touched after this because
+		// lzma_thread_join() may return right away.
+		if (!mythread_state_cas(&pthr->state, POOL_RUN, POOL_IDLE))
+			break;
+
+		state = POOL_IDLE;
+	}
+
+	return MYTHREAD_RET_VALUE;
+}
+
+
+/// Create a new thread for the pool. This is called with pool->mutex
+/// locked.
+static lzma_pool_thread *
+pool_thread_create(lzma_thread_pool *pool)
+{
+	lzma_pool_thread *pthr = lzma_alloc(sizeof(lzma_pool_thread),
+			pool->allocator);
+	if (pthr == NULL)
+		return NULL;
+
+	pthr->job = NULL;
+	pthr->scratch = NULL;
+	pthr->pool = pool;
+
+	if (mythread_state_init(&pthr->state, POOL_IDLE))
+		goto error_state;
+
+	if (mythread_create(&pthr->thread_id, &pool_thread_start, pthr))
+		goto error_thread;
+
+	pthr->next = pool->threads;
+	pool->threads = pthr;
+	++pool->threads_created;
+
+	return pthr;
+
+error_thread:
+	mythread_state_destroy(&pthr->state);
+
+error_state:
+	lzma_free(pthr, pool->allocator);
+	return NULL;
+}
+
+
+static MYTHREAD_RET_TYPE
+thread_start(void *thread_ptr)
+{
+	lzma_thread *thread = thread_ptr;
+	thread->func(thread->arg);
+	return MYTHREAD_RET_VALUE;
+}
+
+
+extern int
+lzma_thread_create(lzma_thread *thread, lzma_thread_pool *pool,
+		bool own, void (*func)(void *arg), void *arg)
+{
+	thread->func = func;
+	thread->arg = arg;
+	thread->pooled = NULL;
+
+	lzma_pool_thread *pthr = NULL;
+
+	if (pool != NULL) {
+		mythread_sync(pool->mutex) {
+			if (pool->threads_free != NULL) {
+				pthr = pool->threads_free;
+				pool->threads_free = pthr->next_free;
+			} else if (pool->threads_created
+					< pool->threads_max) {
+				pthr = pool_thread_create(pool);
+			}
+		}
+
+		if (pthr == NULL && !own)
+			return -1;
+	}
+
+	if (pthr == NULL)
+		return mythread_create(&thread->thread_id, &thread_start,
+				thread);
+
+	thread->pooled = pthr;
+	pthr->job = thread;
+	mythread_state_set(&pthr->state, POOL_RUN);
+	return 0;
+}
+
+
+extern void
+lzma_thread_join(lzma_thread *thread)
+{
+	lzma_pool_thread *pthr = thread->pooled;
+
+	if (pthr == NULL) {
+		const int ret = mythread_join(thread->thread_id);
+		assert(ret == 0);
+		(void)ret;
+		return;
+	}
+
+	uint32_t state = mythread_state_get(&pthr->state);
+	while (state == POOL_RUN)
+		state = mythread_state_wait(&pthr->state, state);
+
+	assert(state == POOL_IDLE);
+	pthr->job = NULL;
+	thread->pooled = NULL;
+
+	lzma_thread_pool *pool = pthr->pool;
+	mythread_sync(pool->mutex) {
+		pthr->next_free = pool->threads_free;
+		pool->threads_free = pthr;
+	}
+
+	return;
+}
+
+
+extern void *
+lzma_thread_scratch_get(lzma_thread *thread, const lzma_allocator *allocator)
+{
+	lzma_pool_thread *pthr = thread->pooled;
+	if (pthr == NULL || pthr->pool->allocator != allocator)
+		return NULL;
+
+	void *ptr = pthr->scratch;
+	pthr->scratch = NULL;
+	return ptr;
+}
+
+
+extern void
+lzma_thread_scratch_put(lzma_thread *thread, void *ptr,
+		const lzma_allocator *allocator)
+{
+	lzma_pool_thread *pthr = thread->pooled;
+	if (pthr == NULL || pthr->pool->allocator != allocator) {
+		lzma_free(ptr, allocator);
+		return;
+	}
+
+	lzma_free(pthr->scratch, allocator);
+	pthr->scratch = ptr;
+	return;
+}
+
+
+extern LZMA_API(lzma_thread_pool *)
+lzma_thread_pool_create(uint32_t threads, const lzma_allocator *allocator)
+{
+	if (threads == 0)
+		return NULL;
+
+	lzma_thread_pool *pool = lzma_alloc(sizeof(lzma_thread_pool),
+			allocator);
+	if (pool == NULL)
+		return NULL;
+
+	if (mythread_mutex_init(&pool->mutex)) {
+		lzma_free(pool, allocator);
+		return NULL;
+	}
+
+	pool->allocator = allocator;
+	pool->threads_max = threads;
+	pool->threads_created = 0;
+	pool->threads_free = NULL;
+	pool->threads = NULL;
+
+	return pool;
+}
+
+
+extern LZMA_API(void)
+lzma_thread_pool_end(lzma_thread_pool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	const lzma_allocator *allocator = pool->allocator;
+	lzma_pool_thread *pthr = pool->threads;
+	while (pthr != NULL) {
+		lzma_pool_thread *next = pthr->next;
+
+		mythread_state_set(&pthr->state, POOL_EXIT);
+		const int ret = mythread_join(pthr->thread_id);
+		assert(ret == 0);
+		(void)ret;
+
+		mythread_state_destroy(&pthr->state);
+		lzma_free(pthr->scratch, allocator);
+		lzma_free(pthr, allocator);
+		pthr = next;
+	}
+
+	mythread_mutex_destroy(&pool->mutex);
+	lzma_free(pool, allocator);
+	return;
+}
+
+#else
+
+extern LZMA_API(lzma_thread_pool *)
+lzma_thread_pool_create(uint32_t threads lzma_attribute((__unused__)),
+		const lzma_allocator *allocator lzma_attribute((__unused__)))
+{
+	return NULL;
+}
+
+
+extern LZMA_API(void)
+lzma_thread_pool_end(lzma_thread_pool *pool lzma_attribute((__unused__)))
+{
+	return;
+}
+
+#endif
@@ -0,0 +1,108 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       thread_pool.h
+/// \brief      Threads of the encoders, optionally taken from a thread pool
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#ifndef LZMA_THREAD_POOL_H
+#define LZMA_THREAD_POOL_H
+
+#include "common.h"
+#include "mythread.h"
+
+
+/// Get the thread pool of LZMA options. It is NULL unless
+/// LZMA_MODE_THREAD_POOL has been set in the mode.
+static inline lzma_thread_pool *
+lzma_options_thread_pool(const lzma_options_lzma *options)
+{
+	return (options->mode & LZMA_MODE_THREAD_POOL) != 0
+			? options->thread_pool : NULL;
+}
+
+
+/// Make LZMA options use the thread pool.
+static inline void
+lzma_options_thread_pool_set(lzma_options_lzma *options,
+		lzma_thread_pool *pool)
+{
+	options->mode = (lzma_mode)(options->mode | LZMA_MODE_THREAD_POOL);
+	options->thread_pool = pool;
+}
+
+#ifdef MYTHREAD_ENABLED
+
+typedef struct lzma_pool_thread_s lzma_pool_thread;
+
+
+/// A thread that runs one function. The thread is either created for
+/// it or taken from an lzma_thread_pool.
+///
+/// The structure must stay at the same address until lzma_thread_join()
+/// has returned.
+typedef struct {
+	/// The function to run and its argument
+	void (*func)(void *arg);
+	void *arg;
+
+	/// Thread of the pool that runs the function, or NULL if the
+	/// thread was created for this structure.
+	lzma_pool_thread *pooled;
+
+	/// The ID of the thread when it isn't from a pool
+	mythread thread_id;
+
+} lzma_thread;
+
+
+/// \brief      Start running a function in another thread
+///
+/// \param      thread      Structure to hold the thread
+/// \param      pool        Pool to take the thread from or NULL to
+///                         create a thread of its own
+/// \param      own         If the pool already has as many threads as
+///                         it may have and all of them are in use, create
+///                         a thread outside the pool if this is true.
+///                         Otherwise fail.
+/// \param      func        Function to run
+/// \param      arg         Argument for func
+///
+/// \return     Zero on success and non-zero if no thread could be
+///             started.
+extern int lzma_thread_create(lzma_thread *thread, lzma_thread_pool *pool,
+		bool own, void (*func)(void *arg), void *arg);
+
+
+/// \brief      Wait for the function to return
+///
+/// A thread from a pool is given back to the pool.
+extern void lzma_thread_join(lzma_thread *thread);
+
+
+/// \brief      Take the scratch memory kept by a thread of a pool
+///
+/// A thread of a pool keeps one block of memory from the previous
+/// stream that used it so that the next stream doesn't need to allocate
+/// it again. Only the builder of the radix match finder is kept this way.
+/// Memory is only passed between streams that use the same allocator
+/// as the pool.
+///
+/// \return     The memory or NULL if the thread doesn't have any
+extern void *lzma_thread_scratch_get(lzma_thread *thread,
+		const lzma_allocator *allocator);
+
+
+/// \brief      Give scratch memory to a thread of a pool
+///
+/// This must be done before lzma_thread_join(). If the thread isn't
+/// from a pool or the pool uses another allocator, ptr is freed.
+extern void lzma_thread_scratch_put(lzma_thread *thread, void *ptr,
+		const lzma_allocator *allocator);
+
+#endif
+
+#endif
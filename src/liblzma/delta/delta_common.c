@@ -50,8 +50,7 @@ lzma_delta_coder_init(lzma_next_coder *next, const lzma_allocator *allocator,
 	const lzma_options_delta *opt = filters[0].options;
 	coder->distance = opt->dist;
 
-	// Initialize the rest of the variables.
-	coder->pos = 0;
+	// Initialize the history.
 	memzero(coder->history, LZMA_DELTA_DIST_MAX);
 
 	// Initialize the next decoder in the chain, if any.
@@ -14,15 +14,116 @@
 #include "delta_private.h"
 
 
+#ifdef LZMA_HAVE_SSE2
+/// Decodes 16 bytes at a time when the distance is 1, 2, 4, or 8.
+/// Each vector is summed in log2(16 / distance) steps, and the last
+/// distance bytes of the previous vector are added to every lane.
+/// buffer[i - 16] must be valid and decoded.
+///
+/// \return     The position where decoding has to continue
+static inline size_t
+decode_scan(uint8_t *buffer, size_t i, size_t size, size_t distance)
+{
+	__m128i prev = _mm_loadu_si128((const __m128i *)(buffer + i - 16));
+
+	for (; size - i >= 16; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(buffer + i));
+
+		if (distance <= 1)
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+
+		if (distance <= 2)
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+
+		if (distance <= 4)
+			x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+
+		x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+
+		// Repeat the last distance bytes of prev.
+		if (distance == 8) {
+			prev = _mm_unpackhi_epi64(prev, prev);
+		} else if (distance == 4) {
+			prev = _mm_shuffle_epi32(prev, 0xFF);
+		} else {
+			if (distance == 1)
+				prev = _mm_unpackhi_epi8(prev, prev);
+
+			prev = _mm_shufflehi_epi16(prev, 0xFF);
+			prev = _mm_shuffle_epi32(prev, 0xFF);
+		}
+
+		prev = _mm_add_epi8(x, prev);
+		_mm_storeu_si128((__m128i *)(buffer + i), prev);
+	}
+
+	return i;
+}
+#endif
+
+
 static void
 decode_buffer(lzma_delta_coder *coder, uint8_t *buffer, size_t size)
 {
 	const size_t distance = coder->distance;
 
-	for (size_t i = 0; i < size; ++i) {
-		buffer[i] += coder->history[(distance + coder->pos) & 0xFF];
-		coder->history[coder->pos-- & 0xFF] = buffer[i];
+	size_t i = 0;
+	for (; i < size && i < distance; ++i)
+		buffer[i] += coder->history[i];
+
+#ifdef LZMA_HAVE_SSE2
+	if (distance >= 16) {
+		// The bytes that are added have been decoded already.
+		for (; size - i >= 16; i += 16) {
+			const __m128i cur = _mm_loadu_si128(
+					(const __m128i *)(buffer + i));
+			const __m128i prev = _mm_loadu_si128(
+					(const __m128i *)(buffer + i - distance));
+			_mm_storeu_si128((__m128i *)(buffer + i),
+					_mm_add_epi8(cur, prev));
+		}
+
+	} else if (distance > 8) {
+		for (; size - i >= 8; i += 8) {
+			const __m128i cur = _mm_loadl_epi64(
+					(const __m128i *)(buffer + i));
+			const __m128i prev = _mm_loadl_epi64(
+					(const __m128i *)(buffer + i - distance));
+			_mm_storel_epi64((__m128i *)(buffer + i),
+					_mm_add_epi8(cur, prev));
+		}
+
+	} else if ((distance & (distance - 1)) == 0 && size >= 16) {
+		for (; i < 16; ++i)
+			buffer[i] += buffer[i - distance];
+
+		// The distance is a constant in each call so that
+		// the branches in decode_scan() go away.
+		switch (distance) {
+		case 1:
+			i = decode_scan(buffer, i, size, 1);
+			break;
+
+		case 2:
+			i = decode_scan(buffer, i, size, 2);
+			break;
+
+		case 4:
+			i = decode_scan(buffer, i, size, 4);
+			break;
+
+		default:
+			i = decode_scan(buffer, i, size, 8);
+			break;
+		}
 	}
+#endif
+
+	for (; i < size; ++i)
+		buffer[i] += buffer[i - distance];
+
+	delta_history_update(coder, buffer, size);
+	return;
 }
 
 
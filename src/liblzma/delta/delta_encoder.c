@@ -14,6 +14,45 @@
 #include "delta_private.h"
 
 
+/// Encodes size bytes from in[] to out[], which may be the same buffer.
+/// The history isn't updated.
+static void
+encode_buffer(const lzma_delta_coder *coder,
+		const uint8_t *in, uint8_t *out, size_t size)
+{
+	const size_t distance = coder->distance;
+
+	// Go from the end to the beginning so that the bytes that are
+	// subtracted haven't been overwritten yet when encoding in place.
+	// A vector of in[] is read before the same vector of out[] is
+	// written so any distance works.
+	size_t i = size;
+
+#ifdef LZMA_HAVE_SSE2
+	while (i >= distance + 16) {
+		i -= 16;
+		const __m128i cur = _mm_loadu_si128((const __m128i *)(in + i));
+		const __m128i prev = _mm_loadu_si128(
+				(const __m128i *)(in + i - distance));
+		_mm_storeu_si128((__m128i *)(out + i),
+				_mm_sub_epi8(cur, prev));
+	}
+#endif
+
+	while (i > distance) {
+		--i;
+		out[i] = in[i] - in[i - distance];
+	}
+
+	while (i > 0) {
+		--i;
+		out[i] = in[i] - coder->history[i];
+	}
+
+	return;
+}
+
+
 /// Copies and encodes the data at the same time. This is used when Delta
 /// is the first filter in the chain (and thus the last filter in the
 /// encoder's filter stack).
@@ -21,14 +60,8 @@ static void
 copy_and_encode(lzma_delta_coder *coder,
 		const uint8_t *restrict in, uint8_t *restrict out, size_t size)
 {
-	const size_t distance = coder->distance;
-
-	for (size_t i = 0; i < size; ++i) {
-		const uint8_t tmp = coder->history[
-				(distance + coder->pos) & 0xFF];
-		coder->history[coder->pos-- & 0xFF] = in[i];
-		out[i] = in[i] - tmp;
-	}
+	encode_buffer(coder, in, out, size);
+	delta_history_update(coder, in, size);
 }
 
 
@@ -37,14 +70,13 @@ copy_and_encode(lzma_delta_coder *coder,
 static void
 encode_in_place(lzma_delta_coder *coder, uint8_t *buffer, size_t size)
 {
-	const size_t distance = coder->distance;
+	// The end of the original data is needed for the history.
+	uint8_t tail[LZMA_DELTA_DIST_MAX];
+	const size_t tail_size = my_min(size, coder->distance);
+	memcpy(tail, buffer + size - tail_size, tail_size);
 
-	for (size_t i = 0; i < size; ++i) {
-		const uint8_t tmp = coder->history[
-				(distance + coder->pos) & 0xFF];
-		coder->history[coder->pos-- & 0xFF] = buffer[i];
-		buffer[i] -= tmp;
-	}
+	encode_buffer(coder, buffer, buffer, size);
+	delta_history_update(coder, tail, tail_size);
 }
 
 
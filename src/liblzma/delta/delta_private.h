@@ -14,6 +14,7 @@
 #define LZMA_DELTA_PRIVATE_H
 
 #include "delta_common.h"
+#include "cpu_features.h"
 
 typedef struct {
 	/// Next coder in the chain
@@ -22,10 +23,9 @@ typedef struct {
 	/// Delta distance
 	size_t distance;
 
-	/// Position in history[]
-	uint8_t pos;
-
-	/// Buffer to hold history of the original data
+	/// The last distance bytes of the original data. The oldest byte
+	/// is first so that history[i] is distance bytes before the byte
+	/// at index i of the next buffer.
 	uint8_t history[LZMA_DELTA_DIST_MAX];
 } lzma_delta_coder;
 
@@ -34,4 +34,28 @@ extern lzma_ret lzma_delta_coder_init(
 		lzma_next_coder *next, const lzma_allocator *allocator,
 		const lzma_filter_info *filters);
 
+
+/// Add the last size bytes of the original data to the history.
+static inline void
+delta_history_update(lzma_delta_coder *coder, const uint8_t *buf,
+		size_t size)
+{
+	// buf can be NULL when size is zero and memcpy() with
+	// a null-pointer is undefined even if the size is zero.
+	if (size == 0)
+		return;
+
+	const size_t distance = coder->distance;
+
+	if (size >= distance) {
+		memcpy(coder->history, buf + size - distance, distance);
+	} else {
+		memmove(coder->history, coder->history + size,
+				distance - size);
+		memcpy(coder->history + distance - size, buf, size);
+	}
+
+	return;
+}
+
 #endif
@@ -66,7 +66,8 @@ static lzma_ret
 decode_buffer(lzma_coder *coder,
 		const uint8_t *restrict in, size_t *restrict in_pos,
 		size_t in_size, uint8_t *restrict out,
-		size_t *restrict out_pos, size_t out_size)
+		size_t *restrict out_pos, size_t out_size,
+		lzma_action action)
 {
 	while (true) {
 		// Wrap the dictionary if needed.
@@ -88,7 +89,7 @@ decode_buffer(lzma_coder *coder,
 		// Call the coder->lz.code() to do the actual decoding.
 		const lzma_ret ret = coder->lz.code(
 				coder->lz.coder, &coder->dict,
-				in, in_pos, in_size);
+				in, in_pos, in_size, action);
 
 		// Copy the decoded data from the dictionary to the out[]
 		// buffer. Do it conditionally because out can be NULL
@@ -141,7 +142,7 @@ lz_decode(void *coder_ptr, const lzma_allocator *allocator,
 
 	if (coder->next.code == NULL)
 		return decode_buffer(coder, in, in_pos, in_size,
-				out, out_pos, out_size);
+				out, out_pos, out_size, action);
 
 	// We aren't the last coder in the chain, we need to decode
 	// our input to a temporary buffer.
@@ -176,7 +177,8 @@ lz_decode(void *coder_ptr, const lzma_allocator *allocator,
 
 		const lzma_ret ret = decode_buffer(coder, coder->temp.buffer,
 				&coder->temp.pos, coder->temp.size,
-				out, out_pos, out_size);
+				out, out_pos, out_size,
+				coder->next_finished ? LZMA_FINISH : LZMA_RUN);
 
 		if (ret == LZMA_STREAM_END)
 			coder->this_finished = true;
@@ -55,10 +55,14 @@ typedef struct {
 	/// Data specific to the LZ-based decoder
 	void *coder;
 
-	/// Function to decode from in[] to *dict
+	/// Function to decode from in[] to *dict. With LZMA_RUN the decoder
+	/// may keep a few bytes of input internally if in[] may continue in
+	/// the next call. LZMA_FINISH requires that all input that can be
+	/// decoded to *dict is decoded.
 	lzma_ret (*code)(void *coder,
 			lzma_dict *restrict dict, const uint8_t *restrict in,
-			size_t *restrict in_pos, size_t in_size);
+			size_t *restrict in_pos, size_t in_size,
+			lzma_action action);
 
 	void (*reset)(void *coder, const void *options);
 
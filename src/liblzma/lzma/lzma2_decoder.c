@@ -56,7 +56,7 @@ typedef struct {
 static lzma_ret
 lzma2_decode(void *coder_ptr, lzma_dict *restrict dict,
 		const uint8_t *restrict in, size_t *restrict in_pos,
-		size_t in_size)
+		size_t in_size, lzma_action action)
 {
 	lzma_lzma2_coder *restrict coder = coder_ptr;
 
@@ -166,17 +166,30 @@ lzma2_decode(void *coder_ptr, lzma_dict *restrict dict,
 		// coder->compressed_size later.
 		const size_t in_start = *in_pos;
 
-		// Decode from in[] to *dict.
+		// Decode from in[] to *dict. The LZMA decoder may hold back
+		// the end of its input if more will follow, so it must not
+		// be given the bytes after the end of the chunk. If the rest
+		// of the chunk is available, nothing may be held back.
+		size_t in_limit = in_size;
+		if (in_size - in_start >= coder->compressed_size) {
+			in_limit = in_start + coder->compressed_size;
+			action = LZMA_FINISH;
+		}
+
 		const lzma_ret ret = coder->lzma.code(coder->lzma.coder,
-				dict, in, in_pos, in_size);
+				dict, in, in_pos, in_limit, action);
 
-		// Validate and update coder->compressed_size.
 		const size_t in_used = *in_pos - in_start;
-		if (in_used > coder->compressed_size)
-			return LZMA_DATA_ERROR;
-
+		assert(in_used <= coder->compressed_size);
 		coder->compressed_size -= in_used;
 
+		// If the whole chunk has been consumed and the LZMA decoder
+		// still has room in the dictionary, it needs more input
+		// than the chunk has.
+		if (ret == LZMA_OK && coder->compressed_size == 0
+				&& dict->pos < dict->limit)
+			return LZMA_DATA_ERROR;
+
 		// Return if we didn't finish the chunk, or an error occurred.
 		if (ret != LZMA_STREAM_END)
 			return ret;
@@ -16,6 +16,7 @@
 #include "lzma2_encoder_rmf.h"
 #include "tuklib_cpucores.h"
 #include "mythread.h"
+#include "thread_pool.h"
 #include "memcmplen.h"
 
 #define LZMA2_TIMEOUT 300
@@ -41,10 +42,12 @@ typedef struct lzma2_fast_coder_s lzma2_fast_coder;
 
 typedef struct {
 #ifdef MYTHREAD_ENABLED
-	mythread thread_id;
-	mythread_mutex mutex;
-	mythread_cond cond;
-	worker_state state;
+	lzma_thread thread;
+	mythread_state state;
+
+	/// False if the thread pool had no thread for this structure.
+	/// The work is then done in the calling thread.
+	bool threaded;
 #endif
 	lzma2_fast_coder *coder;
 	rmf_builder *builder;
@@ -183,93 +186,100 @@ static void set_weights(lzma2_fast_coder *coder)
 #ifdef MYTHREAD_ENABLED
 
 
-static MYTHREAD_RET_TYPE
+static void
+worker_run(worker_thread *thr, worker_state state)
+{
+	lzma2_fast_coder *coder = thr->coder;
+	if (state == THR_BUILD) {
+		lzma_data_block block = { coder->dict_block.data,
+			coder->dict_block.start,
+			coder->dict_block.end };
+		rmf_build_table(coder->match_table, thr->builder, thr != coder->threads, block);
+	}
+	else {
+		assert(state == THR_ENC);
+		thr->out_size = lzma2_rmf_encode(&thr->enc, coder->match_table, thr->block, &coder->opt_cur,
+			&coder->progress_in, &coder->progress_out, &coder->canceled);
+	}
+}
+
+
+static void
 worker_start(void *thr_ptr)
 {
 	worker_thread *thr = thr_ptr;
-	worker_state state = THR_IDLE; // Init to silence a warning
 
 	while (true) {
 		// Wait for work.
-		mythread_mutex_lock(&thr->mutex);
-		while (true) {
-			state = thr->state;
-			if (state != THR_IDLE)
-				break;
-			mythread_cond_wait(&thr->cond, &thr->mutex);
-		}
-		mythread_mutex_unlock(&thr->mutex);
+		const worker_state state = mythread_state_wait(
+				&thr->state, THR_IDLE);
 
 		assert(state != THR_IDLE);
 
 		if (state == THR_EXIT)
 			break;
 
-		lzma2_fast_coder *coder = thr->coder;
-		if (state == THR_BUILD) {
-			lzma_data_block block = { coder->dict_block.data,
-				coder->dict_block.start,
-				coder->dict_block.end };
-			rmf_build_table(coder->match_table, thr->builder, thr != coder->threads, block);
-		}
-		else {
-			assert(state == THR_ENC);
-			thr->out_size = lzma2_rmf_encode(&thr->enc, coder->match_table, thr->block, &coder->opt_cur,
-				&coder->progress_in, &coder->progress_out, &coder->canceled);
-		}
+		worker_run(thr, state);
 
 		// Mark the thread as idle unless the main thread has
-		// told us to exit. Signal is needed for the case
-		// where the main thread is waiting for the threads to stop.
-		mythread_mutex_lock(&thr->mutex);
-		if (thr->state != THR_EXIT) {
-			thr->state = THR_IDLE;
-			mythread_cond_signal(&thr->cond);
-		}
-		mythread_mutex_unlock(&thr->mutex);
+		// told us to exit. This wakes up the main thread if it
+		// is waiting for the threads to stop.
+		mythread_state_cas(&thr->state, state, THR_IDLE);
 	}
-
-	// Exiting, free the resources.
-	mythread_mutex_destroy(&thr->mutex);
-	mythread_cond_destroy(&thr->cond);
-
-	return MYTHREAD_RET_VALUE;
 }
 
 
 static lzma_ret
-thread_initialize(lzma2_fast_coder *coder, size_t i)
+thread_initialize(lzma2_fast_coder *coder, size_t i,
+		const lzma_allocator *allocator)
 {
-	coder->threads[i].coder = coder;
-	coder->threads[i].builder = NULL;
-	coder->threads[i].state = THR_IDLE;
-	lzma2_rmf_enc_construct(&coder->threads[i].enc);
+	worker_thread *thr = coder->threads + i;
+	thr->coder = coder;
+	thr->builder = NULL;
+	thr->threaded = true;
+	lzma2_rmf_enc_construct(&thr->enc);
 
-	if(mythread_mutex_init(&coder->threads[i].mutex))
+	if (mythread_state_init(&thr->state, THR_IDLE))
 		return LZMA_MEM_ERROR;
-	if(mythread_cond_init(&coder->threads[i].cond))
-		goto error_cond;
-	if (mythread_create(&coder->threads[i].thread_id,
-			&worker_start, coder->threads + i) == 0)
+
+	if (lzma_thread_create(&thr->thread, coder->opt_cur.thread_pool,
+			false, &worker_start, thr) == 0) {
+		// A thread from a pool may have the builder of
+		// an earlier stream.
+		thr->builder = lzma_thread_scratch_get(&thr->thread,
+				allocator);
+		return LZMA_OK;
+	}
+
+	if (coder->opt_cur.thread_pool != NULL) {
+		thr->threaded = false;
 		return LZMA_OK;
+	}
 
-	mythread_cond_destroy(&coder->threads[i].cond);
-error_cond:
-	mythread_mutex_destroy(&coder->threads[i].mutex);
+	mythread_state_destroy(&thr->state);
 	return LZMA_MEM_ERROR;
 }
 
 
 static void
-thread_free(lzma2_fast_coder *coder, size_t i)
+thread_free(lzma2_fast_coder *coder, size_t i,
+		const lzma_allocator *allocator)
 {
-	mythread_mutex_lock(&coder->threads[i].mutex);
-	coder->threads[i].state = THR_EXIT;
-	mythread_cond_signal(&coder->threads[i].cond);
-	mythread_mutex_unlock(&coder->threads[i].mutex);
-	int ret = mythread_join(coder->threads[i].thread_id);
-	assert(ret == 0);
-	(void)ret;
+	worker_thread *thr = coder->threads + i;
+
+	if (thr->threaded) {
+		// Leave the builder to the thread for the next stream.
+		lzma_thread_scratch_put(&thr->thread, thr->builder,
+				allocator);
+		thr->builder = NULL;
+
+		mythread_state_set(&thr->state, THR_EXIT);
+		lzma_thread_join(&thr->thread);
+	}
+
+	lzma_free(thr->builder, allocator);
+	thr->builder = NULL;
+	mythread_state_destroy(&thr->state);
 }
 
 
@@ -298,20 +308,28 @@ enc_thread_count(lzma2_fast_coder *coder)
 static inline void
 builder_run(lzma2_fast_coder *coder, size_t i)
 {
-	mythread_mutex_lock(&coder->threads[i].mutex);
-	coder->threads[i].state = THR_BUILD;
-	mythread_cond_signal(&coder->threads[i].cond);
-	mythread_mutex_unlock(&coder->threads[i].mutex);
+	if (coder->threads[i].threaded)
+		mythread_state_set(&coder->threads[i].state, THR_BUILD);
 }
 
 
 static inline void
 encoder_run(lzma2_fast_coder *coder, size_t i)
 {
-	mythread_mutex_lock(&coder->threads[i].mutex);
-	coder->threads[i].state = THR_ENC;
-	mythread_cond_signal(&coder->threads[i].cond);
-	mythread_mutex_unlock(&coder->threads[i].mutex);
+	if (coder->threads[i].threaded)
+		mythread_state_set(&coder->threads[i].state, THR_ENC);
+}
+
+
+/// Do the work of the first count structures that have no thread
+/// in the calling thread. This is done after the threads have been
+/// started so that they run concurrently.
+static void
+threads_run_inline(lzma2_fast_coder *coder, worker_state state, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+		if (!coder->threads[i].threaded)
+			worker_run(coder->threads + i, state);
 }
 
 
@@ -320,11 +338,10 @@ threads_wait(lzma2_fast_coder *coder)
 {
 	// Wait for the threads to settle in the idle state.
 	for (uint32_t i = 0; i < coder->thread_count; ++i) {
-		mythread_mutex_lock(&coder->threads[i].mutex);
-		while (coder->threads[i].state != THR_IDLE)
-			mythread_cond_wait(&coder->threads[i].cond,
-					&coder->threads[i].mutex);
-		mythread_mutex_unlock(&coder->threads[i].mutex);
+		uint32_t state = mythread_state_get(&coder->threads[i].state);
+		while (state != THR_IDLE)
+			state = mythread_state_wait(
+					&coder->threads[i].state, state);
 	}
 }
 
@@ -333,22 +350,14 @@ static lzma_ret
 threads_timed_wait(lzma2_fast_coder *coder)
 {
 	// Wait for the threads to settle in the idle state.
+	// A busy thread can only become idle so if the state didn't
+	// change, the wait timed out.
 	for (uint32_t i = 0; i < coder->thread_count; ++i) {
-		mythread_mutex_lock(&coder->threads[i].mutex);
-		bool timed_out = false;
-		if (coder->threads[i].state != THR_IDLE) {
-			mythread_condtime wait_abs;
-			mythread_condtime_set(&wait_abs, &coder->threads[i].cond, LZMA2_TIMEOUT);
-#ifdef MYTHREAD_WIN95
-			// Prevent possible deadlock due to non-atomic unlock-wait-lock in mythread_cond_wait()
-			mythread_cond_signal(&coder->threads[i].cond);
-#endif
-			while (coder->threads[i].state != THR_IDLE && !timed_out)
-				timed_out = mythread_cond_timedwait(&coder->threads[i].cond,
-					&coder->threads[i].mutex, &wait_abs) != 0;
-		}
-		mythread_mutex_unlock(&coder->threads[i].mutex);
-		if(timed_out)
+		const uint32_t state = mythread_state_get(
+				&coder->threads[i].state);
+		if (state != THR_IDLE && mythread_state_timedwait(
+				&coder->threads[i].state, state,
+				LZMA2_TIMEOUT) != THR_IDLE)
 			return LZMA_TIMED_OUT;
 	}
 	return LZMA_OK;
@@ -358,14 +367,10 @@ threads_timed_wait(lzma2_fast_coder *coder)
 static bool
 working(lzma2_fast_coder *coder)
 {
-	for (size_t i = 0; i < coder->thread_count; ++i) {
-		size_t state;
-		mythread_mutex_lock(&coder->threads[i].mutex);
-		state = coder->threads[i].state;
-		mythread_mutex_unlock(&coder->threads[i].mutex);
-		if (state != THR_IDLE)
+	for (size_t i = 0; i < coder->thread_count; ++i)
+		if (mythread_state_get(&coder->threads[i].state) != THR_IDLE)
 			return true;
-	}
+
 	return false;
 }
 
@@ -379,7 +384,8 @@ working(lzma2_fast_coder *coder)
 
 static inline lzma_ret
 thread_initialize(lzma2_fast_coder *coder lzma_attribute((__unused__)),
-		size_t i lzma_attribute((__unused__)))
+		size_t i lzma_attribute((__unused__)),
+		const lzma_allocator *allocator lzma_attribute((__unused__)))
 {
 	assert(i == 0);
 	coder->threads[i].coder = coder;
@@ -390,9 +396,11 @@ thread_initialize(lzma2_fast_coder *coder lzma_attribute((__unused__)),
 
 
 static void
-thread_free(lzma2_fast_coder *coder lzma_attribute((__unused__)),
-		size_t i lzma_attribute((__unused__)))
+thread_free(lzma2_fast_coder *coder, size_t i,
+		const lzma_allocator *allocator)
 {
+	lzma_free(coder->threads[i].builder, allocator);
+	coder->threads[i].builder = NULL;
 }
 
 
@@ -430,6 +438,14 @@ encoder_run(lzma2_fast_coder *coder, size_t i)
 }
 
 
+static inline void
+threads_run_inline(lzma2_fast_coder *coder lzma_attribute((__unused__)),
+		worker_state state lzma_attribute((__unused__)),
+		size_t count lzma_attribute((__unused__)))
+{
+}
+
+
 static void
 threads_wait(lzma2_fast_coder *coder lzma_attribute((__unused__)))
 {
@@ -464,12 +480,15 @@ threads_run_sequence(lzma2_fast_coder *coder)
 		size_t rmf_threads = rmf_thread_count(coder);
 		for (size_t i = 0; i < rmf_threads; ++i)
 			builder_run(coder, i);
+		threads_run_inline(coder, THR_BUILD, rmf_threads);
 		coder->sequence = CODER_ENC;
 		return_if_error(threads_timed_wait(coder));
 	}
 	if (coder->sequence == CODER_ENC) {
-		for (size_t i = 0; i < coder->thread_count && coder->threads[i].block.end != 0; ++i)
-			encoder_run(coder, i);
+		size_t enc_threads = 0;
+		for (; enc_threads < coder->thread_count && coder->threads[enc_threads].block.end != 0; ++enc_threads)
+			encoder_run(coder, enc_threads);
+		threads_run_inline(coder, THR_ENC, enc_threads);
 		coder->sequence = CODER_WRITE;
 		return_if_error(threads_timed_wait(coder));
 	}
@@ -778,8 +797,7 @@ free_threads(lzma2_fast_coder *coder, const lzma_allocator *allocator)
 {
 	threads_stop(coder);
 	for (size_t i = 0; i < coder->thread_count; ++i) {
-		thread_free(coder, i);
-		lzma_free(coder->threads[i].builder, allocator);
+		thread_free(coder, i, allocator);
 		lzma2_rmf_enc_free(&coder->threads[i].enc);
 	}
 	coder->thread_count = 0;
@@ -820,7 +838,8 @@ create_threads(lzma2_fast_coder *coder, const lzma_allocator *allocator)
 			return LZMA_MEM_ERROR;
 
 		for (coder->thread_count = 0; coder->thread_count < thread_count; ++coder->thread_count)
-			return_if_error(thread_initialize(coder, coder->thread_count));
+			return_if_error(thread_initialize(coder,
+					coder->thread_count, allocator));
 	}
 	coder->out_thread = coder->thread_count;
 	return LZMA_OK;
@@ -910,9 +929,9 @@ is_options_valid(const lzma_options_lzma *options)
 	return is_lclppb_valid(options)
 		&& options->nice_len >= MATCH_LEN_MIN
 		&& options->nice_len <= MATCH_LEN_MAX
-		&& (options->mode == LZMA_MODE_FAST
-			|| options->mode == LZMA_MODE_NORMAL
-			|| options->mode == LZMA_MODE_ULTRA)
+		&& (lzma_options_mode(options) == LZMA_MODE_FAST
+			|| lzma_options_mode(options) == LZMA_MODE_NORMAL
+			|| lzma_options_mode(options) == LZMA_MODE_ULTRA)
 		&& options->near_depth > 0
 		&& options->near_depth <= MATCH_CYCLES_MAX
 		&& options->near_dict_size_log >= NEAR_DICT_LOG_MIN
@@ -957,7 +976,11 @@ lzma_flzma2_encoder_init(lzma_next_coder *next,
 		return LZMA_PROG_ERROR;
 	}
 
+	// The mode of opt_cur has no flags and the thread pool is
+	// non-NULL only if it is to be used.
 	coder->opt_cur = *options;
+	coder->opt_cur.mode = lzma_options_mode(options);
+	coder->opt_cur.thread_pool = lzma_options_thread_pool(options);
 	if (options->depth == 0)
 		coder->opt_cur.depth = 42 + (options->dict_size >> 25) * 4U;
 	// Radix match-finder only searches to an even-numbered depth.
@@ -981,5 +1004,6 @@ lzma_flzma2_encoder_memusage(const void *options)
 {
 	const lzma_options_lzma *const opt = options;
 	return opt->dict_size + rmf_memory_usage(opt->dict_size, opt->threads)
-		+ lzma2_enc_rmf_mem_usage(opt->near_dict_size_log, opt->mode, opt->threads);
+		+ lzma2_enc_rmf_mem_usage(opt->near_dict_size_log,
+			lzma_options_mode(opt), opt->threads);
 }
@@ -17,6 +17,10 @@
 #include "lzma_decoder.h"
 #include "range_decoder.h"
 
+#ifdef LZMA_ASM_OPT_64
+#	include "cpu_features.h"
+#endif
+
 // The macros unroll loops with switch statements.
 // Silence warnings about missing fall-through comments.
 #if TUKLIB_GNUC_REQ(7, 0)
@@ -161,6 +165,19 @@ case seq ## _CHOICE2: \
 
 #define STATES2 16
 
+/// Decoding one symbol may read at most this many bytes of input. The
+/// assembler decoder is never given less than this as input.
+#define LZMA_REQUIRED_INPUT_MAX 20
+
+#ifdef LZMA_ASM_OPT_64
+
+/// Size of the buffer used to stitch the end of one input buffer to the
+/// beginning of the next one so that the assembler decoder can continue
+/// over the boundary.
+#define LZMA_STITCH_SIZE (LZMA_REQUIRED_INPUT_MAX * 4)
+
+#endif
+
 /// Length decoder probabilities; see comments in lzma_common.h.
 typedef struct {
 	probability low[POS_STATES_MAX][LEN_LOW_SYMBOLS * 2];
@@ -284,6 +301,26 @@ typedef struct {
 	/// Uncompressed size as bytes, or LZMA_VLI_UNKNOWN if end of
 	/// payload marker is expected.
 	lzma_vli uncompressed_size;
+
+#ifdef LZMA_ASM_OPT_64
+	/////////////////////////////
+	// Assembler decoder state //
+	/////////////////////////////
+
+	// The assembler code accesses only the members above this.
+
+	/// The assembler decoder variant selected for this CPU
+	int (*decode_asm)(void *coder_ptr, lzma_dict *dictptr,
+			const uint8_t *in, size_t *in_pos, size_t in_size);
+
+	/// Number of bytes in stitch[]
+	size_t stitch_size;
+
+	/// Input that was held back at the end of the previous call.
+	/// It gets decoded together with the beginning of the next
+	/// input buffer.
+	uint8_t stitch[LZMA_STITCH_SIZE];
+#endif
 } lzma_lzma1_decoder;
 
 
@@ -293,20 +330,25 @@ typedef struct {
 // External assembler decoder //
 ////////////////////////////////
 
-#define LZMA_REQUIRED_INPUT_MAX 20
-
-
 extern int
 lzma_decode_asm_5(void *coder_ptr, lzma_dict *dictptr,
 	const uint8_t *in,
 	size_t *in_pos, size_t in_size);
 
+#ifdef LZMA_HAVE_CPUID
+/// Same as lzma_decode_asm_5() but uses BMI2 instructions.
+extern int
+lzma_decode_asm_5_bmi2(void *coder_ptr, lzma_dict *dictptr,
+	const uint8_t *in,
+	size_t *in_pos, size_t in_size);
+#endif
+
 
 static bool lzma_decode_opt(lzma_lzma1_decoder *coder, lzma_dict *dictptr,
 	const uint8_t *in,
 	size_t *in_pos, size_t in_size)
 {
-	int res = lzma_decode_asm_5(coder, dictptr, in, in_pos, in_size - LZMA_REQUIRED_INPUT_MAX);
+	int res = coder->decode_asm(coder, dictptr, in, in_pos, in_size - LZMA_REQUIRED_INPUT_MAX);
 	if (res > 0)
 		return true;
 	else if (res < 0)
@@ -319,23 +361,41 @@ static bool lzma_decode_opt(lzma_lzma1_decoder *coder, lzma_dict *dictptr,
 #endif
 
 
+/// Literal state update as a lookup table, since compared to other state
+/// updates, this would need two branches.
+static const lzma_lzma_state next_state[] = {
+	STATE_LIT_LIT,
+	STATE_LIT_LIT,
+	STATE_LIT_LIT,
+	STATE_LIT_LIT,
+	STATE_MATCH_LIT_LIT,
+	STATE_REP_LIT_LIT,
+	STATE_SHORTREP_LIT_LIT,
+	STATE_MATCH_LIT,
+	STATE_REP_LIT,
+	STATE_SHORTREP_LIT,
+	STATE_MATCH_LIT,
+	STATE_REP_LIT
+};
+
+
+/// Decodes from in[] to *dictptr. If hold is true, decoding may stop when
+/// the remaining input is too short for the assembler decoder, so that
+/// the caller can stitch it to the next input buffer.
 static lzma_ret
-lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
-	const uint8_t *restrict in,
-	size_t *restrict in_pos, size_t in_size)
+lzma_decode_main(lzma_lzma1_decoder *restrict coder,
+	lzma_dict *restrict dictptr, const uint8_t *restrict in,
+	size_t *restrict in_pos, size_t in_size, bool hold)
 {
-	lzma_lzma1_decoder *restrict coder = coder_ptr;
-
 	////////////////////
 	// Initialization //
 	////////////////////
 
-	{
-		const lzma_ret ret = rc_read_init(
-			&coder->rc, in, in_pos, in_size);
-		if (ret != LZMA_STREAM_END)
-			return ret;
-	}
+	lzma_ret ret = rc_read_init(&coder->rc, in, in_pos, in_size);
+	if (ret != LZMA_STREAM_END)
+		return ret;
+
+	ret = LZMA_OK;
 
 	///////////////
 	// Variables //
@@ -367,6 +427,19 @@ lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
 			loop_count = 1;
 		}
 	}
+
+	// Leave the end of the input for lzma_decode() to stitch to
+	// the next input buffer instead of decoding it with the C code.
+	// If the assembler decoder stopped at dict.limit or at the end
+	// of payload marker, this is skipped.
+	if (hold && loop_count != 1 && coder->sequence == SEQ_IS_MATCH
+			&& dict.pos < dict.limit) {
+		dictptr->pos = dict.pos;
+		dictptr->full = dict.full;
+		goto update_size;
+	}
+#else
+	(void)hold;
 #endif
 
 	// Range decoder
@@ -395,8 +468,6 @@ lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
 	// Temporary variables
 	uint32_t pos_state = dict.pos & pos_mask;
 
-	lzma_ret ret = LZMA_OK;
-
 	// The main decoder loop. The "switch" is used to restart the decoder at
 	// correct location. Once restarted, the "switch" is no longer used.
 	switch (coder->sequence)
@@ -408,6 +479,61 @@ lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
 
 	case SEQ_NORMALIZE:
 	case SEQ_IS_MATCH:
+#ifndef HAVE_SMALL
+		// Fast path for runs of literals. A literal including its
+		// is_match bit needs at most nine input bytes so with
+		// LZMA_REQUIRED_INPUT_MAX bytes left the input checks of
+		// rc_normalize() can be skipped. The literal bits are hard
+		// to predict so they are decoded without branches. The loop
+		// stops without decoding anything when a match comes next.
+		while (in_size - rc_in_pos >= LZMA_REQUIRED_INPUT_MAX
+				&& dict.pos < dict.limit) {
+			rc_normalize_safe();
+			rc_bound = (rc.range >> RC_BIT_MODEL_TOTAL_BITS)
+					* coder->is_match[pos_state][state];
+			if (rc.code >= rc_bound)
+				break;
+
+			rc_update_0(coder->is_match[pos_state][state]);
+
+			probs = literal_subcoder(coder->literal,
+					literal_context_bits, literal_pos_mask,
+					dict.pos, dict_get(&dict, 1));
+			symbol = 1;
+
+			uint32_t bit;
+
+			if (is_literal_state(state)) {
+				for (unsigned i = 0; i < 8; ++i) {
+					rc_bit_safe(probs[symbol], bit);
+					symbol = (symbol << 1) + bit;
+				}
+			} else {
+				uint32_t match_byte = (uint32_t)(
+						dict_get(&dict, rep0)) << 1;
+				uint32_t match_offset = 0x100;
+
+				for (unsigned i = 0; i < 8; ++i) {
+					const uint32_t match_bit
+							= match_byte & match_offset;
+					rc_bit_safe(probs[match_offset
+							+ match_bit + symbol],
+							bit);
+					symbol = (symbol << 1) + bit;
+
+					// Keep match_offset if the bit
+					// matched match_bit, else clear it.
+					match_offset &= match_bit ^ (bit - 1);
+					match_byte <<= 1;
+				}
+			}
+
+			state = next_state[state];
+			dict_put(&dict, (uint8_t)(symbol));
+			pos_state = dict.pos & pos_mask;
+		}
+#endif
+
 		if (unlikely(no_eopm && dict.pos == dict.limit))
 			break;
 
@@ -509,23 +635,6 @@ lzma_decode(void *coder_ptr, lzma_dict *restrict dictptr,
 			}
 
 			//update_literal(state);
-			// Use a lookup table to update to literal state,
-			// since compared to other state updates, this would
-			// need two branches.
-			static const lzma_lzma_state next_state[] = {
-				STATE_LIT_LIT,
-				STATE_LIT_LIT,
-				STATE_LIT_LIT,
-				STATE_LIT_LIT,
-				STATE_MATCH_LIT_LIT,
-				STATE_REP_LIT_LIT,
-				STATE_SHORTREP_LIT_LIT,
-				STATE_MATCH_LIT,
-				STATE_REP_LIT,
-				STATE_SHORTREP_LIT,
-				STATE_MATCH_LIT,
-				STATE_REP_LIT
-			};
 			state = next_state[state];
 
 	case SEQ_LITERAL_WRITE:
@@ -848,6 +957,8 @@ out:
 		dictptr->pos = dict.pos;
 		dictptr->full = dict.full;
 	}
+
+update_size:
 #endif
 
 	// Update the remaining amount of uncompressed data if uncompressed
@@ -879,6 +990,122 @@ out:
 }
 
 
+/// Runs lzma_decode_main() until the input has been consumed, the
+/// dictionary is full, or the end of the input is held back.
+static lzma_ret
+decode_buffer(lzma_lzma1_decoder *restrict coder,
+	lzma_dict *restrict dict, const uint8_t *restrict in,
+	size_t *restrict in_pos, size_t in_size, bool hold)
+{
+	lzma_ret ret;
+
+	// lzma_decode_main() returns without decoding the last bytes
+	// of the input if the assembler decoder was run after the C code.
+	// Without hold those bytes are decoded on the next round.
+	do {
+		ret = lzma_decode_main(coder, dict, in, in_pos, in_size, hold);
+	} while (ret == LZMA_OK && *in_pos < in_size
+			&& dict->pos < dict->limit
+			&& !(hold && coder->sequence == SEQ_IS_MATCH));
+
+	return ret;
+}
+
+
+#ifdef LZMA_ASM_OPT_64
+/// Decodes the input that was held back in coder->stitch[] followed by
+/// the beginning of in[]. When the held-back bytes have been consumed,
+/// the rest of the stitch buffer is given back to in[] and
+/// coder->stitch_size is set to zero.
+static lzma_ret
+decode_stitched(lzma_lzma1_decoder *restrict coder,
+	lzma_dict *restrict dict, const uint8_t *restrict in,
+	size_t *restrict in_pos, size_t in_size, bool hold)
+{
+	const size_t added = lzma_bufcpy(in, in_pos, in_size,
+			coder->stitch, &coder->stitch_size, LZMA_STITCH_SIZE);
+
+	// If there still isn't enough input for the assembler decoder,
+	// wait for more.
+	if (hold && coder->stitch_size <= LZMA_REQUIRED_INPUT_MAX * 2)
+		return LZMA_OK;
+
+	size_t stitch_pos = 0;
+	lzma_ret ret = decode_buffer(coder, dict, coder->stitch,
+			&stitch_pos, coder->stitch_size,
+			hold || *in_pos < in_size);
+
+	const size_t left = coder->stitch_size - stitch_pos;
+	if (left <= added) {
+		// Everything that was held back has been decoded.
+		// The rest came from in[] so it can be decoded from there.
+		*in_pos -= left;
+		coder->stitch_size = 0;
+	} else {
+		// Input that the caller has already seen as consumed
+		// must not be left over at the end of the data.
+		if (ret == LZMA_STREAM_END)
+			return LZMA_DATA_ERROR;
+
+		memmove(coder->stitch, coder->stitch + stitch_pos, left);
+		coder->stitch_size = left;
+	}
+
+	return ret;
+}
+#endif
+
+
+static lzma_ret
+lzma_decode(void *coder_ptr, lzma_dict *restrict dict,
+	const uint8_t *restrict in,
+	size_t *restrict in_pos, size_t in_size, lzma_action action)
+{
+	lzma_lzma1_decoder *restrict coder = coder_ptr;
+
+	// Input may be held back only if more of it will follow and this
+	// call got some new input. When called again without new input,
+	// everything gets decoded.
+	const bool hold = action == LZMA_RUN && *in_pos < in_size;
+
+#ifdef LZMA_ASM_OPT_64
+	if (coder->stitch_size > 0) {
+		const lzma_ret ret = decode_stitched(coder, dict,
+				in, in_pos, in_size, hold);
+		if (ret != LZMA_OK || coder->stitch_size > 0
+				|| *in_pos == in_size)
+			return ret;
+	}
+#endif
+
+	const lzma_ret ret = decode_buffer(
+			coder, dict, in, in_pos, in_size, hold);
+
+#ifdef LZMA_ASM_OPT_64
+	if (ret == LZMA_OK && *in_pos < in_size && dict->pos < dict->limit) {
+		// The end of the input was held back.
+		assert(hold);
+		assert(in_size - *in_pos <= LZMA_STITCH_SIZE);
+		lzma_bufcpy(in, in_pos, in_size, coder->stitch,
+				&coder->stitch_size, LZMA_STITCH_SIZE);
+	}
+#endif
+
+	return ret;
+}
+
+
+/// LZMA1 data has no framing that tells where its input ends. The bytes
+/// after it may belong to something else, so none may be held back.
+static lzma_ret
+lzma1_decode(void *coder_ptr, lzma_dict *restrict dict,
+	const uint8_t *restrict in,
+	size_t *restrict in_pos, size_t in_size, lzma_action action)
+{
+	(void)action;
+	return lzma_decode(coder_ptr, dict, in, in_pos, in_size, LZMA_FINISH);
+}
+
 
 static void
 lzma_decoder_uncompressed(void *coder_ptr, lzma_vli uncompressed_size)
@@ -960,6 +1187,10 @@ lzma_decoder_reset(void *coder_ptr, const void *opt)
 	coder->offset = 0;
 	coder->len = 0;
 
+#ifdef LZMA_ASM_OPT_64
+	coder->stitch_size = 0;
+#endif
+
 	return;
 }
 
@@ -976,6 +1207,16 @@ lzma_lzma_decoder_create(lzma_lz_decoder *lz, const lzma_allocator *allocator,
 		lz->code = &lzma_decode;
 		lz->reset = &lzma_decoder_reset;
 		lz->set_uncompressed = &lzma_decoder_uncompressed;
+
+#ifdef LZMA_ASM_OPT_64
+		lzma_lzma1_decoder *coder = lz->coder;
+		coder->decode_asm = &lzma_decode_asm_5;
+#	ifdef LZMA_HAVE_CPUID
+		if (lzma_cpu_has_bmi2())
+			coder->decode_asm = &lzma_decode_asm_5_bmi2;
+#	endif
+		coder->stitch_size = 0;
+#endif
 	}
 
 	// All dictionary sizes are OK here. LZ decoder will take care of
@@ -1002,6 +1243,8 @@ lzma_decoder_init(lzma_lz_decoder *lz, const lzma_allocator *allocator,
 	return_if_error(lzma_lzma_decoder_create(
 			lz, allocator, options, lz_options));
 
+	lz->code = &lzma1_decode;
+
 	lzma_decoder_reset(lz->coder, options);
 	lzma_decoder_uncompressed(lz->coder, LZMA_VLI_UNKNOWN);
 
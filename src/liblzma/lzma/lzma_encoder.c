@@ -426,8 +426,9 @@ is_options_valid(const lzma_options_lzma *options)
 	return is_lclppb_valid(options)
 			&& options->nice_len >= MATCH_LEN_MIN
 			&& options->nice_len <= MATCH_LEN_MAX
-			&& (options->mode == LZMA_MODE_FAST
-				|| options->mode == LZMA_MODE_NORMAL);
+			&& (lzma_options_mode(options) == LZMA_MODE_FAST
+				|| lzma_options_mode(options)
+					== LZMA_MODE_NORMAL);
 }
 
 
@@ -563,7 +564,7 @@ lzma_lzma_encoder_create(void **coder_ptr,
 	// but it's OK here, since nothing bad happens with invalid
 	// options in the code below, and they will get rejected by
 	// lzma_lzma_encoder_reset() call at the end of this function.
-	switch (options->mode) {
+	switch (lzma_options_mode(options)) {
 		case LZMA_MODE_FAST:
 			coder->fast_mode = true;
 			break;
@@ -20,6 +20,14 @@
 typedef struct lzma_lzma1_encoder_s lzma_lzma1_encoder;
 
 
+/// Get the mode of the options without LZMA_MODE_THREAD_POOL.
+static inline lzma_mode
+lzma_options_mode(const lzma_options_lzma *options)
+{
+	return (lzma_mode)(options->mode & ~LZMA_MODE_THREAD_POOL);
+}
+
+
 extern lzma_ret lzma_lzma_encoder_init(lzma_next_coder *next,
 		const lzma_allocator *allocator,
 		const lzma_filter_info *filters);
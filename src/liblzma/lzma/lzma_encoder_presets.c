@@ -69,6 +69,7 @@ lzma_lzma_preset(lzma_options_lzma *options, uint32_t preset)
 		return true;
 
 	options->threads = 1;
+	options->thread_pool = NULL;
 
 	options->preset_dict = NULL;
 	options->preset_dict_size = 0;
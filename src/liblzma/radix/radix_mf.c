@@ -68,6 +68,13 @@ rmf_create_builder(rmf_match_table* const tbl, rmf_builder *builder, const lzma_
 {
 	size_t match_buffer_size = calc_buf_size(tbl->dictionary_size);
 
+	// An existing builder may come from another match table through
+	// a thread pool, so its buffer may be too small.
+	if (builder && builder->match_buffer_size < match_buffer_size) {
+		lzma_free(builder, allocator);
+		builder = NULL;
+	}
+
 	if (!builder) {
 		builder = lzma_alloc(
 			sizeof(rmf_builder) + (match_buffer_size - 1) * sizeof(rmf_build_match), allocator);
@@ -75,10 +82,10 @@ rmf_create_builder(rmf_match_table* const tbl, rmf_builder *builder, const lzma_
 		if (builder == NULL)
 			return NULL;
 
-		builder->table = tbl->table;
 		builder->match_buffer_size = match_buffer_size;
 		builder_init_tails(builder);
 	}
+	builder->table = tbl->table;
 	builder->max_len = tbl->is_struct ? STRUCTURED_MAX_LENGTH : BITPACK_MAX_LENGTH;
 	builder->match_buffer_limit = match_buffer_size;
 
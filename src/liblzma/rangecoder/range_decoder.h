@@ -97,6 +97,17 @@ do { \
 } while (0)
 
 
+/// Like rc_normalize() but without checking for the end of the input.
+/// This may be used only when the caller knows that enough input is left.
+#define rc_normalize_safe() \
+do { \
+	if (rc.range < RC_TOP_VALUE) { \
+		rc.range <<= RC_SHIFT_BITS; \
+		rc.code = (rc.code << RC_SHIFT_BITS) | in[rc_in_pos++]; \
+	} \
+} while (0)
+
+
 /// Start decoding a bit. This must be used together with rc_update_0()
 /// and rc_update_1():
 ///
@@ -167,6 +178,23 @@ do { \
 	case seq: rc_bit(prob, action0, action1, seq)
 
 
+/// Decodes one bit into "bit" (0 or 1) without branching on its value.
+/// This is faster than rc_bit() when the bits are hard to predict, as with
+/// literals. The end of the input isn't checked; see rc_normalize_safe().
+#define rc_bit_safe(prob, bit) \
+do { \
+	rc_normalize_safe(); \
+	rc_bound = (rc.range >> RC_BIT_MODEL_TOTAL_BITS) * (prob); \
+	const uint32_t rc_mask = UINT32_C(0) - (uint32_t)(rc.code >= rc_bound); \
+	rc.range = (rc_bound & ~rc_mask) | ((rc.range - rc_bound) & rc_mask); \
+	rc.code -= rc_bound & rc_mask; \
+	const uint32_t rc_delta = (((RC_BIT_MODEL_TOTAL - (prob)) & ~rc_mask) \
+			| ((prob) & rc_mask)) >> RC_MOVE_BITS; \
+	prob += (rc_delta ^ rc_mask) - rc_mask; \
+	bit = rc_mask & 1; \
+} while (0)
+
+
 /// Decode a bit without using a probability.
 #define rc_direct(dest, seq) \
 do { \
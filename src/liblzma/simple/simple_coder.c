@@ -5,6 +5,12 @@
 ///
 /// Simple filters don't change the size of the data i.e. number of bytes
 /// in equals the number of bytes out.
+///
+/// The data is filtered in place in out[]: the encoder copies the input
+/// straight to the buffer of the next coder and the decoder lets the next
+/// coder decode straight to the output buffer of the application. Only
+/// the few bytes at the end that the filter cannot convert yet are kept
+/// in coder->buffer[] between the calls.
 //
 //  Author:     Lasse Collin
 //
@@ -12,6 +12,7 @@
 ///////////////////////////////////////////////////////////////////////////////
 
 #include "simple_private.h"
+#include "cpu_features.h"
 
 
 #define Test86MSByte(b) ((b) == 0 || (b) == 0xFF)
@@ -23,6 +24,57 @@ typedef struct {
 } lzma_simple_x86;
 
 
+/// \brief      Find the next CALL or JMP opcode
+///
+/// The state of the filter changes only at 0xE8 and 0xE9 bytes, so the
+/// bytes between them can be skipped without looking at them one by one.
+///
+/// \return     Position of the first 0xE8 or 0xE9 byte in
+///             buffer[pos] ... buffer[limit], or if there is none,
+///             limit + 1 or pos, whichever is bigger
+static inline size_t
+find_opcode(const uint8_t *buffer, size_t pos, size_t limit)
+{
+#ifdef LZMA_HAVE_SSE2
+	// 0xE8 and 0xE9 differ only in the lowest bit.
+	const __m128i mask = _mm_set1_epi8((char)(0xFE));
+	const __m128i opcode = _mm_set1_epi8((char)(0xE8));
+
+	for (; pos + 32 <= limit + 1; pos += 32) {
+		const __m128i a = _mm_loadu_si128(
+				(const __m128i *)(buffer + pos));
+		const __m128i b = _mm_loadu_si128(
+				(const __m128i *)(buffer + pos + 16));
+		const uint32_t hits = (uint32_t)(_mm_movemask_epi8(
+					_mm_cmpeq_epi8(_mm_and_si128(a, mask),
+						opcode)))
+				| ((uint32_t)(_mm_movemask_epi8(
+					_mm_cmpeq_epi8(_mm_and_si128(b, mask),
+						opcode))) << 16);
+		if (hits != 0)
+			return pos + ctz32(hits);
+	}
+
+	if (pos + 16 <= limit + 1) {
+		const __m128i a = _mm_loadu_si128(
+				(const __m128i *)(buffer + pos));
+		const uint32_t hits = (uint32_t)(_mm_movemask_epi8(
+				_mm_cmpeq_epi8(_mm_and_si128(a, mask),
+					opcode)));
+		if (hits != 0)
+			return pos + ctz32(hits);
+
+		pos += 16;
+	}
+#endif
+
+	while (pos <= limit && (buffer[pos] & 0xFE) != 0xE8)
+		++pos;
+
+	return pos;
+}
+
+
 static size_t
 x86_code(void *simple_ptr, uint32_t now_pos, bool is_encoder,
 		uint8_t *buffer, size_t size)
@@ -46,12 +98,10 @@ x86_code(void *simple_ptr, uint32_t now_pos, bool is_encoder,
 	const size_t limit = size - 5;
 	size_t buffer_pos = 0;
 
-	while (buffer_pos <= limit) {
-		uint8_t b = buffer[buffer_pos];
-		if (b != 0xE8 && b != 0xE9) {
-			++buffer_pos;
-			continue;
-		}
+	while (true) {
+		buffer_pos = find_opcode(buffer, buffer_pos, limit);
+		if (buffer_pos > limit)
+			break;
 
 		const uint32_t offset = now_pos + (uint32_t)(buffer_pos)
 				- prev_pos;
@@ -66,7 +116,7 @@ x86_code(void *simple_ptr, uint32_t now_pos, bool is_encoder,
 			}
 		}
 
-		b = buffer[buffer_pos + 4];
+		uint8_t b = buffer[buffer_pos + 4];
 
 		if (Test86MSByte(b)
 			&& MASK_TO_ALLOWED_STATUS[(prev_mask >> 1) & 0x7]
@@ -126,6 +126,7 @@ parse_real(args_info *args, int argc, char **argv)
 		OPT_ARM,
 		OPT_ARMTHUMB,
 		OPT_SPARC,
+		OPT_ARM64,
 		OPT_DELTA,
 		OPT_LZMA1,
 		OPT_LZMA2,
@@ -143,6 +144,7 @@ parse_real(args_info *args, int argc, char **argv)
 		OPT_ROBOT,
 		OPT_FLUSH_TIMEOUT,
 		OPT_IGNORE_CHECK,
+		OPT_AUTO_FILTERS,
 	};
 
 	static const char short_opts[]
@@ -196,7 +198,9 @@ parse_real(args_info *args, int argc, char **argv)
 		{ "arm",          optional_argument, NULL,  OPT_ARM },
 		{ "armthumb",     optional_argument, NULL,  OPT_ARMTHUMB },
 		{ "sparc",        optional_argument, NULL,  OPT_SPARC },
+		{ "arm64",        optional_argument, NULL,  OPT_ARM64 },
 		{ "delta",        optional_argument, NULL,  OPT_DELTA },
+		{ "auto-filters", no_argument,       NULL,  OPT_AUTO_FILTERS },
 
 		// Other options
 		{ "quiet",        no_argument,       NULL,  'q' },
@@ -371,6 +375,11 @@ parse_real(args_info *args, int argc, char **argv)
 					options_bcj(optarg));
 			break;
 
+		case OPT_ARM64:
+			coder_add_filter(LZMA_FILTER_ARM64,
+					options_bcj(optarg));
+			break;
+
 		case OPT_DELTA:
 			coder_add_filter(LZMA_FILTER_DELTA,
 					options_delta(optarg));
@@ -386,6 +395,10 @@ parse_real(args_info *args, int argc, char **argv)
 					options_lzma(optarg));
 			break;
 
+		case OPT_AUTO_FILTERS:
+			opt_auto_filters = true;
+			break;
+
 		// Other
 
 		// --format
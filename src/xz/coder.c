@@ -27,6 +27,7 @@ bool opt_auto_adjust = true;
 bool opt_single_stream = false;
 uint64_t opt_block_size = 0;
 uint64_t *opt_block_list = NULL;
+bool opt_auto_filters = false;
 
 
 /// Stream used to communicate with liblzma
@@ -35,6 +36,15 @@ static lzma_stream strm = LZMA_STREAM_INIT;
 /// Filters needed for all encoding all formats, and also decoding in raw data
 static lzma_filter filters[LZMA_FILTERS_MAX + 1];
 
+/// Filter chain chosen by --auto-filters for the current file or Block.
+/// The LZMA2 options are copied from filters[0].
+static lzma_filter auto_chain[LZMA_FILTERS_MAX + 1];
+static lzma_options_lzma auto_lzma;
+static lzma_options_delta auto_delta;
+
+/// What auto_chain was made from
+static detect_info auto_info;
+
 /// Input and output buffers
 static io_buf in_buf;
 static io_buf out_buf;
@@ -60,6 +70,54 @@ static lzma_mt mt_options = {
 	.timeout = 300,
 	.filters = filters,
 };
+
+/// Filter chains that the threaded encoder chooses from for each Block
+/// with --auto-filters. They share the LZMA2 options with filters[0].
+/// liblzma sets the Delta distance for each Block.
+static lzma_filter auto_class_chains[LZMA_BLOCK_CLASS_COUNT][3];
+static const lzma_filter *auto_class_filters[LZMA_BLOCK_CLASS_COUNT];
+static lzma_options_delta auto_class_delta = {
+	.type = LZMA_DELTA_TYPE_BYTE,
+	.dist = LZMA_DELTA_DIST_MIN,
+};
+
+
+/// Let the threaded encoder choose the filters for each Block with
+/// --auto-filters. Blocks that fit no class use the chain chosen from
+/// the beginning of the file, and incompressible Blocks are stored.
+static void
+auto_filters_classes(void)
+{
+	static const lzma_vli ids[LZMA_BLOCK_CLASS_COUNT] = {
+		LZMA_VLI_UNKNOWN,  // LZMA_BLOCK_CLASS_GENERIC
+		LZMA_FILTER_X86,   // LZMA_BLOCK_CLASS_X86
+		LZMA_FILTER_ARM64, // LZMA_BLOCK_CLASS_ARM64
+		LZMA_FILTER_DELTA, // LZMA_BLOCK_CLASS_STRUCTURED
+		LZMA_VLI_UNKNOWN,  // LZMA_BLOCK_CLASS_INCOMPRESSIBLE
+	};
+
+	for (size_t c = 0; c < LZMA_BLOCK_CLASS_COUNT; ++c) {
+		auto_class_filters[c] = NULL;
+
+		if (ids[c] == LZMA_VLI_UNKNOWN
+				|| !lzma_filter_encoder_is_supported(ids[c]))
+			continue;
+
+		lzma_filter *chain = auto_class_chains[c];
+		chain[0].id = ids[c];
+		chain[0].options = ids[c] == LZMA_FILTER_DELTA
+				? &auto_class_delta : NULL;
+		chain[1].id = LZMA_FILTER_LZMA2;
+		chain[1].options = filters[0].options;
+		chain[2].id = LZMA_VLI_UNKNOWN;
+
+		auto_class_filters[c] = chain;
+	}
+
+	mt_options.flags |= LZMA_USE_BLOCK_FILTERS;
+	mt_options.block_filters = auto_class_filters;
+	return;
+}
 #endif
 
 
@@ -209,6 +267,20 @@ coder_set_compression_settings(void)
 				message_fatal(_("LZMA1 cannot be used "
 						"with the .xz format"));
 
+	// --auto-filters builds its chains around the LZMA2 options, which
+	// come from a preset or --lzma2. Only .xz has room for the other
+	// filters without the decompressor needing to be told.
+	if (opt_auto_filters && opt_mode == MODE_COMPRESS) {
+		if (opt_format != FORMAT_XZ)
+			message_fatal(_("--auto-filters can only be used "
+					"with the .xz format"));
+
+		if (filters_count != 1 || filters[0].id != LZMA_FILTER_LZMA2)
+			message_fatal(_("--auto-filters cannot be used with "
+					"a custom filter chain other than "
+					"--lzma2"));
+	}
+
 	// Print the selected filter chain.
 	message_filters_show(V_DEBUG, filters);
 
@@ -240,9 +312,14 @@ coder_set_compression_settings(void)
 			}
 		}
 
-		if (!use_rmf && hardware_threads_get() > 1) {
-			message(V_WARNING, _("Switching to single-threaded "
-					"mode due to --flush-timeout"));
+		if (hardware_threads_get() > 1) {
+			// The radix match finder keeps its threads
+			// because they were already set above.
+			if (!use_rmf)
+				message(V_WARNING, _("Switching to "
+						"single-threaded mode due "
+						"to --flush-timeout"));
+
 			hardware_threads_set(1);
 		}
 	}
@@ -254,12 +331,27 @@ coder_set_compression_settings(void)
 	if (opt_mode == MODE_COMPRESS) {
 #ifdef HAVE_ENCODERS
 #	ifdef MYTHREAD_ENABLED
-		if (!use_rmf && opt_format == FORMAT_XZ && hardware_threads_get() > 1) {
+		if (opt_format == FORMAT_XZ && hardware_threads_get() > 1) {
+			// With the radix match finder, liblzma splits
+			// the threads between Blocks and the match finder
+			// of each Block within the memory usage limit.
 			mt_options.threads = hardware_threads_get();
 			mt_options.block_size = opt_block_size;
 			mt_options.check = check;
+			mt_options.memlimit = memory_limit == UINT64_MAX
+					? 0 : memory_limit;
+			if (opt_auto_filters)
+				auto_filters_classes();
+
 			memory_usage = lzma_stream_encoder_mt_memusage(
 					&mt_options);
+
+			// The threaded encoder splits the input into
+			// Blocks by itself, so regular input files can
+			// be given to it in one piece unless --block-list
+			// needs to control the Block boundaries.
+			if (opt_block_list == NULL)
+				io_map_src_compress(true);
 			if (memory_usage != UINT64_MAX)
 				message(V_DEBUG, _("Using up to %" PRIu32
 						" threads."),
@@ -308,7 +400,18 @@ coder_set_compression_settings(void)
 
 #ifdef HAVE_ENCODERS
 #	ifdef MYTHREAD_ENABLED
-	if (!use_rmf && opt_format == FORMAT_XZ && mt_options.threads > 1) {
+	if (use_rmf && opt_format == FORMAT_XZ && mt_options.threads > 1) {
+		// liblzma already encodes as few Blocks concurrently as
+		// it can. Encoding one Block without the input and output
+		// buffers of the threaded encoder needs less memory and
+		// the radix match finder still uses all the threads.
+		hardware_threads_set(1);
+		io_map_src_compress(false);
+		memory_usage = lzma_raw_encoder_memusage(filters);
+		if (memory_usage == UINT64_MAX)
+			message_bug();
+
+	} else if (opt_format == FORMAT_XZ && mt_options.threads > 1) {
 		// Try to reduce the number of threads before
 		// adjusting the compression settings down.
 		do {
@@ -394,19 +497,92 @@ coder_set_compression_settings(void)
 }
 
 
+/// Choose auto_chain for data that begins with buf[]. If inherit is true,
+/// the data is a new Block of the same file, and if it doesn't begin with
+/// a header of its own, it is assumed to be more of the previous data.
+/// Return true if the chain differs from the previous one.
+static bool
+auto_filters_select(const uint8_t *buf, size_t size, bool inherit)
+{
+	detect_info info;
+	detect_data(&info, buf, size);
+
+	if (inherit && info.bcj == LZMA_VLI_UNKNOWN
+			&& info.delta_dist == 0
+			&& (auto_info.bcj != LZMA_VLI_UNKNOWN
+				|| auto_info.delta_dist != 0)) {
+		info.bcj = auto_info.bcj;
+		info.delta_dist = auto_info.delta_dist;
+		info.incompressible = false;
+	}
+
+	if (auto_chain[0].id != LZMA_VLI_UNKNOWN
+			&& info.bcj == auto_info.bcj
+			&& info.delta_dist == auto_info.delta_dist
+			&& info.incompressible == auto_info.incompressible)
+		return false;
+
+	auto_info = info;
+
+	size_t i = 0;
+	if (info.bcj != LZMA_VLI_UNKNOWN) {
+		auto_chain[i].id = info.bcj;
+		auto_chain[i].options = NULL;
+		++i;
+
+	} else if (info.delta_dist != 0) {
+		auto_delta.type = LZMA_DELTA_TYPE_BYTE;
+		auto_delta.dist = info.delta_dist;
+		auto_chain[i].id = LZMA_FILTER_DELTA;
+		auto_chain[i].options = &auto_delta;
+		++i;
+	}
+
+	// Random data won't compress much no matter how hard LZMA2 tries.
+	// The fast mode never needs more memory than the other modes.
+	auto_lzma = *(const lzma_options_lzma *)(filters[0].options);
+	if (info.incompressible)
+		auto_lzma.mode = LZMA_MODE_FAST;
+
+	auto_chain[i].id = LZMA_FILTER_LZMA2;
+	auto_chain[i].options = &auto_lzma;
+	auto_chain[i + 1].id = LZMA_VLI_UNKNOWN;
+
+	message_filters_show(V_DEBUG, auto_chain);
+	return true;
+}
+
+
+/// Return how much to read for --auto-filters before the encoder is
+/// initialized. It must not be more than the first Block.
+static size_t
+auto_filters_read_size(void)
+{
+	uint64_t size = DETECT_SIZE;
+
+	if (opt_block_size > 0)
+		size = my_min(size, opt_block_size);
+
+	if (opt_block_list != NULL)
+		size = my_min(size, opt_block_list[0]);
+
+	return (size_t)(size);
+}
+
+
 #ifdef HAVE_DECODERS
-/// Return true if the data in in_buf seems to be in the .xz format.
+/// Return true if the data in strm.next_in seems to be in the .xz format.
 static bool
 is_format_xz(void)
 {
 	// Specify the magic as hex to be compatible with EBCDIC systems.
 	static const uint8_t magic[6] = { 0xFD, 0x37, 0x7A, 0x58, 0x5A, 0x00 };
 	return strm.avail_in >= sizeof(magic)
-			&& memcmp(in_buf.u8, magic, sizeof(magic)) == 0;
+			&& memcmp(strm.next_in, magic, sizeof(magic)) == 0;
 }
 
 
-/// Return true if the data in in_buf seems to be in the .lzma format.
+/// Return true if the data in strm.next_in seems to be in the .lzma format.
 static bool
 is_format_lzma(void)
 {
@@ -416,7 +592,7 @@ is_format_lzma(void)
 
 	// Decode the LZMA1 properties.
 	lzma_filter filter = { .id = LZMA_FILTER_LZMA1 };
-	if (lzma_properties_decode(&filter, NULL, in_buf.u8, 5) != LZMA_OK)
+	if (lzma_properties_decode(&filter, NULL, strm.next_in, 5) != LZMA_OK)
 		return false;
 
 	// A hack to ditch tons of false positives: We allow only dictionary
@@ -444,7 +620,8 @@ is_format_lzma(void)
 	// Again, if someone complains, this will be reconsidered.
 	uint64_t uncompressed_size = 0;
 	for (size_t i = 0; i < 8; ++i)
-		uncompressed_size |= (uint64_t)(in_buf.u8[5 + i]) << (i * 8);
+		uncompressed_size |= (uint64_t)(strm.next_in[5 + i])
+				<< (i * 8);
 
 	if (uncompressed_size != UINT64_MAX
 			&& uncompressed_size > (UINT64_C(1) << 38))
@@ -467,6 +644,14 @@ coder_init(file_pair *pair)
 
 	if (opt_mode == MODE_COMPRESS) {
 #ifdef HAVE_ENCODERS
+		const lzma_filter *chain = filters;
+		if (opt_auto_filters) {
+			auto_chain[0].id = LZMA_VLI_UNKNOWN;
+			auto_filters_select(strm.next_in, strm.avail_in,
+					false);
+			chain = auto_chain;
+		}
+
 		switch (opt_format) {
 		case FORMAT_AUTO:
 			// args.c ensures this.
@@ -475,13 +660,30 @@ coder_init(file_pair *pair)
 
 		case FORMAT_XZ:
 #	ifdef MYTHREAD_ENABLED
-			if (!use_rmf && hardware_threads_get() > 1)
+			if (hardware_threads_get() > 1) {
+				// Small files get all the threads in
+				// the match finder of a single Block.
+				mt_options.uncompressed_size
+					= S_ISREG(pair->src_st.st_mode)
+						&& pair->src_st.st_size > 0
+					? (uint64_t)(pair->src_st.st_size)
+					: 0;
+
+				// A mapped input file stays in place until
+				// the file is closed, so the worker threads
+				// can read it without copying.
+				if (pair->src_map != NULL)
+					mt_options.flags |= LZMA_STABLE_INPUT;
+				else
+					mt_options.flags &= ~LZMA_STABLE_INPUT;
+
+				mt_options.filters = chain;
 				ret = lzma_stream_encoder_mt(
 						&strm, &mt_options);
-			else
+			} else
 #	endif
 				ret = lzma_stream_encoder(
-						&strm, filters, check);
+						&strm, chain, check);
 			break;
 
 		case FORMAT_LZMA:
@@ -507,6 +709,11 @@ coder_init(file_pair *pair)
 		if (!opt_single_stream)
 			flags |= LZMA_CONCATENATED;
 
+		// With more than one thread, verify the integrity check
+		// in parallel with decompression.
+		if (hardware_threads_get() > 1)
+			flags |= LZMA_THREADED_CHECK;
+
 		// We abuse FORMAT_AUTO to indicate unknown file format,
 		// for which we may consider passthru mode.
 		enum format_type init_format = FORMAT_AUTO;
@@ -603,7 +810,7 @@ split_block(uint64_t *block_remaining,
 {
 	if (*next_block_remaining > 0) {
 		// The Block at *list_pos has previously been split up.
-		assert(use_rmf || hardware_threads_get() == 1);
+		assert(hardware_threads_get() == 1);
 		assert(opt_block_size > 0);
 		assert(opt_block_list != NULL);
 
@@ -631,7 +838,7 @@ split_block(uint64_t *block_remaining,
 		// If in single-threaded mode, split up the Block if needed.
 		// This is not needed in multi-threaded mode because liblzma
 		// will do this due to how threaded encoding works.
-		if ((use_rmf || hardware_threads_get() == 1) && opt_block_size > 0
+		if (hardware_threads_get() == 1 && opt_block_size > 0
 				&& *block_remaining > opt_block_size) {
 			*next_block_remaining
 					= *block_remaining - opt_block_size;
@@ -671,13 +878,18 @@ coder_normal(file_pair *pair)
 	// Position in opt_block_list. Unused if --block-list wasn't used.
 	size_t list_pos = 0;
 
+	// True when --auto-filters should look at the next input before
+	// it is given to a new Block. The threaded encoder keeps the chain
+	// that was chosen for the file.
+	bool auto_block = false;
+
 	// Handle --block-size for single-threaded mode and the first step
 	// of --block-list.
 	if (opt_mode == MODE_COMPRESS && opt_format == FORMAT_XZ) {
 		// --block-size doesn't do anything here in threaded mode,
 		// because the threaded encoder will take care of splitting
 		// to fixed-sized Blocks.
-		if ((use_rmf || hardware_threads_get() == 1) && opt_block_size > 0)
+		if (hardware_threads_get() == 1 && opt_block_size > 0)
 			block_remaining = opt_block_size;
 
 		// If --block-list was used, start with the first size.
@@ -691,13 +903,23 @@ coder_normal(file_pair *pair)
 		// mode the size info isn't written into Block Headers.
 		if (opt_block_list != NULL) {
 			if (block_remaining < opt_block_list[list_pos]) {
-				assert(use_rmf || hardware_threads_get() == 1);
+				assert(hardware_threads_get() == 1);
 				next_block_remaining = opt_block_list[list_pos]
 						- block_remaining;
 			} else {
 				block_remaining = opt_block_list[list_pos];
 			}
 		}
+
+		// With --auto-filters, coder_run() has already read
+		// the beginning of the first Block.
+		if (strm.avail_in > 0 && pair->src_map == NULL
+				&& action == LZMA_RUN
+				&& block_remaining != UINT64_MAX) {
+			block_remaining -= strm.avail_in;
+			if (block_remaining == 0)
+				action = LZMA_FULL_BARRIER;
+		}
 	}
 
 	strm.next_out = out_buf.u8;
@@ -715,6 +937,21 @@ coder_normal(file_pair *pair)
 			if (strm.avail_in == SIZE_MAX)
 				break;
 
+			if (auto_block && strm.avail_in > 0) {
+				auto_block = false;
+				if (auto_filters_select(strm.next_in,
+						strm.avail_in, true)) {
+					ret = lzma_filters_update(
+							&strm, auto_chain);
+					if (ret != LZMA_OK) {
+						message_error("%s: %s",
+							pair->src_name,
+							message_strm(ret));
+						break;
+					}
+				}
+			}
+
 			if (pair->src_eof) {
 				action = LZMA_FINISH;
 
@@ -733,6 +970,11 @@ coder_normal(file_pair *pair)
 		// Let liblzma do the actual work.
 		ret = lzma_code(&strm, action);
 
+		// The input may have been garbage if the source file
+		// is mapped and reading it failed.
+		if (io_src_map_error(pair))
+			break;
+
 		// Write out if the output buffer became full.
 		if (strm.avail_out == 0) {
 			if (opt_mode != MODE_TEST && io_write(pair, &out_buf,
@@ -761,7 +1003,7 @@ coder_normal(file_pair *pair)
 			} else {
 				// Start a new Block after LZMA_FULL_BARRIER.
 				if (opt_block_list == NULL) {
-					assert(use_rmf || hardware_threads_get() == 1);
+					assert(hardware_threads_get() == 1);
 					assert(opt_block_size > 0);
 					block_remaining = opt_block_size;
 				} else {
@@ -769,6 +1011,9 @@ coder_normal(file_pair *pair)
 							&next_block_remaining,
 							&list_pos);
 				}
+
+				auto_block = opt_auto_filters
+						&& hardware_threads_get() == 1;
 			}
 
 			// Start a new Block after LZMA_FULL_FLUSH or continue
@@ -872,16 +1117,29 @@ coder_passthru(file_pair *pair)
 		if (user_abort)
 			return false;
 
-		if (io_write(pair, &in_buf, strm.avail_in))
+		// If the input file is mapped, copy it to in_buf in
+		// IO_BUFFER_SIZE chunks. This is a rare case so the extra
+		// copying doesn't matter.
+		const size_t size = my_min(strm.avail_in, IO_BUFFER_SIZE);
+		if (strm.next_in != in_buf.u8)
+			memcpy(in_buf.u8, strm.next_in, size);
+
+		if (io_src_map_error(pair) || io_write(pair, &in_buf, size))
 			return false;
 
-		strm.total_in += strm.avail_in;
+		strm.next_in += size;
+		strm.avail_in -= size;
+		strm.total_in += size;
 		strm.total_out = strm.total_in;
 		message_progress_update();
 
-		strm.avail_in = io_read(pair, &in_buf, IO_BUFFER_SIZE);
-		if (strm.avail_in == SIZE_MAX)
-			return false;
+		if (strm.avail_in == 0 && !pair->src_eof) {
+			strm.next_in = in_buf.u8;
+			strm.avail_in = io_read(pair, &in_buf,
+					IO_BUFFER_SIZE);
+			if (strm.avail_in == SIZE_MAX)
+				return false;
+		}
 	}
 
 	return true;
@@ -902,9 +1160,23 @@ coder_run(const char *filename)
 	// Assume that something goes wrong.
 	bool success = false;
 
-	if (opt_mode == MODE_COMPRESS) {
+	if (pair->src_map != NULL) {
+		// The whole input file is in memory. Give all of it to
+		// liblzma at once; nothing will be read from src_fd.
+		strm.next_in = pair->src_map;
+		strm.avail_in = pair->src_map_size;
+		pair->src_eof = true;
+	} else if (opt_mode == MODE_COMPRESS) {
 		strm.next_in = NULL;
 		strm.avail_in = 0;
+
+		// --auto-filters looks at the beginning of the file
+		// before the encoder is initialized.
+		if (opt_auto_filters) {
+			strm.next_in = in_buf.u8;
+			strm.avail_in = io_read(pair, &in_buf,
+					auto_filters_read_size());
+		}
 	} else {
 		// Read the first chunk of input data. This is needed
 		// to detect the input file type.
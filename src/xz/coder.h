@@ -52,6 +52,11 @@ extern uint64_t opt_block_size;
 /// as an array that is terminated with 0.
 extern uint64_t *opt_block_list;
 
+/// If true, a BCJ or Delta filter and the LZMA2 mode are chosen for each
+/// file, and for each Block in single-threaded mode, by looking at the
+/// beginning of the data.
+extern bool opt_auto_filters;
+
 /// Set the integrity check type used when compressing
 extern void coder_set_check(lzma_check check);
 
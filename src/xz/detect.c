@@ -0,0 +1,217 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       detect.c
+/// \brief      Guesses the type of data for --auto-filters
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "private.h"
+#include "tuklib_integer.h"
+
+
+/// Smaller amounts of data are never considered random because
+/// the byte frequencies wouldn't say much.
+#define RANDOM_MIN 4096
+
+
+/// Return the BCJ filter for an ELF e_machine value.
+static lzma_vli
+elf_filter(const uint8_t *buf, size_t size)
+{
+	// e_ident[EI_DATA] tells the byte order of the rest of the header.
+	if (size < 28 || (buf[5] != 1 && buf[5] != 2))
+		return LZMA_VLI_UNKNOWN;
+
+	const bool le = buf[5] == 1;
+	const uint32_t machine = le ? read16le(buf + 18) : read16be(buf + 18);
+
+	switch (machine) {
+	case 3:   // EM_386
+	case 62:  // EM_X86_64
+		return LZMA_FILTER_X86;
+
+	case 183: // EM_AARCH64
+		return LZMA_FILTER_ARM64;
+
+	case 40:  // EM_ARM
+		if (!le)
+			return LZMA_VLI_UNKNOWN;
+
+		// An odd entry point means that the code is Thumb.
+		// This is good enough with 64-bit ELF too because
+		// the lowest byte of e_entry is at the same offset.
+		return (buf[24] & 1) ? LZMA_FILTER_ARMTHUMB : LZMA_FILTER_ARM;
+
+	case 20:  // EM_PPC
+	case 21:  // EM_PPC64
+		return le ? LZMA_VLI_UNKNOWN : LZMA_FILTER_POWERPC;
+
+	case 2:   // EM_SPARC
+	case 18:  // EM_SPARC32PLUS
+	case 43:  // EM_SPARCV9
+		return LZMA_FILTER_SPARC;
+
+	case 50:  // EM_IA_64
+		return LZMA_FILTER_IA64;
+	}
+
+	return LZMA_VLI_UNKNOWN;
+}
+
+
+/// Return the BCJ filter for the Machine field of a PE file.
+static lzma_vli
+pe_filter(const uint8_t *buf, size_t size)
+{
+	if (size < 0x40)
+		return LZMA_VLI_UNKNOWN;
+
+	// e_lfanew points to the PE header.
+	const uint32_t pe = read32le(buf + 0x3C);
+	if (pe > size - 6 || memcmp(buf + pe, "PE\0\0", 4) != 0)
+		return LZMA_VLI_UNKNOWN;
+
+	switch (read16le(buf + pe + 4)) {
+	case 0x014C: // IMAGE_FILE_MACHINE_I386
+	case 0x8664: // IMAGE_FILE_MACHINE_AMD64
+		return LZMA_FILTER_X86;
+
+	case 0xAA64: // IMAGE_FILE_MACHINE_ARM64
+		return LZMA_FILTER_ARM64;
+
+	case 0x01C0: // IMAGE_FILE_MACHINE_ARM
+		return LZMA_FILTER_ARM;
+
+	case 0x01C2: // IMAGE_FILE_MACHINE_THUMB
+	case 0x01C4: // IMAGE_FILE_MACHINE_ARMNT
+		return LZMA_FILTER_ARMTHUMB;
+
+	case 0x0200: // IMAGE_FILE_MACHINE_IA64
+		return LZMA_FILTER_IA64;
+	}
+
+	return LZMA_VLI_UNKNOWN;
+}
+
+
+/// Return the BCJ filter for the cputype of a Mach-O file. Universal
+/// binaries aren't recognized because their magic bytes are the same
+/// as in Java class files.
+static lzma_vli
+macho_filter(const uint8_t *buf, size_t size)
+{
+	if (size < 8)
+		return LZMA_VLI_UNKNOWN;
+
+	uint32_t cputype;
+	if ((read32le(buf) | 1) == 0xFEEDFACF)
+		cputype = read32le(buf + 4);
+	else if ((read32be(buf) | 1) == 0xFEEDFACF)
+		cputype = read32be(buf + 4);
+	else
+		return LZMA_VLI_UNKNOWN;
+
+	switch (cputype) {
+	case 0x00000007: // CPU_TYPE_X86
+	case 0x01000007: // CPU_TYPE_X86_64
+		return LZMA_FILTER_X86;
+
+	case 0x0100000C: // CPU_TYPE_ARM64
+		return LZMA_FILTER_ARM64;
+
+	case 0x00000012: // CPU_TYPE_POWERPC
+	case 0x01000012: // CPU_TYPE_POWERPC64
+		return LZMA_FILTER_POWERPC;
+	}
+
+	return LZMA_VLI_UNKNOWN;
+}
+
+
+/// Return the distance between samples of uncompressed audio or image
+/// data, or zero if the data isn't WAV or BMP.
+static uint32_t
+delta_distance(const uint8_t *buf, size_t size)
+{
+	uint32_t dist = 0;
+
+	if (size >= 36 && memcmp(buf, "RIFF", 4) == 0
+			&& memcmp(buf + 8, "WAVEfmt ", 8) == 0) {
+		// PCM audio: the block align is the size of one sample
+		// of all the channels.
+		if (read16le(buf + 20) == 1)
+			dist = read16le(buf + 32);
+
+	} else if (size >= 32 && buf[0] == 'B' && buf[1] == 'M'
+			&& read32le(buf + 14) >= 40) {
+		// Uncompressed BMP with 24 or 32 bits per pixel
+		const uint32_t bpp = read16le(buf + 28);
+		if (read32le(buf + 30) == 0 && (bpp == 24 || bpp == 32))
+			dist = bpp / 8;
+	}
+
+	// One byte is left as is because LZMA2 handles 8-bit data
+	// fine without help.
+	return dist >= 2 && dist <= LZMA_DELTA_DIST_MAX ? dist : 0;
+}
+
+
+/// Return true if the bytes are close to uniformly distributed. The
+/// number of pairs of equal bytes is compared to what it would be with
+/// 7.95 bits of entropy per byte. This is Renyi entropy of order two,
+/// which needs no logarithms.
+static bool
+is_random(const uint8_t *buf, size_t size)
+{
+	if (size < RANDOM_MIN)
+		return false;
+
+	uint32_t counts[256] = { 0 };
+	for (size_t i = 0; i < size; ++i)
+		++counts[buf[i]];
+
+	uint64_t pairs = 0;
+	for (size_t i = 0; i < 256; ++i)
+		pairs += (uint64_t)(counts[i]) * (counts[i] - (counts[i] > 0));
+
+	// 2^7.95 is about 247.
+	return pairs * 247 <= (uint64_t)(size) * (size - 1);
+}
+
+
+extern void
+detect_data(detect_info *info, const uint8_t *buf, size_t size)
+{
+	size = my_min(size, DETECT_SIZE);
+
+	info->bcj = LZMA_VLI_UNKNOWN;
+	info->delta_dist = 0;
+	info->incompressible = false;
+
+	if (size >= 4 && memcmp(buf, "\x7F" "ELF", 4) == 0)
+		info->bcj = elf_filter(buf, size);
+	else if (size >= 2 && buf[0] == 'M' && buf[1] == 'Z')
+		info->bcj = pe_filter(buf, size);
+	else
+		info->bcj = macho_filter(buf, size);
+
+	if (info->bcj != LZMA_VLI_UNKNOWN) {
+		if (!lzma_filter_encoder_is_supported(info->bcj))
+			info->bcj = LZMA_VLI_UNKNOWN;
+
+		return;
+	}
+
+	info->delta_dist = delta_distance(buf, size);
+	if (info->delta_dist != 0 && !lzma_filter_encoder_is_supported(
+			LZMA_FILTER_DELTA))
+		info->delta_dist = 0;
+
+	if (info->delta_dist == 0)
+		info->incompressible = is_random(buf, size);
+
+	return;
+}
@@ -0,0 +1,39 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       detect.h
+/// \brief      Guesses the type of data for --auto-filters
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+/// Number of bytes from the beginning of a file or Block that is enough
+/// for detect_data()
+#define DETECT_SIZE IO_BUFFER_SIZE
+
+
+/// Filters suggested by detect_data()
+typedef struct {
+	/// ID of the BCJ filter for the machine code or LZMA_VLI_UNKNOWN
+	lzma_vli bcj;
+
+	/// Distance for the Delta filter or zero if it isn't needed
+	uint32_t delta_dist;
+
+	/// True if the data looks random and isn't worth much effort
+	bool incompressible;
+
+} detect_info;
+
+
+/// \brief      Suggest filters for the data
+///
+/// Executables are recognized from ELF, PE, and Mach-O headers, and
+/// uncompressed audio and images from WAV and BMP headers. A BCJ filter
+/// that this liblzma doesn't support is never suggested.
+///
+/// \param      info    The result is stored here
+/// \param      buf     Beginning of the file or Block
+/// \param      size    Size of buf; up to DETECT_SIZE bytes is used
+extern void detect_data(detect_info *info, const uint8_t *buf, size_t size);
@@ -37,6 +37,14 @@ static bool warn_fchown;
 #	endif
 #endif
 
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#	include <sys/mman.h>
+#	define IO_USE_MMAP 1
+#	if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#		define MAP_ANONYMOUS MAP_ANON
+#	endif
+#endif
+
 #include "tuklib_open_stdxxx.h"
 
 #ifndef O_BINARY
@@ -66,11 +74,24 @@ typedef enum {
 /// If true, try to create sparse files when decompressing.
 static bool try_sparse = true;
 
+/// If true, regular source files are mapped also when compressing.
+static bool map_src_compress = false;
+
 #ifdef ENABLE_SANDBOX
 /// True if the conditions for sandboxing (described in main()) have been met.
 static bool sandbox_allowed = false;
 #endif
 
+#ifdef IO_USE_MMAP
+/// The mapping of the current source file for map_sigbus_handler().
+/// Only one source file is open at a time.
+static const uint8_t *volatile sigbus_map = NULL;
+static volatile size_t sigbus_map_size = 0;
+
+/// Set by map_sigbus_handler() if reading the mapping has failed.
+static volatile sig_atomic_t sigbus_map_failed = false;
+#endif
+
 #ifndef TUKLIB_DOSLIKE
 /// File status flags of standard input. This is used by io_open_src()
 /// and io_close_src().
@@ -91,6 +112,38 @@ static int user_abort_pipe[2];
 static bool io_write_buf(file_pair *pair, const uint8_t *buf, size_t size);
 
 
+#ifdef IO_USE_MMAP
+/// Reading a mapped file raises SIGBUS if the file is truncated after
+/// it was mapped or if the device returns a read error. Replace the
+/// mapping with zeros so that the code reading it, possibly a liblzma
+/// worker thread, can continue, and let io_src_map_error() fail the
+/// file. SIGBUS from any other address kills the program as usual.
+static void
+map_sigbus_handler(int sig, siginfo_t *info, void *context)
+{
+	(void)context;
+
+	const int saved_errno = errno;
+	const uint8_t *addr = info->si_addr;
+	const uint8_t *map = sigbus_map;
+
+	if (map != NULL && addr >= map && addr < map + sigbus_map_size
+			&& mmap((void *)(map), sigbus_map_size, PROT_READ,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+				-1, 0) != MAP_FAILED) {
+		sigbus_map_failed = true;
+	} else {
+		// The faulting access is retried when we return.
+		// Let it get the default action this time.
+		signal(sig, SIG_DFL);
+	}
+
+	errno = saved_errno;
+	return;
+}
+#endif
+
+
 extern void
 io_init(void)
 {
@@ -120,6 +173,15 @@ io_init(void)
 	}
 #endif
 
+#ifdef IO_USE_MMAP
+	struct sigaction sa;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_SIGINFO;
+	sa.sa_sigaction = &map_sigbus_handler;
+	if (sigaction(SIGBUS, &sa, NULL))
+		message_signal_handler();
+#endif
+
 #ifdef __DJGPP__
 	// Avoid doing useless things when statting files.
 	// This isn't important but doesn't hurt.
@@ -155,6 +217,14 @@ io_no_sparse(void)
 }
 
 
+extern void
+io_map_src_compress(bool enable)
+{
+	map_src_compress = enable;
+	return;
+}
+
+
 #ifdef ENABLE_SANDBOX
 extern void
 io_allow_sandbox(void)
@@ -496,6 +566,58 @@ io_copy_attrs(const file_pair *pair)
 }
 
 
+#ifdef IO_USE_MMAP
+/// \brief      Map a regular source file into memory
+///
+/// Decompressing from a mapping lets the decoder see the whole input as
+/// one contiguous buffer, so it never has to stitch input across the
+/// boundaries of small read() buffers. The threaded encoder can read
+/// its Blocks from the mapping without copying them. Failing to map
+/// the file is not an error; io_read() will be used in that case.
+///
+/// This is done before io_sandbox_enter() so that no extra capabilities
+/// are needed for the source file descriptor. Errors when reading the
+/// mapping are caught by map_sigbus_handler().
+static void
+io_map_src(file_pair *pair)
+{
+	// The single-threaded encoder reads the input in chunks to split
+	// it into Blocks, and --list seeks around the file with io_pread().
+	if (opt_mode == MODE_COMPRESS ? !map_src_compress
+			: opt_mode == MODE_LIST)
+		return;
+
+	if (!S_ISREG(pair->src_st.st_mode) || pair->src_st.st_size <= 0
+			|| (uintmax_t)(pair->src_st.st_size) > SIZE_MAX)
+		return;
+
+	const size_t size = (size_t)(pair->src_st.st_size);
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE,
+			pair->src_fd, 0);
+	if (map == MAP_FAILED)
+		return;
+
+#ifdef HAVE_MADVISE
+	// These are only hints so errors are ignored.
+#	ifdef MADV_SEQUENTIAL
+	(void)madvise(map, size, MADV_SEQUENTIAL);
+#	endif
+#	ifdef MADV_WILLNEED
+	(void)madvise(map, size, MADV_WILLNEED);
+#	endif
+#endif
+
+	pair->src_map = map;
+	pair->src_map_size = size;
+
+	sigbus_map_failed = false;
+	sigbus_map_size = size;
+	sigbus_map = map;
+	return;
+}
+#endif
+
+
 /// Opens the source file. Returns false on success, true on error.
 static bool
 io_open_src_real(file_pair *pair)
@@ -726,6 +848,10 @@ io_open_src_real(file_pair *pair)
 				: POSIX_FADV_SEQUENTIAL);
 #endif
 
+#ifdef IO_USE_MMAP
+	io_map_src(pair);
+#endif
+
 	return false;
 
 error_msg:
@@ -754,6 +880,8 @@ io_open_src(const char *src_name)
 		.src_eof = false,
 		.dest_try_sparse = false,
 		.dest_pending_sparse = 0,
+		.src_map = NULL,
+		.src_map_size = 0,
 	};
 
 	// Block the signals, for which we have a custom signal handler, so
@@ -792,6 +920,15 @@ io_close_src(file_pair *pair, bool success)
 	}
 #endif
 
+#ifdef IO_USE_MMAP
+	if (pair->src_map != NULL) {
+		sigbus_map = NULL;
+		(void)munmap((void *)(pair->src_map), pair->src_map_size);
+		pair->src_map = NULL;
+		pair->src_map_size = 0;
+	}
+#endif
+
 	if (pair->src_fd != STDIN_FILENO && pair->src_fd != -1) {
 		// Close the file before possibly unlinking it. On DOS-like
 		// systems this is always required since unlinking will fail
@@ -1097,6 +1234,15 @@ io_close(file_pair *pair, bool success)
 extern void
 io_fix_src_pos(file_pair *pair, size_t rewind_size)
 {
+	if (pair->src_map != NULL) {
+		// Nothing has been read from src_fd, so seek to the
+		// absolute position after the decompressed stream.
+		assert(rewind_size <= pair->src_map_size);
+		(void)lseek(pair->src_fd, (off_t)(pair->src_map_size
+				- rewind_size), SEEK_SET);
+		return;
+	}
+
 	assert(rewind_size <= IO_BUFFER_SIZE);
 
 	if (rewind_size > 0) {
@@ -1109,13 +1255,29 @@ io_fix_src_pos(file_pair *pair, size_t rewind_size)
 }
 
 
-extern size_t
-io_read(file_pair *pair, io_buf *buf_union, size_t size)
+extern bool
+io_src_map_error(file_pair *pair)
+{
+#ifdef IO_USE_MMAP
+	if (pair->src_map != NULL && sigbus_map_failed) {
+		message_error(_("%s: Read error: %s"),
+				pair->src_name, strerror(EIO));
+		return true;
+	}
+#else
+	(void)pair;
+#endif
+
+	return false;
+}
+
+
+static size_t
+io_read_buf(file_pair *pair, uint8_t *buf, size_t size)
 {
 	// We use small buffers here.
 	assert(size < SSIZE_MAX);
 
-	uint8_t *buf = buf_union->u8;
 	size_t left = size;
 
 	while (left > 0) {
@@ -1169,6 +1331,13 @@ io_read(file_pair *pair, io_buf *buf_union, size_t size)
 }
 
 
+extern size_t
+io_read(file_pair *pair, io_buf *buf, size_t size)
+{
+	return io_read_buf(pair, buf->u8, size);
+}
+
+
 extern bool
 io_seek_src(file_pair *pair, uint64_t pos)
 {
@@ -1193,14 +1362,14 @@ io_seek_src(file_pair *pair, uint64_t pos)
 
 
 extern bool
-io_pread(file_pair *pair, io_buf *buf, size_t size, uint64_t pos)
+io_pread(file_pair *pair, uint8_t *buf, size_t size, uint64_t pos)
 {
 	// Using lseek() and read() is more portable than pread() and
 	// for us it is as good as real pread().
 	if (io_seek_src(pair, pos))
 		return true;
 
-	const size_t amount = io_read(pair, buf, size);
+	const size_t amount = io_read_buf(pair, buf, size);
 	if (amount == SIZE_MAX)
 		return true;
 
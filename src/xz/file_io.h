@@ -59,6 +59,13 @@ typedef struct {
 	/// Stat of the destination file.
 	struct stat dest_st;
 
+	/// If non-NULL, the whole source file has been mapped into memory
+	/// read-only and can be decoded in one call without io_read().
+	const uint8_t *src_map;
+
+	/// Size of the mapping in bytes. This is the size of the source file.
+	size_t src_map_size;
+
 } file_pair;
 
 
@@ -78,6 +85,14 @@ extern void io_write_to_user_abort_pipe(void);
 extern void io_no_sparse(void);
 
 
+/// \brief      Set if regular source files are mapped when compressing
+///
+/// Source files are always mapped, if possible, when decompressing
+/// or testing. When compressing, this is enabled only if the encoder
+/// takes the whole input in one call.
+extern void io_map_src_compress(bool enable);
+
+
 #ifdef ENABLE_SANDBOX
 /// \brief      main() calls this if conditions for sandboxing have been met.
 extern void io_allow_sandbox(void);
@@ -123,10 +138,24 @@ extern size_t io_read(file_pair *pair, io_buf *buf, size_t size);
 ///
 /// \param      pair        File pair having the source file open for reading
 /// \param      rewind_size How many bytes of extra have been read i.e.
-///                         how much to seek backwards.
+///                         how much to seek backwards. If the source
+///                         file is mapped, this is the number of bytes
+///                         left unused at the end of the mapping.
 extern void io_fix_src_pos(file_pair *pair, size_t rewind_size);
 
 
+/// \brief      Check if reading the mapped source file has failed
+///
+/// If the source file is truncated while it is mapped or the device
+/// returns a read error, the rest of the mapping reads as zeros. The
+/// data given to liblzma is garbage then and the file must not be
+/// treated as successfully processed.
+///
+/// \return     On error, an error message is printed and true is
+///             returned. Otherwise false is returned.
+extern bool io_src_map_error(file_pair *pair);
+
+
 /// \brief      Seek to the given absolute position in the source file
 ///
 /// This calls lseek() and also clears pair->src_eof.
@@ -153,7 +182,8 @@ extern bool io_seek_src(file_pair *pair, uint64_t pos);
 ///
 /// \return     On success, false is returned. On error, error message
 ///             is printed and true is returned.
-extern bool io_pread(file_pair *pair, io_buf *buf, size_t size, uint64_t pos);
+extern bool io_pread(file_pair *pair, uint8_t *buf, size_t size,
+		uint64_t pos);
 
 
 /// \brief      Writes a buffer to the destination file
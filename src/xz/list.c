@@ -333,6 +333,16 @@ xz_ver_to_str(uint32_t ver)
 }
 
 
+/// Read function for lzma_file_info_pread(). lzma_file_info_pread()
+/// doesn't return LZMA_BUF_ERROR itself, so it is used to tell that
+/// io_pread() failed and has already shown an error message.
+static lzma_ret
+pread_callback(void *pair, uint8_t *buf, size_t size, uint64_t pos)
+{
+	return io_pread(pair, buf, size, pos) ? LZMA_BUF_ERROR : LZMA_OK;
+}
+
+
 /// \brief      Parse the Index(es) from the given .xz file
 ///
 /// \param      xfi     Pointer to structure where the decoded information
@@ -355,75 +365,38 @@ parse_indexes(xz_file_info *xfi, file_pair *pair)
 		return true;
 	}
 
-	io_buf buf;
-	lzma_stream strm = LZMA_STREAM_INIT;
+	// The reads are big enough to often contain the Stream Header
+	// of one Stream and the Stream Footer and Index of the previous
+	// one, which keeps the number of reads small on files having
+	// many Streams.
+	uint64_t memlimit = hardware_memlimit_get(MODE_LIST);
 	lzma_index *idx = NULL;
 
-	lzma_ret ret = lzma_file_info_decoder(&strm, &idx,
-			hardware_memlimit_get(MODE_LIST),
-			(uint64_t)(pair->src_st.st_size));
-	if (ret != LZMA_OK) {
-		message_error("%s: %s", pair->src_name, message_strm(ret));
-		return true;
-	}
-
-	while (true) {
-		if (strm.avail_in == 0) {
-			strm.next_in = buf.u8;
-			strm.avail_in = io_read(pair, &buf, IO_BUFFER_SIZE);
-			if (strm.avail_in == SIZE_MAX)
-				goto error;
-		}
-
-		ret = lzma_code(&strm, LZMA_RUN);
-
-		switch (ret) {
-		case LZMA_OK:
-			break;
-
-		case LZMA_SEEK_NEEDED:
-			// liblzma won't ask us to seek past the known size
-			// of the input file.
-			assert(strm.seek_pos
-					<= (uint64_t)(pair->src_st.st_size));
-			if (io_seek_src(pair, strm.seek_pos))
-				goto error;
-
-			// avail_in must be zero so that we will read new
-			// input.
-			strm.avail_in = 0;
-			break;
+	const lzma_ret ret = lzma_file_info_pread(&idx, &memlimit, NULL,
+			(uint64_t)(pair->src_st.st_size), &pread_callback, pair);
 
-		case LZMA_STREAM_END: {
-			lzma_end(&strm);
-			xfi->idx = idx;
+	if (ret == LZMA_OK) {
+		xfi->idx = idx;
 
-			// Calculate xfi->stream_padding.
-			lzma_index_iter iter;
-			lzma_index_iter_init(&iter, xfi->idx);
-			while (!lzma_index_iter_next(&iter,
-					LZMA_INDEX_ITER_STREAM))
-				xfi->stream_padding += iter.stream.padding;
+		// Calculate xfi->stream_padding.
+		lzma_index_iter iter;
+		lzma_index_iter_init(&iter, xfi->idx);
+		while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM))
+			xfi->stream_padding += iter.stream.padding;
 
-			return false;
-		}
+		return false;
+	}
 
-		default:
-			message_error("%s: %s", pair->src_name,
-					message_strm(ret));
+	if (ret == LZMA_BUF_ERROR)
+		return true;
 
-			// If the error was too low memory usage limit,
-			// show also how much memory would have been needed.
-			if (ret == LZMA_MEMLIMIT_ERROR)
-				message_mem_needed(V_ERROR,
-						lzma_memusage(&strm));
+	message_error("%s: %s", pair->src_name, message_strm(ret));
 
-			goto error;
-		}
-	}
+	// If the error was too low memory usage limit,
+	// show also how much memory would have been needed.
+	if (ret == LZMA_MEMLIMIT_ERROR)
+		message_mem_needed(V_ERROR, memlimit);
 
-error:
-	lzma_end(&strm);
 	return true;
 }
 
@@ -447,7 +420,7 @@ parse_block_header(file_pair *pair, const lzma_index_iter *iter,
 				- lzma_check_size(iter->stream.flags->check),
 			LZMA_BLOCK_HEADER_SIZE_MAX);
 	io_buf buf;
-	if (io_pread(pair, &buf, size, iter->block.compressed_file_offset))
+	if (io_pread(pair, buf.u8, size, iter->block.compressed_file_offset))
 		return true;
 
 	// Zero would mean Index Indicator and thus not a valid Block.
@@ -537,8 +510,12 @@ parse_block_header(file_pair *pair, const lzma_index_iter *iter,
 	bhi->compressed_size = block.compressed_size;
 
 	// Calculate the decoder memory usage and update the maximum
-	// memory usage of this Block.
-	bhi->memusage = lzma_raw_decoder_memusage(filters);
+	// memory usage of this Block. If the Block Header stores
+	// Uncompressed Size, liblzma doesn't allocate a dictionary bigger
+	// than that.
+	bhi->memusage = lzma_raw_decoder_memusage_sized(
+			filters, block.uncompressed_size);
+
 	if (xfi->memusage_max < bhi->memusage)
 		xfi->memusage_max = bhi->memusage;
 
@@ -591,7 +568,7 @@ parse_check_value(file_pair *pair, const lzma_index_iter *iter)
 	const uint64_t offset = iter->block.compressed_file_offset
 			+ iter->block.total_size - size;
 	io_buf buf;
-	if (io_pread(pair, &buf, size, offset))
+	if (io_pread(pair, buf.u8, size, offset))
 		return true;
 
 	// CRC32 and CRC64 are in little endian. Guess that all the future
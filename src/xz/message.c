@@ -1037,7 +1037,8 @@ message_filters_to_str(char buf[FILTERS_STR_SIZE],
 		case LZMA_FILTER_IA64:
 		case LZMA_FILTER_ARM:
 		case LZMA_FILTER_ARMTHUMB:
-		case LZMA_FILTER_SPARC: {
+		case LZMA_FILTER_SPARC:
+		case LZMA_FILTER_ARM64: {
 			static const char bcj_names[][9] = {
 				"x86",
 				"powerpc",
@@ -1045,6 +1046,7 @@ message_filters_to_str(char buf[FILTERS_STR_SIZE],
 				"arm",
 				"armthumb",
 				"sparc",
+				"arm64",
 			};
 
 			const lzma_options_bcj *opt = filters[i].options;
@@ -1198,6 +1200,11 @@ message_help(bool long_help)
 "                      start a new .xz block after the given comma-separated\n"
 "                      intervals of uncompressed data"));
 		puts(_(
+"      --auto-filters  choose a BCJ or Delta filter and the LZMA2 mode for each\n"
+"                      file (and each block when single-threaded) from the\n"
+"                      beginning of the data; when multi-threaded, also\n"
+"                      classify each block from samples of all of its data"));
+		puts(_(
 "      --flush-timeout=TIMEOUT\n"
 "                      when compressing, if more than TIMEOUT milliseconds has\n"
 "                      passed since the previous flush and reading more input\n"
@@ -1250,6 +1257,7 @@ message_help(bool long_help)
 "  --arm[=OPTS]        ARM BCJ filter (little endian only)\n"
 "  --armthumb[=OPTS]   ARM-Thumb BCJ filter (little endian only)\n"
 "  --sparc[=OPTS]      SPARC BCJ filter\n"
+"  --arm64[=OPTS]      ARM64 BCJ filter\n"
 "                      Valid OPTS for all BCJ filters:\n"
 "                        start=NUM  start offset for conversions (default=0)"));
 
@@ -56,6 +56,7 @@
 #include "args.h"
 #include "hardware.h"
 #include "file_io.h"
+#include "detect.h"
 #include "options.h"
 #include "signals.h"
 #include "suffix.h"
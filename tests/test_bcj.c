@@ -0,0 +1,350 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_bcj.c
+/// \brief      Tests the BCJ filters against reference implementations
+///
+/// The output of a BCJ encoder is read by decoding with LZMA2 alone,
+/// and the BCJ decoder is given data that was encoded with LZMA2 alone.
+/// The coders are called with small and varying buffers so that the
+/// state of the filter is carried over between the calls.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+#define SIZE 100000
+
+static uint8_t original[SIZE];
+static uint8_t expected[SIZE];
+static uint8_t out[SIZE];
+static uint8_t compressed[2 * SIZE + 1024];
+
+static lzma_options_lzma opt_lzma2;
+
+
+/// The x86 filter one byte at a time as it was in the original
+/// implementation. The last four bytes are left as is.
+static void
+x86_reference(uint8_t *buf, size_t size, bool is_encoder)
+{
+	static const bool MASK_TO_ALLOWED_STATUS[8]
+		= { true, true, true, false, true, false, false, false };
+
+	static const uint32_t MASK_TO_BIT_NUMBER[8]
+			= { 0, 1, 2, 2, 3, 3, 3, 3 };
+
+	uint32_t prev_mask = 0;
+	uint32_t prev_pos = (uint32_t)(-5);
+
+	for (size_t i = 0; i + 5 <= size; ) {
+		if (buf[i] != 0xE8 && buf[i] != 0xE9) {
+			++i;
+			continue;
+		}
+
+		const uint32_t offset = (uint32_t)(i) - prev_pos;
+		prev_pos = (uint32_t)(i);
+
+		if (offset > 5) {
+			prev_mask = 0;
+		} else {
+			for (uint32_t j = 0; j < offset; ++j) {
+				prev_mask &= 0x77;
+				prev_mask <<= 1;
+			}
+		}
+
+		uint8_t b = buf[i + 4];
+
+		if ((b == 0 || b == 0xFF)
+				&& MASK_TO_ALLOWED_STATUS[(prev_mask >> 1) & 7]
+				&& (prev_mask >> 1) < 0x10) {
+			uint32_t src = ((uint32_t)(b) << 24)
+					| ((uint32_t)(buf[i + 3]) << 16)
+					| ((uint32_t)(buf[i + 2]) << 8)
+					| buf[i + 1];
+			uint32_t dest;
+
+			while (true) {
+				if (is_encoder)
+					dest = src + (uint32_t)(i + 5);
+				else
+					dest = src - (uint32_t)(i + 5);
+
+				if (prev_mask == 0)
+					break;
+
+				const uint32_t j = MASK_TO_BIT_NUMBER[
+						prev_mask >> 1];
+				b = (uint8_t)(dest >> (24 - j * 8));
+				if (b != 0 && b != 0xFF)
+					break;
+
+				src = dest ^ ((1U << (32 - j * 8)) - 1);
+			}
+
+			buf[i + 4] = (uint8_t)(~(((dest >> 24) & 1) - 1));
+			buf[i + 3] = (uint8_t)(dest >> 16);
+			buf[i + 2] = (uint8_t)(dest >> 8);
+			buf[i + 1] = (uint8_t)(dest);
+			i += 5;
+			prev_mask = 0;
+		} else {
+			++i;
+			prev_mask |= 1;
+			if (b == 0 || b == 0xFF)
+				prev_mask |= 0x10;
+		}
+	}
+}
+
+
+/// The ARM64 filter written from the instruction formats. BL has a 26-bit
+/// word offset and ADRP a 21-bit page offset whose low two bits are
+/// in bits 29-30. ADRP is converted only if the offset is within
+/// +/-512 MiB, and then the result is stored sign-extended from 18 bits.
+static void
+arm64_reference(uint8_t *buf, size_t size, bool is_encoder)
+{
+	for (size_t i = 0; i + 4 <= size; i += 4) {
+		uint32_t instr = (uint32_t)(buf[i])
+				| ((uint32_t)(buf[i + 1]) << 8)
+				| ((uint32_t)(buf[i + 2]) << 16)
+				| ((uint32_t)(buf[i + 3]) << 24);
+
+		if ((instr & 0xFC000000) == 0x94000000) {
+			uint32_t imm = instr & 0x03FFFFFF;
+			if (is_encoder)
+				imm += (uint32_t)(i) >> 2;
+			else
+				imm -= (uint32_t)(i) >> 2;
+
+			instr = 0x94000000 | (imm & 0x03FFFFFF);
+
+		} else if ((instr & 0x9F000000) == 0x90000000) {
+			const uint32_t imm = (((instr >> 5) & 0x7FFFF) << 2)
+					| ((instr >> 29) & 3);
+			const int32_t page = imm >= (1U << 20)
+					? (int32_t)(imm) - (1 << 21)
+					: (int32_t)(imm);
+			if (page < -(1 << 17) || page >= (1 << 17))
+				continue;
+
+			uint32_t dest = (uint32_t)(page);
+			if (is_encoder)
+				dest += (uint32_t)(i) >> 12;
+			else
+				dest -= (uint32_t)(i) >> 12;
+
+			dest &= 0x3FFFF;
+			if (dest & 0x20000)
+				dest |= 0x1C0000;
+
+			instr = (instr & 0x9F00001F) | ((dest & 3) << 29)
+					| ((dest >> 2) << 5);
+
+		} else {
+			continue;
+		}
+
+		buf[i] = (uint8_t)(instr);
+		buf[i + 1] = (uint8_t)(instr >> 8);
+		buf[i + 2] = (uint8_t)(instr >> 16);
+		buf[i + 3] = (uint8_t)(instr >> 24);
+	}
+}
+
+
+/// The amount of input or output to give in the next call
+static size_t
+next_step(size_t *step, size_t left)
+{
+	*step = *step * 7 % 4093 + 1;
+	return my_min(*step, left);
+}
+
+
+/// Encode SIZE bytes with the filters and return the compressed size.
+static size_t
+encode(const lzma_filter *filters, const uint8_t *in, size_t step)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_raw_encoder(&strm, filters) == LZMA_OK);
+
+	strm.next_in = in;
+	strm.next_out = compressed;
+	strm.avail_out = sizeof(compressed);
+
+	lzma_ret ret;
+	do {
+		const size_t in_left = SIZE - (size_t)(strm.next_in - in);
+		strm.avail_in = next_step(&step, in_left);
+		ret = lzma_code(&strm, strm.avail_in == in_left
+				? LZMA_FINISH : LZMA_RUN);
+	} while (ret == LZMA_OK);
+
+	expect(ret == LZMA_STREAM_END);
+	expect(strm.total_in == SIZE);
+
+	const size_t compressed_size = strm.total_out;
+	lzma_end(&strm);
+	return compressed_size;
+}
+
+
+/// Decode to out[] with the filters.
+static void
+decode(const lzma_filter *filters, size_t compressed_size, size_t step)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_raw_decoder(&strm, filters) == LZMA_OK);
+
+	strm.next_in = compressed;
+	strm.avail_in = compressed_size;
+	strm.next_out = out;
+	memcrap(out, sizeof(out));
+
+	lzma_ret ret;
+	do {
+		strm.avail_out = next_step(&step,
+				SIZE - (size_t)(strm.next_out - out));
+		ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK && strm.total_out < SIZE);
+
+	expect(ret == LZMA_OK || ret == LZMA_STREAM_END);
+	expect(strm.total_out == SIZE);
+	lzma_end(&strm);
+}
+
+
+/// Run the filter both ways with LZMA2. expected[] must have been
+/// filtered from original[] by the reference encoder.
+static void
+test_filter(lzma_vli id, size_t step)
+{
+	const lzma_filter lzma2[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma2 },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+	const lzma_filter bcj_lzma2[3] = {
+		{ .id = id, .options = NULL },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma2 },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	decode(lzma2, encode(bcj_lzma2, original, step), step + 1);
+	expect(memcmp(out, expected, SIZE) == 0);
+
+	decode(bcj_lzma2, encode(lzma2, expected, step), step + 2);
+	expect(memcmp(out, original, SIZE) == 0);
+}
+
+
+/// Fill original[] with random bytes of which about one in every
+/// `opcode` is 0xE8 or 0xE9 and one in four is 0x00 or 0xFF.
+static void
+fill_x86(uint32_t r, uint32_t opcode)
+{
+	for (size_t i = 0; i < SIZE; ++i) {
+		r = r * 1103515245 + 12345;
+		const uint32_t x = r >> 8;
+
+		if (x % opcode == 0)
+			original[i] = 0xE8 | (x >> 16 & 1);
+		else if ((x >> 4) % 4 == 0)
+			original[i] = (x >> 17 & 1) ? 0xFF : 0x00;
+		else
+			original[i] = (uint8_t)(x >> 12);
+	}
+}
+
+
+static void
+test_x86(void)
+{
+	static const uint32_t opcodes[] = { 3, 16, 50, 1000 };
+
+	for (size_t i = 0; i < ARRAY_SIZE(opcodes); ++i) {
+		fill_x86(0x12345678 + (uint32_t)(i), opcodes[i]);
+
+		memcpy(expected, original, SIZE);
+		x86_reference(expected, SIZE, true);
+
+		// The reference decoder must undo the reference encoder
+		// or the reference isn't worth comparing to.
+		memcpy(out, expected, SIZE);
+		x86_reference(out, SIZE, false);
+		expect(memcmp(out, original, SIZE) == 0);
+
+		for (size_t step = 1; step < 4000; step += 997)
+			test_filter(LZMA_FILTER_X86, step);
+	}
+}
+
+
+/// Fill original[] with little endian words of which about a quarter are
+/// BL and a quarter ADRP instructions. Some of the ADRP offsets are out of
+/// the range that is converted.
+static void
+fill_arm64(uint32_t r)
+{
+	for (size_t i = 0; i < SIZE; i += 4) {
+		r = r * 1103515245 + 12345;
+		const uint32_t x = r >> 8;
+		r = r * 1103515245 + 12345;
+		uint32_t instr = (r >> 16) | (x << 16);
+
+		if (x % 4 == 0) {
+			instr = 0x94000000 | (instr & 0x03FFFFFF);
+
+		} else if (x % 4 == 1) {
+			// A page offset in [-2^18, 2^18) so that about half
+			// of them are in the range.
+			const uint32_t page = ((instr >> 8) & 0x7FFFF)
+					- 0x40000;
+			instr = 0x90000000 | (instr & 0x1F)
+					| ((page & 3) << 29)
+					| (((page >> 2) & 0x7FFFF) << 5);
+		}
+
+		original[i] = (uint8_t)(instr);
+		original[i + 1] = (uint8_t)(instr >> 8);
+		original[i + 2] = (uint8_t)(instr >> 16);
+		original[i + 3] = (uint8_t)(instr >> 24);
+	}
+}
+
+
+static void
+test_arm64(void)
+{
+	for (uint32_t seed = 0; seed < 2; ++seed) {
+		fill_arm64(0x87654321 + seed);
+
+		memcpy(expected, original, SIZE);
+		arm64_reference(expected, SIZE, true);
+
+		memcpy(out, expected, SIZE);
+		arm64_reference(out, SIZE, false);
+		expect(memcmp(out, original, SIZE) == 0);
+
+		for (size_t step = 1; step < 4000; step += 997)
+			test_filter(LZMA_FILTER_ARM64, step);
+	}
+}
+
+
+extern int
+main(void)
+{
+	succeed(lzma_lzma_preset(&opt_lzma2, 0));
+	opt_lzma2.dict_size = LZMA_DICT_SIZE_MIN;
+
+	test_x86();
+	test_arm64();
+
+	return 0;
+}
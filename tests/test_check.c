@@ -2,8 +2,6 @@
 //
 /// \file       test_check.c
 /// \brief      Tests integrity checks
-///
-/// \todo       Add SHA256
 //
 //  Author:     Lasse Collin
 //
@@ -71,6 +69,292 @@ test_crc64(void)
 }
 
 
+// Always the same pseudo-random bytes
+static void
+fill_random(uint8_t *buf, size_t size)
+{
+	uint32_t r = 0x12345678;
+	for (size_t i = 0; i < size; ++i) {
+		r = r * 1103515245 + 12345;
+		buf[i] = (uint8_t)(r >> 23);
+	}
+}
+
+
+// Bit-by-bit versions to compare the optimized code against
+static uint32_t
+crc32_bitwise(const uint8_t *buf, size_t size, uint32_t crc)
+{
+	crc = ~crc;
+	while (size-- != 0) {
+		crc ^= *buf++;
+		for (int i = 0; i < 8; ++i)
+			crc = (crc >> 1) ^ (UINT32_C(0xEDB88320) & (0U - (crc & 1)));
+	}
+
+	return ~crc;
+}
+
+
+static uint64_t
+crc64_bitwise(const uint8_t *buf, size_t size, uint64_t crc)
+{
+	crc = ~crc;
+	while (size-- != 0) {
+		crc ^= *buf++;
+		for (int i = 0; i < 8; ++i)
+			crc = (crc >> 1) ^ (UINT64_C(0xC96C5795D7870F42)
+					& (0U - (crc & 1)));
+	}
+
+	return ~crc;
+}
+
+
+// Compare against the bit-by-bit versions with every size up to a few
+// times the block size of the folding code, with every alignment of
+// the buffer, and with initial values other than zero. Each buffer is
+// also calculated in two pieces split at a varying point.
+static bool
+test_equivalence(void)
+{
+	enum { MAX_SIZE = 1100, MAX_ALIGN = 16 };
+	static uint8_t buf[MAX_SIZE + MAX_ALIGN];
+	fill_random(buf, sizeof(buf));
+
+	for (size_t size = 0; size <= MAX_SIZE; ++size)
+	for (size_t align = 0; align < MAX_ALIGN; ++align) {
+		const uint8_t *in = buf + align;
+		const uint32_t init32 = size * 0x9E3779B9U + align;
+		const uint64_t init64 = init32 * UINT64_C(0x100000001B3);
+		const size_t split = (size * 7 + align) % (size + 1);
+
+		const uint32_t crc32 = crc32_bitwise(in, size, init32);
+		if (lzma_crc32(in, size, init32) != crc32
+				|| lzma_crc32(in + split, size - split,
+					lzma_crc32(in, split, init32))
+					!= crc32)
+			return true;
+
+		const uint64_t crc64 = crc64_bitwise(in, size, init64);
+		if (lzma_crc64(in, size, init64) != crc64
+				|| lzma_crc64(in + split, size - split,
+					lzma_crc64(in, split, init64))
+					!= crc64)
+			return true;
+	}
+
+	return false;
+}
+
+
+// SHA-256 isn't in the public API. The Check field of a Block gives it.
+static bool
+sha256_matches(const uint8_t *buf, size_t size, size_t chunk,
+		const char *expected)
+{
+	static uint8_t out[(1 << 20) + 4096];
+	lzma_block block = {
+		.version = 0,
+		.check = LZMA_CHECK_SHA256,
+		.compressed_size = LZMA_VLI_UNKNOWN,
+		.uncompressed_size = LZMA_VLI_UNKNOWN,
+	};
+
+	if (chunk == 0) {
+		// Everything in one call
+		size_t out_pos = 0;
+		if (lzma_block_uncomp_encode(&block, buf, size,
+				out, &out_pos, sizeof(out)) != LZMA_OK)
+			return false;
+	} else {
+		// The input is given to the Block encoder a piece at a time
+		lzma_options_lzma opt;
+		lzma_lzma_preset(&opt, 0);
+		lzma_filter filters[2] = {
+			{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+			{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+		};
+		block.filters = filters;
+		if (lzma_block_header_size(&block) != LZMA_OK)
+			return false;
+
+		lzma_stream strm = LZMA_STREAM_INIT;
+		if (lzma_block_encoder(&strm, &block) != LZMA_OK)
+			return false;
+
+		size_t pos = 0;
+		lzma_ret ret;
+		do {
+			size_t n = size - pos < chunk ? size - pos : chunk;
+			strm.next_in = buf + pos;
+			strm.avail_in = n;
+			strm.next_out = out;
+			strm.avail_out = sizeof(out);
+			ret = lzma_code(&strm, pos + n == size
+					? LZMA_FINISH : LZMA_RUN);
+			pos += n - strm.avail_in;
+
+			// Vary the size of the pieces.
+			chunk = chunk * 5 % 4093 + 1;
+		} while (ret == LZMA_OK);
+
+		lzma_end(&strm);
+		if (ret != LZMA_STREAM_END)
+			return false;
+	}
+
+	char hex[2 * 32 + 1];
+	for (size_t i = 0; i < 32; ++i)
+		snprintf(hex + 2 * i, 3, "%02x", block.raw_check[i]);
+
+	return strcmp(hex, expected) == 0;
+}
+
+
+static bool
+test_sha256(void)
+{
+	// FIPS 180-2 test vectors
+	static const char *const abc56 = "abcdbcdecdefdefgefghfghighijhijk"
+			"ijkljklmklmnlmnomnopnopq";
+	if (!sha256_matches((const uint8_t *)"", 0, 0,
+			"e3b0c44298fc1c149afbf4c8996fb924"
+			"27ae41e4649b934ca495991b7852b855")
+			|| !sha256_matches((const uint8_t *)"abc", 3, 0,
+			"ba7816bf8f01cfea414140de5dae2223"
+			"b00361a396177a9cb410ff61f20015ad")
+			|| !sha256_matches((const uint8_t *)abc56, 56, 0,
+			"248d6a61d20638b8e5c026930c3e6039"
+			"a33ce45964ff2167f6ecedd419db06c1"))
+		return true;
+
+	static uint8_t buf[(1 << 20) + 16];
+	memset(buf, 'a', 1000000);
+	if (!sha256_matches(buf, 1000000, 0,
+			"cdc76e5c9914fb9281a1c7e284d73e67"
+			"f1809a48a497200e046d39ccc7112cd0"))
+		return true;
+
+	// Pseudo-random data that isn't aligned, both in one call and
+	// in pieces of many sizes so that all the paths of the update
+	// function get used
+	fill_random(buf, sizeof(buf));
+	static const char *const random_sha256
+			= "c9505cd26885ce73a186c1de23e5e662"
+			"142b86a7c09fc2b3180aecaf8213f2d2";
+	if (!sha256_matches(buf + 3, 1000003, 0, random_sha256)
+			|| !sha256_matches(buf + 3, 1000003, 1, random_sha256)
+			|| !sha256_matches(buf + 3, 1000003, 64,
+				random_sha256))
+		return true;
+
+	return false;
+}
+
+
+// Encode a Block with a multithreaded LZMA2 encoder and return its check.
+// The check is calculated in slices by several threads then.
+static bool
+block_check(const uint8_t *buf, size_t size, lzma_check check,
+		uint32_t threads, bool streamed, uint8_t *raw_check)
+{
+	lzma_options_lzma opt;
+	lzma_lzma_preset(&opt, 0);
+	opt.threads = threads;
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+	lzma_block block = {
+		.version = 0,
+		.check = check,
+		.filters = filters,
+		.compressed_size = LZMA_VLI_UNKNOWN,
+		.uncompressed_size = LZMA_VLI_UNKNOWN,
+	};
+
+	const size_t out_size = lzma_block_buffer_bound(size);
+	uint8_t *out = malloc(out_size);
+	if (out == NULL)
+		return false;
+
+	lzma_ret ret;
+	if (streamed) {
+		// All the input in one call
+		lzma_stream strm = LZMA_STREAM_INIT;
+		ret = lzma_block_header_size(&block);
+		if (ret == LZMA_OK)
+			ret = lzma_block_encoder(&strm, &block);
+
+		strm.next_in = buf;
+		strm.avail_in = size;
+		strm.next_out = out;
+		strm.avail_out = out_size;
+		while (ret == LZMA_OK)
+			ret = lzma_code(&strm, LZMA_FINISH);
+
+		lzma_end(&strm);
+		if (ret == LZMA_STREAM_END)
+			ret = LZMA_OK;
+	} else {
+		size_t out_pos = 0;
+		ret = lzma_block_buffer_encode(&block, NULL, buf, size,
+				out, &out_pos, out_size);
+	}
+
+	free(out);
+	memcpy(raw_check, block.raw_check, LZMA_CHECK_SIZE_MAX);
+	return ret == LZMA_OK;
+}
+
+
+static bool
+test_check_mt(void)
+{
+	const size_t size = (4 << 20) + 5;
+	uint8_t *buf = malloc(size);
+	if (buf == NULL)
+		return true;
+
+	// Repeat a block of pseudo-random data. This compresses quickly.
+	fill_random(buf, 1 << 16);
+	for (size_t i = 1 << 16; i < size; ++i)
+		buf[i] = buf[i - (1 << 16)];
+
+	bool error = false;
+
+	for (int streamed = 0; streamed < 2; ++streamed)
+	for (size_t n = size - 3; n <= size; n += 3) {
+		uint8_t raw[LZMA_CHECK_SIZE_MAX];
+		uint8_t expected[LZMA_CHECK_SIZE_MAX];
+
+		const uint32_t crc32 = conv32le(lzma_crc32(buf, n, 0));
+		memcpy(expected, &crc32, sizeof(crc32));
+		if (!block_check(buf, n, LZMA_CHECK_CRC32, 4, streamed, raw)
+				|| memcmp(raw, expected, 4) != 0)
+			error = true;
+
+		const uint64_t crc64 = conv64le(lzma_crc64(buf, n, 0));
+		memcpy(expected, &crc64, sizeof(crc64));
+		if (!block_check(buf, n, LZMA_CHECK_CRC64, 4, streamed, raw)
+				|| memcmp(raw, expected, 8) != 0)
+			error = true;
+
+		if (lzma_check_is_supported(LZMA_CHECK_SHA256)
+				&& (!block_check(buf, n, LZMA_CHECK_SHA256,
+					1, streamed, expected)
+				|| !block_check(buf, n, LZMA_CHECK_SHA256,
+					4, streamed, raw)
+				|| memcmp(raw, expected, 32) != 0))
+			error = true;
+	}
+
+	free(buf);
+	return error;
+}
+
+
 int
 main(void)
 {
@@ -78,6 +362,9 @@ main(void)
 
 	error |= test_crc32();
 	error |= test_crc64();
+	error |= test_equivalence();
+	error |= test_sha256();
+	error |= test_check_mt();
 
 	return error ? 1 : 0;
 }
@@ -74,6 +74,33 @@ test_fxz() {
 	echo . | tr -d '\n\r'
 }
 
+# Compress with --auto-filters and check that the filter chain shown
+# with -vv matches the first argument.
+test_auto_filters() {
+	EXPECTED=$1
+	shift
+
+	if LC_ALL=C $XZ -c -vv --auto-filters "$@" "$FILE" \
+			> tmp_compressed 2> tmp_messages ; then
+		:
+	else
+		echo "Compressing failed: --auto-filters $* $FILE"
+		(exit 1)
+		exit 1
+	fi
+
+	if grep -e "Filter chain: $EXPECTED" tmp_messages > /dev/null ; then
+		:
+	else
+		echo "--auto-filters didn't choose $EXPECTED: $* $FILE"
+		(exit 1)
+		exit 1
+	fi
+
+	# Show progress:
+	echo . | tr -d '\n\r'
+}
+
 XZ="../src/xz/fxz --memlimit-compress=48MiB --memlimit-decompress=10MiB \
 		--no-adjust --threads=1 --check=crc64"
 XZDEC="../src/xzdec/fxzdec" # No memory usage limiter available
@@ -90,8 +117,8 @@ else
 fi
 
 # Remove temporary now (in case they are something weird), and on exit.
-rm -f tmp_compressed tmp_uncompressed
-trap 'rm -f tmp_compressed tmp_uncompressed' 0
+rm -f tmp_compressed tmp_uncompressed tmp_messages tmp_auto_*
+trap 'rm -f tmp_compressed tmp_uncompressed tmp_messages tmp_auto_*' 0
 
 # Compress and decompress each file with various filter configurations.
 # This takes quite a bit of time.
@@ -107,6 +134,9 @@ do
 	test_fxz -2
 	test_fxz -3
 	test_fxz -4
+	test_fxz -1 --auto-filters
+	test_fxz -1 --auto-filters --block-size=4096
+	test_fxz -1 --auto-filters --block-size=8192 --threads=2
 
 	# Disabled until Subblock format is stable.
 #		--subblock \
@@ -127,7 +157,8 @@ do
 		--ia64 \
 		--arm \
 		--armthumb \
-		--sparc
+		--sparc \
+		--arm64
 	do
 		test_fxz $ARGS --lzma2=dict=1MiB,nice=32,mode=fast
 
@@ -138,5 +169,28 @@ do
 	echo
 done
 
+# The chains that --auto-filters chooses: BCJ for executables, Delta with
+# the size of a sample for PCM audio, and the fast mode for data that
+# doesn't compress. Compressed data serves as random data.
+echo "  auto-filters" | tr -d '\n\r'
+
+FILE=$srcdir/compress_prepared_bcj_x86
+test_auto_filters '--x86 --lzma2=' -1
+
+# 16-bit stereo WAV header followed by text
+FILE=tmp_auto_wav
+printf 'RIFF\044\000\001\000WAVEfmt \020\000\000\000\001\000\002\000' \
+		> "$FILE"
+printf '\104\254\000\000\020\261\002\000\004\000\020\000data\000\000\001\000' \
+		>> "$FILE"
+cat compress_generated_text >> "$FILE"
+test_auto_filters '--delta=dist=4 --lzma2=' -1
+
+FILE=tmp_auto_random
+$XZ -c -1 compress_generated_text > "$FILE"
+test_auto_filters '--lzma2=[^ ]*mode=fast' -3
+
+echo
+
 (exit 0)
 exit 0
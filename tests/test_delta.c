@@ -0,0 +1,160 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_delta.c
+/// \brief      Tests the Delta filter against its definition
+///
+/// The output of the Delta encoder is read by decoding with LZMA2 alone,
+/// and the Delta decoder is given data that was encoded with LZMA2 alone.
+/// The coders are called with small and varying buffers so that the
+/// history is carried over between the calls.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+#define SIZE 3000
+
+static uint8_t original[SIZE];
+static uint8_t expected[SIZE];
+static uint8_t twice[SIZE];
+static uint8_t out[SIZE];
+static uint8_t compressed[2 * SIZE + 1024];
+
+static lzma_options_lzma opt_lzma2;
+
+
+/// out[i] = in[i] - in[i - dist] where bytes before the beginning are zero
+static void
+delta(uint8_t *dest, const uint8_t *src, size_t dist)
+{
+	for (size_t i = 0; i < SIZE; ++i)
+		dest[i] = src[i] - (i >= dist ? src[i - dist] : 0);
+}
+
+
+/// The amount of input or output to give in the next call
+static size_t
+next_step(size_t *step, size_t left)
+{
+	*step = *step * 7 % 509 + 1;
+	return my_min(*step, left);
+}
+
+
+/// Encode SIZE bytes with the filters and return the compressed size.
+static size_t
+encode(const lzma_filter *filters, const uint8_t *in, size_t step)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_raw_encoder(&strm, filters) == LZMA_OK);
+
+	strm.next_in = in;
+	strm.next_out = compressed;
+	strm.avail_out = sizeof(compressed);
+
+	lzma_ret ret;
+	do {
+		const size_t in_left = SIZE - (size_t)(strm.next_in - in);
+		strm.avail_in = next_step(&step, in_left);
+		ret = lzma_code(&strm, strm.avail_in == in_left
+				? LZMA_FINISH : LZMA_RUN);
+	} while (ret == LZMA_OK);
+
+	expect(ret == LZMA_STREAM_END);
+	expect(strm.total_in == SIZE);
+
+	const size_t compressed_size = strm.total_out;
+	lzma_end(&strm);
+	return compressed_size;
+}
+
+
+/// Decode to out[] with the filters.
+static void
+decode(const lzma_filter *filters, size_t compressed_size, size_t step)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_raw_decoder(&strm, filters) == LZMA_OK);
+
+	strm.next_in = compressed;
+	strm.avail_in = compressed_size;
+	strm.next_out = out;
+	memcrap(out, sizeof(out));
+
+	lzma_ret ret;
+	do {
+		strm.avail_out = next_step(&step,
+				SIZE - (size_t)(strm.next_out - out));
+		ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK && strm.total_out < SIZE);
+
+	expect(ret == LZMA_OK || ret == LZMA_STREAM_END);
+	expect(strm.total_out == SIZE);
+	lzma_end(&strm);
+}
+
+
+static void
+test_distance(size_t dist)
+{
+	lzma_options_delta opt_delta = {
+		.type = LZMA_DELTA_TYPE_BYTE,
+		.dist = (uint32_t)(dist),
+	};
+
+	const lzma_filter lzma2[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma2 },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+	const lzma_filter delta_lzma2[3] = {
+		{ .id = LZMA_FILTER_DELTA, .options = &opt_delta },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma2 },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	// Two Delta filters use both the copying and the in-place encoder.
+	const lzma_filter delta_delta_lzma2[4] = {
+		{ .id = LZMA_FILTER_DELTA, .options = &opt_delta },
+		{ .id = LZMA_FILTER_DELTA, .options = &opt_delta },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma2 },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	delta(expected, original, dist);
+	delta(twice, expected, dist);
+
+	decode(lzma2, encode(delta_lzma2, original, dist), dist + 1);
+	expect(memcmp(out, expected, SIZE) == 0);
+
+	decode(lzma2, encode(delta_delta_lzma2, original, dist), dist + 2);
+	expect(memcmp(out, twice, SIZE) == 0);
+
+	decode(delta_lzma2, encode(lzma2, expected, dist), dist + 3);
+	expect(memcmp(out, original, SIZE) == 0);
+
+	decode(delta_delta_lzma2, encode(lzma2, twice, dist), dist + 4);
+	expect(memcmp(out, original, SIZE) == 0);
+}
+
+
+extern int
+main(void)
+{
+	succeed(lzma_lzma_preset(&opt_lzma2, 0));
+	opt_lzma2.dict_size = LZMA_DICT_SIZE_MIN;
+
+	uint32_t r = 0x12345678;
+	for (size_t i = 0; i < SIZE; ++i) {
+		r = r * 1103515245 + 12345;
+		original[i] = (uint8_t)(r >> 23);
+	}
+
+	for (size_t dist = LZMA_DELTA_DIST_MIN; dist <= LZMA_DELTA_DIST_MAX;
+			++dist)
+		test_distance(dist);
+
+	return 0;
+}
@@ -29,6 +29,15 @@ do
 		exit 1
 	fi
 
+	# -T2 verifies the integrity check in a separate thread.
+	if test -z "$XZ" || "$XZ" -dc -T2 "$I" > /dev/null; then
+		:
+	else
+		echo "Good file failed with -T2: $I"
+		(exit 1)
+		exit 1
+	fi
+
 	if test -z "$XZDEC" || "$XZDEC" "$I" > /dev/null; then
 		:
 	else
@@ -46,6 +55,12 @@ do
 		exit 1
 	fi
 
+	if test -n "$XZ" && "$XZ" -dc -T2 "$I" > /dev/null 2>&1; then
+		echo "Bad file succeeded with -T2: $I"
+		(exit 1)
+		exit 1
+	fi
+
 	if test -n "$XZDEC" && "$XZDEC" "$I" > /dev/null 2>&1; then
 		echo "Bad file succeeded: $I"
 		(exit 1)
@@ -278,15 +278,168 @@ test_code(lzma_index *i)
 }
 
 
+static void
+test_lookup(const lzma_index *i)
+{
+	lzma_index_lookup *l = lzma_index_lookup_init(i, NULL);
+	expect(l != NULL);
+
+	// The first and last byte of every Block and a few offsets
+	// past the end
+	const size_t count = 2 * lzma_index_block_count(i) + 3;
+	lzma_vli *targets = malloc(count * sizeof(lzma_vli));
+	lzma_vli *numbers = malloc(count * sizeof(lzma_vli));
+	expect(targets != NULL && numbers != NULL);
+
+	size_t n = 0;
+	lzma_index_iter r;
+	lzma_index_iter_init(&r, i);
+	while (!lzma_index_iter_next(&r, LZMA_INDEX_ITER_BLOCK)) {
+		targets[n++] = r.block.uncompressed_file_offset;
+		targets[n++] = r.block.uncompressed_file_offset
+				+ r.block.uncompressed_size - 1;
+	}
+
+	const lzma_vli end = lzma_index_uncompressed_size(i);
+	targets[n++] = end;
+	targets[n++] = end + 1;
+	targets[n++] = LZMA_VLI_MAX;
+	expect(n == count);
+
+	lzma_index_lookup_batch(l, targets, numbers, count);
+
+	lzma_index_iter a, b;
+	lzma_index_iter_init(&a, i);
+	for (size_t j = 0; j < count; ++j) {
+		// An empty first Block gives a target that wraps around.
+		if (targets[j] > LZMA_VLI_MAX)
+			continue;
+
+		if (lzma_index_iter_locate(&a, targets[j])) {
+			expect(numbers[j] == 0);
+			expect(lzma_index_lookup_locate(l, &b, targets[j]));
+			continue;
+		}
+
+		expect(numbers[j] == a.block.number_in_file);
+		expect(!lzma_index_lookup_locate(l, &b, targets[j]));
+		expect(a.stream.number == b.stream.number);
+		expect(a.block.number_in_file == b.block.number_in_file);
+		expect(a.block.compressed_file_offset
+				== b.block.compressed_file_offset);
+		expect(a.block.uncompressed_file_offset
+				== b.block.uncompressed_file_offset);
+		expect(a.block.unpadded_size == b.block.unpadded_size);
+
+		// The iterator continues from the located Block.
+		const bool reta = lzma_index_iter_next(
+				&a, LZMA_INDEX_ITER_BLOCK);
+		const bool retb = lzma_index_iter_next(
+				&b, LZMA_INDEX_ITER_BLOCK);
+		expect(reta == retb);
+		expect(reta || a.block.number_in_file
+				== b.block.number_in_file);
+	}
+
+	expect(lzma_index_lookup_block(l, &b, 0));
+	expect(lzma_index_lookup_block(l, &b,
+			lzma_index_block_count(i) + 1));
+
+	free(targets);
+	free(numbers);
+	lzma_index_lookup_end(l, NULL);
+}
+
+
 static void
 test_many(lzma_index *i)
 {
 	test_copy(i);
+	test_lookup(i);
 	test_read(i);
 	test_code(i);
 }
 
 
+static void
+test_append_multi(void)
+{
+	// Build the same Index as create_big() in uneven pieces.
+	lzma_vli *unpadded = malloc(BIG_COUNT * sizeof(lzma_vli));
+	lzma_vli *uncompressed = malloc(BIG_COUNT * sizeof(lzma_vli));
+	expect(unpadded != NULL && uncompressed != NULL);
+
+	uint32_t n = 11;
+	for (size_t j = 0; j < BIG_COUNT; ++j) {
+		n = 7019 * n + 7607;
+		unpadded[j] = n * 3011;
+		uncompressed[j] = n;
+	}
+
+	lzma_index *a = create_big();
+	lzma_index *b = create_empty();
+
+	expect(lzma_index_append_multi(b, NULL, NULL, NULL, 0) == LZMA_OK);
+	expect(lzma_index_append_multi(b, NULL, NULL, NULL, 1)
+			== LZMA_PROG_ERROR);
+
+	size_t done = 0;
+	const size_t pieces[] = { 1, 700, 3, 2000 };
+	for (size_t j = 0; j < ARRAY_SIZE(pieces); ++j) {
+		expect(lzma_index_append_multi(b, NULL, unpadded + done,
+				uncompressed + done, pieces[j]) == LZMA_OK);
+		done += pieces[j];
+	}
+
+	// A bad Record in the middle must leave the Index unchanged.
+	const lzma_vli saved = unpadded[done + 10];
+	unpadded[done + 10] = 1;
+	expect(lzma_index_append_multi(b, NULL, unpadded + done,
+			uncompressed + done, BIG_COUNT - done)
+			== LZMA_PROG_ERROR);
+	expect(lzma_index_block_count(b) == done);
+	unpadded[done + 10] = saved;
+
+	expect(lzma_index_append_multi(b, NULL, unpadded + done,
+			uncompressed + done, BIG_COUNT - done) == LZMA_OK);
+
+	expect(is_equal(a, b));
+	expect(lzma_index_total_size(a) == lzma_index_total_size(b));
+	expect(lzma_index_uncompressed_size(a)
+			== lzma_index_uncompressed_size(b));
+	expect(lzma_index_size(a) == lzma_index_size(b));
+
+	// The Index encoder encodes whole Records directly when the
+	// output buffer is big enough. Check that it gives the same
+	// result as encoding one byte at a time.
+	const size_t index_size = lzma_index_size(b);
+	uint8_t *buf1 = malloc(index_size);
+	uint8_t *buf2 = malloc(index_size);
+	expect(buf1 != NULL && buf2 != NULL);
+
+	size_t buf_pos = 0;
+	succeed(lzma_index_buffer_encode(b, buf1, &buf_pos, index_size));
+	expect(buf_pos == index_size);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_index_encoder(&strm, a) == LZMA_OK);
+	succeed(coder_loop(&strm, NULL, 0, buf2, index_size,
+			LZMA_STREAM_END, LZMA_RUN));
+	lzma_end(&strm);
+
+	expect(memcmp(buf1, buf2, index_size) == 0);
+
+	test_many(b);
+
+	lzma_index_end(a, NULL);
+	lzma_index_end(b, NULL);
+	free(unpadded);
+	free(uncompressed);
+	free(buf1);
+	free(buf2);
+}
+
+
 static void
 test_cat(void)
 {
@@ -373,6 +526,7 @@ test_cat(void)
 		expect(!lzma_index_iter_next(&r, LZMA_INDEX_ITER_BLOCK)
 				^ (i == 0));
 
+	test_lookup(a);
 	lzma_index_end(a, NULL);
 
 	// Mix of empty and small
@@ -410,6 +564,7 @@ test_cat(void)
 		expect(!lzma_index_iter_next(&r, LZMA_INDEX_ITER_BLOCK)
 				^ (i == 0));
 
+	test_lookup(a);
 	lzma_index_end(a, NULL);
 }
 
@@ -484,6 +639,8 @@ test_locate(void)
 	expect(lzma_index_iter_locate(&r, 5 + 11));
 	expect(lzma_index_iter_locate(&r, 5 + 15));
 
+	test_lookup(i);
+
 	// Large Index
 	lzma_index_end(i, NULL);
 	i = lzma_index_init(NULL);
@@ -653,6 +810,8 @@ main(void)
 
 	test_overflow();
 
+	test_append_multi();
+
 	lzma_index *i = create_empty();
 	test_many(i);
 	lzma_index_end(i, NULL);
@@ -0,0 +1,129 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_lzma_decoder.c
+/// \brief      Tests the LZMA decoder with input in small and odd-sized pieces
+///
+/// When the decoder is called with LZMA_RUN, it holds the end of a short
+/// input buffer back and joins it to the beginning of the next buffer.
+/// LZMA2 clips the input to the current chunk. Here the input is given
+/// one byte at a time and in odd-sized pieces so that the held bytes and
+/// the chunk boundaries fall at every kind of position.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+#define SIZE (512 << 10)
+
+static uint8_t original[SIZE];
+static uint8_t out[SIZE + 1];
+static uint8_t compressed[SIZE + SIZE / 2];
+static size_t compressed_size;
+
+
+/// Text-like data with an incompressible part in the middle, which
+/// LZMA2 stores in uncompressed chunks
+static void
+create_data(void)
+{
+	static const char *const words[8] = {
+		"chunk ", "input ", "decoder ", "range ",
+		"literal ", "match ", "stitch ", "buffer\n",
+	};
+
+	uint32_t seed = 1;
+	size_t i = 0;
+	while (i < SIZE) {
+		seed = seed * 1103515245 + 12345;
+		if (i >= SIZE / 2 && i < SIZE / 2 + (100 << 10)) {
+			original[i++] = (uint8_t)(seed >> 23);
+			continue;
+		}
+
+		const char *word = words[seed >> 29];
+		while (*word != '\0' && i < SIZE)
+			original[i++] = (uint8_t)(*word++);
+	}
+}
+
+
+/// The amount of input to give in the next call. A zero step means
+/// odd sizes that vary from call to call.
+static size_t
+next_step(size_t *step, size_t fixed, size_t left)
+{
+	if (fixed != 0)
+		return my_min(fixed, left);
+
+	*step = (*step * 7 % 509 + 1) | 1;
+	return my_min(*step, left);
+}
+
+
+/// Decode compressed[] giving step bytes of input at a time. All but
+/// the last piece are given with LZMA_RUN.
+static void
+decode(const lzma_filter *filters, size_t fixed)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_raw_decoder(&strm, filters) == LZMA_OK);
+
+	strm.next_in = compressed;
+	strm.next_out = out;
+	strm.avail_out = sizeof(out);
+
+	size_t step = 1;
+	lzma_ret ret;
+	do {
+		const size_t in_left = compressed_size
+				- (size_t)(strm.next_in - compressed);
+		strm.avail_in = next_step(&step, fixed, in_left);
+		ret = lzma_code(&strm, strm.avail_in == in_left
+				? LZMA_FINISH : LZMA_RUN);
+	} while (ret == LZMA_OK);
+
+	expect(ret == LZMA_STREAM_END);
+	expect(strm.total_in == compressed_size);
+	expect(strm.total_out == SIZE);
+	expect(memcmp(out, original, SIZE) == 0);
+
+	lzma_end(&strm);
+}
+
+
+static void
+test_filter(lzma_vli id)
+{
+	lzma_options_lzma opt_lzma;
+	succeed(lzma_lzma_preset(&opt_lzma, 6 | LZMA_PRESET_ORIG));
+
+	lzma_filter filters[2] = {
+		{ .id = id, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	compressed_size = 0;
+	expect(lzma_raw_buffer_encode(filters, NULL, original, SIZE,
+			compressed, &compressed_size, sizeof(compressed))
+			== LZMA_OK);
+
+	decode(filters, 1);
+	decode(filters, 3);
+	decode(filters, 0);
+	decode(filters, 4095);
+}
+
+
+extern int
+main(void)
+{
+	create_data();
+
+	test_filter(LZMA_FILTER_LZMA1);
+	test_filter(LZMA_FILTER_LZMA2);
+
+	return 0;
+}
@@ -0,0 +1,337 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_seekable.c
+/// \brief      Tests the random access .xz decoder
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+
+#define DATA_SIZE 300000
+#define BLOCK_SIZE 25000
+#define FILE_SIZE_MAX (DATA_SIZE + DATA_SIZE / 2)
+
+static uint8_t data[DATA_SIZE];
+static uint8_t file[FILE_SIZE_MAX];
+static size_t file_size = 0;
+static lzma_index *file_index;
+static uint8_t out[DATA_SIZE + 1];
+
+
+/// Encodes data[begin, end) into file[] as one Stream having
+/// multiple Blocks.
+static void
+encode_stream(size_t begin, size_t end, lzma_check check)
+{
+	lzma_options_lzma opt_lzma;
+	succeed(lzma_lzma_preset(&opt_lzma, 1));
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	lzma_stream_flags flags = { .version = 0, .check = check };
+	expect(lzma_stream_header_encode(&flags, file + file_size)
+			== LZMA_OK);
+	file_size += LZMA_STREAM_HEADER_SIZE;
+
+	lzma_index *i = lzma_index_init(NULL);
+	expect(i != NULL);
+
+	for (size_t pos = begin; pos < end; pos += BLOCK_SIZE) {
+		const size_t size = my_min(BLOCK_SIZE, end - pos);
+		lzma_block block = {
+			.version = 0,
+			.check = check,
+			.filters = filters,
+		};
+
+		expect(lzma_block_buffer_encode(&block, NULL, data + pos,
+				size, file, &file_size, FILE_SIZE_MAX)
+				== LZMA_OK);
+		expect(lzma_index_append(i, NULL,
+				lzma_block_unpadded_size(&block),
+				block.uncompressed_size) == LZMA_OK);
+	}
+
+	expect(lzma_index_buffer_encode(i, file, &file_size, FILE_SIZE_MAX)
+			== LZMA_OK);
+
+	flags.backward_size = lzma_index_size(i);
+	expect(lzma_stream_footer_encode(&flags, file + file_size)
+			== LZMA_OK);
+	file_size += LZMA_STREAM_HEADER_SIZE;
+
+	lzma_index_end(i, NULL);
+}
+
+
+static void
+create_file(void)
+{
+	// Something compressible but not trivially so
+	uint32_t n = 1;
+	for (size_t i = 0; i < DATA_SIZE; ++i) {
+		n = 101771 * n + 12345;
+		data[i] = (uint8_t)("abcdefgh"[(n >> 24) & 7]
+				+ (i % 97 == 0));
+	}
+
+	// Two Streams with Stream Padding between them
+	encode_stream(0, DATA_SIZE / 3, LZMA_CHECK_CRC32);
+	memzero(file + file_size, 8);
+	file_size += 8;
+	encode_stream(DATA_SIZE / 3, DATA_SIZE, LZMA_CHECK_CRC64);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_file_info_decoder(&strm, &file_index, UINT64_MAX,
+			file_size) == LZMA_OK);
+	strm.next_in = file;
+	strm.avail_in = file_size;
+	expect(lzma_code(&strm, LZMA_RUN) == LZMA_STREAM_END);
+	lzma_end(&strm);
+
+	expect(lzma_index_uncompressed_size(file_index) == DATA_SIZE);
+	expect(lzma_index_block_count(file_index) > 10);
+}
+
+
+static size_t pread_count;
+
+
+static lzma_ret
+pread_file(void *opaque, uint8_t *buf, size_t size, uint64_t pos)
+{
+	expect(opaque == file);
+	expect(pos <= file_size && size <= file_size - pos);
+	memcpy(buf, file + pos, size);
+	++pread_count;
+	return LZMA_OK;
+}
+
+
+static lzma_ret
+pread_fail(void *opaque lzma_attribute((__unused__)),
+		uint8_t *buf lzma_attribute((__unused__)),
+		size_t size lzma_attribute((__unused__)),
+		uint64_t pos lzma_attribute((__unused__)))
+{
+	return LZMA_BUF_ERROR;
+}
+
+
+static void
+test_file_info_pread(void)
+{
+	// The file is small enough to be read at once.
+	lzma_index *i = NULL;
+	uint64_t memlimit = UINT64_MAX;
+	pread_count = 0;
+	expect(lzma_file_info_pread(&i, &memlimit, NULL, file_size,
+			&pread_file, file) == LZMA_OK);
+	expect(pread_count == 1);
+	expect(lzma_index_file_size(i) == file_size);
+	expect(lzma_index_stream_count(i) == 2);
+	expect(lzma_index_block_count(i)
+			== lzma_index_block_count(file_index));
+	expect(lzma_index_uncompressed_size(i) == DATA_SIZE);
+	lzma_index_end(i, NULL);
+
+	// Errors from the read function are passed through.
+	expect(lzma_file_info_pread(&i, &memlimit, NULL, file_size,
+			&pread_fail, file) == LZMA_BUF_ERROR);
+
+	// Too low memory usage limit tells how much would be needed.
+	memlimit = 1;
+	expect(lzma_file_info_pread(&i, &memlimit, NULL, file_size,
+			&pread_file, file) == LZMA_MEMLIMIT_ERROR);
+	expect(memlimit > 1);
+
+	// Not an .xz file
+	memlimit = UINT64_MAX;
+	file[0] ^= 1;
+	expect(lzma_file_info_pread(&i, &memlimit, NULL, file_size,
+			&pread_file, file) == LZMA_FORMAT_ERROR);
+	file[0] ^= 1;
+
+	expect(lzma_file_info_pread(&i, &memlimit, NULL, 0,
+			&pread_file, file) == LZMA_FORMAT_ERROR);
+}
+
+
+/// Decodes size bytes starting from offset. The whole file is given
+/// as input if chunk is zero. Otherwise the input is read in chunks
+/// from the file position requested by the decoder.
+static void
+test_read(lzma_stream *strm, size_t *file_pos, size_t chunk,
+		size_t offset, size_t size)
+{
+	expect(lzma_seekable_decoder_seek(strm, offset) == LZMA_OK);
+
+	memcrap(out, size);
+	strm->next_out = out;
+	strm->avail_out = size;
+
+	while (strm->avail_out > 0) {
+		if (chunk != 0 && strm->avail_in == 0
+				&& *file_pos < file_size) {
+			strm->next_in = file + *file_pos;
+			strm->avail_in = my_min(chunk, file_size - *file_pos);
+			*file_pos += strm->avail_in;
+		}
+
+		const lzma_ret ret = lzma_code(strm, LZMA_RUN);
+		if (ret == LZMA_SEEK_NEEDED) {
+			expect(strm->seek_pos < file_size);
+			*file_pos = (size_t)(strm->seek_pos);
+			if (chunk == 0) {
+				strm->next_in = file + *file_pos;
+				strm->avail_in = file_size - *file_pos;
+				*file_pos = file_size;
+			} else {
+				strm->avail_in = 0;
+			}
+
+			continue;
+		}
+
+		if (ret == LZMA_STREAM_END)
+			break;
+
+		expect(ret == LZMA_OK);
+	}
+
+	const size_t expected = offset >= DATA_SIZE
+			? 0 : my_min(size, DATA_SIZE - offset);
+	expect(size - strm->avail_out == expected);
+	expect(memcmp(out, data + offset, expected) == 0);
+}
+
+
+static void
+test_seeks(uint64_t cache_size, size_t chunk)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_seekable_decoder(&strm, file_index, UINT64_MAX,
+			cache_size, 0) == LZMA_OK);
+
+	// The first input starts from the beginning of the file.
+	size_t file_pos = 0;
+	if (chunk == 0) {
+		strm.next_in = file;
+		strm.avail_in = file_size;
+		file_pos = file_size;
+	}
+
+	// Sequential reads cross Block and Stream boundaries.
+	test_read(&strm, &file_pos, chunk, 0, 1000);
+	test_read(&strm, &file_pos, chunk, 1000, DATA_SIZE - 1000);
+
+	// Backward and forward within and between Blocks
+	uint32_t n = 7;
+	for (size_t i = 0; i < 40; ++i) {
+		n = 7019 * n + 7607;
+		const size_t offset = n % DATA_SIZE;
+		test_read(&strm, &file_pos, chunk, offset, 1 + n % 40000);
+		test_read(&strm, &file_pos, chunk, offset / 2, 1 + n % 100);
+	}
+
+	test_read(&strm, &file_pos, chunk, DATA_SIZE - 1, 10);
+	test_read(&strm, &file_pos, chunk, DATA_SIZE, 10);
+	test_read(&strm, &file_pos, chunk, DATA_SIZE + 10, 10);
+	test_read(&strm, &file_pos, chunk, BLOCK_SIZE, BLOCK_SIZE);
+
+	lzma_end(&strm);
+}
+
+
+static void
+test_errors(void)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	expect(lzma_seekable_decoder_seek(&strm, 0) == LZMA_PROG_ERROR);
+	expect(lzma_seekable_decoder(&strm, file_index, UINT64_MAX, 0,
+			LZMA_CONCATENATED) == LZMA_OPTIONS_ERROR);
+
+	expect(lzma_stream_decoder(&strm, UINT64_MAX, 0) == LZMA_OK);
+	expect(lzma_seekable_decoder_seek(&strm, 0) == LZMA_PROG_ERROR);
+
+	// Corrupt the last Block of the first Stream.
+	expect(lzma_seekable_decoder(&strm, file_index, UINT64_MAX, 0, 0)
+			== LZMA_OK);
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, file_index);
+	expect(!lzma_index_iter_locate(&iter, DATA_SIZE / 3 - 1));
+	const size_t corrupt_pos = (size_t)(
+			iter.block.compressed_file_offset
+			+ iter.block.unpadded_size - 1);
+	file[corrupt_pos] ^= 1;
+
+	strm.next_in = file;
+	strm.avail_in = file_size;
+	strm.next_out = out;
+	strm.avail_out = sizeof(out);
+	expect(lzma_seekable_decoder_seek(&strm, DATA_SIZE / 3 - 1)
+			== LZMA_OK);
+	expect(lzma_code(&strm, LZMA_RUN) == LZMA_DATA_ERROR);
+	expect(lzma_seekable_decoder_seek(&strm, 0) == LZMA_PROG_ERROR);
+
+	// IGNORE_CHECK skips the corrupt CRC32.
+	expect(lzma_seekable_decoder(&strm, file_index, UINT64_MAX, 0,
+			LZMA_IGNORE_CHECK) == LZMA_OK);
+	strm.next_in = file;
+	strm.avail_in = file_size;
+	strm.next_out = out;
+	strm.avail_out = sizeof(out);
+	expect(lzma_code(&strm, LZMA_RUN) == LZMA_STREAM_END);
+	expect(memcmp(out, data, DATA_SIZE) == 0);
+
+	file[corrupt_pos] ^= 1;
+
+	// An Index decoded from the Index field has no Stream Flags.
+	lzma_stream_flags flags;
+	expect(lzma_stream_footer_decode(&flags, file + file_size
+			- LZMA_STREAM_HEADER_SIZE) == LZMA_OK);
+
+	lzma_index *idx;
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = file_size - LZMA_STREAM_HEADER_SIZE
+			- (size_t)(flags.backward_size);
+	expect(lzma_index_buffer_decode(&idx, &memlimit, NULL, file,
+			&in_pos, file_size - LZMA_STREAM_HEADER_SIZE)
+			== LZMA_OK);
+	expect(lzma_seekable_decoder(&strm, idx, UINT64_MAX, 0, 0)
+			== LZMA_PROG_ERROR);
+
+	expect(lzma_index_stream_flags(idx, &flags) == LZMA_OK);
+	expect(lzma_seekable_decoder(&strm, idx, UINT64_MAX, 0, 0)
+			== LZMA_OK);
+
+	lzma_index_end(idx, NULL);
+	lzma_end(&strm);
+}
+
+
+extern int
+main(void)
+{
+	create_file();
+
+	test_file_info_pread();
+
+	test_seeks(0, 0);
+	test_seeks(0, 1);
+	test_seeks(0, 4096);
+	test_seeks(3 * BLOCK_SIZE, 0);
+	test_seeks(3 * BLOCK_SIZE, 333);
+	test_seeks(UINT64_MAX, 4096);
+
+	test_errors();
+
+	lzma_index_end(file_index, NULL);
+	return 0;
+}
@@ -0,0 +1,712 @@
+///////////////////////////////////////////////////////////////////////////////
+//
+/// \file       test_stream_encoder_mt.c
+/// \brief      Tests the options of the threaded .xz encoder
+///
+/// Every Stream is decoded with lzma_stream_buffer_decode() and compared
+/// to the input. Where the options affect how the input is split into
+/// Blocks, the sizes of the Blocks are read from the Index.
+//
+//  This file has been put into the public domain.
+//  You can do whatever you want with this file.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+#include "tests.h"
+#include "mythread.h"
+
+#ifdef MYTHREAD_ENABLED
+
+/// Compressed Stream and its size
+static uint8_t *compressed;
+static size_t compressed_size;
+static size_t compressed_alloc;
+
+
+/// Fill buf with pseudo-random words, which compress reasonably well.
+static void
+fill_text(uint8_t *buf, size_t size, uint32_t seed)
+{
+	static const char *const words[8] = {
+		"thread ", "block ", "encoder ", "input ",
+		"stream ", "output ", "index ", "filter\n",
+	};
+
+	size_t i = 0;
+	while (i < size) {
+		seed = seed * 1103515245 + 12345;
+		const char *word = words[seed >> 29];
+		while (*word != '\0' && i < size)
+			buf[i++] = (uint8_t)(*word++);
+	}
+}
+
+
+/// Fill buf with pseudo-random bytes, which don't compress.
+static void
+fill_random(uint8_t *buf, size_t size, uint32_t seed)
+{
+	for (size_t i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (uint8_t)(seed >> 23);
+	}
+}
+
+
+/// Wait for the worker threads without a busy loop.
+static void
+sleep_ms(uint32_t ms)
+{
+	mythread_mutex mutex;
+	mythread_cond cond;
+	mythread_condtime wait_abs;
+
+	succeed(mythread_mutex_init(&mutex));
+	succeed(mythread_cond_init(&cond));
+	mythread_condtime_set(&wait_abs, &cond, ms);
+
+	mythread_sync(mutex) {
+		while (mythread_cond_timedwait(&cond, &mutex, &wait_abs) == 0)
+			;
+	}
+
+	mythread_cond_destroy(&cond);
+	mythread_mutex_destroy(&mutex);
+}
+
+
+/// Allocate the buffer for the compressed Stream of size bytes of input.
+static void
+compressed_reserve(size_t size)
+{
+	free(compressed);
+	compressed_alloc = lzma_stream_buffer_bound(size);
+	compressed = malloc(compressed_alloc);
+	expect(compressed != NULL);
+	compressed_size = 0;
+}
+
+
+/// Decode the compressed Stream and compare it to expected.
+static void
+decode_compare(const uint8_t *expected, size_t size)
+{
+	uint8_t *out = malloc(size + 1);
+	expect(out != NULL);
+
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = 0;
+	size_t out_pos = 0;
+	expect(lzma_stream_buffer_decode(&memlimit, 0, NULL,
+			compressed, &in_pos, compressed_size,
+			out, &out_pos, size + 1) == LZMA_OK);
+	expect(in_pos == compressed_size);
+	expect(out_pos == size);
+	expect(memcmp(out, expected, size) == 0);
+
+	free(out);
+}
+
+
+/// Decode the Index of the compressed Stream.
+static lzma_index *
+index_decode(void)
+{
+	expect(compressed_size >= 2 * LZMA_STREAM_HEADER_SIZE);
+
+	lzma_stream_flags flags;
+	succeed(lzma_stream_footer_decode(&flags, compressed
+			+ compressed_size - LZMA_STREAM_HEADER_SIZE));
+
+	lzma_index *idx;
+	uint64_t memlimit = UINT64_MAX;
+	size_t in_pos = compressed_size - LZMA_STREAM_HEADER_SIZE
+			- (size_t)(flags.backward_size);
+	succeed(lzma_index_buffer_decode(&idx, &memlimit, NULL, compressed,
+			&in_pos, compressed_size - LZMA_STREAM_HEADER_SIZE));
+	return idx;
+}
+
+
+/// Read the uncompressed sizes of the Blocks from the Index. Returns
+/// the number of Blocks.
+static size_t
+block_sizes(uint64_t *sizes, size_t sizes_max)
+{
+	lzma_index *idx = index_decode();
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, idx);
+
+	size_t count = 0;
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+		expect(count < sizes_max);
+		sizes[count++] = iter.block.uncompressed_size;
+	}
+
+	lzma_index_end(idx, NULL);
+	return count;
+}
+
+
+/// Read the offsets of the Blocks in the Stream from the Index. Returns
+/// the number of Blocks.
+static size_t
+block_offsets(uint64_t *offsets, size_t offsets_max)
+{
+	lzma_index *idx = index_decode();
+	lzma_index_iter iter;
+	lzma_index_iter_init(&iter, idx);
+
+	size_t count = 0;
+	while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+		expect(count < offsets_max);
+		offsets[count++] = iter.block.compressed_file_offset;
+	}
+
+	lzma_index_end(idx, NULL);
+	return count;
+}
+
+
+/// Finish encoding with the input and output that strm already has.
+static void
+encode_finish(lzma_stream *strm)
+{
+	lzma_ret ret;
+	do {
+		ret = lzma_code(strm, LZMA_FINISH);
+	} while (ret == LZMA_OK);
+
+	expect(ret == LZMA_STREAM_END);
+}
+
+
+/// Feed the pieces to the encoder step bytes at a time. The pieces are
+/// given in the order listed and finished with LZMA_FINISH.
+static void
+encode_pieces(lzma_stream *strm, const uint8_t *const *pieces,
+		const size_t *piece_sizes, size_t piece_count, size_t step)
+{
+	strm->next_out = compressed;
+	strm->avail_out = compressed_alloc;
+
+	for (size_t i = 0; i < piece_count; ++i) {
+		for (size_t pos = 0; pos < piece_sizes[i]; pos += step) {
+			strm->next_in = pieces[i] + pos;
+			strm->avail_in = my_min(step, piece_sizes[i] - pos);
+
+			while (strm->avail_in > 0)
+				succeed(lzma_code(strm, LZMA_RUN));
+		}
+	}
+
+	encode_finish(strm);
+	compressed_size = (size_t)(strm->total_out);
+}
+
+
+/// With LZMA_STABLE_INPUT the Blocks are read from the input of the
+/// application, so a new Block has to be started where the input stops
+/// being contiguous in memory.
+static void
+test_stable_input(void)
+{
+	const size_t a_size = 300000;
+	const size_t b_size = 200000;
+	const size_t again_size = 100000;
+	const size_t total = a_size + b_size + again_size;
+
+	uint8_t *a = malloc(a_size);
+	uint8_t *b = malloc(b_size);
+	uint8_t *expected = malloc(total);
+	expect(a != NULL && b != NULL && expected != NULL);
+
+	fill_text(a, a_size, 1);
+	fill_text(b, b_size, 2);
+
+	// The beginning of a is given again after b.
+	memcpy(expected, a, a_size);
+	memcpy(expected + a_size, b, b_size);
+	memcpy(expected + a_size + b_size, a, again_size);
+
+	const uint8_t *const pieces[3] = { a, b, a };
+	const size_t piece_sizes[3] = { a_size, b_size, again_size };
+
+	const lzma_mt mt = {
+		.flags = LZMA_STABLE_INPUT,
+		.threads = 2,
+		.block_size = 128 << 10,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+	};
+
+	compressed_reserve(total);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	succeed(lzma_stream_encoder_mt(&strm, &mt));
+	encode_pieces(&strm, pieces, piece_sizes, 3, 7000);
+	lzma_end(&strm);
+
+	decode_compare(expected, total);
+
+	// Blocks are cut at block_size and at both boundaries.
+	static const uint64_t expected_sizes[] = {
+		131072, 131072, 37856,
+		131072, 68928,
+		100000,
+	};
+
+	uint64_t sizes[16];
+	expect(block_sizes(sizes, ARRAY_SIZE(sizes))
+			== ARRAY_SIZE(expected_sizes));
+	for (size_t i = 0; i < ARRAY_SIZE(expected_sizes); ++i)
+		expect(sizes[i] == expected_sizes[i]);
+
+	free(expected);
+	free(b);
+	free(a);
+}
+
+
+/// With LZMA_EARLY_OUTPUT the output of a Block can be read before the
+/// Block has been finished. The output is read one byte at a time so
+/// that it is read as soon as it becomes readable.
+static void
+test_early_output(uint32_t preset)
+{
+	// 256 KiB Blocks that alternate between incompressible and
+	// compressible data.
+	const size_t block_size = 256 << 10;
+	const size_t size = 6 * block_size;
+
+	uint8_t *in = malloc(size);
+	expect(in != NULL);
+
+	for (size_t i = 0; i < size; i += block_size) {
+		if (i / block_size % 2 == 0)
+			fill_random(in + i, block_size, (uint32_t)(i));
+		else
+			fill_text(in + i, block_size, (uint32_t)(i));
+	}
+
+	const lzma_mt mt = {
+		.flags = LZMA_EARLY_OUTPUT,
+		.threads = 2,
+		.block_size = block_size,
+		.timeout = 100,
+		.preset = preset,
+		.check = LZMA_CHECK_CRC32,
+	};
+
+	compressed_reserve(size);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	succeed(lzma_stream_encoder_mt(&strm, &mt));
+
+	// Give a part of the first Block and wait until more than
+	// the Stream Header can be read. With all input used, LZMA_RUN
+	// returns immediately and LZMA_BUF_ERROR tells that nothing
+	// could be done.
+	strm.next_in = in;
+	strm.avail_in = block_size / 2;
+	strm.next_out = compressed;
+
+	for (unsigned i = 0; i < 500; ++i) {
+		strm.avail_out = 1;
+		const lzma_ret ret = lzma_code(&strm, LZMA_RUN);
+		expect(ret == LZMA_OK || ret == LZMA_BUF_ERROR);
+
+		if (strm.avail_in == 0 && strm.total_out
+				> LZMA_STREAM_HEADER_SIZE)
+			break;
+
+		if (strm.avail_out == 1)
+			sleep_ms(10);
+	}
+
+	expect(strm.avail_in == 0);
+	expect(strm.total_out > LZMA_STREAM_HEADER_SIZE);
+
+	// Encode the rest. An error would be returned if the output of
+	// a Block had to be replaced after some of it had been read.
+	strm.avail_in = size - block_size / 2;
+
+	lzma_ret ret;
+	do {
+		expect((size_t)(strm.next_out - compressed)
+				< compressed_alloc);
+		strm.avail_out = 1;
+		ret = lzma_code(&strm, LZMA_FINISH);
+	} while (ret == LZMA_OK);
+
+	expect(ret == LZMA_STREAM_END);
+	compressed_size = (size_t)(strm.total_out);
+	lzma_end(&strm);
+
+	decode_compare(in, size);
+
+	uint64_t sizes[16];
+	expect(block_sizes(sizes, ARRAY_SIZE(sizes)) == 6);
+
+	// The Block Headers were written before the sizes were known.
+	lzma_filter filters[LZMA_FILTERS_MAX + 1];
+	lzma_block block = {
+		.version = 0,
+		.check = LZMA_CHECK_CRC32,
+		.filters = filters,
+	};
+	block.header_size = lzma_block_header_size_decode(
+			compressed[LZMA_STREAM_HEADER_SIZE]);
+	succeed(lzma_block_header_decode(&block, NULL,
+			compressed + LZMA_STREAM_HEADER_SIZE));
+	expect(block.compressed_size == LZMA_VLI_UNKNOWN);
+	expect(block.uncompressed_size == LZMA_VLI_UNKNOWN);
+
+	for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; ++i)
+		free(filters[i].options);
+
+	free(in);
+}
+
+
+/// Number of threads in this process or zero if it isn't known
+static unsigned
+thread_count(void)
+{
+	unsigned count = 0;
+
+#ifdef __linux__
+	FILE *file = fopen("/proc/self/status", "r");
+	if (file == NULL)
+		return 0;
+
+	char line[256];
+	while (fgets(line, sizeof(line), file) != NULL)
+		if (sscanf(line, "Threads: %u", &count) == 1)
+			break;
+
+	fclose(file);
+#endif
+
+	return count;
+}
+
+
+/// The thread_pool members are read only with LZMA_USE_THREAD_POOL and
+/// LZMA_MODE_THREAD_POOL. A pool caps the threads of all the streams
+/// that use it.
+static void
+test_thread_pool(void)
+{
+	const size_t size = 1 << 20;
+	uint8_t *in = malloc(size);
+	expect(in != NULL);
+	fill_text(in, size, 5);
+
+	// Reading this pointer would crash.
+	lzma_thread_pool *const unused = (lzma_thread_pool *)(uintptr_t)(1);
+
+	lzma_options_lzma opt_lzma;
+	succeed(lzma_lzma_preset(&opt_lzma, 1));
+	opt_lzma.threads = 2;
+	opt_lzma.thread_pool = unused;
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	compressed_reserve(size);
+	expect(lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32,
+			NULL, in, size, compressed, &compressed_size,
+			compressed_alloc) == LZMA_OK);
+	decode_compare(in, size);
+
+	lzma_mt mt = {
+		.threads = 4,
+		.block_size = 128 << 10,
+		.filters = filters,
+		.check = LZMA_CHECK_CRC32,
+		.thread_pool = unused,
+	};
+
+	const uint8_t *const pieces[1] = { in };
+	lzma_stream strm = LZMA_STREAM_INIT;
+	succeed(lzma_stream_encoder_mt(&strm, &mt));
+	encode_pieces(&strm, pieces, &size, 1, size);
+	lzma_end(&strm);
+	decode_compare(in, size);
+
+	// Two streams share a pool of three threads. With the original
+	// match finder every Block is encoded by one thread.
+	lzma_thread_pool *pool = lzma_thread_pool_create(3, NULL);
+	expect(pool != NULL);
+
+	mt.flags = LZMA_USE_THREAD_POOL;
+	mt.preset = 1 | LZMA_PRESET_ORIG;
+	mt.filters = NULL;
+	mt.thread_pool = pool;
+
+	uint8_t *b_out = malloc(compressed_alloc);
+	expect(b_out != NULL);
+
+	lzma_stream a = LZMA_STREAM_INIT;
+	lzma_stream b = LZMA_STREAM_INIT;
+	succeed(lzma_stream_encoder_mt(&a, &mt));
+	succeed(lzma_stream_encoder_mt(&b, &mt));
+
+	a.next_out = compressed;
+	a.avail_out = compressed_alloc;
+	b.next_out = b_out;
+	b.avail_out = compressed_alloc;
+
+	// Give four Blocks to both streams. The first stream takes all
+	// the threads of the pool. The second one gets none and creates
+	// one thread outside the pool. Without the pool there would be
+	// eight threads.
+	const unsigned threads_before = thread_count();
+
+	a.next_in = in;
+	a.avail_in = size / 2;
+	while (a.avail_in > 0)
+		succeed(lzma_code(&a, LZMA_RUN));
+
+	b.next_in = in;
+	b.avail_in = size / 2;
+	while (b.avail_in > 0)
+		succeed(lzma_code(&b, LZMA_RUN));
+
+	if (threads_before != 0)
+		expect(thread_count() <= threads_before + 3 + 1);
+
+	a.avail_in = size / 2;
+	encode_finish(&a);
+	compressed_size = (size_t)(a.total_out);
+	decode_compare(in, size);
+
+	b.avail_in = size / 2;
+	encode_finish(&b);
+	compressed_size = (size_t)(b.total_out);
+	memcpy(compressed, b_out, compressed_size);
+	decode_compare(in, size);
+
+	lzma_end(&a);
+	lzma_end(&b);
+	lzma_thread_pool_end(pool);
+
+	free(b_out);
+	free(in);
+}
+
+
+/// Fill buf with text that has x86 CALL instructions to near targets
+/// every 64 bytes.
+static void
+fill_x86(uint8_t *buf, size_t size, uint32_t seed)
+{
+	fill_text(buf, size, seed);
+
+	for (size_t i = 0; i + 5 <= size; i += 64) {
+		seed = seed * 1103515245 + 12345;
+		const uint32_t rel = (seed >> 16) - 0x8000;
+		buf[i] = 0xE8;
+		write32le(buf + i + 1, rel);
+	}
+}
+
+
+/// Fill buf with 4-byte records of small numbers, each of which is
+/// usually the same as in the previous record.
+static void
+fill_records(uint8_t *buf, size_t size, uint32_t seed)
+{
+	for (size_t i = 0; i < size; ++i) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (uint8_t)((i % 4) * 5 + (i >> 10) % 16
+				+ ((seed >> 28) == 0));
+	}
+}
+
+
+/// Decode the Block Header at offset of the compressed Stream.
+/// The filter options have to be freed by the caller.
+static void
+block_header_filters(uint64_t offset, lzma_filter *filters)
+{
+	lzma_block block = {
+		.version = 0,
+		.check = LZMA_CHECK_CRC32,
+		.filters = filters,
+	};
+	block.header_size = lzma_block_header_size_decode(
+			compressed[offset]);
+	succeed(lzma_block_header_decode(&block, NULL,
+			compressed + offset));
+}
+
+
+/// With LZMA_USE_BLOCK_FILTERS each Block is encoded with the chain of
+/// its class of data. Blocks of LZMA_BLOCK_CLASS_INCOMPRESSIBLE are
+/// stored when its chain is NULL.
+static void
+test_block_filters(uint32_t flags)
+{
+	// x86 code, records, random data, and text in Blocks of their own
+	const size_t block_size = 256 << 10;
+	const size_t size = 4 * block_size;
+
+	uint8_t *in = malloc(size);
+	expect(in != NULL);
+	fill_x86(in, block_size, 6);
+	fill_records(in + block_size, block_size, 7);
+	fill_random(in + 2 * block_size, block_size, 8);
+	fill_text(in + 3 * block_size, block_size, 9);
+
+	lzma_options_lzma opt_lzma;
+	succeed(lzma_lzma_preset(&opt_lzma, 1));
+
+	lzma_options_delta opt_delta = {
+		.type = LZMA_DELTA_TYPE_BYTE,
+		.dist = 1,
+	};
+
+	const lzma_filter x86[3] = {
+		{ .id = LZMA_FILTER_X86, .options = NULL },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const lzma_filter delta[3] = {
+		{ .id = LZMA_FILTER_DELTA, .options = &opt_delta },
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	const lzma_filter *const block_filters[LZMA_BLOCK_CLASS_COUNT] = {
+		[LZMA_BLOCK_CLASS_X86] = x86,
+		[LZMA_BLOCK_CLASS_STRUCTURED] = delta,
+	};
+
+	lzma_mt mt = {
+		.flags = flags,
+		.threads = 2,
+		.block_size = block_size,
+		.preset = 1,
+		.check = LZMA_CHECK_CRC32,
+		.block_filters = block_filters,
+	};
+
+	const uint8_t *const pieces[1] = { in };
+	compressed_reserve(size);
+
+	lzma_stream strm = LZMA_STREAM_INIT;
+	succeed(lzma_stream_encoder_mt(&strm, &mt));
+	encode_pieces(&strm, pieces, &size, 1, size);
+	lzma_end(&strm);
+	decode_compare(in, size);
+
+	uint64_t offsets[16];
+	expect(block_offsets(offsets, ARRAY_SIZE(offsets)) == 4);
+
+	lzma_filter filters[4][LZMA_FILTERS_MAX + 1];
+	for (size_t i = 0; i < 4; ++i)
+		block_header_filters(offsets[i], filters[i]);
+
+	expect(filters[0][0].id == LZMA_FILTER_X86);
+	expect(filters[0][1].id == LZMA_FILTER_LZMA2);
+
+	// The Delta distance is the record size.
+	expect(filters[1][0].id == LZMA_FILTER_DELTA);
+	expect(((const lzma_options_delta *)(filters[1][0].options))->dist
+			== 4);
+	expect(filters[1][1].id == LZMA_FILTER_LZMA2);
+
+	// The stored Block uses the smallest dictionary.
+	expect(filters[2][0].id == LZMA_FILTER_LZMA2);
+	expect(((const lzma_options_lzma *)(filters[2][0].options))
+			->dict_size == LZMA_DICT_SIZE_MIN);
+	expect(filters[2][1].id == LZMA_VLI_UNKNOWN);
+
+	expect(filters[3][0].id == LZMA_FILTER_LZMA2);
+	expect(((const lzma_options_lzma *)(filters[3][0].options))
+			->dict_size > LZMA_DICT_SIZE_MIN);
+	expect(filters[3][1].id == LZMA_VLI_UNKNOWN);
+
+	for (size_t i = 0; i < 4; ++i)
+		for (size_t j = 0; filters[i][j].id != LZMA_VLI_UNKNOWN; ++j)
+			free(filters[i][j].options);
+
+	// Without the flag the member isn't read.
+	mt.flags &= ~LZMA_USE_BLOCK_FILTERS;
+	mt.block_filters = (const lzma_filter *const *)(uintptr_t)(1);
+
+	succeed(lzma_stream_encoder_mt(&strm, &mt));
+	encode_pieces(&strm, pieces, &size, 1, size);
+	lzma_end(&strm);
+	decode_compare(in, size);
+
+	free(in);
+}
+
+
+/// The single-call encoders call the radix encoder until it has finished
+/// even if its match finder threads are still busy when it returns.
+static void
+test_buffer_encode(const uint8_t *in, size_t in_size, uint32_t preset)
+{
+	lzma_options_lzma opt_lzma;
+	succeed(lzma_lzma_preset(&opt_lzma, preset));
+
+	lzma_filter filters[2] = {
+		{ .id = LZMA_FILTER_LZMA2, .options = &opt_lzma },
+		{ .id = LZMA_VLI_UNKNOWN, .options = NULL },
+	};
+
+	compressed_reserve(in_size);
+	expect(lzma_stream_buffer_encode_mt(filters, LZMA_CHECK_CRC32, 4,
+			NULL, in, in_size, compressed, &compressed_size,
+			compressed_alloc) == LZMA_OK);
+	decode_compare(in, in_size);
+
+	compressed_size = 0;
+	expect(lzma_stream_buffer_encode(filters, LZMA_CHECK_CRC32,
+			NULL, in, in_size, compressed, &compressed_size,
+			compressed_alloc) == LZMA_OK);
+	decode_compare(in, in_size);
+}
+
+#endif
+
+
+extern int
+main(void)
+{
+#ifdef MYTHREAD_ENABLED
+	test_stable_input();
+	test_early_output(1);
+	test_early_output(1 | LZMA_PRESET_ORIG);
+	test_thread_pool();
+	test_block_filters(LZMA_USE_BLOCK_FILTERS);
+	test_block_filters(LZMA_USE_BLOCK_FILTERS | LZMA_EARLY_OUTPUT);
+
+	// Several MiB keep the radix match finder threads busy for a while.
+	// The last MiB doesn't compress.
+	const size_t buffer_size = 4 << 20;
+	uint8_t *buffer = malloc(buffer_size);
+	expect(buffer != NULL);
+	fill_text(buffer, buffer_size - (1 << 20), 3);
+
+	fill_random(buffer + buffer_size - (1 << 20), 1 << 20, 4);
+
+	test_buffer_encode(buffer, buffer_size, 1);
+	test_buffer_encode(buffer, buffer_size, 6);
+	test_buffer_encode(buffer, buffer_size, 1 | LZMA_PRESET_ORIG);
+	free(buffer);
+
+	free(compressed);
+	return 0;
+#else
+	// Skip the test.
+	return 77;
+#endif
+}